@@ -69,6 +69,7 @@
 
 #include <string.h>
 #include <stdbool.h>
+#include <limits.h>
 
 
 
@@ -105,16 +106,79 @@
 // Some functions may run faster because of immediate access to the value size.
 #define TBD_USE_NULL_TERMINATED_VALUES
 
-// Cache the last found key:value.
+// Cache recently found key:values.
 #define TBD_USE_LAST_FOUND_CACHE
 
+// Number of keyvalues remembered by the last found cache, must be a power of 2.
+// Each key maps to one cache entry by a hash of the key.
+#define TBD_LAST_FOUND_CACHE_SIZE 16
+
 // Use a list for accessing garbage elements.
 #define TBD_USE_GARBAGE_LIST
 
+// Evict keyvalues that were not found recently instead of failing when the tbd is full.
+// Only active when the tbd is initialized with TBD_INIT_FLAG_EVICT.
+// Uses the CLOCK (second chance) algorithm, which needs one reference bit in each keyvalue.
+// The hand clears the reference bit of each keyvalue it passes, and evicts the first keyvalue whose bit was already clear.
+#define TBD_USE_EVICTION
+
+// Allow keyvalues to expire after a time to live.
+// Stores an expiry time in each keyvalue.
+#define TBD_USE_EXPIRY
+
+// Log changes to a write-ahead log opened with tbd_wal_open.
+// Records are buffered and written in batches through user callbacks.
+#define TBD_USE_WAL
+
+// Stamp every change with a version, so changes can be exported with tbd_export_since.
+// Deletes leave tombstones when the tbd is initialized with TBD_INIT_FLAG_TOMBSTONES.
+#define TBD_USE_VERSIONS
+
+// Double buffered publication of read-mostly tbds with tbd_publish_t.
+// Needs the GCC or Clang __atomic builtins.
+#define TBD_USE_PUBLISH
+
+// Stable handles to keyvalues, see tbd_handle_get.
+// A handle resolves in constant time, and follows its keyvalue when it is moved.
+#define TBD_USE_HANDLES
+
+// Number of handles that can be held at the same time, at most 255.
+#define TBD_HANDLE_TABLE_SIZE 8
+
+// Count calls of each operation, failed allocations and the keyvalues compared by stack searches.
+#define TBD_USE_OP_COUNTERS
+
+// Keep a histogram of the latency of each operation, timed by the clock set with tbd_set_clock.
+// Adds TBD_OP_COUNT * TBD_LATENCY_BUCKET_COUNT counters to the tbd header, so it is off unless defined here or by the compiler.
+//#define TBD_USE_LATENCY_HISTOGRAMS
+
+// Call the hook set with tbd_set_trace at operation entry and exit, key lookups, allocation, eviction and garbage collection.
+// Trace points compile to nothing unless defined here or by the compiler.
+//#define TBD_USE_TRACE
+
+// With TBD_USE_TRACE, also place a static probe named tbd:<EVENT> at each trace point for perf and bpftrace.
+// Needs <sys/sdt.h> from systemtap.
+//#define TBD_USE_SDT_PROBES
+
+// Reject lookups of absent keys with a counting Bloom filter, without searching the stack.
+// The filter takes tbd_init_t.filter_size bytes between the header and the stack, and is off when that is 0.
+#define TBD_USE_FILTER
+
+// Number of filter counters set by each key.
+#define TBD_FILTER_HASH_COUNT 3
+
+// Keep one byte of the key hash in each keyvalue, so a search reads the heap only for keys with the same byte.
+// Each keyvalue grows by that byte, from 66 to 67 bytes with the default options.
+#define TBD_USE_FINGERPRINTS
+
 // Create the smallest possible database.
 // The is requires keys and values to be null terimated strings.
 #define TBD_MAKE_TINY
 
+// Size of the value buffer used by tbd_from_json.
+// Larger values can be parsed with a tbd_json_parser_t and a larger buffer.
+#define TBD_JSON_VALUE_BUFFER_SIZE 256
+
 // Pack structs
 // This will minimize the overhead used by tbd.
 // If defined some functions may run slower because of unaligned memory accesses.
@@ -140,6 +204,26 @@
 
 
 
+/*
+ * Atomic support.
+ * Needed for publishing.
+ */
+#if defined(TBD_USE_PUBLISH)
+  #if defined(__GNUC__) || defined(__clang__)
+
+    #define TBD_ATOMIC_LOAD(_ptr_)            __atomic_load_n((_ptr_), __ATOMIC_SEQ_CST)
+    #define TBD_ATOMIC_STORE(_ptr_, _value_)  __atomic_store_n((_ptr_), (_value_), __ATOMIC_SEQ_CST)
+    #define TBD_ATOMIC_ADD(_ptr_, _value_)    __atomic_add_fetch((_ptr_), (_value_), __ATOMIC_SEQ_CST)
+    #define TBD_ATOMIC_SUB(_ptr_, _value_)    __atomic_sub_fetch((_ptr_), (_value_), __ATOMIC_SEQ_CST)
+
+  #else
+    #undef TBD_USE_PUBLISH
+  #endif
+#endif
+
+
+
+
 /*
  * Standard I/O support.
  * Needed for JSON.
@@ -151,6 +235,51 @@
 
 
 
+/*
+ * Trace support.
+ * TBD_TRACE(tbd, OP_BEGIN, id, size) reports TBD_TRACE_OP_BEGIN to the trace hook, and fires the probe tbd:OP_BEGIN.
+ */
+#if defined(TBD_USE_TRACE)
+
+  #if defined(TBD_USE_SDT_PROBES)
+    #include <sys/sdt.h>
+    #define TBD_TRACE_PROBE(_event_, _id_, _size_)    DTRACE_PROBE2(tbd, _event_, (_id_), (_size_))
+  #else
+    #define TBD_TRACE_PROBE(_event_, _id_, _size_)
+  #endif
+
+  #define TBD_TRACE(_tbd_, _event_, _id_, _size_) \
+    do \
+    { \
+      TBD_TRACE_PROBE(_event_, _id_, _size_); \
+      if ((_tbd_)->trace) \
+      { \
+        (_tbd_)->trace((_tbd_)->trace_context, TBD_TRACE_##_event_, (unsigned) (_id_), (TBD_SIZE_T) (_size_)); \
+      } \
+    } while (0)
+
+#else
+
+  #define TBD_TRACE(_tbd_, _event_, _id_, _size_)    ((void) 0)
+
+#endif
+
+
+
+
+/*
+ * Prefetch support.
+ * TBD_PREFETCH(address) asks the cache to load memory that is read soon, where the compiler can.
+ */
+#if defined(__GNUC__)
+  #define TBD_PREFETCH(_address_)    __builtin_prefetch(_address_)
+#else
+  #define TBD_PREFETCH(_address_)    ((void) 0)
+#endif
+
+
+
+
 /*
  * Define rules for structure alignment.
  */
@@ -225,6 +354,22 @@ static TBD_SIZE_T tbd_key_size(const tbd_key_t* key)
 
 
 
+/** Number of heap bytes used by the key, including any null terminator.
+ */
+static TBD_SIZE_T tbd_key_heap_size(const tbd_key_t* key)
+{
+  TBD_ASSERT(key);
+  
+#ifndef TBD_USE_NULL_TERMINATED_KEY_STRINGS  
+  return key->size;
+#else
+  return strlen(key->str) + 1;  // add 1 for null terminator
+#endif  
+}
+
+
+
+
 
 
 
@@ -362,6 +507,8 @@ static void tbd_heap_empty(tbd_heap_t* heap)
 {
   TBD_ASSERT(heap);
   
+  // the heap grows down from the end of the tbd, so move the top back to the end
+  heap->top += heap->size;
   heap->size = 0;
 }
 
@@ -409,8 +556,16 @@ static unsigned char* tbd_heap_pop(tbd_heap_t* heap, TBD_SIZE_T hunk_size)
 TBD_BEGIN_STRUCT(tbd_keyvalue_flags)
 {
   unsigned char is_garbage : 1;
-  
-} 
+
+#ifdef TBD_USE_EVICTION
+  unsigned char is_referenced : 1;    ///< Set when found, cleared when passed by the eviction clock.
+#endif
+
+#ifdef TBD_USE_VERSIONS
+  unsigned char is_tombstone : 1;     ///< Set when deleted, the keyvalue is kept until the delete is acknowledged.
+#endif
+
+}
 TBD_END_STRUCT(tbd_keyvalue_flags)
 
 
@@ -425,6 +580,22 @@ TBD_BEGIN_STRUCT(tbd_keyvalue)
   tbd_value_t value;           ///< The value reference.
   tbd_keyvalue_flags_t flags;  ///< Various single bit flags.
   
+#ifdef TBD_USE_FINGERPRINTS
+  unsigned char fingerprint;   ///< High byte of the hash of the key.
+#endif
+  
+#ifdef TBD_USE_EXPIRY
+  TBD_TIME_T expires;          ///< Time when the keyvalue expires, 0 if it never expires.
+#endif
+  
+#ifdef TBD_USE_VERSIONS
+  TBD_VERSION_T version;       ///< Version of the last change to the keyvalue.
+#endif
+  
+#ifdef TBD_USE_HANDLES
+  unsigned char handle;        ///< Handle table slot + 1 of the handle to this keyvalue, 0 if there is none.
+#endif
+  
 #ifdef TBD_USE_GARBAGE_LIST  
   struct tbd_keyvalue_struct* prev_garbage;    ///< Pointer to previous element before this that is garbage.
   struct tbd_keyvalue_struct* next_garbage;    ///< Pointer to next element after this that is garbage.
@@ -447,6 +618,10 @@ static void tbd_keyvalue_set_garbage(tbd_keyvalue_t* self, bool is_garbage)
   {
     tbd_key_clear(&self->key);
     tbd_value_clear(&self->value);
+    
+#ifdef TBD_USE_HANDLES
+    self->handle = 0;
+#endif
   }
 }
 
@@ -497,6 +672,22 @@ static bool tbd_keyvalue_is_garbage(const tbd_keyvalue_t* self)
 
 
 
+/** Returns true if the keyvalue was deleted, but is kept as a record of the delete.
+ */
+static bool tbd_keyvalue_is_tombstone(const tbd_keyvalue_t* self)
+{
+  TBD_ASSERT(self);
+  
+#ifdef TBD_USE_VERSIONS
+  return self->flags.is_tombstone;
+#else
+  return false;
+#endif
+}
+
+
+
+
 /** Clear values for given keyvalue.
  */
 static void tbd_keyvalue_clear(tbd_keyvalue_t* keyvalue)
@@ -525,6 +716,37 @@ static TBD_SIZE_T tbd_keyvalue_size(const tbd_keyvalue_t* keyvalue)
 
 
 
+/** Change the size of the value without moving the keyvalue in the heap.
+ *  The key is moved so it stays immediately after the value.
+ *  When using null terminated values, the caller must write the new terminator.
+ *  Returns false if the value and key do not fit in the heap allocated to the keyvalue.
+ */
+static bool tbd_keyvalue_resize_value(tbd_keyvalue_t* keyvalue, TBD_SIZE_T value_size)
+{
+  TBD_ASSERT(keyvalue);
+  
+  const TBD_SIZE_T key_size = tbd_key_heap_size(&keyvalue->key);
+  
+  if (value_size + key_size > keyvalue->heap.size)
+  {
+    return false;
+  }
+  
+  char* key_str = (char*) (keyvalue->value.data + value_size);
+  
+  memmove(key_str, keyvalue->key.str, key_size);
+  keyvalue->key.str = key_str;
+  
+#ifndef TBD_USE_NULL_TERMINATED_VALUES
+  keyvalue->value.size = value_size;
+#endif
+  
+  return true;
+}
+
+
+
+
 /** Key comparision
  */
 static int tbd_keyvalue_keycmp(const tbd_keyvalue_t* keyvalue, const char* key)
@@ -539,12 +761,18 @@ static int tbd_keyvalue_keycmp(const tbd_keyvalue_t* keyvalue, const char* key)
 
 
 /** Keyvalue comparison
+ *  Garbage has no key, and compares greater than any used keyvalue.
  */
 static int tbd_keyvalue_cmp(const tbd_keyvalue_t* keyvalue1, const tbd_keyvalue_t* keyvalue2)
 {
   TBD_ASSERT(keyvalue1);
   TBD_ASSERT(keyvalue2);
   
+  if (tbd_keyvalue_is_garbage(keyvalue1) || tbd_keyvalue_is_garbage(keyvalue2))
+  {
+    return (int) tbd_keyvalue_is_garbage(keyvalue1) - (int) tbd_keyvalue_is_garbage(keyvalue2);
+  }
+  
   return tbd_keyvalue_keycmp(keyvalue1, keyvalue2->key.str);
 }
 
@@ -564,28 +792,51 @@ static int tbd_keyvalue_cmp_heap(const tbd_keyvalue_t* keyvalue1, const tbd_keyv
 
 
 
-/** Copy keyvalue data from src to dest.
+/** Copy keyvalue data from src to dest, keeping the heap allocated to dest.
+ *  The heap allocated to dest must be large enough for the data of src, and may overlap the heap of src.
+ *  Returns the number of heap bytes copied.
  */
 static TBD_SIZE_T tbd_keyvalue_copy(tbd_keyvalue_t* dest, const tbd_keyvalue_t* src)
 {
   TBD_ASSERT(dest);
   TBD_ASSERT(src);
   
-  // copy heap data
-
-  const TBD_SIZE_T value_size = tbd_value_size(&src->value);
+  // the value and key keep their offsets within the heap
+  const TBD_SIZE_T value_offset = (TBD_SIZE_T) (src->value.data - src->heap.top);
+  const TBD_SIZE_T key_offset = (TBD_SIZE_T) ((unsigned char*) src->key.str - src->heap.top);
+  const TBD_SIZE_T data_size = key_offset + tbd_key_heap_size(&src->key);
   
-  memcpy(dest->value.data, src->value.data, value_size);
+  TBD_ASSERT(data_size <= dest->heap.size);
   
-  const TBD_SIZE_T key_size = tbd_key_size(&src->key);
-  
-  memcpy(dest->key.str, src->key.str, key_size);
+  // copy heap data
+  memmove(dest->heap.top, src->heap.top, data_size);
   
   // copy stack data
   dest->key = src->key;
+  dest->key.str = (char*) (dest->heap.top + key_offset);
+  
   dest->value = src->value;
+  dest->value.data = dest->heap.top + value_offset;
+  
+  dest->flags = src->flags;
+  
+#ifdef TBD_USE_FINGERPRINTS
+  dest->fingerprint = src->fingerprint;
+#endif
+  
+#ifdef TBD_USE_EXPIRY
+  dest->expires = src->expires;
+#endif
+  
+#ifdef TBD_USE_VERSIONS
+  dest->version = src->version;
+#endif
   
-  return tbd_keyvalue_size(src);
+#ifdef TBD_USE_HANDLES
+  dest->handle = src->handle;
+#endif
+  
+  return data_size;
 }
 
 
@@ -664,32 +915,6 @@ static TBD_SIZE_T tbd_keyvalue_merge_garbage(tbd_keyvalue_t* keyvalue1, tbd_keyv
 
 
 
-#ifdef TBD_USE_GARBAGE_LIST
-
-/** Return number of bytes of garbage for the keyvalue.
- */
-static TBD_SIZE_T tbd_keyvalue_garbage_list_size(const tbd_keyvalue_t* keyvalue)
-{
-  TBD_ASSERT(keyvalue);
-  
-  TBD_SIZE_T total_size = 0;
-  
-  while(keyvalue)
-  {
-    total_size += tbd_keyvalue_size(keyvalue);
-    keyvalue = keyvalue->next_garbage;
-  }
-  
-  return total_size;
-}
-
-#endif
-
-
-
-
-
-
 /** Simple iterator structure for stack
  */
 typedef struct tbd_keyvalue_stack_iterator_struct
@@ -1085,71 +1310,81 @@ static bool tbd_keyvalue_stack_is_contiguous(const tbd_keyvalue_stack_t* stack)
 
 
 
-static bool tbd_keyvalue_stack_bubble_by_key(tbd_keyvalue_stack_t* stack)
+/** Keyvalue comparison function used to sort the stack.
+ */
+typedef int (*tbd_keyvalue_cmp_fn)(const tbd_keyvalue_t* keyvalue1, const tbd_keyvalue_t* keyvalue2);
+
+
+
+
+/** Move the keyvalue at index down the binary heap formed by the first count keyvalues, until no child compares greater.
+ */
+static void tbd_keyvalue_stack_sift_down(tbd_keyvalue_stack_t* stack, TBD_SIZE_T index, TBD_SIZE_T count, tbd_keyvalue_cmp_fn cmp)
 {
   TBD_ASSERT(stack);
+  TBD_ASSERT(cmp);
   
-  if (tbd_keyvalue_stack_count(stack) < 2)
-  {
-    return false;
-  }
-  
-  tbd_keyvalue_stack_const_iterator_t end = tbd_keyvalue_stack_end(stack);  
-  
-  tbd_keyvalue_stack_iterator_t next = tbd_keyvalue_stack_begin(stack);
-  tbd_keyvalue_stack_iterator_t prev = tbd_keyvalue_stack_begin(stack);  
-  tbd_keyvalue_stack_iterator_next(&next);
-  
-  bool swapped = false;
-  do
+  while (2 * index + 1 < count)
   {
-    if (tbd_keyvalue_cmp(prev.ptr, next.ptr) > 0)
+    TBD_SIZE_T child = 2 * index + 1;
+    
+    if ((child + 1 < count) && (cmp(stack->start + child, stack->start + child + 1) < 0))
     {
-      tbd_keyvalue_swap(prev.ptr, next.ptr);
-      swapped = true;
+      ++child;
     }
     
-    tbd_keyvalue_stack_iterator_next(&next);
-    tbd_keyvalue_stack_iterator_next(&prev);
+    if (cmp(stack->start + index, stack->start + child) >= 0)
+    {
+      break;
+    }
     
-  } while (!tbd_keyvalue_stack_iterator_is_equal(&end, &next));
-  
-  return swapped;
+    tbd_keyvalue_swap(stack->start + index, stack->start + child);
+    index = child;
+  }
 }
 
 
 
 
-static bool tbd_keyvalue_stack_bubble_by_heap(tbd_keyvalue_stack_t* stack)
+/** Sort the stack in place with heapsort, which needs no memory beyond the stack and is O(n log n).
+ *  Keyvalues that compare equal are left in no particular order.
+ */
+static void tbd_keyvalue_stack_sort(tbd_keyvalue_stack_t* stack, tbd_keyvalue_cmp_fn cmp)
 {
   TBD_ASSERT(stack);
+  TBD_ASSERT(cmp);
+  
+  TBD_SIZE_T count = tbd_keyvalue_stack_count(stack);
   
-  if (tbd_keyvalue_stack_count(stack) < 2)
+  if (count < 2)
   {
-    return false;
+    return;
   }
   
-  tbd_keyvalue_stack_const_iterator_t end = tbd_keyvalue_stack_end(stack);  
+  // skip the sort when the stack is already in order, which is common when sorting again after a few changes
+  TBD_SIZE_T i = 1;
+  while ((i < count) && (cmp(stack->start + i - 1, stack->start + i) <= 0))
+  {
+    ++i;
+  }
   
-  tbd_keyvalue_stack_iterator_t next = tbd_keyvalue_stack_begin(stack);
-  tbd_keyvalue_stack_iterator_t prev = tbd_keyvalue_stack_begin(stack);  
-  tbd_keyvalue_stack_iterator_next(&next);
+  if (i == count)
+  {
+    return;
+  }
   
-  bool swapped = false;
-  do
+  for (i = count / 2; i > 0; --i)
   {
-    if (tbd_keyvalue_cmp_heap(prev.ptr, next.ptr) > 0)
-    {
-      tbd_keyvalue_swap(prev.ptr, next.ptr);
-      swapped = true;
-    }
-    
-    tbd_keyvalue_stack_iterator_next(&next);
-    tbd_keyvalue_stack_iterator_next(&prev);
-    
-  } while (!tbd_keyvalue_stack_iterator_is_equal(&end, &next));
+    tbd_keyvalue_stack_sift_down(stack, i - 1, count, cmp);
+  }
   
-  return swapped;
+  // move the greatest keyvalue to the top of the stack, and restore the heap below it
+  while (count > 1)
+  {
+    --count;
+    tbd_keyvalue_swap(stack->start, stack->start + count);
+    tbd_keyvalue_stack_sift_down(stack, 0, count, cmp);
+  }
 }
 
 
@@ -1159,15 +1394,7 @@ static void tbd_keyvalue_stack_sort_by_key(tbd_keyvalue_stack_t* stack)
 {
   TBD_ASSERT(stack);
   
-  // run bubble sort until no elements are swapped
-  do
-  {
-    if (!tbd_keyvalue_stack_bubble_by_key(stack))
-    {
-      break;
-    }
-    
-  } while (1);
+  tbd_keyvalue_stack_sort(stack, tbd_keyvalue_cmp);
 }
 
 
@@ -1177,15 +1404,7 @@ static void tbd_keyvalue_stack_sort_by_heap(tbd_keyvalue_stack_t* stack)
 {
   TBD_ASSERT(stack);
   
-  // run bubble sort until no elements are swapped
-  do
-  {
-    if (!tbd_keyvalue_stack_bubble_by_heap(stack))
-    {
-      break;
-    }
-    
-  } while (1);
+  tbd_keyvalue_stack_sort(stack, tbd_keyvalue_cmp_heap);
 }
 
 
@@ -1199,6 +1418,8 @@ typedef struct tbd_garbage_list_struct
 {
   struct tbd_keyvalue_struct* front;   ///< Pointer to the front of a list of elements that are garbage (can be garbage collected). 
   struct tbd_keyvalue_struct* back;    ///< Pointer to the back of a list of elements that are garbage (can be garbage collected).  
+  TBD_SIZE_T size;                     ///< Number of bytes of garbage in the list, counting stack and heap.
+  TBD_SIZE_T count;                    ///< Number of elements in the list.
  
 } tbd_garbage_list_t;
 
@@ -1211,6 +1432,8 @@ static void tbd_garbage_list_clear(tbd_garbage_list_t* garbage)
   
   garbage->front = NULL;
   garbage->back = NULL;
+  garbage->size = 0;
+  garbage->count = 0;
 }
 
 
@@ -1220,17 +1443,7 @@ static TBD_SIZE_T tbd_garbage_list_count(const tbd_garbage_list_t* self)
 {
   TBD_ASSERT(self);
   
-  size_t result = 0;
-  
-  tbd_keyvalue_t* ptr = self->front;
-  
-  while (ptr)
-  {
-    ++result;
-    ptr = ptr->next_garbage;
-  }
-  
-  return result;
+  return self->count;
 }
 
 
@@ -1274,6 +1487,9 @@ static void tbd_garbage_list_insert(tbd_garbage_list_t* garbage, tbd_keyvalue_t*
     garbage->back = keyvalue;
     keyvalue->prev_garbage = 0;
     keyvalue->next_garbage = 0;
+    
+    garbage->size += tbd_keyvalue_size(keyvalue);
+    ++garbage->count;
   }
   else
   {
@@ -1287,12 +1503,18 @@ static void tbd_garbage_list_insert(tbd_garbage_list_t* garbage, tbd_keyvalue_t*
       next = next->next_garbage;         
     }
     
-    // find the last keyvalue element
+    // find the last keyvalue element, counting the sub list on the way
     tbd_keyvalue_t* keyvalue_last = keyvalue;
     
+    garbage->size += tbd_keyvalue_size(keyvalue);
+    ++garbage->count;
+    
     while (keyvalue_last->next_garbage)
     {
       keyvalue_last = keyvalue_last->next_garbage;
+      
+      garbage->size += tbd_keyvalue_size(keyvalue_last);
+      ++garbage->count;
     }
     
     // insert the sub list
@@ -1312,6 +1534,10 @@ static void tbd_garbage_list_insert(tbd_garbage_list_t* garbage, tbd_keyvalue_t*
       next->prev_garbage = keyvalue_last;
       keyvalue_last->next_garbage = next;
     }
+    else if (!next)
+    {
+      garbage->back = keyvalue_last;
+    }
   }
   
   tbd_keyvalue_set_garbage(keyvalue, true);
@@ -1349,6 +1575,12 @@ static void tbd_garbage_list_delete(tbd_garbage_list_t* garbage, tbd_keyvalue_t*
     next->prev_garbage = keyvalue->prev_garbage;
   }
   
+  keyvalue->prev_garbage = NULL;
+  keyvalue->next_garbage = NULL;
+  
+  garbage->size -= tbd_keyvalue_size(keyvalue);
+  --garbage->count;
+  
   tbd_keyvalue_set_garbage(keyvalue, false);
 }
 
@@ -1372,6 +1604,63 @@ static void tbd_garbage_list_pop(tbd_garbage_list_t* garbage)
   {
     garbage->back = NULL;
   }
+  
+  garbage->size -= tbd_keyvalue_size(keyvalue);
+  --garbage->count;
+}
+
+
+
+
+/** Merge a list of keyvalues sorted in heap order into the garbage list.
+ *  Both lists are walked once, so merging many keyvalues costs one pass over the garbage list.
+ */
+static void tbd_garbage_list_merge(tbd_garbage_list_t* garbage, tbd_keyvalue_t* keyvalue)
+{
+  TBD_ASSERT(garbage);
+  
+  tbd_keyvalue_t* prev = NULL;
+  tbd_keyvalue_t* next = garbage->front;
+  
+  while (keyvalue)
+  {
+    tbd_keyvalue_t* keyvalue_next = keyvalue->next_garbage;
+    
+    // find the insertion point
+    while ( (next) && (next->heap.top < keyvalue->heap.top) )
+    {
+      prev = next;
+      next = next->next_garbage;
+    }
+    
+    // link keyvalue between prev and next
+    keyvalue->prev_garbage = prev;
+    keyvalue->next_garbage = next;
+    
+    if (prev)
+    {
+      prev->next_garbage = keyvalue;
+    }
+    else
+    {
+      garbage->front = keyvalue;
+    }
+    
+    if (next)
+    {
+      next->prev_garbage = keyvalue;
+    }
+    else
+    {
+      garbage->back = keyvalue;
+    }
+    
+    garbage->size += tbd_keyvalue_size(keyvalue);
+    ++garbage->count;
+    
+    prev = keyvalue;
+    keyvalue = keyvalue_next;
+  }
 }
 
 
@@ -1386,8 +1675,40 @@ static void tbd_garbage_list_pop(tbd_garbage_list_t* garbage)
 
 
 
-/** Main structure for a tbd.
- *
+#ifdef TBD_USE_WAL
+
+/** Write-ahead log structure.
+ */
+typedef struct tbd_wal_struct
+{
+  tbd_write_fn write;            ///< Callback that appends bytes to the log.
+  tbd_sync_fn sync;              ///< Callback that makes appended bytes durable, may be NULL.
+  void* context;                 ///< Passed to the callbacks.
+  
+  unsigned char* buffer;         ///< Records waiting to be written.
+  TBD_SIZE_T buffer_size;        ///< Size in bytes of the buffer.
+  TBD_SIZE_T buffer_used;        ///< Number of bytes waiting in the buffer.
+  TBD_SIZE_T unsynced_size;      ///< Number of bytes logged since the last sync.
+  
+  TBD_WAL_SYNC_ENUM sync_mode;   ///< When to sync.
+  TBD_TIME_T sync_interval;      ///< Time between syncs for TBD_WAL_SYNC_INTERVAL.
+  TBD_TIME_T sync_time;          ///< Time of the last sync.
+  
+  TBD_SIZE_T log_size;           ///< Number of bytes logged since the log was opened.
+  TBD_SIZE_T sync_count;         ///< Number of syncs since the log was opened.
+  
+  bool is_open;                  ///< Set while changes are logged.
+  bool has_error;                ///< Set when a callback failed, cleared by tbd_wal_flush.
+  
+} tbd_wal_t;
+
+#endif
+
+
+
+
+/** Main structure for a tbd.
+ *
  *  Stores meta-data about the memory region used for tbd.
  *
  *  The keyvalue stack grows downward into memory (higher memory addresses are used for added key elements).
@@ -1398,11 +1719,65 @@ struct tbd_struct
 {
   TBD_SIZE_T size;         ///< Total size in bytes of the allocated datastore in bytes.
   TBD_SIZE_T hunk_size;    ///< Hunk size for the datastore, this is the minimum size that is allocated from the heap.
-  
-#ifdef TBD_USE_LAST_FOUND_CACHE  
-  tbd_keyvalue_t* last_found;    ///< Pointer to last keyvalue that was found using tbd_keyvalue_find.
+  unsigned flags;          ///< TBD_INIT_FLAG_* values the datastore was initialized with.
+  TBD_TIME_T now;          ///< Current time, set by tbd_set_time.
+  bool is_sorted_by_key;   ///< Set when the stack is in key order, cleared when keyvalues are added, trashed or moved.
+  TBD_SIZE_T moved_size;   ///< Number of heap bytes moved by tbd_garbage_fold and tbd_garbage_pack.
+
+#ifdef TBD_USE_EVICTION
+  TBD_SIZE_T clock_hand;        ///< Stack index of the next keyvalue considered for eviction.
+  TBD_SIZE_T evict_count;       ///< Number of keyvalues evicted to make room.
+#endif
+
+#ifdef TBD_USE_OP_COUNTERS
+  TBD_SIZE_T op_count[TBD_OP_COUNT];   ///< Number of calls of each operation.
+  TBD_SIZE_T read_hit_count;           ///< Number of reads that found their key.
+  TBD_SIZE_T read_miss_count;          ///< Number of reads that did not find their key.
+  TBD_SIZE_T alloc_fail_count;         ///< Number of keyvalues that could not be allocated.
+  TBD_SIZE_T find_count;               ///< Number of stack searches by tbd_find_keyvalue.
+  TBD_SIZE_T find_scan_count;          ///< Number of keyvalues compared by stack searches.
+#endif
+
+#ifdef TBD_USE_LATENCY_HISTOGRAMS
+  tbd_clock_fn clock;                                                     ///< Clock that times operations, NULL when not timing.
+  unsigned latency_histogram[TBD_OP_COUNT][TBD_LATENCY_BUCKET_COUNT];     ///< Operations counted by log2 of their latency.
+  TBD_TIME_T latency_sum[TBD_OP_COUNT];                                   ///< Sum of the latencies of each operation.
+#endif
+
+#ifdef TBD_USE_FILTER
+  TBD_SIZE_T filter_size;       ///< Number of filter counters, which start right after the header.
+  bool is_filter_saturated;     ///< Set when a counter overflowed, the filter is rebuilt by the next garbage collection.
+  TBD_SIZE_T filter_reject_count;   ///< Number of lookups rejected by the filter.
+#endif
+
+#ifdef TBD_USE_TRACE
+  tbd_trace_fn trace;           ///< Trace hook, NULL when not tracing.
+  void* trace_context;          ///< Passed to the trace hook.
+#endif
+
+#ifdef TBD_USE_EXPIRY
+  TBD_SIZE_T sweep_hand;        ///< Stack index of the next keyvalue checked by tbd_expire_sweep.
+#endif
+
+#ifdef TBD_USE_LAST_FOUND_CACHE
+  tbd_keyvalue_t* last_found[TBD_LAST_FOUND_CACHE_SIZE];   ///< Keyvalues recently found using tbd_find_keyvalue, indexed by key hash.
+  TBD_SIZE_T lookup_cache_hit_count;     ///< Number of lookups answered by the last found cache.
+  TBD_SIZE_T lookup_cache_miss_count;    ///< Number of lookups that had to search the stack.
 #endif  
   
+#ifdef TBD_USE_WAL
+  tbd_wal_t wal;                 ///< The write-ahead log.
+#endif
+  
+#ifdef TBD_USE_VERSIONS
+  TBD_VERSION_T version;         ///< Version of the last change, increases with every change.
+#endif
+  
+#ifdef TBD_USE_HANDLES
+  tbd_keyvalue_t* handles[TBD_HANDLE_TABLE_SIZE];          ///< Keyvalue each handle refers to, NULL if the slot is free.
+  unsigned handle_generation[TBD_HANDLE_TABLE_SIZE];       ///< Changed whenever a slot is freed, so old handles stop resolving.
+#endif
+  
 #ifdef TBD_USE_GARBAGE_LIST  
   tbd_garbage_list_t garbage;    ///< The garbage list.
 #endif  
@@ -1420,7 +1795,7 @@ static TBD_SIZE_T tbd_keyvalue_hunk_size(const tbd_t* tbd, TBD_SIZE_T key_size,
 {
   TBD_ASSERT(tbd);
   
-  TBD_SIZE_T hunk_count = (key_size + value_size) / tbd->hunk_size; // calculate number of hunks required for a keyvalue
+  TBD_SIZE_T hunk_count = (key_size + value_size + tbd->hunk_size - 1) / tbd->hunk_size; // calculate number of hunks required for a keyvalue, rounding up
   
   if (!hunk_count) // must use at least 1 hunk
   {
@@ -1504,6 +1879,34 @@ static void tbd_garbage_list_const_iterator_next(tbd_garbage_list_const_iterator
 
 
 
+/** Relink the garbage list from the garbage flags, after keyvalues were moved on the stack.
+ */
+static void tbd_garbage_list_rebuild(tbd_t* tbd)
+{
+  TBD_ASSERT(tbd);
+  
+  tbd_garbage_list_clear(&tbd->garbage);
+  
+  // the bottom of the stack is usually the bottom of the heap, so most keyvalues are merged at the front
+  TBD_SIZE_T i;
+  for (i = 0; i < tbd->stack.count; ++i)
+  {
+    tbd_keyvalue_t* keyvalue = tbd_keyvalue_stack_get(&tbd->stack, i);
+    
+    // used keyvalues may have been copied over garbage, so clear their stale links too
+    keyvalue->prev_garbage = NULL;
+    keyvalue->next_garbage = NULL;
+    
+    if (tbd_keyvalue_is_garbage(keyvalue))
+    {
+      tbd_garbage_list_merge(&tbd->garbage, keyvalue);
+    }
+  }
+}
+
+
+
+
 #endif//TBD_USE_GARBAGE_LIST
 
 
@@ -1554,1458 +1957,6423 @@ static tbd_keyvalue_t* tbd_find_first_garbage_hunk(tbd_t* tbd, TBD_SIZE_T hunk_s
 
 
 
-/** Create a new keyvalue with the given sizes.
+#ifdef TBD_USE_EXPIRY
+
+/** Returns true if the keyvalue has an expiry time that has passed.
  */
-static tbd_keyvalue_t* tbd_create_keyvalue(tbd_t* tbd, TBD_SIZE_T key_size, TBD_SIZE_T value_size)
+static bool tbd_keyvalue_is_expired(const tbd_t* tbd, const tbd_keyvalue_t* keyvalue)
 {
   TBD_ASSERT(tbd);
-
-  const TBD_SIZE_T hunk_size = tbd_keyvalue_hunk_size(tbd, key_size, value_size);
+  TBD_ASSERT(keyvalue);
   
-  tbd_keyvalue_t* keyvalue = NULL;
+  return keyvalue->expires && (keyvalue->expires <= tbd->now);
+}
 
-  // try to find a garbage element with same heap size  
-  keyvalue = tbd_find_first_garbage_hunk(tbd, hunk_size);  
+#endif
 
-  if (keyvalue)
-  {
-    tbd_reclaim_garbage(tbd, keyvalue);
-  }
 
-  // if no suitable garbage could be reclaimed, then allocate from heap
-  else
-  {
-    // check there is enough room to add elements of that size
-    keyvalue = tbd_keyvalue_stack_push(&tbd->stack);
-    unsigned char* heap_top = tbd_heap_push(&tbd->heap, hunk_size);
-  
-    const unsigned char* stack_btm = (unsigned char*) keyvalue + sizeof(tbd_keyvalue_t);
-    
-    if (heap_top < stack_btm)
-    {
-      tbd_keyvalue_stack_pop(&tbd->stack);
-      tbd_heap_pop(&tbd->heap, hunk_size);
-      return NULL;
-    }
 
-    keyvalue->heap.top = heap_top;  
-    keyvalue->heap.size = hunk_size;  
 
-    // initialize garbage list node
-    tbd_keyvalue_recycle(keyvalue);    
-  }
-  
-  // set value and key pointers
-  keyvalue->value.data = keyvalue->heap.top;
-  
-#ifndef TBD_USE_NULL_TERMINATED_VALUES   
-  keyvalue->value.size = value_size;
-#else
-  memset(keyvalue->value.data, 0, value_size);
-#endif
+/** Returns true if a keyvalue is visible, that is not garbage, a tombstone or expired.
+ */
+static bool tbd_keyvalue_is_visible(const tbd_t* tbd, const tbd_keyvalue_t* keyvalue)
+{
+  TBD_ASSERT(tbd);
+  TBD_ASSERT(keyvalue);
   
-  // store string at end so each key:value heap allocation is null terminated
-  keyvalue->key.str = (char*) (keyvalue->heap.top + value_size);
+  if (tbd_keyvalue_is_garbage(keyvalue) || tbd_keyvalue_is_tombstone(keyvalue))
+  {
+    return false;
+  }
   
-#ifndef TBD_USE_NULL_TERMINATED_KEY_STRINGS  
-  keyvalue->key.size = key_size;
+#ifdef TBD_USE_EXPIRY
+  if (tbd_keyvalue_is_expired(tbd, keyvalue))
+  {
+    return false;
+  }
 #endif
   
-  return keyvalue;
+  return true;
 }
 
 
 
 
-/** Find a keyvalue struct with a given key.
- *  Returns NULL if key was not found.
+/** Returns true if the keyvalue is inside the stack.
+ *  A keyvalue pointer can end up outside of the stack when garbage is popped.
  */
-static tbd_keyvalue_t* tbd_find_keyvalue(tbd_t* tbd, const char* key)
+static bool tbd_keyvalue_is_on_stack(const tbd_t* tbd, const tbd_keyvalue_t* keyvalue)
 {
   TBD_ASSERT(tbd);
+  TBD_ASSERT(keyvalue);
   
-  if (tbd_is_empty(tbd))
-  {
-    return NULL;
-  }
+  return (keyvalue >= tbd->stack.start) && ((TBD_SIZE_T) (keyvalue - tbd->stack.start) < tbd->stack.count);
+}
+
+
+
+
+// FNV-1a hash constants, used for cache indexes and checksums.
+#define TBD_FNV_OFFSET_BASIS    (2166136261UL)
+#define TBD_FNV_PRIME           (16777619UL)
+
+
+
+
+/** Continue a 32 bit FNV-1a checksum over more data.
+ *  Start with TBD_FNV_OFFSET_BASIS.
+ */
+static unsigned long tbd_checksum(unsigned long checksum, const void* data, TBD_SIZE_T size)
+{
+  TBD_ASSERT(data || !size);
   
-#ifdef TBD_USE_LAST_FOUND_CACHE  
+  const unsigned char* bytes = (const unsigned char*) data;
   
-  // Look in cached pointer first.
-  if (tbd->last_found && !tbd_keyvalue_is_garbage(tbd->last_found) && tbd_keyvalue_keycmp(tbd->last_found, key) == 0)
+  while (size--)
   {
-    return tbd->last_found;
+    checksum ^= *bytes++;
+    checksum = (checksum * TBD_FNV_PRIME) & 0xFFFFFFFFUL;
   }
   
-#endif  
-  
-  // a simple linear search for a given key
-  // TODO convert to standard C search
-  
-  tbd_keyvalue_stack_iterator_t iter = tbd_keyvalue_stack_begin(&tbd->stack);
-  tbd_keyvalue_stack_const_iterator_t end = tbd_keyvalue_stack_end(&tbd->stack);
+  return checksum;
+}
+
+
+
+
+/** Store an unsigned integer as little endian bytes.
+ */
+static void tbd_uint_to_bytes(unsigned char* bytes, unsigned long long value, TBD_SIZE_T size)
+{
+  TBD_ASSERT(bytes);
   
-  if (!iter.ptr)
+  TBD_SIZE_T i;
+  for (i = 0; i < size; ++i)
   {
-    return NULL;
+    bytes[i] = (unsigned char) (value >> (8 * i));
   }
+}
+
+
+
+
+/** Get an unsigned integer from little endian bytes.
+ */
+static unsigned long long tbd_uint_from_bytes(const unsigned char* bytes, TBD_SIZE_T size)
+{
+  TBD_ASSERT(bytes);
   
-  while (!tbd_keyvalue_stack_iterator_is_equal(&end, &iter))
+  unsigned long long value = 0;
+  
+  while (size--)
   {
-    if (!tbd_keyvalue_is_garbage(iter.ptr) && (tbd_keyvalue_keycmp(iter.ptr, key) == 0))
-    {
-      
-#ifdef TBD_USE_LAST_FOUND_CACHE      
-      tbd->last_found = iter.ptr;
-#endif      
-      
-      return iter.ptr;
-    }
-    
-    tbd_keyvalue_stack_iterator_next(&iter);
+    value = (value << 8) | bytes[size];
   }
   
-  return 0;
+  return value;
 }
 
 
 
 
-static const tbd_keyvalue_t* tbd_find_const_keyvalue(const tbd_t* tbd, const char* key)
+/** 32 bit FNV-1a hash of a key, shared by the last found cache, the filter and the fingerprints.
+ */
+static unsigned long tbd_key_hash(const char* key)
 {
-  // Cast away constness, then cast it back before returning.
-  // Allows the use of tbd_keyvalue_find function.
-  return (const tbd_keyvalue_t*) tbd_find_keyvalue((tbd_t*) tbd, key);
+  TBD_ASSERT(key);
+  
+  unsigned long hash = TBD_FNV_OFFSET_BASIS;
+  
+  while (*key)
+  {
+    hash ^= (unsigned char) *key++;
+    hash = (hash * TBD_FNV_PRIME) & 0xFFFFFFFFUL;
+  }
+  
+  return hash;
 }
 
 
 
 
-int tbd_version(void)
+#ifdef TBD_USE_FINGERPRINTS
+
+/** Get the fingerprint of a key from its hash.
+ *  The high byte is used, the low bits already pick the last found cache entry.
+ */
+static unsigned char tbd_key_fingerprint(unsigned long hash)
 {
-  return TBD_VERSION;
+  return (unsigned char) (hash >> 24);
 }
 
+#endif
 
 
-int tbd_is_error(int value)
-{
-  // all error codes are less than 0
-  return value < 0;
-}
 
 
+#ifdef TBD_USE_LAST_FOUND_CACHE
 
-size_t tbd_size(const tbd_t* tbd)
+/** Get the index of the last found cache entry for a key hash.
+ */
+static TBD_SIZE_T tbd_last_found_index(unsigned long hash)
 {
-  TBD_ASSERT(tbd);
-  
-  return tbd->size;
+  return (TBD_SIZE_T) (hash & (TBD_LAST_FOUND_CACHE_SIZE - 1));
 }
 
 
 
 
-size_t tbd_head_size(const tbd_t* tbd)
+/** Forget all keyvalues in the last found cache.
+ *  Must be called whenever keyvalues are moved on the stack.
+ */
+static void tbd_last_found_clear(tbd_t* tbd)
 {
   TBD_ASSERT(tbd);
   
-  return sizeof(tbd_t);
+  TBD_SIZE_T i;
+  for (i = 0; i < TBD_LAST_FOUND_CACHE_SIZE; ++i)
+  {
+    tbd->last_found[i] = NULL;
+  }
 }
 
 
 
 
-size_t tbd_size_used(const tbd_t* tbd)
+/** Forget a single keyvalue in the last found cache.
+ */
+static void tbd_last_found_forget(tbd_t* tbd, const tbd_keyvalue_t* keyvalue)
 {
   TBD_ASSERT(tbd);
   
-  return tbd_head_size(tbd) + tbd->stack.count * sizeof(tbd_keyvalue_t) + tbd->heap.size;
+  TBD_SIZE_T i;
+  for (i = 0; i < TBD_LAST_FOUND_CACHE_SIZE; ++i)
+  {
+    if (tbd->last_found[i] == keyvalue)
+    {
+      tbd->last_found[i] = NULL;
+    }
+  }
 }
 
+#endif
 
 
 
-size_t tbd_count(const tbd_t* tbd)
-{
-  TBD_ASSERT(tbd);
-  
-  return tbd->stack.count;
-}
 
+#ifdef TBD_USE_FILTER
 
+// Largest count of a filter counter.  A counter that reaches it stays there until the filter is rebuilt.
+#define TBD_FILTER_COUNTER_MAX    (255u)
 
 
-TBD_SIZE_T tbd_max_count(const tbd_t* tbd, TBD_SIZE_T keyvalue_size)
+
+
+static unsigned char* tbd_filter_begin(const tbd_t* tbd)
 {
-  // TODO implement this
+  TBD_ASSERT(tbd);
   
-  return 0;  
+  return (unsigned char*) (tbd + 1);
 }
 
 
 
 
-TBD_SIZE_T tbd_max_key_length(const tbd_t* tbd)
+/** Get the index of the i-th filter counter for a key, by double hashing an FNV-1a hash of the key.
+ */
+static TBD_SIZE_T tbd_filter_index(const tbd_t* tbd, unsigned long hash, unsigned i)
 {
-  return TBD_MAX_KEY_LENGTH;  
+  const unsigned long step = ((hash >> 16) | (hash << 16)) | 1;
+  
+  return (TBD_SIZE_T) (((hash + i * step) & 0xFFFFFFFFUL) % tbd->filter_size);
 }
 
 
 
 
-int tbd_copy(tbd_t* dest, const tbd_t* src)
+static void tbd_filter_add(tbd_t* tbd, unsigned long hash)
 {
-  TBD_ASSERT(dest);
-  TBD_ASSERT(src);
-
-  tbd_keyvalue_stack_const_iterator_t src_stack = tbd_keyvalue_stack_const_begin(&src->stack);
-
-  while (src_stack.ptr)
+  TBD_ASSERT(tbd);
+  
+  if (!tbd->filter_size)
   {
-    //tbd_create(dest, src_stack.ptr->key, 
-    
-    tbd_keyvalue_stack_const_iterator_next(&src_stack);
+    return;
   }
   
-  return TBD_NO_ERROR;
+  unsigned char* counters = tbd_filter_begin(tbd);
+  
+  unsigned i;
+  for (i = 0; i < TBD_FILTER_HASH_COUNT; ++i)
+  {
+    unsigned char* counter = &counters[tbd_filter_index(tbd, hash, i)];
+    
+    if (*counter < TBD_FILTER_COUNTER_MAX)
+    {
+      ++*counter;
+    }
+    else
+    {
+      tbd->is_filter_saturated = true;
+    }
+  }
 }
 
 
 
 
-int tbd_sort_by_key(tbd_t* tbd)
+static void tbd_filter_remove(tbd_t* tbd, unsigned long hash)
 {
   TBD_ASSERT(tbd);
   
-  tbd_keyvalue_stack_sort_by_key(&tbd->stack);
+  if (!tbd->filter_size)
+  {
+    return;
+  }
   
-  return TBD_NO_ERROR;
+  unsigned char* counters = tbd_filter_begin(tbd);
+  
+  unsigned i;
+  for (i = 0; i < TBD_FILTER_HASH_COUNT; ++i)
+  {
+    unsigned char* counter = &counters[tbd_filter_index(tbd, hash, i)];
+    
+    // a saturated counter may be counting more keys than it shows
+    if (*counter && (*counter < TBD_FILTER_COUNTER_MAX))
+    {
+      --*counter;
+    }
+  }
 }
 
 
 
 
-int tbd_sort_by_heap(tbd_t* tbd)
+/** Returns false if the key is certainly not in the tbd.
+ */
+static bool tbd_filter_may_contain(const tbd_t* tbd, unsigned long hash)
 {
   TBD_ASSERT(tbd);
   
-  tbd_keyvalue_stack_sort_by_heap(&tbd->stack);
+  if (!tbd->filter_size)
+  {
+    return true;
+  }
   
-  return TBD_NO_ERROR;
+  const unsigned char* counters = tbd_filter_begin(tbd);
+  
+  unsigned i;
+  for (i = 0; i < TBD_FILTER_HASH_COUNT; ++i)
+  {
+    if (!counters[tbd_filter_index(tbd, hash, i)])
+    {
+      return false;
+    }
+  }
+  
+  return true;
 }
 
 
 
 
-int tbd_create(tbd_t* tbd, const char* key, const void* value, size_t value_size)
+/** Count the keys of every used keyvalue again.
+ */
+static void tbd_filter_rebuild(tbd_t* tbd)
 {
   TBD_ASSERT(tbd);
-  TBD_ASSERT(key);
-  TBD_ASSERT(value);
-  TBD_ASSERT(value_size);
-  
-  TBD_ASSERT(TBD_MAX_SIZE >= value_size);
-  
-  
-  // check that an element with given key does not already exist
-  if (tbd_find_keyvalue(tbd, key))
-  {
-    return TBD_ERROR_KEY_EXISTS;
-  }
-  
-  const size_t key_size = strlen(key) + 1;
   
-  assert(TBD_MAX_KEY_LENGTH >= key_size - 1);
-  
-  struct tbd_keyvalue_struct* keyvalue = tbd_create_keyvalue(tbd, key_size, value_size);
+  memset(tbd_filter_begin(tbd), 0, tbd->filter_size);
+  tbd->is_filter_saturated = false;
   
-  if (!keyvalue)
+  TBD_SIZE_T i;
+  for (i = 0; i < tbd->stack.count; ++i)
   {
-    return TBD_ERROR;
+    const tbd_keyvalue_t* keyvalue = tbd_keyvalue_stack_get(&tbd->stack, i);
+    
+    if (!tbd_keyvalue_is_garbage(keyvalue))
+    {
+      tbd_filter_add(tbd, tbd_key_hash(keyvalue->key.str));
+    }
   }
-  
-  // copy the data into the newly allocated memory
-  memcpy(keyvalue->key.str, key, key_size);
-  memcpy(keyvalue->value.data, value, value_size);
-  
-  return TBD_NO_ERROR;   
 }
 
+#endif
+
 
 
 
-int tbd_read(tbd_t* tbd, const char* key, void* value, size_t value_size)
+/** Record the key of a keyvalue whose key was just written, in its fingerprint and in the filter.
+ */
+static void tbd_keyvalue_index_key(tbd_t* tbd, tbd_keyvalue_t* keyvalue)
 {
   TBD_ASSERT(tbd);
-  TBD_ASSERT(key);
-  TBD_ASSERT(value);
-  TBD_ASSERT(value_size);
+  TBD_ASSERT(keyvalue);
   
-  // find the element
-  struct tbd_keyvalue_struct* ptr = tbd_find_keyvalue(tbd, key);
-  if (!ptr)
-  {
-    return TBD_ERROR_KEY_NOT_FOUND;
-  }
+  const unsigned long hash = tbd_key_hash(keyvalue->key.str);
   
-  // copy value size
-  const TBD_SIZE_T ptr_value_size = tbd_value_size(&ptr->value);
+#ifdef TBD_USE_FINGERPRINTS
+  keyvalue->fingerprint = tbd_key_fingerprint(hash);
+#endif
   
-  if (ptr_value_size != value_size)
-  {
-    return TBD_ERROR_BAD_SIZE;
-  }
-
-  // copy the data to the value
-  memcpy(value, ptr->value.data, value_size);
+#ifdef TBD_USE_FILTER
+  tbd_filter_add(tbd, hash);
+#endif
   
-  return TBD_NO_ERROR;
+  (void) tbd;
+  (void) hash;
 }
 
 
 
 
-int tbd_update(tbd_t* tbd, const char* key, const void* value, size_t value_size)
+/** Returns false if the key of the keyvalue certainly has another hash, without reading the key.
+ */
+static bool tbd_keyvalue_may_match(const tbd_keyvalue_t* keyvalue, unsigned long hash)
 {
-  TBD_ASSERT(tbd);
-  TBD_ASSERT(key);
-  TBD_ASSERT(value);
-  TBD_ASSERT(value_size);
-  
-  // find the element
-  struct tbd_keyvalue_struct* ptr = tbd_find_keyvalue(tbd, key);
-  if (!ptr)
-  {
-    return TBD_ERROR_KEY_NOT_FOUND;
-  }
-  
-  const TBD_SIZE_T ptr_value_size = tbd_value_size(&ptr->value);
-  
-  if (value_size != ptr_value_size)
-  {
-    return TBD_ERROR_BAD_SIZE;
-  }
-  
-  // compute minimum copy size, truncate to value_size
-  const size_t copy_size = (ptr_value_size < value_size) ? ptr_value_size: value_size;
+  TBD_ASSERT(keyvalue);
   
-  // copy the value into datastore
-  memcpy(ptr->value.data, value, copy_size);
+#ifdef TBD_USE_FINGERPRINTS
+  return keyvalue->fingerprint == tbd_key_fingerprint(hash);
+#else
+  (void) keyvalue;
+  (void) hash;
   
-  return TBD_NO_ERROR;
+  return true;
+#endif
 }
 
 
 
 
-int tbd_delete(tbd_t* tbd, const char* key)
+#if defined(TBD_USE_HANDLES)
+
+/** Mask for the generation stored in a handle.
+ */
+#define TBD_HANDLE_GENERATION_MASK 0xFFFFFFu
+
+
+
+
+/** Make a handle from a slot and its generation, never 0.
+ */
+static tbd_handle_t tbd_handle_make(const tbd_t* tbd, TBD_SIZE_T slot)
 {
   TBD_ASSERT(tbd);
-  TBD_ASSERT(key);
-  
-  // find the element
-  struct tbd_keyvalue_struct* ptr = tbd_find_keyvalue(tbd, key);
-  if (!ptr)
-  {
-    return TBD_NO_ERROR; // no error if it did not exist
-  }  
-  
-  #if defined(TBD_USE_GARBAGE_LIST)
-    tbd_garbage_list_insert(&tbd->garbage, ptr);
-  #endif  
+  TBD_ASSERT(slot < TBD_HANDLE_TABLE_SIZE);
   
-  tbd_keyvalue_set_garbage(ptr, true);
-  
-  return TBD_NO_ERROR;
+  return ((tbd_handle_t) (tbd->handle_generation[slot] & TBD_HANDLE_GENERATION_MASK) << 8) | (tbd_handle_t) (slot + 1);
 }
 
 
 
 
-size_t tbd_read_size(tbd_t* tbd, const char* key)
+/** Find the keyvalue a handle refers to.
+ *  Returns NULL if the handle was released or its keyvalue is gone.
+ */
+static tbd_keyvalue_t* tbd_handle_resolve(const tbd_t* tbd, tbd_handle_t handle)
 {
   TBD_ASSERT(tbd);
-  TBD_ASSERT(key);
   
-  // find the element
-  struct tbd_keyvalue_struct* ptr = tbd_find_keyvalue(tbd, key);
-  if (!ptr)
+  const TBD_SIZE_T slot = (TBD_SIZE_T) (handle & 0xFF) - 1;
+  
+  if ((slot >= TBD_HANDLE_TABLE_SIZE) || (handle != tbd_handle_make(tbd, slot)))
   {
-    return 0;
+    return NULL;
   }
-
-  return tbd_value_size(&ptr->value);
+  
+  return tbd->handles[slot];
 }
 
 
 
 
-void tbd_clear(tbd_t* tbd)
+/** Free a handle slot, so handles to it stop resolving.
+ */
+static void tbd_handle_free(tbd_t* tbd, TBD_SIZE_T slot)
 {
   TBD_ASSERT(tbd);
-
-  tbd_keyvalue_stack_clear(&tbd->stack);
-  tbd_heap_clear(&tbd->heap);
-
-  #if defined(TBD_USE_LAST_FOUND_CACHE)  
-    tbd->last_found = NULL;
-  #endif  
+  TBD_ASSERT(slot < TBD_HANDLE_TABLE_SIZE);
   
-  #if defined(TBD_USE_GARBAGE_LIST)
-    tbd_garbage_list_clear(&tbd->garbage);
-  #endif
+  tbd->handles[slot] = NULL;
+  ++tbd->handle_generation[slot];
 }
 
 
 
 
-void tbd_empty(tbd_t* tbd)
+/** Free the handle to a keyvalue that is going away.
+ */
+static void tbd_handle_forget(tbd_t* tbd, tbd_keyvalue_t* keyvalue)
 {
   TBD_ASSERT(tbd);
-
-  tbd_keyvalue_stack_empty(&tbd->stack);
-  tbd_heap_empty(&tbd->heap);
-
-  #if defined(TBD_USE_LAST_FOUND_CACHE)  
-    tbd->last_found = NULL;
-  #endif  
+  TBD_ASSERT(keyvalue);
   
-  #if defined (TBD_USE_GARBAGE_LIST)
-    tbd_garbage_list_clear(&tbd->garbage);
-  #endif
+  if (keyvalue->handle)
+  {
+    tbd_handle_free(tbd, keyvalue->handle - 1);
+    keyvalue->handle = 0;
+  }
 }
 
 
 
 
-int tbd_is_empty(const tbd_t* tbd)
+/** Pass the handle of a keyvalue on to the keyvalue replacing it.
+ */
+static void tbd_handle_move(tbd_t* tbd, tbd_keyvalue_t* from, tbd_keyvalue_t* to)
 {
   TBD_ASSERT(tbd);
+  TBD_ASSERT(from);
+  TBD_ASSERT(to);
   
-  return (0 == tbd->stack.count);
+  to->handle = from->handle;
+  from->handle = 0;
+  
+  if (to->handle)
+  {
+    tbd->handles[to->handle - 1] = to;
+  }
 }
 
 
 
 
-/** Initialize the tbd inside the memory bounds in init structure.
+/** Point the handle table at the keyvalues after they were moved on the stack.
+ *  Handles whose keyvalue was not found are freed.
  */
-tbd_t* tbd_init(const tbd_init_t* init)
+static void tbd_handle_rebuild(tbd_t* tbd)
 {
-  TBD_ASSERT(init);
+  TBD_ASSERT(tbd);
   
-  /* check for non-null pointer */
-  if (!init)
+  tbd_keyvalue_t* handles[TBD_HANDLE_TABLE_SIZE] = {NULL};
+  
+  TBD_SIZE_T i;
+  for (i = 0; i < tbd->stack.count; ++i)
   {
-    return 0;
+    tbd_keyvalue_t* keyvalue = tbd_keyvalue_stack_get(&tbd->stack, i);
+    
+    if (keyvalue->handle && !tbd_keyvalue_is_garbage(keyvalue))
+    {
+      handles[keyvalue->handle - 1] = keyvalue;
+    }
   }
   
-  /* check for enough room to store tbd_struct */
-  if (init->size < sizeof(struct tbd_struct))
+  for (i = 0; i < TBD_HANDLE_TABLE_SIZE; ++i)
   {
-    return 0;
+    if (tbd->handles[i] && !handles[i])
+    {
+      tbd_handle_free(tbd, i);
+    }
+    
+    tbd->handles[i] = handles[i];
   }
-  
-  tbd_t* tbd = init->start;
-  
-  tbd_clear(tbd);
-  
-  tbd->size = init->size;
-  tbd->hunk_size = init->hunk_size;
-  
-  // locate keyvalue list immediately after tbd struct
-  tbd->stack.start = (tbd_keyvalue_t*) (tbd + 1);
-  tbd->stack.count = 0;
-  
-  // locate start of heap at end of allocated region
-  tbd->heap.top = ((unsigned char*) init->start) + init->size;
-  tbd->heap.size = 0;
-  
-  return tbd;
 }
 
 
 
 
-
-
-
-
-/*
- *
- * ITERATOR FUNCTIONS
- *
- */
-
-
-
-
-/** Get forward iterator to first keyvalue element.
+/** Free every handle.
  */
-tbd_const_iterator_t tbd_const_begin(const tbd_t* tbd)
+static void tbd_handle_clear(tbd_t* tbd)
 {
   TBD_ASSERT(tbd);
   
-  return (tbd_const_iterator_t) { .ptr = tbd_keyvalue_stack_const_begin(&tbd->stack).ptr }; 
+  TBD_SIZE_T i;
+  for (i = 0; i < TBD_HANDLE_TABLE_SIZE; ++i)
+  {
+    if (tbd->handles[i])
+    {
+      tbd_handle_free(tbd, i);
+    }
+  }
 }
 
+#endif
+
 
 
 
-/** Get forward iterator to end+1 keyvalue element.
+/** Turn a used keyvalue into garbage.
  */
-tbd_const_iterator_t tbd_const_end(const tbd_t* tbd)
+static void tbd_trash_keyvalue(tbd_t* tbd, tbd_keyvalue_t* keyvalue)
 {
   TBD_ASSERT(tbd);
+  TBD_ASSERT(keyvalue);
   
-  return (tbd_const_iterator_t) {.ptr = tbd_keyvalue_stack_end(&tbd->stack).ptr};  
+  // before the garbage list merges the key away
+  #if defined(TBD_USE_FILTER)
+    tbd_filter_remove(tbd, tbd_key_hash(keyvalue->key.str));
+  #endif
+  
+  #if defined(TBD_USE_HANDLES)
+    tbd_handle_forget(tbd, keyvalue);
+  #endif
+  
+  #if defined(TBD_USE_GARBAGE_LIST)
+    tbd_garbage_list_insert(&tbd->garbage, keyvalue);
+  #endif  
+  
+  #if defined(TBD_USE_LAST_FOUND_CACHE)
+    tbd_last_found_forget(tbd, keyvalue);
+  #endif
+  
+  tbd_keyvalue_set_garbage(keyvalue, true);
+  
+  tbd->is_sorted_by_key = false;
 }
 
 
 
 
-/** Move iterator to next element.
+/** Turn a newly allocated keyvalue, that never held a key, into garbage.
  */
-tbd_const_iterator_t tbd_const_iterator_next(tbd_const_iterator_t i)
+static void tbd_discard_keyvalue(tbd_t* tbd, tbd_keyvalue_t* keyvalue)
 {
-  tbd_keyvalue_stack_const_iterator_t temp = {.ptr = i.ptr};
+  TBD_ASSERT(tbd);
+  TBD_ASSERT(keyvalue);
   
-  return (tbd_const_iterator_t) {.ptr = tbd_keyvalue_stack_const_iterator_next(&temp)};
-}
-
-
-
-
-/** Test if iterators are equivalent.
- */
-int tbd_const_iterator_is_equal(tbd_const_iterator_t a, tbd_const_iterator_t b)
-{  
-  return (a.ptr == b.ptr);
+  #if defined(TBD_USE_GARBAGE_LIST)
+    tbd_garbage_list_insert(&tbd->garbage, keyvalue);
+  #endif
+  
+  tbd_keyvalue_set_garbage(keyvalue, true);
+  
+  tbd->is_sorted_by_key = false;
 }
 
 
 
 
-/** Get pointer to key pointed to by iterator.
- * Will return NULL if iterator is invalid.
+/** Remove a used keyvalue that was deleted, expired or evicted.
+ *  If the tbd keeps tombstones it becomes one with the next version, otherwise it becomes garbage.
+ *  Returns true if a tombstone was left.
  */
-const char* tbd_const_iterator_key(const tbd_const_iterator_t i)
+static bool tbd_bury_keyvalue(tbd_t* tbd, tbd_keyvalue_t* keyvalue)
 {
-  TBD_ASSERT(i.ptr);
+  TBD_ASSERT(tbd);
+  TBD_ASSERT(keyvalue);
   
-  return ((tbd_keyvalue_t*)(i.ptr))->key.str;  
+#ifdef TBD_USE_VERSIONS
+  // keep a tombstone until the removal has been exported and acknowledged
+  if (tbd->flags & TBD_INIT_FLAG_TOMBSTONES)
+  {
+    keyvalue->flags.is_tombstone = 1;
+    keyvalue->version = ++tbd->version;
+    
+  #if defined(TBD_USE_EXPIRY)
+    keyvalue->expires = 0;
+  #endif
+    
+  #if defined(TBD_USE_LAST_FOUND_CACHE)
+    tbd_last_found_forget(tbd, keyvalue);
+  #endif
+  
+  #if defined(TBD_USE_HANDLES)
+    tbd_handle_forget(tbd, keyvalue);
+  #endif
+    
+    return true;
+  }
+#endif
+  
+  tbd_trash_keyvalue(tbd, keyvalue);
+  
+  return false;
 }
 
 
 
 
-/** Get the size in bytes of the value pointed to by iterator.
+#ifdef TBD_USE_VERSIONS
+
+/** Turn the tombstone of a key that was just created again into garbage.
+ *  The new keyvalue is exported as a put, which replaces the delete on every replica.
  */
-size_t tbd_const_iterator_value_size(const tbd_const_iterator_t i)
+static void tbd_forget_tombstone(tbd_t* tbd, const char* key)
 {
-  TBD_ASSERT(i.ptr);
+  TBD_ASSERT(tbd);
+  TBD_ASSERT(key);
   
-  return tbd_value_size(&((tbd_keyvalue_t*)(i.ptr))->value);
+  if (!(tbd->flags & TBD_INIT_FLAG_TOMBSTONES))
+  {
+    return;
+  }
+  
+  const unsigned long hash = tbd_key_hash(key);
+  
+#ifdef TBD_USE_FILTER
+  // tombstones stay in the filter, so it still rules out most keys
+  if (!tbd_filter_may_contain(tbd, hash))
+  {
+    return;
+  }
+#endif
+  
+  TBD_SIZE_T i;
+  for (i = 0; i < tbd->stack.count; ++i)
+  {
+    tbd_keyvalue_t* keyvalue = tbd_keyvalue_stack_get(&tbd->stack, i);
+    
+    if (tbd_keyvalue_is_tombstone(keyvalue) && !tbd_keyvalue_is_garbage(keyvalue) && tbd_keyvalue_may_match(keyvalue, hash) && (tbd_keyvalue_keycmp(keyvalue, key) == 0))
+    {
+      keyvalue->flags.is_tombstone = 0;
+      tbd_trash_keyvalue(tbd, keyvalue);
+      return;
+    }
+  }
 }
 
+#endif
 
 
 
-/** Get the pointer to the value pointd to by the iterator.
+
+/** Allocate a new keyvalue from the top of the stack and the top of the heap.
+ *  Returns NULL if the stack would run into the heap.
  */
-const void* tbd_const_iterator_value(const tbd_const_iterator_t i)
+static tbd_keyvalue_t* tbd_push_keyvalue(tbd_t* tbd, TBD_SIZE_T hunk_size)
 {
-  TBD_ASSERT(i.ptr);
+  TBD_ASSERT(tbd);
   
-  return ((tbd_keyvalue_t*)(i.ptr))->value.data;
-}
-
-
-
-
+  // check there is enough room to add elements of that size
+  tbd_keyvalue_t* keyvalue = tbd_keyvalue_stack_push(&tbd->stack);
+  unsigned char* heap_top = tbd_heap_push(&tbd->heap, hunk_size);
 
+  const unsigned char* stack_btm = (unsigned char*) keyvalue + sizeof(tbd_keyvalue_t);
+  
+  if (heap_top < stack_btm)
+  {
+    tbd_keyvalue_stack_pop(&tbd->stack);
+    tbd_heap_pop(&tbd->heap, hunk_size);
+    return NULL;
+  }
 
+  keyvalue->heap.top = heap_top;  
+  keyvalue->heap.size = hunk_size;  
 
+  // initialize garbage list node
+  tbd_keyvalue_recycle(keyvalue);
+  
+  tbd->is_sorted_by_key = false;
+  
+  return keyvalue;
+}
 
-/*
- *
- * GARBAGE COLLECTION FUNCTIONS
- *
- */
 
 
 
+#ifdef TBD_USE_EVICTION
 
-/** Returns size in bytes of garbage in tbd.
+/** Move the clock hand to the next used keyvalue that has not been referenced since the hand last passed it.
+ *  Returns NULL if there are no used keyvalues.
  */
-TBD_SIZE_T tbd_garbage_size(const tbd_t* tbd)
+static tbd_keyvalue_t* tbd_evict_find_victim(tbd_t* tbd)
 {
   TBD_ASSERT(tbd);
   
-  size_t result = 0;
-  
-#ifdef TBD_USE_GARBAGE_LIST  
+  const TBD_SIZE_T count = tbd_keyvalue_stack_count(&tbd->stack);
   
-  tbd_keyvalue_t* ptr = tbd->garbage.front;
+  // the first pass clears every reference bit, so two passes always find a victim
+  TBD_SIZE_T remaining = 2 * count;
   
-  if (ptr)
+  while (remaining--)
   {
-    result = tbd_keyvalue_garbage_list_size(ptr); 
+    if (tbd->clock_hand >= count)
+    {
+      tbd->clock_hand = 0;
+    }
+    
+    tbd_keyvalue_t* keyvalue = tbd_keyvalue_stack_get(&tbd->stack, tbd->clock_hand++);
+    
+    // tombstones stay until their delete is acknowledged
+    if (tbd_keyvalue_is_garbage(keyvalue) || tbd_keyvalue_is_tombstone(keyvalue))
+    {
+      continue;
+    }
+    
+    if (keyvalue->flags.is_referenced)
+    {
+      keyvalue->flags.is_referenced = 0;
+      continue;
+    }
+    
+    return keyvalue;
   }
   
-#else
+  return NULL;
+}
+
+
+
+
+/** Evict cold keyvalues until a hunk of the given size can be allocated.
+ *  Returns NULL if the hunk does not fit even in an empty tbd.
+ */
+static tbd_keyvalue_t* tbd_evict_keyvalue(tbd_t* tbd, TBD_SIZE_T hunk_size)
+{
+  TBD_ASSERT(tbd);
   
-  if (tbd_keyvalue_stack_count(&tbd->stack))
+  tbd_keyvalue_t* victim = NULL;
+  
+  while ((victim = tbd_evict_find_victim(tbd)))
   {
-    tbd_keyvalue_stack_iterator_t stack_ptr = tbd_keyvalue_stack_begin(&tbd->stack);
-    tbd_keyvalue_stack_const_iterator_t stack_end = tbd_keyvalue_stack_end(&tbd->stack);
+    TBD_TRACE(tbd, EVICT, 0, victim->heap.size);
     
-    while (!tbd_keyvalue_stack_const_iterator_is_equal(&stack_end, &stack_ptr))
+    ++tbd->evict_count;
+    
+    // a tombstone holds on to its memory until acknowledged, so evicting more would only empty the tbd
+    if (tbd_bury_keyvalue(tbd, victim))
     {
-      tbd_keyvalue_stack_iterator_next(&stack_ptr);  
-    }    
+      return NULL;
+    }
+    
+    // garbage at the top of the stack and heap is released without moving any data
+    tbd_garbage_pop(tbd, tbd_size(tbd));
+    
+    // reuse the victim in place if it was not popped and its hunk is large enough
+    if (tbd_keyvalue_is_on_stack(tbd, victim) && (victim->heap.size >= hunk_size))
+    {
+      tbd_reclaim_garbage(tbd, victim);
+      return victim;
+    }
+    
+    tbd_keyvalue_t* keyvalue = tbd_push_keyvalue(tbd, hunk_size);
+    
+    if (keyvalue)
+    {
+      return keyvalue;
+    }
   }
   
-#endif
-  
-  return result;
+  return NULL;
 }
 
+#endif//TBD_USE_EVICTION
 
 
 
-/** Returns number of garbage keyvalue elements in tbd.
+
+/** Lay out the key and value of a newly allocated keyvalue within its heap.
  */
-TBD_SIZE_T tbd_garbage_count(const tbd_t* tbd)
+static void tbd_keyvalue_place(tbd_t* tbd, tbd_keyvalue_t* keyvalue, TBD_SIZE_T key_size, TBD_SIZE_T value_size)
 {
-  TBD_ASSERT(tbd);  
+  TBD_ASSERT(tbd);
+  TBD_ASSERT(keyvalue);
   
-  #if defined(TBD_USE_GARBAGE_LIST)
-    return tbd_garbage_list_count(&tbd->garbage);
-  #else
-   
-    // TODO iterate over keyvalue stack and count garbage
-    return 0;
+  // a reused garbage hunk or evicted slot can be anywhere on the stack
+  tbd->is_sorted_by_key = false;
   
-  #endif
+#ifdef TBD_USE_EVICTION
+  // new keyvalues are cold until they are found again
+  keyvalue->flags.is_referenced = 0;
+#endif
+
+#ifdef TBD_USE_EXPIRY
+  keyvalue->expires = 0;
+#endif
+
+#ifdef TBD_USE_VERSIONS
+  keyvalue->flags.is_tombstone = 0;
+  keyvalue->version = 0;
+#endif
+
+#ifdef TBD_USE_HANDLES
+  keyvalue->handle = 0;
+#endif
+  
+  // set value and key pointers
+  keyvalue->value.data = keyvalue->heap.top;
+  
+#ifndef TBD_USE_NULL_TERMINATED_VALUES   
+  keyvalue->value.size = value_size;
+#else
+  memset(keyvalue->value.data, 0, value_size);
+#endif
+  
+  // store string at end so each key:value heap allocation is null terminated
+  keyvalue->key.str = (char*) (keyvalue->heap.top + value_size);
+  
+#ifndef TBD_USE_NULL_TERMINATED_KEY_STRINGS  
+  keyvalue->key.size = key_size;
+#else
+  (void) key_size;
+#endif
 }
 
 
 
 
-/** Merge all keyvalues in stack that are garbage and are located next to each other in heap.
+/** Create a new keyvalue with the given sizes.
  */
-TBD_SIZE_T tbd_garbage_merge(tbd_t* tbd)
+static tbd_keyvalue_t* tbd_create_keyvalue(tbd_t* tbd, TBD_SIZE_T key_size, TBD_SIZE_T value_size)
 {
   TBD_ASSERT(tbd);
+
+  const TBD_SIZE_T hunk_size = tbd_keyvalue_hunk_size(tbd, key_size, value_size);
   
-  size_t total_merged = 0;
+  TBD_TRACE(tbd, ALLOC_BEGIN, 0, hunk_size);
   
-  tbd_keyvalue_stack_iterator_t prev = tbd_keyvalue_stack_begin(&tbd->stack);
-  tbd_keyvalue_stack_iterator_t next = tbd_keyvalue_stack_begin(&tbd->stack);  
-  tbd_keyvalue_stack_const_iterator_t end = tbd_keyvalue_stack_end(&tbd->stack);
+  tbd_keyvalue_t* keyvalue = NULL;
+
+  // try to find a garbage element with same heap size  
+  keyvalue = tbd_find_first_garbage_hunk(tbd, hunk_size);  
+
+  if (keyvalue)
+  {
+    TBD_TRACE(tbd, ALLOC_REUSE, 0, hunk_size);
+    
+    tbd_reclaim_garbage(tbd, keyvalue);
+  }
+
+  // if no suitable garbage could be reclaimed, then allocate from heap
+  else
+  {
+    keyvalue = tbd_push_keyvalue(tbd, hunk_size);
+  }
   
-  if (tbd_keyvalue_stack_iterator_is_equal(&end, &next))
+#ifdef TBD_USE_EVICTION
+  
+  // if the heap is full, then make room by evicting cold keyvalues
+  if (!keyvalue && (tbd->flags & TBD_INIT_FLAG_EVICT))
   {
-    return 0;
+    keyvalue = tbd_evict_keyvalue(tbd, hunk_size);
   }
   
-  // increment next ahead of prev
-  tbd_keyvalue_stack_iterator_next(&next);  
+#endif
   
-  while(!tbd_keyvalue_stack_iterator_is_equal(&end, &next))
+  TBD_TRACE(tbd, ALLOC_END, keyvalue != NULL, hunk_size);
+  
+  if (!keyvalue)
   {
-    total_merged += tbd_keyvalue_merge_garbage(prev.ptr, next.ptr);
+#ifdef TBD_USE_OP_COUNTERS
+    ++tbd->alloc_fail_count;
+#endif
     
-    tbd_keyvalue_stack_iterator_next(&next);    
-    tbd_keyvalue_stack_iterator_next(&prev);
+    return NULL;
   }
   
-  return total_merged;
+  tbd_keyvalue_place(tbd, keyvalue, key_size, value_size);
+  
+  return keyvalue;
 }
 
 
 
 
-/** TODO: Remove use of garbage list
+/** Look up a key without searching the stack, in the filter and the last found cache.
+ *  Sets event to TBD_TRACE_FILTER_REJECT or TBD_TRACE_CACHE_HIT if one of them answered, or TBD_TRACE_COUNT, for tbd_find_trace_quick.
+ *  Returns true with the keyvalue, or NULL, in found if the lookup is over.
+ *  Returns false if the stack must be searched.
  */
-TBD_SIZE_T tbd_garbage_pop(tbd_t* tbd, size_t garbage_limit)
+static bool tbd_find_keyvalue_quick(tbd_t* tbd, const char* key, unsigned long hash, tbd_keyvalue_t** found, TBD_TRACE_ENUM* event)
 {
   TBD_ASSERT(tbd);
+  TBD_ASSERT(found);
+  TBD_ASSERT(event);
   
-  size_t pop_total = 0;
+  *found = NULL;
+  *event = TBD_TRACE_COUNT;
   
-  if (!garbage_limit)
+  if (tbd_is_empty(tbd))
   {
-    return 0;
+    return true;
   }
-    
-  
-  tbd_keyvalue_stack_iterator_t iter = tbd_keyvalue_stack_begin(&tbd->stack);  
-  tbd_keyvalue_stack_const_iterator_t end = tbd_keyvalue_stack_end(&tbd->stack);
   
-
-  while (!tbd_keyvalue_stack_iterator_is_equal(&end, &iter) && tbd_keyvalue_is_garbage(iter.ptr) &&(iter.ptr->heap.top == tbd->heap.top))
+#ifdef TBD_USE_FILTER
+  if (!tbd_filter_may_contain(tbd, hash))
   {
-    const size_t keyvalue_size = tbd_keyvalue_size(iter.ptr);
-    
-    if ((pop_total + keyvalue_size) > garbage_limit)
-    {
-      break;
-    }
+    ++tbd->filter_reject_count;
     
-    pop_total += keyvalue_size;
+    *event = TBD_TRACE_FILTER_REJECT;
     
-    TBD_SIZE_T heap_size = tbd_heap_size(&iter.ptr->heap);
+    return true;
+  }
+#endif
+  
+#ifdef TBD_USE_LAST_FOUND_CACHE  
+  
+  // Look in the cache first.
+  // A cached pointer is only trusted if it still points at a used keyvalue with the same key.
+  tbd_keyvalue_t* last_found = tbd->last_found[tbd_last_found_index(hash)];
+  
+  if (last_found && tbd_keyvalue_is_on_stack(tbd, last_found) && !tbd_keyvalue_is_garbage(last_found) && !tbd_keyvalue_is_tombstone(last_found) && tbd_keyvalue_may_match(last_found, hash) && tbd_keyvalue_keycmp(last_found, key) == 0)
+  {
+    tbd->lookup_cache_hit_count++;
     
-    tbd_heap_pop(&tbd->heap, heap_size);
-    tbd_keyvalue_stack_pop(&tbd->stack);
-    tbd_garbage_list_delete(&tbd->garbage, iter.ptr);
+    *event = TBD_TRACE_CACHE_HIT;
     
-    if (!tbd_keyvalue_stack_count(&tbd->stack))
+#ifdef TBD_USE_EXPIRY
+    if (tbd_keyvalue_is_expired(tbd, last_found))
     {
-      break;
+      tbd_bury_keyvalue(tbd, last_found);
+      return true;
     }
+#endif
+
+#ifdef TBD_USE_EVICTION
+    last_found->flags.is_referenced = 1;
+#endif
     
-    iter = tbd_keyvalue_stack_begin(&tbd->stack); 
+    *found = last_found;
+    return true;
   }
   
-  return pop_total;
+  tbd->lookup_cache_miss_count++;
+  
+#else
+  (void) key;
+#endif  
+  
+  return false;
 }
 
 
 
 
-TBD_SIZE_T tbd_garbage_fold(tbd_t* tbd, size_t garbage_limit)
+/** Report how tbd_find_keyvalue_quick answered a lookup.
+ */
+static void tbd_find_trace_quick(tbd_t* tbd, TBD_TRACE_ENUM event)
 {
   TBD_ASSERT(tbd);
   
-  if (!garbage_limit)
+  if (TBD_TRACE_FILTER_REJECT == event)
   {
-    return 0;
+    TBD_TRACE(tbd, FILTER_REJECT, 0, 0);
   }
-  
-  if (0 == tbd_garbage_size(tbd))
+  else if (TBD_TRACE_CACHE_HIT == event)
   {
-    return 0;
+    TBD_TRACE(tbd, CACHE_HIT, 0, 0);
   }
   
-  size_t garbage_total = 0;
+  (void) tbd;
+}
 
-  tbd_keyvalue_stack_iterator_t top = tbd_keyvalue_stack_begin(&tbd->stack);
-  tbd_keyvalue_stack_const_iterator_t top_end = tbd_keyvalue_stack_end(&tbd->stack);
-  
-  tbd_keyvalue_stack_reverse_iterator_t btm = tbd_keyvalue_stack_rbegin(&tbd->stack);
-  tbd_keyvalue_stack_const_reverse_iterator_t btm_end = tbd_keyvalue_stack_rend(&tbd->stack);
+
+
+
+/** Returns true if a stack search for the key stops at this keyvalue.
+ */
+static bool tbd_keyvalue_is_match(const tbd_keyvalue_t* keyvalue, const char* key, unsigned long hash)
+{
+  // the fingerprint rules out most other keys without touching the heap
+  return tbd_keyvalue_may_match(keyvalue, hash) && !tbd_keyvalue_is_garbage(keyvalue) && !tbd_keyvalue_is_tombstone(keyvalue) && (tbd_keyvalue_keycmp(keyvalue, key) == 0);
+}
+
+
+
+
+/** Finish a stack search that stopped at a keyvalue.
+ *  Returns NULL if the keyvalue has expired.
+ */
+static tbd_keyvalue_t* tbd_find_keyvalue_accept(tbd_t* tbd, tbd_keyvalue_t* keyvalue, unsigned long hash)
+{
+  TBD_ASSERT(tbd);
+  TBD_ASSERT(keyvalue);
   
-  if (!(top.ptr || top_end.ptr || btm.ptr || btm_end.ptr))
+#ifdef TBD_USE_EXPIRY
+  // an expired keyvalue is removed as soon as it is touched
+  if (tbd_keyvalue_is_expired(tbd, keyvalue))
   {
-    return 0;
+    tbd_bury_keyvalue(tbd, keyvalue);
+    return NULL;
   }
+#endif
   
-  while ((garbage_total < garbage_limit) && (top.ptr != top_end.ptr) && (btm.ptr != btm_end.ptr))
-  { 
-    if (tbd_keyvalue_is_garbage(top.ptr))
-    {
-      tbd_keyvalue_stack_iterator_next(&top);
-      continue;  
-    }
-    
-    if (!tbd_keyvalue_is_garbage(btm.ptr))
-    {
-      tbd_keyvalue_stack_reverse_iterator_next(&btm);
-      continue;
-    }
-    
-    tbd_keyvalue_stack_iterator_t temp_top = top;
-    
-    while (temp_top.ptr != top_end.ptr)
-    {
-      if (tbd_keyvalue_is_garbage(temp_top.ptr))
-      {
-        tbd_keyvalue_stack_iterator_next(&temp_top);
-        continue;  
-      }      
-      
-      size_t garbage_size = tbd_keyvalue_size(temp_top.ptr);
-      
-      if (garbage_total + garbage_size > garbage_limit)
-      {
-        tbd_keyvalue_stack_iterator_next(&temp_top);
-        continue;
-      }
-      
-      if (btm.ptr->heap.size == temp_top.ptr->heap.size)
-      {
-        garbage_total += tbd_keyvalue_copy(btm.ptr, temp_top.ptr);
-        
-        tbd_keyvalue_set_garbage(btm.ptr, false);
-        tbd_keyvalue_set_garbage(temp_top.ptr, true);
-        
-#if defined(TBD_USE_GARBAGE_LIST)
-        
-        temp_top.ptr->next_garbage = btm.ptr->next_garbage;
-        temp_top.ptr->prev_garbage = btm.ptr->prev_garbage;  
-        
-        if (tbd->garbage.front == btm.ptr)
-        {
-          tbd->garbage.front = temp_top.ptr;
-        }
-        
-        if (tbd->garbage.back == btm.ptr)
-        {
-          tbd->garbage.back = temp_top.ptr;
-        }
+#ifdef TBD_USE_LAST_FOUND_CACHE      
+  tbd->last_found[tbd_last_found_index(hash)] = keyvalue;
+#else
+  (void) hash;
+#endif      
+
+#ifdef TBD_USE_EVICTION
+  keyvalue->flags.is_referenced = 1;
 #endif
-        
-      }
-      
-      tbd_keyvalue_stack_iterator_next(&temp_top);      
-    }
-    
-    tbd_keyvalue_stack_iterator_next(&top);
-    tbd_keyvalue_stack_reverse_iterator_next(&btm);
-  }
   
-  return garbage_total;
+  return keyvalue;
 }
 
 
 
 
-/** Pack heap elements.
- *  Process adjacent elements.  If lower element is garbage and upper element is used, 
- *  then copy upper element and align with bottom of lower element
+/** Find a keyvalue struct with a given key, see tbd_find_keyvalue.
  */
-TBD_SIZE_T tbd_garbage_pack(tbd_t* tbd, size_t garbage_limit)
+static tbd_keyvalue_t* tbd_find_keyvalue_search(tbd_t* tbd, const char* key, unsigned long hash)
 {
   TBD_ASSERT(tbd);
   
-  if (!garbage_limit)
-  {
-    return 0;
-  }
+  tbd_keyvalue_t* found;
+  TBD_TRACE_ENUM event;
   
-  if (!tbd->stack.count)
+  const bool is_answered = tbd_find_keyvalue_quick(tbd, key, hash, &found, &event);
+  
+  tbd_find_trace_quick(tbd, event);
+  
+  if (is_answered)
   {
-    return 0;
+    return found;
   }
   
-  int garbage_total = 0;
+  // a simple linear search for a given key
+  // TODO convert to standard C search
+  
+  tbd_keyvalue_stack_iterator_t iter = tbd_keyvalue_stack_begin(&tbd->stack);
+  tbd_keyvalue_stack_const_iterator_t end = tbd_keyvalue_stack_end(&tbd->stack);
   
-  tbd_keyvalue_stack_reverse_iterator_t dest = tbd_keyvalue_stack_rbegin(&tbd->stack);
-  const tbd_keyvalue_stack_const_reverse_iterator_t end = tbd_keyvalue_stack_rend(&tbd->stack);
-    
-  if (!dest.ptr || !end.ptr)
+  if (!iter.ptr)
   {
-    return 0;
+    return NULL;
   }
-
-  tbd_keyvalue_stack_reverse_iterator_t src = dest;  
-  tbd_keyvalue_stack_reverse_iterator_next(&src);
   
-  while(src.ptr != end.ptr)
+#ifdef TBD_USE_OP_COUNTERS
+  ++tbd->find_count;
+#endif
+  
+  while (!tbd_keyvalue_stack_iterator_is_equal(&end, &iter))
   {
-    if (tbd_keyvalue_is_garbage(dest.ptr) && !tbd_keyvalue_is_garbage(src.ptr))
-    {
-      const size_t src_size = src.ptr->heap.size;
-      const size_t dest_size = dest.ptr->heap.size;
-      
-      // TODO handle situation where src and dest overlap
-      
-      dest.ptr->heap.top = dest.ptr->heap.top + dest.ptr->heap.size - src_size;
-      dest.ptr->heap.size = src_size;
-      
-      tbd_keyvalue_copy(dest.ptr, src.ptr);
-      
-      src.ptr->heap.size = dest_size;
-      
-#if defined(TBD_USE_GARBAGE_LIST)      
-      tbd_garbage_list_delete(&tbd->garbage, dest.ptr);
-      tbd_garbage_list_insert(&tbd->garbage, src.ptr);    
+#ifdef TBD_USE_OP_COUNTERS
+    ++tbd->find_scan_count;
 #endif
+    
+    if (tbd_keyvalue_is_match(iter.ptr, key, hash))
+    {
+      return tbd_find_keyvalue_accept(tbd, iter.ptr, hash);
     }
     
-    tbd_keyvalue_stack_reverse_iterator_next(&dest);    
-    tbd_keyvalue_stack_reverse_iterator_next(&src);
+    tbd_keyvalue_stack_iterator_next(&iter);
   }
   
-  return garbage_total;
+  return 0;
 }
 
 
 
 
-TBD_SIZE_T tbd_garbage_collect(tbd_t* tbd, size_t garbage_limit)
+/** Find a keyvalue struct with a given key.
+ *  Returns NULL if key was not found.
+ */
+static tbd_keyvalue_t* tbd_find_keyvalue(tbd_t* tbd, const char* key)
 {
-  TBD_ASSERT(tbd);
+  TBD_TRACE(tbd, FIND_BEGIN, 0, 0);
   
-  size_t collected_size = 0;
-  size_t total_collected_size = 0;
+  tbd_keyvalue_t* keyvalue = tbd_find_keyvalue_search(tbd, key, tbd_key_hash(key));
   
-  if (!garbage_limit)
-  {
-    return total_collected_size = 0;
-  }
+  TBD_TRACE(tbd, FIND_END, keyvalue != NULL, 0);
   
-  if (0 == tbd_garbage_size(tbd))
-  {
-    return total_collected_size;
-  }
+  return keyvalue;
+}
+
+
+
+
+// Largest number of keys tbd_find_keyvalues looks up at once.
+#define TBD_FIND_BATCH_SIZE    (16u)
+
+/** Find the keyvalues of up to TBD_FIND_BATCH_SIZE keys whose hashes are already known, as tbd_find_keyvalue would find each.
+ *  The keys that are not in the last found cache share a single search of the stack.
+ *  Finding a key never moves a keyvalue, so all pointers in found stay valid.
+ *  Nothing is traced, events gets what tbd_find_keyvalue_quick answered for each key, so the caller can trace each key in turn.
+ */
+static void tbd_find_keyvalues(tbd_t* tbd, size_t count, const char* const* keys, const unsigned long* hashes, tbd_keyvalue_t** found, TBD_TRACE_ENUM* events)
+{
+  TBD_ASSERT(tbd);
+  TBD_ASSERT(count <= TBD_FIND_BATCH_SIZE);
   
-  // Get easy collection from garbage at top of heap
-  collected_size = tbd_garbage_pop(tbd, garbage_limit);
-  total_collected_size += collected_size;
+  size_t pending[TBD_FIND_BATCH_SIZE];                  // indexes of the keys still searched for
+  unsigned long pending_hashes[TBD_FIND_BATCH_SIZE];    // their hashes, packed for the search loop
+  size_t pending_count = 0;
+  size_t i;
   
-  if (garbage_limit <= collected_size)
+  for (i = 0; i < count; ++i)
   {
-    return total_collected_size;
+    if (!tbd_find_keyvalue_quick(tbd, keys[i], hashes[i], &found[i], &events[i]))
+    {
+      pending[pending_count] = i;
+      pending_hashes[pending_count] = hashes[i];
+      ++pending_count;
+    }
   }
   
-  garbage_limit -= collected_size;
+#ifdef TBD_USE_OP_COUNTERS
+  tbd->find_count += pending_count;
+#endif
   
-  // fold data into garbage areas
-  collected_size = tbd_garbage_fold(tbd, garbage_limit);  
-  total_collected_size += collected_size;
+  tbd_keyvalue_stack_iterator_t iter = tbd_keyvalue_stack_begin(&tbd->stack);
+  tbd_keyvalue_stack_const_iterator_t end = tbd_keyvalue_stack_end(&tbd->stack);
   
-  if (garbage_limit <= collected_size)
+  while (pending_count && iter.ptr && !tbd_keyvalue_stack_iterator_is_equal(&end, &iter))
   {
-    return total_collected_size;
+#ifdef TBD_USE_OP_COUNTERS
+    ++tbd->find_scan_count;
+#endif
+    
+    size_t j = 0;
+    
+    while (j < pending_count)
+    {
+      if (tbd_keyvalue_is_match(iter.ptr, keys[pending[j]], pending_hashes[j]))
+      {
+        found[pending[j]] = tbd_find_keyvalue_accept(tbd, iter.ptr, pending_hashes[j]);
+        
+        --pending_count;
+        pending[j] = pending[pending_count];
+        pending_hashes[j] = pending_hashes[pending_count];
+      }
+      else
+      {
+        ++j;
+      }
+    }
+    
+    tbd_keyvalue_stack_iterator_next(&iter);
   }
   
-  garbage_limit -= collected_size;  
-  
-  // pack remaining data
-  collected_size = tbd_garbage_pack(tbd, garbage_limit);
-  total_collected_size += collected_size;
-  
-  return total_collected_size;
+  // keys still pending were not found, and are still NULL
 }
 
 
 
 
-TBD_SIZE_T tbd_garbage_clean(tbd_t* tbd)
+static const tbd_keyvalue_t* tbd_find_const_keyvalue(const tbd_t* tbd, const char* key)
 {
-  TBD_ASSERT(tbd);
-  
-  const size_t garbage_size = tbd_garbage_size(tbd);
-  
-  return tbd_garbage_collect(tbd, garbage_size);
+  // Cast away constness, then cast it back before returning.
+  // Allows the use of tbd_keyvalue_find function.
+  return (const tbd_keyvalue_t*) tbd_find_keyvalue((tbd_t*) tbd, key);
 }
 
 
 
 
-
-
-
-/* 
- * 
- * Statistics and other general info.
- *
+/** Find a visible keyvalue without writing anything, not even the cache.
+ *  Safe to call from many threads at once.
+ *  Returns NULL if key was not found.
  */
-
-
-void tbd_stats_get(tbd_stats_t* stats, const tbd_t* tbd)
+static const tbd_keyvalue_t* tbd_find_keyvalue_read_only(const tbd_t* tbd, const char* key)
 {
   TBD_ASSERT(tbd);
-  TBD_ASSERT(stats);
+  TBD_ASSERT(key);
   
-  stats->tbd_address = tbd;
-  stats->tbd_size = tbd_size(tbd);
-  stats->tbd_size_used = tbd_size_used(tbd);
-  stats->tbd_head_size = tbd_head_size(tbd);
+  const unsigned long hash = tbd_key_hash(key);
   
-  stats->tbd_keyvalue_size = sizeof (tbd_keyvalue_t);
+#ifdef TBD_USE_FILTER
+  if (!tbd_filter_may_contain(tbd, hash))
+  {
+    return NULL;
+  }
+#endif
   
-  stats->stack_top = tbd_keyvalue_stack_top(&tbd->stack);
-  stats->stack_btm = tbd->stack.start;
-  stats->stack_count = tbd->stack.count;
-  stats->stack_size = tbd->stack.count * sizeof(tbd_keyvalue_t);
+  TBD_SIZE_T i;
+  for (i = 0; i < tbd->stack.count; ++i)
+  {
+    const tbd_keyvalue_t* keyvalue = tbd_keyvalue_stack_get(&tbd->stack, i);
+    
+    if (tbd_keyvalue_may_match(keyvalue, hash) && tbd_keyvalue_is_visible(tbd, keyvalue) && (tbd_keyvalue_keycmp(keyvalue, key) == 0))
+    {
+      return keyvalue;
+    }
+  }
   
-  stats->heap_top = tbd->heap.top;
-  stats->heap_size = tbd->heap.size;
-
-  stats->garbage_size = tbd_garbage_size(tbd);
-  stats->garbage_count = tbd_garbage_count(tbd);
-
-#if defined(TBD_USE_GARBAGE_LIST)
-  stats->garbage_front = tbd->garbage.front;
-  stats->garbage_back = tbd->garbage.back; 
-#endif
+  return NULL;
 }
 
 
 
 
-int tbd_stats_print(const tbd_stats_t* stats)
-{
-  TBD_ASSERT(stats);
-  
-  int total_printed = 0;
-  
-  
-#ifdef TBD_INCLUDE_STDIO
-  
-  total_printed += puts("{");
-  total_printed += printf("\ttbd_address:\t%p,\n", stats->tbd_address);
-  total_printed += printf("\ttbd_size:\t0x%0X,\n", (unsigned) stats->tbd_size);
-  total_printed += printf("\ttbd_size_used:\t0x%0X,\n", (unsigned) stats->tbd_size_used);
-  total_printed += printf("\ttbd_head_size:\t0x%0X,\n", (unsigned) stats->tbd_head_size);
-  
-  total_printed += printf("\ttbd_keyvalue_size:\t0x%0X,\n", (unsigned) stats->tbd_keyvalue_size); 
-  
-  total_printed += printf("\tstack_top:\t%p,\n", stats->stack_top);
-  total_printed += printf("\tstack_btm:\t%p,\n", stats->stack_btm);
-  
-  total_printed += printf("\tstack_count:\t0x%0X,\n", (unsigned) stats->stack_count);
-  total_printed += printf("\tstack_size:\t0x%0X,\n", (unsigned) stats->stack_size);
-  
-  total_printed += printf("\theap_top:\t%p,\n", stats->heap_top);  
-  total_printed += printf("\theap_size:\t0x%0X,\n", (unsigned) stats->heap_size);  
+// Write-ahead log record layout, all integers are little endian:
+//
+//   u8 operation, u8 key length, u32 value size, key, value, u32 FNV-1a checksum of the record
+//
+// The key length does not include the null terminator.
+// A put record holds the whole new value, an expire record holds the u64 expiry time.
 
-  total_printed += printf("\tgarbage_front:\t%p,\n", stats->garbage_front);  
-  total_printed += printf("\tgarbage_back:\t%p,\n", stats->garbage_back);   
-  total_printed += printf("\tgarbage_size:\t0x%0X,\n", (unsigned) stats->garbage_size);  
-  total_printed += printf("\tgarbage_count:\t0x%0X,\n", (unsigned) stats->garbage_count);  
+#define TBD_WAL_RECORD_HEAD_SIZE    (6u)
+#define TBD_WAL_RECORD_TAIL_SIZE    (4u)
 
-  
-  total_printed += puts("}");
+#define TBD_WAL_OP_PUT              ('P')
+#define TBD_WAL_OP_DELETE           ('D')
+#define TBD_WAL_OP_EXPIRE           ('E')
 
-#endif/*TBD_INCLUDE_STDIO*/  
-  
-  return total_printed;
-}
 
 
 
+#ifdef TBD_USE_WAL
 
-int tbd_print_stats(const tbd_t* tbd)
+/** Write the buffered records to the log, without syncing.
+ */
+static void tbd_wal_write(tbd_wal_t* wal)
 {
-  TBD_ASSERT(tbd);
+  TBD_ASSERT(wal);
   
-  tbd_stats_t stats;
+  const TBD_SIZE_T size = wal->buffer_used;
   
-  tbd_stats_get(&stats, tbd);
+  wal->buffer_used = 0;
   
-  return tbd_stats_print(&stats);
+  if (size && (wal->write(wal->context, wal->buffer, size) != size))
+  {
+    wal->has_error = true;
+  }
 }
 
 
 
 
-/*
- *
- * JSON FUNCTIONS
- *
+/** Write the buffered records to the log, then sync once for all of them.
  */
-
-
-static size_t tbd_key_to_json(char* json, size_t json_size, const tbd_key_t* key, TBD_KEY_TO_JSON_FORMAT_ENUM format)
+static void tbd_wal_commit(tbd_t* tbd)
 {
-  TBD_ASSERT(json);
-  TBD_ASSERT(json_size);
-  TBD_ASSERT(key);
+  TBD_ASSERT(tbd);
   
-  size_t total_printed = 0;
+  tbd_wal_t* wal = &tbd->wal;
   
-#ifdef TBD_INCLUDE_STDIO  
-
+  tbd_wal_write(wal);
   
-  switch (format)
+  if (wal->sync && (wal->sync(wal->context) != 0))
   {
-    case TBD_KEY_TO_JSON_FORMAT_RAW:
-    {
-      total_printed += snprintf(json, json_size, "%s", key->str);     
-    } break;
-      
-    case TBD_KEY_TO_JSON_FORMAT_STRING:
-    {
-      total_printed += snprintf(json, json_size, "\"%s\"", key->str);      
-    } break;
+    wal->has_error = true;
   }
   
-#endif
-  
-  return total_printed;
+  wal->unsynced_size = 0;
+  wal->sync_time = tbd->now;
+  ++wal->sync_count;
 }
 
 
 
 
-static size_t tbd_value_to_json(char* json, size_t json_size, const tbd_value_t* value, TBD_VALUE_TO_JSON_FORMAT_ENUM format)
+/** Commit if the sync mode says it is time to.
+ */
+static void tbd_wal_tick(tbd_t* tbd)
 {
-  TBD_ASSERT(json);
-  TBD_ASSERT(json_size);
-  TBD_ASSERT(value);
+  TBD_ASSERT(tbd);
   
-  size_t total_printed = 0;
-
-#ifdef TBD_INCLUDE_STDIO
+  tbd_wal_t* wal = &tbd->wal;
   
-  size_t printed = 0;
-    
-  const size_t value_size = tbd_value_size(value);
+  if (!wal->is_open || !wal->unsynced_size)
+  {
+    return;
+  }
   
-  switch(format)
+  switch (wal->sync_mode)
   {
-    case TBD_VALUE_TO_JSON_FORMAT_RAW:
+    case TBD_WAL_SYNC_ALWAYS:
     {
-      if (value_size < json_size)
-      {
-        memcpy(json, value->data, value_size);
-      }
-      printed = value_size;
-      total_printed += printed;
+      tbd_wal_commit(tbd);
     } break;
-      
-    case TBD_VALUE_TO_JSON_FORMAT_HEX:  
-    default:
+    
+    case TBD_WAL_SYNC_INTERVAL:
     {
-      printed = snprintf(json, json_size, "'");
-      
-      if (printed)
+      if (tbd->now - wal->sync_time >= wal->sync_interval)
       {
-        json += printed;
-        json_size -= printed;
-        total_printed += printed;
+        tbd_wal_commit(tbd);
       }
-      size_t data_size = value_size;
-      unsigned char* data = value->data;
-      
-      while (data_size)
-      {
-        printed = snprintf(json, json_size, "%X", *data);
-        json += printed;
-        json_size -= printed;
-        total_printed += printed;
-        
-        ++data;
-        --data_size;
-      }
-      
-      printed = snprintf(json, json_size, "'");
-      json += printed;
-      json_size -= printed;
-      total_printed += printed;      
-    }
+    } break;
+    
+    case TBD_WAL_SYNC_NEVER:
+    default:
+      break;
   }
+}
+
+
 
-#endif//TBD_INCLUDE_STDIO  
+
+/** Copy bytes into the buffer, writing the buffer out whenever it fills up.
+ */
+static void tbd_wal_append(tbd_wal_t* wal, const void* data, TBD_SIZE_T size)
+{
+  TBD_ASSERT(wal);
   
-  return total_printed;
+  const unsigned char* bytes = (const unsigned char*) data;
+  
+  while (size)
+  {
+    if (wal->buffer_used == wal->buffer_size)
+    {
+      tbd_wal_write(wal);
+    }
+    
+    TBD_SIZE_T copy_size = wal->buffer_size - wal->buffer_used;
+    
+    if (copy_size > size)
+    {
+      copy_size = size;
+    }
+    
+    memcpy(wal->buffer + wal->buffer_used, bytes, copy_size);
+    
+    wal->buffer_used += copy_size;
+    bytes += copy_size;
+    size -= copy_size;
+  }
 }
 
+#endif
+
 
 
 
-static size_t tbd_heap_to_json(char* json, size_t json_size, const tbd_heap_t* heap)
+/** Log a change to the write-ahead log, if one is open.
+ *  Returns TBD_ERROR_WAL if the change could not be written or synced.
+ */
+static int tbd_wal_log(tbd_t* tbd, unsigned char op, const char* key, const void* value, TBD_SIZE_T value_size)
 {
-  TBD_ASSERT(json);
-  TBD_ASSERT(json_size);
-  TBD_ASSERT(heap);
+  TBD_ASSERT(tbd);
+  TBD_ASSERT(key);
+  
+#ifdef TBD_USE_WAL
+  
+  tbd_wal_t* wal = &tbd->wal;
+  
+  if (!wal->is_open)
+  {
+    return TBD_NO_ERROR;
+  }
+  
+  const TBD_SIZE_T key_size = strlen(key);
+  
+  unsigned char head[TBD_WAL_RECORD_HEAD_SIZE];
+  
+  head[0] = op;
+  head[1] = (unsigned char) key_size;
+  tbd_uint_to_bytes(&head[2], value_size, 4);
+  
+  unsigned long checksum = tbd_checksum(TBD_FNV_OFFSET_BASIS, head, sizeof(head));
+  checksum = tbd_checksum(checksum, key, key_size);
+  checksum = tbd_checksum(checksum, value, value_size);
+  
+  unsigned char tail[TBD_WAL_RECORD_TAIL_SIZE];
+  tbd_uint_to_bytes(tail, checksum, sizeof(tail));
+  
+  tbd_wal_append(wal, head, sizeof(head));
+  tbd_wal_append(wal, key, key_size);
+  tbd_wal_append(wal, value, value_size);
+  tbd_wal_append(wal, tail, sizeof(tail));
+  
+  const TBD_SIZE_T record_size = sizeof(head) + key_size + value_size + sizeof(tail);
+  
+  wal->unsynced_size += record_size;
+  wal->log_size += record_size;
+  
+  tbd_wal_tick(tbd);
   
-  size_t total_printed = 0;
+  return wal->has_error ? TBD_ERROR_WAL : TBD_NO_ERROR;
   
-#ifdef TBD_INCLUDE_STDIO  
+#else
+  
+  (void) op;
+  (void) value;
+  (void) value_size;
+  
+  return TBD_NO_ERROR;
+  
+#endif
+}
+
 
-  total_printed += snprintf(json, json_size, "{%p : %lx}", heap->top, heap->size);  
+
+
+/** Record a successful change to a keyvalue.
+ *  Stamps the keyvalue with the next version and logs the change to the write-ahead log.
+ */
+static int tbd_commit_change(tbd_t* tbd, tbd_keyvalue_t* keyvalue, unsigned char op, const char* key, const void* value, TBD_SIZE_T value_size)
+{
+  TBD_ASSERT(tbd);
+  TBD_ASSERT(keyvalue);
   
+#ifdef TBD_USE_VERSIONS
+  keyvalue->version = ++tbd->version;
 #endif
   
-  return total_printed;
+  return tbd_wal_log(tbd, op, key, value, value_size);
 }
 
 
 
 
-size_t tbd_keyvalue_to_json(char* json, size_t json_size, const tbd_t* tbd, const char* key, TBD_KEY_TO_JSON_FORMAT_ENUM key_format, TBD_VALUE_TO_JSON_FORMAT_ENUM value_format)
+int tbd_version(void)
 {
-  TBD_ASSERT(json);
-  TBD_ASSERT(json_size);
-  TBD_ASSERT(tbd);
-  TBD_ASSERT(key);
+  return TBD_VERSION;
+}
+
+
+
+int tbd_is_error(int value)
+{
+  // all error codes are less than 0
+  return value < 0;
+}
+
+
 
-  size_t total_printed = 0;
+size_t tbd_size(const tbd_t* tbd)
+{
+  TBD_ASSERT(tbd);
   
-#ifdef TBD_INCLUDE_STDIO  
+  return tbd->size;
+}
+
+
+
+
+size_t tbd_head_size(const tbd_t* tbd)
+{
+  TBD_ASSERT(tbd);
   
-  // find the element
-  const tbd_keyvalue_t* ptr = tbd_find_const_keyvalue(tbd, key);
-  if (!ptr)
-  {
-    return 0;
-  }  
+#ifdef TBD_USE_FILTER
+  return sizeof(tbd_t) + tbd->filter_size;
+#else
+  return sizeof(tbd_t);
+#endif
+}
+
+
+
+
+size_t tbd_size_used(const tbd_t* tbd)
+{
+  TBD_ASSERT(tbd);
   
-  size_t printed = 0;
+  return tbd_head_size(tbd) + tbd->stack.count * sizeof(tbd_keyvalue_t) + tbd->heap.size;
+}
 
-  const size_t key_size = tbd_key_size(&ptr->key);
 
-  if (key_size)
-  {
-    printed = tbd_key_to_json(json, json_size, &ptr->key, key_format);
 
-    total_printed += printed;
-    json += printed;
-    json_size -= printed;
-    
-    printed = snprintf(json, json_size, ":");    
-    total_printed += printed;
-    json += printed;
-    json_size -= printed;
-  }
+
+size_t tbd_count(const tbd_t* tbd)
+{
+  TBD_ASSERT(tbd);
   
-  printed = tbd_value_to_json(json, json_size, &ptr->value, value_format);
+  return tbd->stack.count;
+}
+
+
+
+
+/** Count garbage keyvalues that a keyvalue of the given hunk size can reuse, see tbd_find_first_garbage_hunk.
+ */
+static TBD_SIZE_T tbd_garbage_hunk_count(const tbd_t* tbd, TBD_SIZE_T hunk_size)
+{
+  TBD_ASSERT(tbd);
   
-  total_printed += printed;
-  json += printed;
-  json_size -= printed;
+  TBD_SIZE_T count = 0;
   
-#endif//TBD_INCLUDE_STDIO  
+  TBD_SIZE_T i;
+  for (i = 0; i < tbd->stack.count; ++i)
+  {
+    const tbd_keyvalue_t* keyvalue = tbd_keyvalue_stack_get(&tbd->stack, i);
+    
+    if (tbd_keyvalue_is_garbage(keyvalue) && (keyvalue->heap.size == hunk_size))
+    {
+      ++count;
+    }
+  }
   
-  return total_printed;
+  return count;
 }
 
 
 
 
-size_t tbd_keys_to_json(char* json, size_t json_size, const tbd_t* tbd, TBD_KEY_TO_JSON_FORMAT_ENUM key_format)
+TBD_SIZE_T tbd_max_count(const tbd_t* tbd, TBD_SIZE_T keyvalue_size)
 {
-  TBD_ASSERT(json);
-  TBD_ASSERT(json_size);
   TBD_ASSERT(tbd);
   
+  const TBD_SIZE_T hunk_size = tbd_keyvalue_hunk_size(tbd, keyvalue_size, 0);
   
-  size_t total_printed = 0;
+  // each new keyvalue takes a stack element from the bottom of the gap and a hunk from the top
+  const unsigned char* stack_end = (const unsigned char*) (tbd->stack.start + tbd->stack.count);
+  const TBD_SIZE_T free_size = (TBD_SIZE_T) (tbd->heap.top - stack_end);
   
-#ifdef TBD_INCLUDE_STDIO  
+  return tbd_garbage_hunk_count(tbd, hunk_size) + free_size / (sizeof(tbd_keyvalue_t) + hunk_size);
+}
+
+
+
+
+int tbd_reserve(tbd_t* tbd, TBD_SIZE_T count, TBD_SIZE_T keyvalue_size)
+{
+  TBD_ASSERT(tbd);
   
-  size_t printed = 0;
+  const TBD_SIZE_T hunk_size = tbd_keyvalue_hunk_size(tbd, keyvalue_size, 0);
   
-  tbd_keyvalue_stack_const_iterator_t iter = tbd_keyvalue_stack_const_begin(&tbd->stack);
-  tbd_keyvalue_stack_const_iterator_t end = tbd_keyvalue_stack_end(&tbd->stack);
+  TBD_SIZE_T reserved_count = tbd_garbage_hunk_count(tbd, hunk_size);
   
-  // return if no elements
-  if (tbd_keyvalue_stack_const_iterator_is_equal(&end, &iter))
+  if (reserved_count >= count)
   {
-    return total_printed;;
+    return TBD_NO_ERROR;
   }
   
-
-  // go to first non-garbage item
-  while (!tbd_keyvalue_stack_const_iterator_is_equal(&end, &iter))
+  // check first, so a reservation that does not fit leaves the tbd unchanged
+  if (tbd_max_count(tbd, keyvalue_size) < count)
   {
-    if (!tbd_keyvalue_is_garbage(iter.ptr))
-    {
-      break;
-    }
-      
-    tbd_keyvalue_stack_const_iterator_next(&iter);
+    return TBD_ERROR_BAD_SIZE;
   }
   
-  
-  // return if all garbage
-  if (tbd_keyvalue_stack_const_iterator_is_equal(&end, &iter))
+  // reserved keyvalues are garbage of the right size, which tbd_create_keyvalue reuses before growing the heap
+  for (; reserved_count < count; ++reserved_count)
   {
-    return total_printed;;
+    tbd_keyvalue_t* keyvalue = tbd_push_keyvalue(tbd, hunk_size);
+    TBD_ASSERT(keyvalue);
+    
+    tbd_keyvalue_place(tbd, keyvalue, 1, 0);
+    keyvalue->key.str[0] = '\0';
+    
+    tbd_discard_keyvalue(tbd, keyvalue);
   }
   
-  
-  // print opening bracket
-  printed = snprintf(json, json_size, "[");
-  
-  total_printed += printed;
-  json += printed;
-  json_size -= printed;
-  
-  
-  // print first key
-  printed = tbd_key_to_json(json, json_size, &iter.ptr->key, key_format);
+  return TBD_NO_ERROR;
+}
+
 
-  total_printed += printed;
-  json += printed;
-  json_size -= printed;
+
+
+TBD_SIZE_T tbd_max_key_length(const tbd_t* tbd)
+{
+  return TBD_MAX_KEY_LENGTH;  
+}
+
+
+
+
+/** Number of heap bytes in use by a keyvalue, the value followed by the key.
+ */
+static TBD_SIZE_T tbd_keyvalue_used_size(const tbd_keyvalue_t* keyvalue)
+{
+  TBD_ASSERT(keyvalue);
   
-  tbd_keyvalue_stack_const_iterator_next(&iter);
+  return (TBD_SIZE_T) ((unsigned char*) keyvalue->key.str - keyvalue->value.data) + tbd_key_heap_size(&keyvalue->key);
+}
+
+
 
+
+int tbd_copy(tbd_t* dest, const tbd_t* src)
+{
+  TBD_ASSERT(dest);
+  TBD_ASSERT(src);
+  TBD_ASSERT(dest != src);
+  
+  tbd_empty(dest);
   
-  // print the rest of the keys
-  while (!tbd_keyvalue_stack_const_iterator_is_equal(&end, &iter))
+  // copy the live keyvalues to the dest stack, they still point into the src heap
+  const unsigned char* stack_end = (const unsigned char*) dest->heap.top;
+  TBD_SIZE_T heap_size = 0;
+  
+  TBD_SIZE_T i;
+  for (i = 0; i < src->stack.count; ++i)
   {
-    if (!tbd_keyvalue_is_garbage(iter.ptr))
+    const tbd_keyvalue_t* keyvalue = tbd_keyvalue_stack_get(&src->stack, i);
+    
+    if (!tbd_keyvalue_is_visible(src, keyvalue))
     {
-      printed = snprintf(json, json_size, ",");
-      
-      total_printed += printed;    
-      json += printed;
-      json_size -= printed;      
-      
-      printed = tbd_key_to_json(json, json_size, &iter.ptr->key, key_format);
+      continue;
+    }
+    
+    heap_size += tbd_keyvalue_hunk_size(dest, tbd_keyvalue_used_size(keyvalue), 0);
+    
+    tbd_keyvalue_t* copy = tbd_keyvalue_stack_push(&dest->stack);
+    
+    if ((const unsigned char*) (copy + 1) + heap_size > stack_end)
+    {
+      tbd_empty(dest);
+      return TBD_ERROR_BAD_SIZE;
+    }
     
-      total_printed += printed;    
-      json += printed;
-      json_size -= printed;
-    }   
-    tbd_keyvalue_stack_const_iterator_next(&iter);
+    *copy = *keyvalue;
   }
   
+  tbd_keyvalue_stack_sort_by_key(&dest->stack);
   
-  // print closing bracket
-  printed = snprintf(json, json_size, "]");
+  // lay the heap out in the same order, so there are no gaps
+  for (i = 0; i < dest->stack.count; ++i)
+  {
+    tbd_keyvalue_t* keyvalue = tbd_keyvalue_stack_get(&dest->stack, i);
+    
+    const TBD_SIZE_T used_size = tbd_keyvalue_used_size(keyvalue);
+    const TBD_SIZE_T key_offset = (TBD_SIZE_T) ((unsigned char*) keyvalue->key.str - keyvalue->value.data);
+    
+    keyvalue->heap.size = tbd_keyvalue_hunk_size(dest, used_size, 0);
+    keyvalue->heap.top = tbd_heap_push(&dest->heap, keyvalue->heap.size);
+    
+    memcpy(keyvalue->heap.top, keyvalue->value.data, used_size);
+    
+    keyvalue->value.data = keyvalue->heap.top;
+    keyvalue->key.str = (char*) (keyvalue->heap.top + key_offset);
+    
+#ifdef TBD_USE_EVICTION
+    keyvalue->flags.is_referenced = 0;
+#endif
+
+#ifdef TBD_USE_HANDLES
+    keyvalue->handle = 0;
+#endif
+  }
   
-  total_printed += printed;
-  json += printed;
-  json_size -= printed;  
+#ifdef TBD_USE_FILTER
+  tbd_filter_rebuild(dest);
+#endif
   
+  dest->now = src->now;
+  dest->is_sorted_by_key = true;
   
-#endif//TBD_INCLUDE_STDIO
+#ifdef TBD_USE_VERSIONS
+  dest->version = src->version;
+#endif
   
-  return total_printed;
+  return TBD_NO_ERROR;
 }
 
 
 
 
-size_t tbd_garbage_list_to_json(char* json, size_t json_size, const tbd_t* tbd)
+/** Move a pointer into src to the same place in dest.
+ */
+static void* tbd_relocate(const void* ptr, const tbd_t* src, tbd_t* dest)
 {
-  TBD_ASSERT(json);
-  TBD_ASSERT(json_size);
-  TBD_ASSERT(tbd);
-  
-  
-  size_t total_printed = 0;
-  
-#ifdef TBD_INCLUDE_STDIO  
-  
-  size_t printed = 0;
-  
-  tbd_garbage_list_const_iterator_t iter = tbd_garbage_list_const_begin(tbd);
-  
-  // return if no elements
-  if (!iter.ptr)
+  if (!ptr)
   {
-    total_printed = snprintf(json, json_size, "[]"); // print empty array
-    return total_printed;
+    return NULL;
   }
   
+  return (unsigned char*) dest + ((const unsigned char*) ptr - (const unsigned char*) src);
+}
+
+
+
+
+int tbd_copy_raw(tbd_t* dest, const tbd_t* src)
+{
+  TBD_ASSERT(dest);
+  TBD_ASSERT(src);
+  TBD_ASSERT(dest != src);
   
-  // print opening bracket
-  printed = snprintf(json, json_size, "[");
-  
-  total_printed += printed;
-  json += printed;
-  json_size -= printed;
+  if ((dest->size != src->size) || (dest->hunk_size != src->hunk_size) || (tbd_head_size(dest) != tbd_head_size(src)))
+  {
+    return TBD_ERROR_BAD_SIZE;
+  }
   
+  tbd_empty(dest);
   
-  // print first key
-  printed = tbd_heap_to_json(json, json_size, &iter.ptr->heap);
+  // copy the stack and the heap as they are, garbage and all
+  memcpy(dest->stack.start, src->stack.start, src->stack.count * sizeof(tbd_keyvalue_t));
   
-  total_printed += printed;
-  json += printed;
-  json_size -= printed;
+  dest->heap.top = (unsigned char*) tbd_relocate(src->heap.top, src, dest);
+  dest->heap.size = src->heap.size;
   
-  tbd_garbage_list_const_iterator_next(&iter);
+  memcpy(dest->heap.top, src->heap.top, src->heap.size);
   
+  dest->stack.count = src->stack.count;
   
-  // print the rest of the garbage list
-  while (iter.ptr)
+  TBD_SIZE_T i;
+  for (i = 0; i < dest->stack.count; ++i)
   {
-    printed = snprintf(json, json_size, ",");
-      
-    total_printed += printed;    
-    json += printed;
-    json_size -= printed;      
-      
-    printed = tbd_heap_to_json(json, json_size, &iter.ptr->heap);
-      
-    total_printed += printed;    
-    json += printed;
-    json_size -= printed;
+    tbd_keyvalue_t* keyvalue = tbd_keyvalue_stack_get(&dest->stack, i);
     
-    tbd_garbage_list_const_iterator_next(&iter);
+    keyvalue->heap.top = (unsigned char*) tbd_relocate(keyvalue->heap.top, src, dest);
+    keyvalue->value.data = (unsigned char*) tbd_relocate(keyvalue->value.data, src, dest);
+    keyvalue->key.str = (char*) tbd_relocate(keyvalue->key.str, src, dest);
+    
+#ifdef TBD_USE_GARBAGE_LIST
+    keyvalue->prev_garbage = (tbd_keyvalue_t*) tbd_relocate(keyvalue->prev_garbage, src, dest);
+    keyvalue->next_garbage = (tbd_keyvalue_t*) tbd_relocate(keyvalue->next_garbage, src, dest);
+#endif
   }
   
+#ifdef TBD_USE_GARBAGE_LIST
+  dest->garbage.front = (tbd_keyvalue_t*) tbd_relocate(src->garbage.front, src, dest);
+  dest->garbage.back = (tbd_keyvalue_t*) tbd_relocate(src->garbage.back, src, dest);
+  dest->garbage.size = src->garbage.size;
+  dest->garbage.count = src->garbage.count;
+#endif
   
-  // print closing bracket
-  printed = snprintf(json, json_size, "]");
+#ifdef TBD_USE_HANDLES
+  // handles to src keyvalues resolve in dest as well
+  for (i = 0; i < TBD_HANDLE_TABLE_SIZE; ++i)
+  {
+    dest->handles[i] = (tbd_keyvalue_t*) tbd_relocate(src->handles[i], src, dest);
+    dest->handle_generation[i] = src->handle_generation[i];
+  }
+#endif
   
-  total_printed += printed;
-  json += printed;
-  json_size -= printed;  
+#ifdef TBD_USE_FILTER
+  memcpy(tbd_filter_begin(dest), tbd_filter_begin(src), src->filter_size);
+  dest->is_filter_saturated = src->is_filter_saturated;
+#endif
   
+  dest->now = src->now;
+  dest->is_sorted_by_key = src->is_sorted_by_key;
   
-#endif//TBD_INCLUDE_STDIO
+#ifdef TBD_USE_VERSIONS
+  dest->version = src->version;
+#endif
   
-  return total_printed;
+  return TBD_NO_ERROR;
 }
 
 
 
 
-/**
- *  TODO: Convert to use iterators.
- */
-size_t tbd_to_json(char* json, size_t json_size, const tbd_t* tbd, TBD_KEY_TO_JSON_FORMAT_ENUM key_format, TBD_VALUE_TO_JSON_FORMAT_ENUM value_format)
+int tbd_sort_by_key(tbd_t* tbd)
 {
-  TBD_ASSERT(json);
-  TBD_ASSERT(json_size);
   TBD_ASSERT(tbd);
   
+  tbd_keyvalue_stack_sort_by_key(&tbd->stack);
   
-  size_t total_printed = 0;
+  tbd->is_sorted_by_key = true;
   
-#ifdef TBD_INCLUDE_STDIO  
+#ifdef TBD_USE_LAST_FOUND_CACHE
+  // sorting moves keyvalues on the stack
+  tbd_last_found_clear(tbd);
+#endif
+  
+#ifdef TBD_USE_GARBAGE_LIST
+  tbd_garbage_list_rebuild(tbd);
+#endif
+  
+#ifdef TBD_USE_HANDLES
+  tbd_handle_rebuild(tbd);
+#endif
+  
+  return TBD_NO_ERROR;
+}
+
+
+
+
+int tbd_sort_by_heap(tbd_t* tbd)
+{
+  TBD_ASSERT(tbd);
+  
+  tbd_keyvalue_stack_sort_by_heap(&tbd->stack);
+  
+  tbd->is_sorted_by_key = false;
+  
+#ifdef TBD_USE_LAST_FOUND_CACHE
+  // sorting moves keyvalues on the stack
+  tbd_last_found_clear(tbd);
+#endif
+  
+#ifdef TBD_USE_GARBAGE_LIST
+  tbd_garbage_list_rebuild(tbd);
+#endif
+  
+#ifdef TBD_USE_HANDLES
+  tbd_handle_rebuild(tbd);
+#endif
+  
+  return TBD_NO_ERROR;
+}
+
+
+
+
+/** Read the clock if operations are timed.
+ *  Returns the start time to pass to tbd_op_time.
+ */
+static TBD_TIME_T tbd_op_clock(const tbd_t* tbd)
+{
+  TBD_ASSERT(tbd);
+  
+#ifdef TBD_USE_LATENCY_HISTOGRAMS
+  if (tbd->clock)
+  {
+    return tbd->clock();
+  }
+#else
+  (void) tbd;
+#endif
+  
+  return 0;
+}
+
+
+
+
+/** Count an operation, and report its start.
+ */
+static void tbd_op_count(tbd_t* tbd, TBD_OP_ENUM op)
+{
+  TBD_ASSERT(tbd);
+  
+#ifdef TBD_USE_OP_COUNTERS
+  ++tbd->op_count[op];
+#else
+  (void) op;
+#endif
+  
+  TBD_TRACE(tbd, OP_BEGIN, op, 0);
+  
+  (void) tbd;
+}
+
+
+
+
+/** Add the latency of count timed operations that started together to their histogram.
+ *  Each operation is charged an equal share of the time since start.
+ */
+static void tbd_op_time(tbd_t* tbd, TBD_OP_ENUM op, TBD_TIME_T start, size_t count)
+{
+  TBD_ASSERT(tbd);
+  
+#ifdef TBD_USE_LATENCY_HISTOGRAMS
+  if (!tbd->clock || !count)
+  {
+    return;
+  }
+  
+  const TBD_TIME_T latency = tbd->clock() - start;
+  
+  tbd->latency_sum[op] += latency;
+  
+  // the bucket is the position of the highest set bit
+  TBD_TIME_T share = latency / count;
+  unsigned bucket = 0;
+  
+  while ((share >>= 1) && (bucket < TBD_LATENCY_BUCKET_COUNT - 1))
+  {
+    ++bucket;
+  }
+  
+  tbd->latency_histogram[op][bucket] += count;
+#else
+  (void) tbd;
+  (void) op;
+  (void) start;
+  (void) count;
+#endif
+}
+
+
+
+
+/** Count an operation, and read the clock if it is timed.
+ *  Returns the start time to pass to tbd_op_end.
+ */
+static TBD_TIME_T tbd_op_begin(tbd_t* tbd, TBD_OP_ENUM op)
+{
+  tbd_op_count(tbd, op);
+  
+  return tbd_op_clock(tbd);
+}
+
+
+
+
+/** Report the end of an operation, and add its latency to its histogram if it is timed.
+ */
+static void tbd_op_end(tbd_t* tbd, TBD_OP_ENUM op, TBD_TIME_T start)
+{
+  TBD_ASSERT(tbd);
+  
+  TBD_TRACE(tbd, OP_END, op, 0);
+  
+  tbd_op_time(tbd, op, start, 1);
+}
+
+
+
+
+int tbd_set_clock(tbd_t* tbd, tbd_clock_fn clock)
+{
+  TBD_ASSERT(tbd);
+  
+#ifdef TBD_USE_LATENCY_HISTOGRAMS
+  tbd->clock = clock;
+  return TBD_NO_ERROR;
+#else
+  (void) clock;
+  return TBD_ERROR;
+#endif
+}
+
+
+
+
+int tbd_set_trace(tbd_t* tbd, tbd_trace_fn trace, void* context)
+{
+  TBD_ASSERT(tbd);
+  
+#ifdef TBD_USE_TRACE
+  tbd->trace = trace;
+  tbd->trace_context = context;
+  return TBD_NO_ERROR;
+#else
+  (void) trace;
+  (void) context;
+  return TBD_ERROR;
+#endif
+}
+
+
+
+
+/** Create a keyvalue, see tbd_create.
+ */
+static int tbd_create_op(tbd_t* tbd, const char* key, const void* value, size_t value_size)
+{
+  TBD_ASSERT(tbd);
+  TBD_ASSERT(key);
+  TBD_ASSERT(value);
+  TBD_ASSERT(value_size);
+  
+  TBD_ASSERT(TBD_MAX_SIZE >= value_size);
+  
+  
+  // check that an element with given key does not already exist
+  if (tbd_find_keyvalue(tbd, key))
+  {
+    return TBD_ERROR_KEY_EXISTS;
+  }
+  
+  const size_t key_size = strlen(key) + 1;
+  
+  assert(TBD_MAX_KEY_LENGTH >= key_size - 1);
+  
+  struct tbd_keyvalue_struct* keyvalue = tbd_create_keyvalue(tbd, key_size, value_size);
+  
+  if (!keyvalue)
+  {
+    return TBD_ERROR;
+  }
+  
+  // copy the data into the newly allocated memory
+  memcpy(keyvalue->key.str, key, key_size);
+  memcpy(keyvalue->value.data, value, value_size);
+  
+#ifdef TBD_USE_VERSIONS
+  tbd_forget_tombstone(tbd, key);
+#endif
+  
+  tbd_keyvalue_index_key(tbd, keyvalue);
+  
+  return tbd_commit_change(tbd, keyvalue, TBD_WAL_OP_PUT, key, value, value_size);
+}
+
+
+
+
+/** Copy the value of a found keyvalue, ptr is NULL if the key was not found.
+ */
+static int tbd_read_found(tbd_t* tbd, const tbd_keyvalue_t* ptr, void* value, size_t value_size)
+{
+  TBD_ASSERT(tbd);
+  TBD_ASSERT(value);
+  TBD_ASSERT(value_size);
+  
+  if (!ptr)
+  {
+#ifdef TBD_USE_OP_COUNTERS
+    ++tbd->read_miss_count;
+#endif
+    
+    return TBD_ERROR_KEY_NOT_FOUND;
+  }
+  
+#ifdef TBD_USE_OP_COUNTERS
+  ++tbd->read_hit_count;
+#endif
+  
+  // copy value size
+  const TBD_SIZE_T ptr_value_size = tbd_value_size(&ptr->value);
+  
+  if (ptr_value_size != value_size)
+  {
+    return TBD_ERROR_BAD_SIZE;
+  }
+
+  // copy the data to the value
+  memcpy(value, ptr->value.data, value_size);
+  
+  return TBD_NO_ERROR;
+}
+
+
+
+
+/** Read a keyvalue, see tbd_read.
+ */
+static int tbd_read_op(tbd_t* tbd, const char* key, void* value, size_t value_size)
+{
+  TBD_ASSERT(tbd);
+  TBD_ASSERT(key);
+  
+  // find the element
+  return tbd_read_found(tbd, tbd_find_keyvalue(tbd, key), value, value_size);
+}
+
+
+
+
+int tbd_read_const(const tbd_t* tbd, const char* key, void* value, size_t value_size)
+{
+  TBD_ASSERT(tbd);
+  TBD_ASSERT(key);
+  TBD_ASSERT(value);
+  TBD_ASSERT(value_size);
+  
+  const tbd_keyvalue_t* ptr = tbd_find_keyvalue_read_only(tbd, key);
+  if (!ptr)
+  {
+    return TBD_ERROR_KEY_NOT_FOUND;
+  }
+  
+  if (tbd_value_size(&ptr->value) != value_size)
+  {
+    return TBD_ERROR_BAD_SIZE;
+  }
+  
+  memcpy(value, ptr->value.data, value_size);
+  
+  return TBD_NO_ERROR;
+}
+
+
+
+
+/** Update a keyvalue, see tbd_update.
+ */
+static int tbd_update_op(tbd_t* tbd, const char* key, const void* value, size_t value_size)
+{
+  TBD_ASSERT(tbd);
+  TBD_ASSERT(key);
+  TBD_ASSERT(value);
+  TBD_ASSERT(value_size);
+  
+  // find the element
+  struct tbd_keyvalue_struct* ptr = tbd_find_keyvalue(tbd, key);
+  if (!ptr)
+  {
+    return TBD_ERROR_KEY_NOT_FOUND;
+  }
+  
+  const TBD_SIZE_T ptr_value_size = tbd_value_size(&ptr->value);
+  
+  if (value_size != ptr_value_size)
+  {
+    return TBD_ERROR_BAD_SIZE;
+  }
+  
+  // compute minimum copy size, truncate to value_size
+  const size_t copy_size = (ptr_value_size < value_size) ? ptr_value_size: value_size;
+  
+  // copy the value into datastore
+  memcpy(ptr->value.data, value, copy_size);
+  
+  return tbd_commit_change(tbd, ptr, TBD_WAL_OP_PUT, key, value, value_size);
+}
+
+
+
+
+/** Create or update a keyvalue, see tbd_put.
+ */
+static int tbd_put_op(tbd_t* tbd, const char* key, const void* value, size_t value_size)
+{
+  TBD_ASSERT(tbd);
+  TBD_ASSERT(key);
+  TBD_ASSERT(value);
+  TBD_ASSERT(value_size);
+  
+  TBD_ASSERT(TBD_MAX_SIZE >= value_size);
+  
+  // find the element, this is the only lookup
+  struct tbd_keyvalue_struct* ptr = tbd_find_keyvalue(tbd, key);
+  
+  // update in place if the value fits in the existing hunk
+  if (ptr && tbd_keyvalue_resize_value(ptr, value_size))
+  {
+    memcpy(ptr->value.data, value, value_size);
+    return tbd_commit_change(tbd, ptr, TBD_WAL_OP_PUT, key, value, value_size);
+  }
+  
+  const size_t key_size = strlen(key) + 1;
+  
+  TBD_ASSERT(TBD_MAX_KEY_LENGTH >= key_size - 1);
+  
+#ifdef TBD_USE_EVICTION
+  // keep the keyvalue being replaced away from the eviction clock
+  if (ptr)
+  {
+    ptr->flags.is_referenced = 1;
+  }
+#endif
+  
+  struct tbd_keyvalue_struct* keyvalue = tbd_create_keyvalue(tbd, key_size, value_size);
+  
+  if (!keyvalue)
+  {
+    return TBD_ERROR;
+  }
+  
+  // copy the data into the newly allocated memory
+  memcpy(keyvalue->key.str, key, key_size);
+  memcpy(keyvalue->value.data, value, value_size);
+  
+#ifdef TBD_USE_VERSIONS
+  if (!ptr)
+  {
+    tbd_forget_tombstone(tbd, key);
+  }
+#endif
+  
+  tbd_keyvalue_index_key(tbd, keyvalue);
+  
+  // the old keyvalue is garbage now, unless making room already evicted it and reused its place on the stack
+  if (ptr && (keyvalue != ptr) && tbd_keyvalue_is_on_stack(tbd, ptr) && !tbd_keyvalue_is_garbage(ptr))
+  {
+#ifdef TBD_USE_EXPIRY
+    keyvalue->expires = ptr->expires;
+#endif
+    
+#ifdef TBD_USE_HANDLES
+    tbd_handle_move(tbd, ptr, keyvalue);
+#endif
+    
+    tbd_trash_keyvalue(tbd, ptr);
+  }
+  
+#ifdef TBD_USE_LAST_FOUND_CACHE
+  // the next lookup of this key is likely to be for the new keyvalue
+  tbd->last_found[tbd_last_found_index(tbd_key_hash(key))] = keyvalue;
+#endif
+  
+  return tbd_commit_change(tbd, keyvalue, TBD_WAL_OP_PUT, key, value, value_size);
+}
+
+
+
+
+/** Delete a keyvalue, see tbd_delete.
+ */
+static int tbd_delete_op(tbd_t* tbd, const char* key)
+{
+  TBD_ASSERT(tbd);
+  TBD_ASSERT(key);
+  
+  // find the element
+  struct tbd_keyvalue_struct* ptr = tbd_find_keyvalue(tbd, key);
+  if (!ptr)
+  {
+    return TBD_NO_ERROR; // no error if it did not exist
+  }  
+  
+  // a tombstone takes the next version
+  tbd_bury_keyvalue(tbd, ptr);
+  
+  return tbd_wal_log(tbd, TBD_WAL_OP_DELETE, key, NULL, 0);
+}
+
+
+
+
+int tbd_create(tbd_t* tbd, const char* key, const void* value, size_t value_size)
+{
+  const TBD_TIME_T start = tbd_op_begin(tbd, TBD_OP_CREATE);
+  const int result = tbd_create_op(tbd, key, value, value_size);
+  tbd_op_end(tbd, TBD_OP_CREATE, start);
+  
+  return result;
+}
+
+
+
+
+int tbd_read(tbd_t* tbd, const char* key, void* value, size_t value_size)
+{
+  const TBD_TIME_T start = tbd_op_begin(tbd, TBD_OP_READ);
+  const int result = tbd_read_op(tbd, key, value, value_size);
+  tbd_op_end(tbd, TBD_OP_READ, start);
+  
+  return result;
+}
+
+
+
+
+int tbd_read_multi(tbd_t* tbd, size_t count, const char* const* keys, void* const* values, const size_t* value_sizes, int* results)
+{
+  TBD_ASSERT(tbd);
+  TBD_ASSERT(!count || (keys && values && value_sizes && results));
+  
+  int result = TBD_NO_ERROR;
+  
+  size_t first;
+  for (first = 0; first < count; first += TBD_FIND_BATCH_SIZE)
+  {
+    const size_t batch_count = (count - first < TBD_FIND_BATCH_SIZE) ? count - first : TBD_FIND_BATCH_SIZE;
+    
+    unsigned long hashes[TBD_FIND_BATCH_SIZE];
+    tbd_keyvalue_t* found[TBD_FIND_BATCH_SIZE];
+    TBD_TRACE_ENUM events[TBD_FIND_BATCH_SIZE];
+    size_t i;
+    
+    // the reads of a batch share one search, so they are timed together
+    const TBD_TIME_T start = tbd_op_clock(tbd);
+    
+    // hash all keys, and start loading the keyvalues they were last found at
+    for (i = 0; i < batch_count; ++i)
+    {
+      hashes[i] = tbd_key_hash(keys[first + i]);
+      
+#ifdef TBD_USE_LAST_FOUND_CACHE
+      TBD_PREFETCH(tbd->last_found[tbd_last_found_index(hashes[i])]);
+#endif
+    }
+    
+    // find all keys in one pass over the stack, and start loading their values
+    tbd_find_keyvalues(tbd, batch_count, keys + first, hashes, found, events);
+    
+    for (i = 0; i < batch_count; ++i)
+    {
+      if (found[i])
+      {
+        TBD_PREFETCH(found[i]->value.data);
+      }
+    }
+    
+    // copy the values out, and report each read as tbd_read would
+    for (i = 0; i < batch_count; ++i)
+    {
+      tbd_op_count(tbd, TBD_OP_READ);
+      
+      TBD_TRACE(tbd, FIND_BEGIN, 0, 0);
+      tbd_find_trace_quick(tbd, events[i]);
+      TBD_TRACE(tbd, FIND_END, found[i] != NULL, 0);
+      
+      results[first + i] = tbd_read_found(tbd, found[i], values[first + i], value_sizes[first + i]);
+      
+      TBD_TRACE(tbd, OP_END, TBD_OP_READ, 0);
+      
+      if ((result == TBD_NO_ERROR) && (results[first + i] != TBD_NO_ERROR))
+      {
+        result = results[first + i];
+      }
+    }
+    
+    tbd_op_time(tbd, TBD_OP_READ, start, batch_count);
+  }
+  
+  return result;
+}
+
+
+
+
+int tbd_update(tbd_t* tbd, const char* key, const void* value, size_t value_size)
+{
+  const TBD_TIME_T start = tbd_op_begin(tbd, TBD_OP_UPDATE);
+  const int result = tbd_update_op(tbd, key, value, value_size);
+  tbd_op_end(tbd, TBD_OP_UPDATE, start);
+  
+  return result;
+}
+
+
+
+
+int tbd_put(tbd_t* tbd, const char* key, const void* value, size_t value_size)
+{
+  const TBD_TIME_T start = tbd_op_begin(tbd, TBD_OP_PUT);
+  const int result = tbd_put_op(tbd, key, value, value_size);
+  tbd_op_end(tbd, TBD_OP_PUT, start);
+  
+  return result;
+}
+
+
+
+
+int tbd_delete(tbd_t* tbd, const char* key)
+{
+  const TBD_TIME_T start = tbd_op_begin(tbd, TBD_OP_DELETE);
+  const int result = tbd_delete_op(tbd, key);
+  tbd_op_end(tbd, TBD_OP_DELETE, start);
+  
+  return result;
+}
+
+
+
+
+size_t tbd_read_size(tbd_t* tbd, const char* key)
+{
+  TBD_ASSERT(tbd);
+  TBD_ASSERT(key);
+  
+  // find the element
+  struct tbd_keyvalue_struct* ptr = tbd_find_keyvalue(tbd, key);
+  if (!ptr)
+  {
+    return 0;
+  }
+
+  return tbd_value_size(&ptr->value);
+}
+
+
+
+
+/** Compare and swap a value, see tbd_cas.
+ */
+static int tbd_cas_op(tbd_t* tbd, const char* key, const void* expected, const void* desired, size_t value_size)
+{
+  TBD_ASSERT(tbd);
+  TBD_ASSERT(key);
+  TBD_ASSERT(expected);
+  TBD_ASSERT(desired);
+  TBD_ASSERT(value_size);
+  
+  // find the element
+  struct tbd_keyvalue_struct* ptr = tbd_find_keyvalue(tbd, key);
+  if (!ptr)
+  {
+    return TBD_ERROR_KEY_NOT_FOUND;
+  }
+  
+  if (value_size != tbd_value_size(&ptr->value))
+  {
+    return TBD_ERROR_BAD_SIZE;
+  }
+  
+  if (memcmp(ptr->value.data, expected, value_size) != 0)
+  {
+    return TBD_ERROR_VALUE_MISMATCH;
+  }
+  
+  memcpy(ptr->value.data, desired, value_size);
+  
+  return tbd_commit_change(tbd, ptr, TBD_WAL_OP_PUT, key, desired, value_size);
+}
+
+
+
+
+int tbd_cas(tbd_t* tbd, const char* key, const void* expected, const void* desired, size_t value_size)
+{
+  const TBD_TIME_T start = tbd_op_begin(tbd, TBD_OP_CAS);
+  const int result = tbd_cas_op(tbd, key, expected, desired, value_size);
+  tbd_op_end(tbd, TBD_OP_CAS, start);
+  
+  return result;
+}
+
+
+
+
+/** Largest number of decimal digits handled by tbd_incr.
+ *  Keeps every intermediate result inside the range of a long.
+ */
+#if LONG_MAX > 0x7FFFFFFFL
+  #define TBD_INCR_MAX_DIGITS    (18u)
+#else
+  #define TBD_INCR_MAX_DIGITS    (8u)
+#endif
+
+
+
+
+/** Increment a value stored as fixed width decimal text, see tbd_incr.
+ *  The value keeps its width, so it is always rewritten in place.
+ */
+static int tbd_incr_op(tbd_t* tbd, const char* key, long delta, long* result, TBD_INCR_OVERFLOW_ENUM overflow)
+{
+  TBD_ASSERT(tbd);
+  TBD_ASSERT(key);
+  
+  // find the element
+  struct tbd_keyvalue_struct* ptr = tbd_find_keyvalue(tbd, key);
+  if (!ptr)
+  {
+    return TBD_ERROR_KEY_NOT_FOUND;
+  }
+  
+  char* text = (char*) ptr->value.data;
+  const TBD_SIZE_T value_size = tbd_value_size(&ptr->value);
+  
+  // the width is the text before any null terminator
+  TBD_SIZE_T width = 0;
+  
+  while ((width < value_size) && text[width])
+  {
+    ++width;
+  }
+  
+  // parse the current value
+  const bool is_negative = width && (text[0] == '-');
+  TBD_SIZE_T i = is_negative ? 1 : 0;
+  
+  if ((i == width) || (width - i > TBD_INCR_MAX_DIGITS))
+  {
+    return TBD_ERROR_NOT_A_NUMBER;
+  }
+  
+  long value = 0;
+  
+  for (; i < width; ++i)
+  {
+    if ((text[i] < '0') || (text[i] > '9'))
+    {
+      return TBD_ERROR_NOT_A_NUMBER;
+    }
+    
+    value = value * 10 + (text[i] - '0');
+  }
+  
+  if (is_negative)
+  {
+    value = -value;
+  }
+  
+  // compute the range that fits in the width, one character is needed for a minus sign
+  long max = 1;
+  long min = 1;
+  
+  for (i = 0; (i < width) && (i < TBD_INCR_MAX_DIGITS); ++i)
+  {
+    max *= 10;
+    min *= (i + 1 < width) ? 10 : 1;
+  }
+  
+  max = max - 1;
+  min = -(min - 1);
+  
+  // add, checking against the range before the sum can overflow
+  const bool is_overflow = (delta > 0) && (delta > max - value);
+  const bool is_underflow = (delta < 0) && (delta < min - value);
+  
+  if (is_overflow || is_underflow)
+  {
+    switch (overflow)
+    {
+      case TBD_INCR_OVERFLOW_SATURATE:
+      {
+        value = is_overflow ? max : min;
+      } break;
+      
+      case TBD_INCR_OVERFLOW_WRAP:
+      {
+        const long range = max - min + 1;
+        long offset = (delta % range) + (value - min);
+        
+        if (offset < 0)
+        {
+          offset += range;
+        }
+        
+        value = min + (offset % range);
+      } break;
+      
+      case TBD_INCR_OVERFLOW_ERROR:
+      default:
+      {
+        return TBD_ERROR_OVERFLOW;
+      }
+    }
+  }
+  else
+  {
+    value += delta;
+  }
+  
+  // write the digits back from the right, padding with zeros
+  unsigned long digits = (value < 0) ? (unsigned long) -value : (unsigned long) value;
+  
+  for (i = width; i > 0; --i)
+  {
+    text[i - 1] = '0' + (char) (digits % 10);
+    digits /= 10;
+  }
+  
+  if (value < 0)
+  {
+    text[0] = '-';
+  }
+  
+  if (result)
+  {
+    *result = value;
+  }
+  
+  return tbd_commit_change(tbd, ptr, TBD_WAL_OP_PUT, key, text, value_size);
+}
+
+
+
+
+int tbd_incr(tbd_t* tbd, const char* key, long delta, long* result, TBD_INCR_OVERFLOW_ENUM overflow)
+{
+  const TBD_TIME_T start = tbd_op_begin(tbd, TBD_OP_INCR);
+  const int incr_result = tbd_incr_op(tbd, key, delta, result, overflow);
+  tbd_op_end(tbd, TBD_OP_INCR, start);
+  
+  return incr_result;
+}
+
+
+
+
+/** Append to a value, see tbd_append.
+ */
+static int tbd_append_op(tbd_t* tbd, const char* key, const void* data, size_t data_size)
+{
+  TBD_ASSERT(tbd);
+  TBD_ASSERT(key);
+  TBD_ASSERT(data);
+  
+  // find the element
+  struct tbd_keyvalue_struct* ptr = tbd_find_keyvalue(tbd, key);
+  if (!ptr)
+  {
+    return TBD_ERROR_KEY_NOT_FOUND;
+  }
+  
+  if (!data_size)
+  {
+    return TBD_NO_ERROR;
+  }
+  
+  const TBD_SIZE_T value_size = tbd_value_size(&ptr->value);
+  const TBD_SIZE_T new_value_size = value_size + data_size;
+  
+#ifdef TBD_USE_NULL_TERMINATED_VALUES
+  const TBD_SIZE_T data_offset = value_size - 1;   // overwrite the null terminator
+#else
+  const TBD_SIZE_T data_offset = value_size;
+#endif
+  
+  // append in place if there is room left in the hunk
+  if (tbd_keyvalue_resize_value(ptr, new_value_size))
+  {
+    memcpy(ptr->value.data + data_offset, data, data_size);
+    
+#ifdef TBD_USE_NULL_TERMINATED_VALUES
+    ptr->value.data[new_value_size - 1] = '\0';
+#endif
+    
+    return tbd_commit_change(tbd, ptr, TBD_WAL_OP_PUT, key, ptr->value.data, new_value_size);
+  }
+  
+  // otherwise move the keyvalue to a larger hunk
+  const TBD_SIZE_T key_size = tbd_key_heap_size(&ptr->key);
+
+#ifdef TBD_USE_EVICTION
+  // keep the keyvalue being appended away from the eviction clock
+  ptr->flags.is_referenced = 1;
+#endif
+  
+  tbd_keyvalue_t* keyvalue = tbd_create_keyvalue(tbd, key_size, new_value_size);
+  
+  if (!keyvalue)
+  {
+    return TBD_ERROR;
+  }
+  
+  // making room may have evicted the keyvalue being appended, and reused its place on the stack
+  if ((keyvalue == ptr) || !tbd_keyvalue_is_on_stack(tbd, ptr) || tbd_keyvalue_is_garbage(ptr))
+  {
+    tbd_discard_keyvalue(tbd, keyvalue);
+    return TBD_ERROR;
+  }
+  
+  memcpy(keyvalue->key.str, ptr->key.str, key_size);
+  memcpy(keyvalue->value.data, ptr->value.data, data_offset);
+  memcpy(keyvalue->value.data + data_offset, data, data_size);
+  
+  tbd_keyvalue_index_key(tbd, keyvalue);
+  
+#ifdef TBD_USE_HANDLES
+  tbd_handle_move(tbd, ptr, keyvalue);
+#endif
+  
+  tbd_trash_keyvalue(tbd, ptr);
+  
+  return tbd_commit_change(tbd, keyvalue, TBD_WAL_OP_PUT, key, keyvalue->value.data, new_value_size);
+}
+
+
+
+
+int tbd_append(tbd_t* tbd, const char* key, const void* data, size_t data_size)
+{
+  const TBD_TIME_T start = tbd_op_begin(tbd, TBD_OP_APPEND);
+  const int result = tbd_append_op(tbd, key, data, data_size);
+  tbd_op_end(tbd, TBD_OP_APPEND, start);
+  
+  return result;
+}
+
+
+
+
+void tbd_clear(tbd_t* tbd)
+{
+  TBD_ASSERT(tbd);
+
+  tbd_keyvalue_stack_clear(&tbd->stack);
+  tbd_heap_clear(&tbd->heap);
+  
+  tbd->is_sorted_by_key = false;
+  tbd->moved_size = 0;
+
+  #if defined(TBD_USE_LAST_FOUND_CACHE)  
+    tbd_last_found_clear(tbd);
+    tbd->lookup_cache_hit_count = 0;
+    tbd->lookup_cache_miss_count = 0;
+  #endif  
+  
+  #if defined(TBD_USE_GARBAGE_LIST)
+    tbd_garbage_list_clear(&tbd->garbage);
+  #endif
+  
+  #if defined(TBD_USE_EVICTION)
+    tbd->clock_hand = 0;
+    tbd->evict_count = 0;
+  #endif
+  
+  #if defined(TBD_USE_OP_COUNTERS)
+    memset(tbd->op_count, 0, sizeof(tbd->op_count));
+    tbd->read_hit_count = 0;
+    tbd->read_miss_count = 0;
+    tbd->alloc_fail_count = 0;
+    tbd->find_count = 0;
+    tbd->find_scan_count = 0;
+  #endif
+  
+  #if defined(TBD_USE_LATENCY_HISTOGRAMS)
+    tbd->clock = NULL;
+    memset(tbd->latency_histogram, 0, sizeof(tbd->latency_histogram));
+    memset(tbd->latency_sum, 0, sizeof(tbd->latency_sum));
+  #endif
+  
+  #if defined(TBD_USE_TRACE)
+    tbd->trace = NULL;
+    tbd->trace_context = NULL;
+  #endif
+  
+  #if defined(TBD_USE_FILTER)
+    tbd->filter_size = 0;
+    tbd->is_filter_saturated = false;
+    tbd->filter_reject_count = 0;
+  #endif
+  
+  #if defined(TBD_USE_EXPIRY)
+    tbd->sweep_hand = 0;
+  #endif
+  
+  // the write-ahead log stays bound, tbd_init closes it
+  
+  #if defined(TBD_USE_VERSIONS)
+    tbd->version = 0;
+  #endif
+  
+  #if defined(TBD_USE_HANDLES)
+    memset(tbd->handles, 0, sizeof(tbd->handles));
+    memset(tbd->handle_generation, 0, sizeof(tbd->handle_generation));
+  #endif
+  
+  tbd->now = 0;
+}
+
+
+
+
+void tbd_empty(tbd_t* tbd)
+{
+  TBD_ASSERT(tbd);
+
+  tbd_keyvalue_stack_empty(&tbd->stack);
+  tbd_heap_empty(&tbd->heap);
+  
+  tbd->is_sorted_by_key = false;
+
+  #if defined(TBD_USE_LAST_FOUND_CACHE)  
+    tbd_last_found_clear(tbd);
+  #endif  
+  
+  #if defined(TBD_USE_HANDLES)
+    tbd_handle_clear(tbd);
+  #endif
+  
+  #if defined (TBD_USE_GARBAGE_LIST)
+    tbd_garbage_list_clear(&tbd->garbage);
+  #endif
+  
+  #if defined(TBD_USE_EVICTION)
+    tbd->clock_hand = 0;
+  #endif
+  
+  #if defined(TBD_USE_EXPIRY)
+    tbd->sweep_hand = 0;
+  #endif
+  
+  #if defined(TBD_USE_FILTER)
+    memset(tbd_filter_begin(tbd), 0, tbd->filter_size);
+    tbd->is_filter_saturated = false;
+  #endif
+}
+
+
+
+
+int tbd_is_empty(const tbd_t* tbd)
+{
+  TBD_ASSERT(tbd);
+  
+  return (0 == tbd->stack.count);
+}
+
+
+
+
+/** Initialize the tbd inside the memory bounds in init structure.
+ */
+tbd_t* tbd_init(const tbd_init_t* init)
+{
+  TBD_ASSERT(init);
+  
+  /* check for non-null pointer */
+  if (!init)
+  {
+    return 0;
+  }
+  
+  /* check for enough room to store tbd_struct */
+  if (init->size < sizeof(struct tbd_struct))
+  {
+    return 0;
+  }
+  
+#ifdef TBD_USE_FILTER
+  if (init->size - sizeof(struct tbd_struct) < init->filter_size)
+  {
+    return 0;
+  }
+#endif
+  
+  tbd_t* tbd = init->start;
+  
+  tbd_clear(tbd);
+  
+#ifdef TBD_USE_WAL
+  memset(&tbd->wal, 0, sizeof(tbd->wal));
+#endif
+  
+  tbd->size = init->size;
+  tbd->hunk_size = init->hunk_size;
+  tbd->flags = init->flags;
+  
+#ifdef TBD_USE_FILTER
+  // locate filter immediately after tbd struct
+  tbd->filter_size = init->filter_size;
+  memset(tbd_filter_begin(tbd), 0, tbd->filter_size);
+#endif
+  
+  // locate keyvalue list immediately after tbd struct and filter
+  tbd->stack.start = (tbd_keyvalue_t*) ((unsigned char*) tbd + tbd_head_size(tbd));
+  tbd->stack.count = 0;
+  
+  // locate start of heap at end of allocated region
+  tbd->heap.top = ((unsigned char*) init->start) + init->size;
+  tbd->heap.size = 0;
+  
+  return tbd;
+}
+
+
+
+
+
+
+
+
+/*
+ *
+ * ITERATOR FUNCTIONS
+ *
+ */
+
+
+
+
+/** Get forward iterator to first keyvalue element.
+ */
+tbd_const_iterator_t tbd_const_begin(const tbd_t* tbd)
+{
+  TBD_ASSERT(tbd);
+  
+  return (tbd_const_iterator_t) { .ptr = tbd_keyvalue_stack_const_begin(&tbd->stack).ptr }; 
+}
+
+
+
+
+/** Get forward iterator to end+1 keyvalue element.
+ */
+tbd_const_iterator_t tbd_const_end(const tbd_t* tbd)
+{
+  TBD_ASSERT(tbd);
+  
+  return (tbd_const_iterator_t) {.ptr = tbd_keyvalue_stack_end(&tbd->stack).ptr};  
+}
+
+
+
+
+/** Move iterator to next element.
+ */
+tbd_const_iterator_t tbd_const_iterator_next(tbd_const_iterator_t i)
+{
+  tbd_keyvalue_stack_const_iterator_t temp = {.ptr = i.ptr};
+  
+  return (tbd_const_iterator_t) {.ptr = tbd_keyvalue_stack_const_iterator_next(&temp)};
+}
+
+
+
+
+/** Test if iterators are equivalent.
+ */
+int tbd_const_iterator_is_equal(tbd_const_iterator_t a, tbd_const_iterator_t b)
+{  
+  return (a.ptr == b.ptr);
+}
+
+
+
+
+/** Get pointer to key pointed to by iterator.
+ * Will return NULL if iterator is invalid.
+ */
+const char* tbd_const_iterator_key(const tbd_const_iterator_t i)
+{
+  TBD_ASSERT(i.ptr);
+  
+  return ((tbd_keyvalue_t*)(i.ptr))->key.str;  
+}
+
+
+
+
+/** Get the size in bytes of the value pointed to by iterator.
+ */
+size_t tbd_const_iterator_value_size(const tbd_const_iterator_t i)
+{
+  TBD_ASSERT(i.ptr);
+  
+  return tbd_value_size(&((tbd_keyvalue_t*)(i.ptr))->value);
+}
+
+
+
+
+/** Get the pointer to the value pointd to by the iterator.
+ */
+const void* tbd_const_iterator_value(const tbd_const_iterator_t i)
+{
+  TBD_ASSERT(i.ptr);
+  
+  return ((tbd_keyvalue_t*)(i.ptr))->value.data;
+}
+
+
+
+
+
+
+
+
+/*
+ *
+ * SCAN FUNCTIONS
+ *
+ */
+
+
+
+
+/** Check if a key starts with a prefix of prefix_size chars.
+ */
+static bool tbd_key_has_prefix(const char* key, const char* prefix, TBD_SIZE_T prefix_size)
+{
+  TBD_ASSERT(key);
+  TBD_ASSERT(prefix);
+  
+  if (!prefix_size)
+  {
+    return true;
+  }
+  
+  // most keys are rejected by the first char
+  return (key[0] == prefix[0]) && (0 == strncmp(key, prefix, prefix_size));
+}
+
+
+
+
+/** Match a key against a glob pattern.
+ *  A '*' matches any number of chars, a '?' matches one char.
+ */
+static bool tbd_key_glob_match(const char* key, const char* pattern)
+{
+  TBD_ASSERT(key);
+  TBD_ASSERT(pattern);
+  
+  const char* star = NULL;       // pattern after the last '*'
+  const char* star_key = NULL;   // where the key was when the last '*' was seen
+  
+  while (*key)
+  {
+    if ('*' == *pattern)
+    {
+      star = ++pattern;
+      star_key = key;
+    }
+    else if (*pattern && (('?' == *pattern) || (*pattern == *key)))
+    {
+      ++pattern;
+      ++key;
+    }
+    else if (star)
+    {
+      // let the last '*' match one more char
+      pattern = star;
+      key = ++star_key;
+    }
+    else
+    {
+      return false;
+    }
+  }
+  
+  while ('*' == *pattern)
+  {
+    ++pattern;
+  }
+  
+  return !*pattern;
+}
+
+
+
+
+/** Get the keyvalue at a position in key order, the stack must be sorted by key.
+ */
+static const tbd_keyvalue_t* tbd_scan_get(const tbd_t* tbd, TBD_SIZE_T index, bool is_ascending)
+{
+  TBD_ASSERT(tbd);
+  
+  return tbd_keyvalue_stack_get(&tbd->stack, is_ascending ? index : tbd->stack.count - 1 - index);
+}
+
+
+
+
+/** Call scan_fn for each visible keyvalue that starts with prefix, and matches pattern if it is not NULL.
+ *  Binary searches for the first match if the stack is sorted by key.
+ */
+static int tbd_scan(const tbd_t* tbd, const char* prefix, TBD_SIZE_T prefix_size, const char* pattern, tbd_scan_fn scan_fn, void* context)
+{
+  TBD_ASSERT(tbd);
+  TBD_ASSERT(prefix);
+  TBD_ASSERT(scan_fn);
+  
+  const TBD_SIZE_T count = tbd->stack.count;
+  
+  if (!count)
+  {
+    return TBD_NO_ERROR;
+  }
+  
+  const tbd_keyvalue_t* first = tbd_keyvalue_stack_get(&tbd->stack, 0);
+  const tbd_keyvalue_t* last = tbd_keyvalue_stack_get(&tbd->stack, count - 1);
+  
+  const bool is_sorted = tbd->is_sorted_by_key && !tbd_keyvalue_is_garbage(first) && !tbd_keyvalue_is_garbage(last);
+  
+  // tbd_sort_by_key puts the lowest key on top, tbd_copy puts it at the bottom
+  const bool is_ascending = is_sorted && (strcmp(first->key.str, last->key.str) <= 0);
+  
+  TBD_SIZE_T index = 0;
+  
+  if (is_sorted)
+  {
+    // find the first key not below the prefix
+    TBD_SIZE_T end = count;
+    
+    while (index < end)
+    {
+      const TBD_SIZE_T middle = index + (end - index) / 2;
+      
+      if (strncmp(tbd_scan_get(tbd, middle, is_ascending)->key.str, prefix, prefix_size) < 0)
+      {
+        index = middle + 1;
+      }
+      else
+      {
+        end = middle;
+      }
+    }
+  }
+  
+  for (; index < count; ++index)
+  {
+    const tbd_keyvalue_t* keyvalue = is_sorted ? tbd_scan_get(tbd, index, is_ascending) : tbd_keyvalue_stack_get(&tbd->stack, index);
+    
+    if (tbd_keyvalue_is_garbage(keyvalue))
+    {
+      continue;
+    }
+    
+    if (!tbd_key_has_prefix(keyvalue->key.str, prefix, prefix_size))
+    {
+      if (is_sorted)
+      {
+        break;   // the matches are all together
+      }
+      
+      continue;
+    }
+    
+    if (!tbd_keyvalue_is_visible(tbd, keyvalue) || (pattern && !tbd_key_glob_match(keyvalue->key.str, pattern)))
+    {
+      continue;
+    }
+    
+    const int scan_result = scan_fn(context, keyvalue->key.str, keyvalue->value.data, tbd_value_size(&keyvalue->value));
+    
+    if (scan_result != TBD_NO_ERROR)
+    {
+      return scan_result;
+    }
+  }
+  
+  return TBD_NO_ERROR;
+}
+
+
+
+
+int tbd_scan_prefix(const tbd_t* tbd, const char* prefix, tbd_scan_fn scan_fn, void* context)
+{
+  TBD_ASSERT(tbd);
+  TBD_ASSERT(prefix);
+  TBD_ASSERT(scan_fn);
+  
+  return tbd_scan(tbd, prefix, strlen(prefix), NULL, scan_fn, context);
+}
+
+
+
+
+int tbd_scan_glob(const tbd_t* tbd, const char* pattern, tbd_scan_fn scan_fn, void* context)
+{
+  TBD_ASSERT(tbd);
+  TBD_ASSERT(pattern);
+  TBD_ASSERT(scan_fn);
+  
+  // the chars before the first wildcard narrow the scan like a prefix
+  const TBD_SIZE_T prefix_size = strcspn(pattern, "*?");
+  
+  return tbd_scan(tbd, pattern, prefix_size, pattern, scan_fn, context);
+}
+
+
+
+
+
+
+
+
+/*
+ *
+ * GARBAGE COLLECTION FUNCTIONS
+ *
+ */
+
+
+
+
+/** Returns size in bytes of garbage in tbd.
+ */
+TBD_SIZE_T tbd_garbage_size(const tbd_t* tbd)
+{
+  TBD_ASSERT(tbd);
+  
+  size_t result = 0;
+  
+#ifdef TBD_USE_GARBAGE_LIST  
+  
+  // the garbage list keeps a running total
+  result = tbd->garbage.size;
+  
+#else
+  
+  if (tbd_keyvalue_stack_count(&tbd->stack))
+  {
+    tbd_keyvalue_stack_iterator_t stack_ptr = tbd_keyvalue_stack_begin(&tbd->stack);
+    tbd_keyvalue_stack_const_iterator_t stack_end = tbd_keyvalue_stack_end(&tbd->stack);
+    
+    while (!tbd_keyvalue_stack_const_iterator_is_equal(&stack_end, &stack_ptr))
+    {
+      tbd_keyvalue_stack_iterator_next(&stack_ptr);  
+    }    
+  }
+  
+#endif
+  
+  return result;
+}
+
+
+
+
+/** Returns number of garbage keyvalue elements in tbd.
+ */
+TBD_SIZE_T tbd_garbage_count(const tbd_t* tbd)
+{
+  TBD_ASSERT(tbd);  
+  
+  #if defined(TBD_USE_GARBAGE_LIST)
+    return tbd_garbage_list_count(&tbd->garbage);
+  #else
+   
+    // TODO iterate over keyvalue stack and count garbage
+    return 0;
+  
+  #endif
+}
+
+
+
+
+TBD_SIZE_T tbd_garbage_largest_size(const tbd_t* tbd)
+{
+  TBD_ASSERT(tbd);
+  
+  TBD_SIZE_T largest_size = 0;
+  
+  TBD_SIZE_T i;
+  for (i = 0; i < tbd->stack.count; ++i)
+  {
+    const tbd_keyvalue_t* keyvalue = tbd_keyvalue_stack_get(&tbd->stack, i);
+    
+    if (tbd_keyvalue_is_garbage(keyvalue) && (keyvalue->heap.size > largest_size))
+    {
+      largest_size = keyvalue->heap.size;
+    }
+  }
+  
+  return largest_size;
+}
+
+
+
+
+/** Merge all keyvalues in stack that are garbage and are located next to each other in heap.
+ */
+static TBD_SIZE_T tbd_garbage_merge_phase(tbd_t* tbd)
+{
+  TBD_ASSERT(tbd);
+  
+  size_t total_merged = 0;
+  
+  tbd_keyvalue_stack_iterator_t prev = tbd_keyvalue_stack_begin(&tbd->stack);
+  tbd_keyvalue_stack_iterator_t next = tbd_keyvalue_stack_begin(&tbd->stack);  
+  tbd_keyvalue_stack_const_iterator_t end = tbd_keyvalue_stack_end(&tbd->stack);
+  
+  if (tbd_keyvalue_stack_iterator_is_equal(&end, &next))
+  {
+    return 0;
+  }
+  
+  // increment next ahead of prev
+  tbd_keyvalue_stack_iterator_next(&next);  
+  
+  while(!tbd_keyvalue_stack_iterator_is_equal(&end, &next))
+  {
+    total_merged += tbd_keyvalue_merge_garbage(prev.ptr, next.ptr);
+    
+    tbd_keyvalue_stack_iterator_next(&next);    
+    tbd_keyvalue_stack_iterator_next(&prev);
+  }
+  
+  return total_merged;
+}
+
+
+
+
+/** TODO: Remove use of garbage list
+ */
+static TBD_SIZE_T tbd_garbage_pop_phase(tbd_t* tbd, size_t garbage_limit)
+{
+  TBD_ASSERT(tbd);
+  
+  size_t pop_total = 0;
+  
+  if (!garbage_limit)
+  {
+    return 0;
+  }
+    
+  
+  tbd_keyvalue_stack_iterator_t iter = tbd_keyvalue_stack_begin(&tbd->stack);  
+  tbd_keyvalue_stack_const_iterator_t end = tbd_keyvalue_stack_end(&tbd->stack);
+  
+
+  while (!tbd_keyvalue_stack_iterator_is_equal(&end, &iter) && tbd_keyvalue_is_garbage(iter.ptr) &&(iter.ptr->heap.top == tbd->heap.top))
+  {
+    const size_t keyvalue_size = tbd_keyvalue_size(iter.ptr);
+    
+    if ((pop_total + keyvalue_size) > garbage_limit)
+    {
+      break;
+    }
+    
+    pop_total += keyvalue_size;
+    
+    TBD_SIZE_T heap_size = tbd_heap_size(&iter.ptr->heap);
+    
+    tbd_heap_pop(&tbd->heap, heap_size);
+    tbd_keyvalue_stack_pop(&tbd->stack);
+    tbd_garbage_list_delete(&tbd->garbage, iter.ptr);
+    
+#ifdef TBD_USE_LAST_FOUND_CACHE
+    // the popped element is no longer on the stack
+    tbd_last_found_forget(tbd, iter.ptr);
+#endif
+    
+    if (!tbd_keyvalue_stack_count(&tbd->stack))
+    {
+      break;
+    }
+    
+    iter = tbd_keyvalue_stack_begin(&tbd->stack); 
+  }
+  
+  return pop_total;
+}
+
+
+
+
+/** Fold used keyvalues from the top of the stack into garbage of the same hunk size further down.
+ *  The garbage moves to the top of the stack, where tbd_garbage_pop can release it.
+ */
+static TBD_SIZE_T tbd_garbage_fold_phase(tbd_t* tbd, size_t garbage_limit)
+{
+  TBD_ASSERT(tbd);
+  
+  if (!garbage_limit)
+  {
+    return 0;
+  }
+  
+  if (0 == tbd_garbage_size(tbd))
+  {
+    return 0;
+  }
+  
+  size_t garbage_total = 0;
+  
+  const TBD_SIZE_T count = tbd_keyvalue_stack_count(&tbd->stack);
+  
+  TBD_SIZE_T btm;
+  for (btm = 0; btm < count; ++btm)
+  {
+    tbd_keyvalue_t* garbage = tbd_keyvalue_stack_get(&tbd->stack, btm);
+    
+    if (!tbd_keyvalue_is_garbage(garbage))
+    {
+      continue;
+    }
+    
+    // find the used keyvalue nearest the top with the same hunk size
+    TBD_SIZE_T top = count;
+    
+    while (--top > btm)
+    {
+      tbd_keyvalue_t* keyvalue = tbd_keyvalue_stack_get(&tbd->stack, top);
+      
+      if (tbd_keyvalue_is_garbage(keyvalue) || (keyvalue->heap.size != garbage->heap.size))
+      {
+        continue;
+      }
+      
+      const size_t keyvalue_size = tbd_keyvalue_size(keyvalue);
+      
+      if (garbage_total + keyvalue_size > garbage_limit)
+      {
+        continue;
+      }
+      
+      tbd->moved_size += tbd_keyvalue_copy(garbage, keyvalue);
+      tbd_keyvalue_set_garbage(keyvalue, true);
+      
+      garbage_total += keyvalue_size;
+      break;
+    }
+  }
+  
+  if (!garbage_total)
+  {
+    return 0;
+  }
+  
+#ifdef TBD_USE_LAST_FOUND_CACHE
+  // folding moves keyvalues on the stack
+  tbd_last_found_clear(tbd);
+#endif
+  
+#ifdef TBD_USE_GARBAGE_LIST
+  tbd_garbage_list_rebuild(tbd);
+#endif
+  
+#ifdef TBD_USE_HANDLES
+  tbd_handle_rebuild(tbd);
+#endif
+  
+  tbd->is_sorted_by_key = false;
+  
+  return garbage_total;
+}
+
+
+
+
+/** Pack heap elements.
+ *  Used keyvalues slide down the stack over the garbage, and their heap slides down to the bottom of the heap.
+ *  Garbage left below the top of the stack, because the limit was reached, is merged into one keyvalue.
+ */
+static TBD_SIZE_T tbd_garbage_pack_phase(tbd_t* tbd, size_t garbage_limit)
+{
+  TBD_ASSERT(tbd);
+  
+  if (!garbage_limit)
+  {
+    return 0;
+  }
+  
+  if (!tbd->stack.count)
+  {
+    return 0;
+  }
+  
+  if (0 == tbd_garbage_size(tbd))
+  {
+    return 0;
+  }
+  
+  const TBD_SIZE_T count = tbd_keyvalue_stack_count(&tbd->stack);
+  
+  // sliding keeps the heap in stack order, so the stack must start in heap order
+  bool is_sorted = false;
+  
+  TBD_SIZE_T read;
+  for (read = 1; read < count; ++read)
+  {
+    if (tbd_keyvalue_cmp_heap(tbd_keyvalue_stack_get(&tbd->stack, read), tbd_keyvalue_stack_get(&tbd->stack, read - 1)) > 0)
+    {
+      tbd_keyvalue_stack_sort_by_heap(&tbd->stack);
+      is_sorted = true;
+      break;
+    }
+  }
+  
+  size_t garbage_total = 0;
+  
+  TBD_SIZE_T write = 0;
+  unsigned char* heap_btm = tbd_heap_end(&tbd->heap);
+  
+  for (read = 0; read < count; ++read)
+  {
+    tbd_keyvalue_t* keyvalue = tbd_keyvalue_stack_get(&tbd->stack, read);
+    
+    if (tbd_keyvalue_is_garbage(keyvalue))
+    {
+      continue;
+    }
+    
+    // keyvalues that are already packed stay where they are
+    if ((write == read) && (tbd_heap_end(&keyvalue->heap) == heap_btm))
+    {
+      heap_btm = keyvalue->heap.top;
+      ++write;
+      continue;
+    }
+    
+    const size_t keyvalue_size = tbd_keyvalue_size(keyvalue);
+    
+    if (garbage_total + keyvalue_size > garbage_limit)
+    {
+      break;
+    }
+    
+    const tbd_keyvalue_t src = *keyvalue;
+    tbd_keyvalue_t* dest = tbd_keyvalue_stack_get(&tbd->stack, write);
+    
+    dest->heap.top = heap_btm - src.heap.size;
+    dest->heap.size = src.heap.size;
+    
+    tbd->moved_size += tbd_keyvalue_copy(dest, &src);
+    
+    garbage_total += keyvalue_size;
+    heap_btm = dest->heap.top;
+    ++write;
+  }
+  
+  if ((write == read) && !is_sorted)
+  {
+    return garbage_total;
+  }
+  
+  if ((write != read) && (read == count))
+  {
+    // all garbage was packed to the top, so release it
+    tbd->stack.count = write;
+    tbd_heap_pop(&tbd->heap, (TBD_SIZE_T) (heap_btm - tbd->heap.top));
+  }
+  else if (write != read)
+  {
+    // merge the garbage between the packed and the unpacked keyvalues
+    const tbd_keyvalue_t* unpacked = tbd_keyvalue_stack_get(&tbd->stack, read);
+    unsigned char* unpacked_end = tbd_heap_end(&unpacked->heap);
+    
+    tbd_keyvalue_t* garbage = tbd_keyvalue_stack_get(&tbd->stack, write++);
+    
+    memmove(garbage + 1, unpacked, (count - read) * sizeof(tbd_keyvalue_t));
+    tbd->stack.count = write + (count - read);
+    
+    tbd_keyvalue_clear(garbage);
+    garbage->heap.top = unpacked_end;
+    garbage->heap.size = (TBD_SIZE_T) (heap_btm - unpacked_end);
+  }
+  
+#ifdef TBD_USE_LAST_FOUND_CACHE
+  // packing moves keyvalues on the stack
+  tbd_last_found_clear(tbd);
+#endif
+  
+#ifdef TBD_USE_GARBAGE_LIST
+  tbd_garbage_list_rebuild(tbd);
+#endif
+  
+#ifdef TBD_USE_HANDLES
+  tbd_handle_rebuild(tbd);
+#endif
+  
+  tbd->is_sorted_by_key = false;
+  
+  return garbage_total;
+}
+
+
+
+
+TBD_SIZE_T tbd_garbage_merge(tbd_t* tbd)
+{
+  TBD_TRACE(tbd, GC_BEGIN, TBD_GC_MERGE, 0);
+  const TBD_SIZE_T size = tbd_garbage_merge_phase(tbd);
+  TBD_TRACE(tbd, GC_END, TBD_GC_MERGE, size);
+  
+  return size;
+}
+
+
+
+
+TBD_SIZE_T tbd_garbage_pop(tbd_t* tbd, size_t garbage_limit)
+{
+  TBD_TRACE(tbd, GC_BEGIN, TBD_GC_POP, garbage_limit);
+  const TBD_SIZE_T size = tbd_garbage_pop_phase(tbd, garbage_limit);
+  TBD_TRACE(tbd, GC_END, TBD_GC_POP, size);
+  
+  return size;
+}
+
+
+
+
+TBD_SIZE_T tbd_garbage_fold(tbd_t* tbd, size_t garbage_limit)
+{
+  TBD_TRACE(tbd, GC_BEGIN, TBD_GC_FOLD, garbage_limit);
+  const TBD_SIZE_T size = tbd_garbage_fold_phase(tbd, garbage_limit);
+  TBD_TRACE(tbd, GC_END, TBD_GC_FOLD, size);
+  
+  return size;
+}
+
+
+
+
+TBD_SIZE_T tbd_garbage_pack(tbd_t* tbd, size_t garbage_limit)
+{
+  TBD_TRACE(tbd, GC_BEGIN, TBD_GC_PACK, garbage_limit);
+  const TBD_SIZE_T size = tbd_garbage_pack_phase(tbd, garbage_limit);
+  TBD_TRACE(tbd, GC_END, TBD_GC_PACK, size);
+  
+  return size;
+}
+
+
+
+
+TBD_SIZE_T tbd_garbage_collect(tbd_t* tbd, size_t garbage_limit)
+{
+  TBD_ASSERT(tbd);
+  
+  size_t collected_size = 0;
+  size_t total_collected_size = 0;
+  
+  if (!garbage_limit)
+  {
+    return total_collected_size = 0;
+  }
+  
+  if (0 == tbd_garbage_size(tbd))
+  {
+    return total_collected_size;
+  }
+  
+#ifdef TBD_USE_FILTER
+  // collection walks the stack anyway, so this is when an overflowed filter is counted again
+  if (tbd->is_filter_saturated)
+  {
+    tbd_filter_rebuild(tbd);
+  }
+#endif
+  
+  // Get easy collection from garbage at top of heap
+  collected_size = tbd_garbage_pop(tbd, garbage_limit);
+  total_collected_size += collected_size;
+  
+  if (garbage_limit <= collected_size)
+  {
+    return total_collected_size;
+  }
+  
+  garbage_limit -= collected_size;
+  
+  // fold data into garbage areas
+  collected_size = tbd_garbage_fold(tbd, garbage_limit);  
+  total_collected_size += collected_size;
+  
+  if (garbage_limit <= collected_size)
+  {
+    return total_collected_size;
+  }
+  
+  garbage_limit -= collected_size;  
+  
+  // pack remaining data
+  collected_size = tbd_garbage_pack(tbd, garbage_limit);
+  total_collected_size += collected_size;
+  
+  return total_collected_size;
+}
+
+
+
+
+TBD_SIZE_T tbd_garbage_clean(tbd_t* tbd)
+{
+  TBD_ASSERT(tbd);
+  
+  if (0 == tbd_garbage_size(tbd))
+  {
+    return 0;
+  }
+  
+  // packing can move more bytes than there is garbage, so allow moving the whole tbd
+  return tbd_garbage_collect(tbd, tbd_size(tbd));
+}
+
+
+
+
+
+
+
+/*
+ *
+ * EXPIRY FUNCTIONS
+ *
+ */
+
+
+
+
+void tbd_set_time(tbd_t* tbd, TBD_TIME_T now)
+{
+  TBD_ASSERT(tbd);
+  
+  tbd->now = now;
+  
+#ifdef TBD_USE_WAL
+  // sync on time as well as on changes, so a quiet log does not wait for the next change
+  tbd_wal_tick(tbd);
+#endif
+}
+
+
+
+
+TBD_TIME_T tbd_time(const tbd_t* tbd)
+{
+  TBD_ASSERT(tbd);
+  
+  return tbd->now;
+}
+
+
+
+
+int tbd_expire(tbd_t* tbd, const char* key, TBD_TIME_T ttl)
+{
+  TBD_ASSERT(tbd);
+  TBD_ASSERT(key);
+  
+#ifdef TBD_USE_EXPIRY
+  
+  // find the element
+  struct tbd_keyvalue_struct* ptr = tbd_find_keyvalue(tbd, key);
+  if (!ptr)
+  {
+    return TBD_ERROR_KEY_NOT_FOUND;
+  }
+  
+  ptr->expires = ttl ? tbd->now + ttl : 0;
+  
+  unsigned char expires[8];
+  tbd_uint_to_bytes(expires, ptr->expires, sizeof(expires));
+  
+  return tbd_commit_change(tbd, ptr, TBD_WAL_OP_EXPIRE, key, expires, sizeof(expires));
+  
+#else
+  
+  return TBD_ERROR;
+  
+#endif
+}
+
+
+
+
+/** Sweep part of the stack for expired keyvalues.
+ *  Expired keyvalues are collected in heap order and merged into the garbage list in one pass.
+ */
+TBD_SIZE_T tbd_expire_sweep(tbd_t* tbd, size_t sweep_limit)
+{
+  TBD_ASSERT(tbd);
+  
+  TBD_SIZE_T expired_count = 0;
+  
+#ifdef TBD_USE_EXPIRY
+  
+  const TBD_SIZE_T count = tbd_keyvalue_stack_count(&tbd->stack);
+  
+  if (sweep_limit > count)
+  {
+    sweep_limit = count;
+  }
+  
+  tbd_keyvalue_t* expired = NULL;   // list of expired keyvalues in heap order
+  
+  while (sweep_limit--)
+  {
+    if (tbd->sweep_hand >= count)
+    {
+      tbd->sweep_hand = 0;
+    }
+    
+    tbd_keyvalue_t* keyvalue = tbd_keyvalue_stack_get(&tbd->stack, tbd->sweep_hand++);
+    
+    if (tbd_keyvalue_is_garbage(keyvalue) || !tbd_keyvalue_is_expired(tbd, keyvalue))
+    {
+      continue;
+    }
+    
+#if defined(TBD_USE_VERSIONS)
+    // a tombstone stays out of the garbage list until acknowledged
+    if (tbd->flags & TBD_INIT_FLAG_TOMBSTONES)
+    {
+      tbd_bury_keyvalue(tbd, keyvalue);
+      ++expired_count;
+      continue;
+    }
+#endif
+    
+    // as tbd_trash_keyvalue does, except the garbage list is merged once at the end
+#if defined(TBD_USE_FILTER)
+    tbd_filter_remove(tbd, tbd_key_hash(keyvalue->key.str));
+#endif
+    
+#if defined(TBD_USE_HANDLES)
+    tbd_handle_forget(tbd, keyvalue);
+#endif
+    
+#if defined(TBD_USE_LAST_FOUND_CACHE)
+    tbd_last_found_forget(tbd, keyvalue);
+#endif
+    
+    tbd_keyvalue_trash(keyvalue);
+    tbd->is_sorted_by_key = false;
+    ++expired_count;
+    
+#if defined(TBD_USE_GARBAGE_LIST)
+    
+    // older keyvalues are lower in the heap, so the front is usually the insertion point
+    tbd_keyvalue_t* prev = NULL;
+    tbd_keyvalue_t* next = expired;
+    
+    while ( (next) && (next->heap.top < keyvalue->heap.top) )
+    {
+      prev = next;
+      next = next->next_garbage;
+    }
+    
+    keyvalue->next_garbage = next;
+    
+    if (prev)
+    {
+      prev->next_garbage = keyvalue;
+    }
+    else
+    {
+      expired = keyvalue;
+    }
+    
+#endif
+  }
+  
+#if defined(TBD_USE_GARBAGE_LIST)
+  tbd_garbage_list_merge(&tbd->garbage, expired);
+#endif
+  
+#endif//TBD_USE_EXPIRY
+  
+  return expired_count;
+}
+
+
+
+
+
+
+
+/*
+ *
+ * SNAPSHOT FUNCTIONS
+ *
+ */
+
+
+// Snapshot layout, all integers are little endian:
+//
+//   header:  magic "TBDS", u8 version, u8 reserved, u16 reserved, u32 record count
+//   record:  u8 key length, u8 record flags, u32 value size, [u64 expiry time], key, value
+//   trailer: u32 FNV-1a checksum of the header and all records
+//
+// The key length does not include the null terminator, the value size is the stored size.
+// The expiry time is only present when TBD_SNAPSHOT_RECORD_FLAG_EXPIRES is set.
+
+#define TBD_SNAPSHOT_HEADER_SIZE            (12u)
+#define TBD_SNAPSHOT_RECORD_HEAD_SIZE       (6u)
+#define TBD_SNAPSHOT_RECORD_FLAG_EXPIRES    (1u << 0)
+
+
+static const unsigned char tbd_snapshot_magic[4] = {'T', 'B', 'D', 'S'};
+
+
+
+
+/** Stream state used while saving or loading a snapshot.
+ */
+typedef struct tbd_snapshot_stream_struct
+{
+  tbd_write_fn write;         ///< Write callback, NULL when loading.
+  tbd_read_fn read;           ///< Read callback, NULL when saving.
+  void* context;              ///< Passed to the callback.
+  unsigned long checksum;     ///< Running checksum of all bytes streamed so far.
+  bool failed;                ///< Set when the callback transferred fewer bytes than requested.
+  
+} tbd_snapshot_stream_t;
+
+
+
+
+static void tbd_snapshot_write(tbd_snapshot_stream_t* stream, const void* data, TBD_SIZE_T size)
+{
+  TBD_ASSERT(stream);
+  TBD_ASSERT(stream->write);
+  
+  if (stream->failed || !size)
+  {
+    return;
+  }
+  
+  stream->checksum = tbd_checksum(stream->checksum, data, size);
+  
+  if (stream->write(stream->context, data, size) != size)
+  {
+    stream->failed = true;
+  }
+}
+
+
+
+
+static void tbd_snapshot_read(tbd_snapshot_stream_t* stream, void* data, TBD_SIZE_T size)
+{
+  TBD_ASSERT(stream);
+  TBD_ASSERT(stream->read);
+  
+  if (stream->failed || !size)
+  {
+    return;
+  }
+  
+  if (stream->read(stream->context, data, size) != size)
+  {
+    stream->failed = true;
+    return;
+  }
+  
+  stream->checksum = tbd_checksum(stream->checksum, data, size);
+}
+
+
+
+
+static void tbd_snapshot_write_keyvalue(tbd_snapshot_stream_t* stream, const tbd_keyvalue_t* keyvalue)
+{
+  TBD_ASSERT(stream);
+  TBD_ASSERT(keyvalue);
+  
+  const TBD_SIZE_T key_size = tbd_key_size(&keyvalue->key);
+  const TBD_SIZE_T value_size = tbd_value_size(&keyvalue->value);
+  
+  unsigned char head[TBD_SNAPSHOT_RECORD_HEAD_SIZE + 8];
+  TBD_SIZE_T head_size = TBD_SNAPSHOT_RECORD_HEAD_SIZE;
+  
+  head[0] = (unsigned char) key_size;
+  head[1] = 0;
+  tbd_uint_to_bytes(&head[2], value_size, 4);
+  
+#ifdef TBD_USE_EXPIRY
+  if (keyvalue->expires)
+  {
+    head[1] |= TBD_SNAPSHOT_RECORD_FLAG_EXPIRES;
+    tbd_uint_to_bytes(&head[head_size], keyvalue->expires, 8);
+    head_size += 8;
+  }
+#endif
+  
+  tbd_snapshot_write(stream, head, head_size);
+  tbd_snapshot_write(stream, keyvalue->key.str, key_size);
+  tbd_snapshot_write(stream, keyvalue->value.data, value_size);
+}
+
+
+
+
+int tbd_save(tbd_t* tbd, tbd_write_fn write, void* context, TBD_SAVE_ORDER_ENUM order)
+{
+  TBD_ASSERT(tbd);
+  TBD_ASSERT(write);
+  
+  tbd_snapshot_stream_t stream = {write, NULL, context, TBD_FNV_OFFSET_BASIS, false};
+  
+  // garbage and tombstones are not saved
+  TBD_SIZE_T count = 0;
+  
+  TBD_SIZE_T i;
+  for (i = 0; i < tbd->stack.count; ++i)
+  {
+    const tbd_keyvalue_t* keyvalue = tbd_keyvalue_stack_get(&tbd->stack, i);
+    
+    if (!tbd_keyvalue_is_garbage(keyvalue) && !tbd_keyvalue_is_tombstone(keyvalue))
+    {
+      ++count;
+    }
+  }
+  
+  unsigned char header[TBD_SNAPSHOT_HEADER_SIZE] = {0};
+  memcpy(header, tbd_snapshot_magic, sizeof(tbd_snapshot_magic));
+  header[4] = TBD_SNAPSHOT_VERSION;
+  tbd_uint_to_bytes(&header[8], count, 4);
+  
+  tbd_snapshot_write(&stream, header, sizeof(header));
+  
+  // the stack sort returns at once when the stack is already in key order
+  if (TBD_SAVE_ORDER_KEY == order)
+  {
+    tbd_sort_by_key(tbd);
+  }
+  
+  // start from the bottom of the stack, so loading pushes the elements back in the same order
+  for (i = 0; (i < tbd->stack.count) && !stream.failed; ++i)
+  {
+    const tbd_keyvalue_t* keyvalue = tbd_keyvalue_stack_get(&tbd->stack, i);
+    
+    if (!tbd_keyvalue_is_garbage(keyvalue) && !tbd_keyvalue_is_tombstone(keyvalue))
+    {
+      tbd_snapshot_write_keyvalue(&stream, keyvalue);
+    }
+  }
+  
+  unsigned char trailer[4];
+  tbd_uint_to_bytes(trailer, stream.checksum, 4);
+  
+  tbd_snapshot_write(&stream, trailer, sizeof(trailer));
+  
+  return stream.failed ? TBD_ERROR : TBD_NO_ERROR;
+}
+
+
+
+
+/** Read one snapshot record directly into a new keyvalue at the top of the stack.
+ */
+static int tbd_snapshot_read_keyvalue(tbd_t* tbd, tbd_snapshot_stream_t* stream)
+{
+  TBD_ASSERT(tbd);
+  TBD_ASSERT(stream);
+  
+  unsigned char head[TBD_SNAPSHOT_RECORD_HEAD_SIZE];
+  tbd_snapshot_read(stream, head, sizeof(head));
+  
+  if (stream->failed)
+  {
+    return TBD_ERROR_BAD_FORMAT;
+  }
+  
+  const TBD_SIZE_T key_size = head[0];
+  const unsigned record_flags = head[1];
+  const unsigned long long value_size = tbd_uint_from_bytes(&head[2], 4);
+  
+  if (!key_size || (key_size > TBD_MAX_KEY_LENGTH) || !value_size || (value_size > TBD_MAX_SIZE))
+  {
+    return TBD_ERROR_BAD_FORMAT;
+  }
+  
+  TBD_TIME_T expires = 0;
+  
+  if (record_flags & TBD_SNAPSHOT_RECORD_FLAG_EXPIRES)
+  {
+    unsigned char expiry[8];
+    tbd_snapshot_read(stream, expiry, sizeof(expiry));
+    
+    expires = (TBD_TIME_T) tbd_uint_from_bytes(expiry, sizeof(expiry));
+  }
+  
+  const TBD_SIZE_T hunk_size = tbd_keyvalue_hunk_size(tbd, key_size + 1, (TBD_SIZE_T) value_size);
+  
+  // the tbd was emptied before loading, so keyvalues are packed without garbage
+  tbd_keyvalue_t* keyvalue = tbd_push_keyvalue(tbd, hunk_size);
+  
+  if (!keyvalue)
+  {
+    return TBD_ERROR;
+  }
+  
+  tbd_keyvalue_place(tbd, keyvalue, key_size + 1, (TBD_SIZE_T) value_size);
+  
+  tbd_snapshot_read(stream, keyvalue->key.str, key_size);
+  tbd_snapshot_read(stream, keyvalue->value.data, (TBD_SIZE_T) value_size);
+  
+  keyvalue->key.str[key_size] = '\0';
+  
+  tbd_keyvalue_index_key(tbd, keyvalue);
+  
+#ifdef TBD_USE_EXPIRY
+  keyvalue->expires = expires;
+#else
+  (void) expires;
+#endif
+
+#ifdef TBD_USE_VERSIONS
+  // loaded keyvalues are changes to the empty tbd
+  keyvalue->version = ++tbd->version;
+#endif
+  
+  if (stream->failed || (strlen(keyvalue->key.str) != key_size))
+  {
+    return TBD_ERROR_BAD_FORMAT;
+  }
+  
+#ifdef TBD_USE_NULL_TERMINATED_VALUES
+  // the stored value size is found from the terminator, so it must be the last byte
+  if (strlen((const char*) keyvalue->value.data) + 1 != value_size)
+  {
+    return TBD_ERROR_BAD_FORMAT;
+  }
+#endif
+  
+  return TBD_NO_ERROR;
+}
+
+
+
+
+int tbd_load(tbd_t* tbd, tbd_read_fn read, void* context)
+{
+  TBD_ASSERT(tbd);
+  TBD_ASSERT(read);
+  
+  tbd_snapshot_stream_t stream = {NULL, read, context, TBD_FNV_OFFSET_BASIS, false};
+  
+  tbd_empty(tbd);
+  
+  unsigned char header[TBD_SNAPSHOT_HEADER_SIZE];
+  tbd_snapshot_read(&stream, header, sizeof(header));
+  
+  if (stream.failed || memcmp(header, tbd_snapshot_magic, sizeof(tbd_snapshot_magic)) || (header[4] != TBD_SNAPSHOT_VERSION))
+  {
+    return TBD_ERROR_BAD_FORMAT;
+  }
+  
+  unsigned long long count = tbd_uint_from_bytes(&header[8], 4);
+  
+  while (count--)
+  {
+    const int result = tbd_snapshot_read_keyvalue(tbd, &stream);
+    
+    if (result != TBD_NO_ERROR)
+    {
+      tbd_empty(tbd);
+      return result;
+    }
+  }
+  
+  const unsigned long checksum = stream.checksum;
+  
+  unsigned char trailer[4];
+  tbd_snapshot_read(&stream, trailer, sizeof(trailer));
+  
+  if (stream.failed || (tbd_uint_from_bytes(trailer, sizeof(trailer)) != checksum))
+  {
+    tbd_empty(tbd);
+    return TBD_ERROR_BAD_FORMAT;
+  }
+  
+  return TBD_NO_ERROR;
+}
+
+
+
+
+
+
+
+/*
+ *
+ * WRITE-AHEAD LOG FUNCTIONS
+ *
+ */
+
+
+
+
+int tbd_wal_open(tbd_t* tbd, const tbd_wal_init_t* init)
+{
+  TBD_ASSERT(tbd);
+  TBD_ASSERT(init);
+  
+#ifdef TBD_USE_WAL
+  
+  if (!init->write)
+  {
+    return TBD_ERROR;
+  }
+  
+  if (!init->buffer || !init->buffer_size)
+  {
+    return TBD_ERROR_BAD_SIZE;
+  }
+  
+  tbd_wal_t* wal = &tbd->wal;
+  
+  memset(wal, 0, sizeof(*wal));
+  
+  wal->write = init->write;
+  wal->sync = init->sync;
+  wal->context = init->context;
+  wal->buffer = (unsigned char*) init->buffer;
+  wal->buffer_size = init->buffer_size;
+  wal->sync_mode = init->sync_mode;
+  wal->sync_interval = init->sync_interval;
+  wal->sync_time = tbd->now;
+  wal->is_open = true;
+  
+  return TBD_NO_ERROR;
+  
+#else
+  
+  return TBD_ERROR;
+  
+#endif
+}
+
+
+
+
+int tbd_wal_flush(tbd_t* tbd)
+{
+  TBD_ASSERT(tbd);
+  
+#ifdef TBD_USE_WAL
+  
+  tbd_wal_t* wal = &tbd->wal;
+  
+  if (!wal->is_open)
+  {
+    return TBD_ERROR;
+  }
+  
+  if (wal->unsynced_size)
+  {
+    tbd_wal_commit(tbd);
+  }
+  
+  const bool has_error = wal->has_error;
+  
+  wal->has_error = false;
+  
+  return has_error ? TBD_ERROR_WAL : TBD_NO_ERROR;
+  
+#else
+  
+  return TBD_ERROR;
+  
+#endif
+}
+
+
+
+
+int tbd_wal_drain(tbd_t* tbd)
+{
+  TBD_ASSERT(tbd);
+  
+#ifdef TBD_USE_WAL
+  
+  tbd_wal_t* wal = &tbd->wal;
+  
+  if (!wal->is_open)
+  {
+    return TBD_ERROR;
+  }
+  
+  // the records stay unsynced, so the sync mode still decides when they are made durable
+  tbd_wal_write(wal);
+  
+  return wal->has_error ? TBD_ERROR_WAL : TBD_NO_ERROR;
+  
+#else
+  
+  return TBD_ERROR;
+  
+#endif
+}
+
+
+
+
+int tbd_wal_close(tbd_t* tbd)
+{
+  TBD_ASSERT(tbd);
+  
+#ifdef TBD_USE_WAL
+  
+  if (!tbd->wal.is_open)
+  {
+    return TBD_NO_ERROR;
+  }
+  
+  const int result = tbd_wal_flush(tbd);
+  
+  tbd->wal.is_open = false;
+  
+  return result;
+  
+#else
+  
+  return TBD_NO_ERROR;
+  
+#endif
+}
+
+
+
+
+/** Apply one logged change, without logging it again.
+ */
+static int tbd_wal_apply(tbd_t* tbd, unsigned char op, const char* key, const void* value, TBD_SIZE_T value_size)
+{
+  TBD_ASSERT(tbd);
+  TBD_ASSERT(key);
+  
+  switch (op)
+  {
+    case TBD_WAL_OP_PUT:
+    {
+      return value_size ? tbd_put(tbd, key, value, value_size) : TBD_ERROR_BAD_FORMAT;
+    }
+    
+    case TBD_WAL_OP_DELETE:
+    {
+      return tbd_delete(tbd, key);
+    }
+    
+    case TBD_WAL_OP_EXPIRE:
+    {
+      if (value_size != 8)
+      {
+        return TBD_ERROR_BAD_FORMAT;
+      }
+      
+#ifdef TBD_USE_EXPIRY
+      tbd_keyvalue_t* ptr = tbd_find_keyvalue(tbd, key);
+      
+      // the key may have been deleted by a later change that is already in the snapshot
+      if (ptr)
+      {
+        ptr->expires = (TBD_TIME_T) tbd_uint_from_bytes((const unsigned char*) value, value_size);
+      }
+#endif
+      
+      return TBD_NO_ERROR;
+    }
+    
+    default:
+    {
+      return TBD_ERROR_BAD_FORMAT;
+    }
+  }
+}
+
+
+
+
+int tbd_wal_replay(tbd_t* tbd, tbd_read_fn read, void* context, void* buffer, size_t buffer_size)
+{
+  TBD_ASSERT(tbd);
+  TBD_ASSERT(read);
+  TBD_ASSERT(buffer);
+  
+#ifdef TBD_USE_WAL
+  // do not log the changes being replayed
+  const bool is_open = tbd->wal.is_open;
+  tbd->wal.is_open = false;
+#endif
+  
+  int result = TBD_NO_ERROR;
+  int replay_count = 0;
+  
+  char key[TBD_MAX_KEY_LENGTH + 1];
+  
+  while (TBD_NO_ERROR == result)
+  {
+    unsigned char head[TBD_WAL_RECORD_HEAD_SIZE];
+    unsigned char tail[TBD_WAL_RECORD_TAIL_SIZE];
+    
+    // stop at the end of the log, or at a record that was only partly written
+    if (read(context, head, sizeof(head)) != sizeof(head))
+    {
+      break;
+    }
+    
+    const TBD_SIZE_T key_size = head[1];
+    const TBD_SIZE_T value_size = (TBD_SIZE_T) tbd_uint_from_bytes(&head[2], 4);
+    
+    if (!key_size || (key_size > TBD_MAX_KEY_LENGTH) || (value_size > TBD_MAX_SIZE))
+    {
+      break;
+    }
+    
+    if (value_size > buffer_size)
+    {
+      result = TBD_ERROR_BAD_SIZE;
+      break;
+    }
+    
+    if ((read(context, key, key_size) != key_size) ||
+        (read(context, buffer, value_size) != value_size) ||
+        (read(context, tail, sizeof(tail)) != sizeof(tail)))
+    {
+      break;
+    }
+    
+    unsigned long checksum = tbd_checksum(TBD_FNV_OFFSET_BASIS, head, sizeof(head));
+    checksum = tbd_checksum(checksum, key, key_size);
+    checksum = tbd_checksum(checksum, buffer, value_size);
+    
+    if (tbd_uint_from_bytes(tail, sizeof(tail)) != checksum)
+    {
+      break;
+    }
+    
+    key[key_size] = '\0';
+    
+    result = tbd_wal_apply(tbd, head[0], key, buffer, value_size);
+    
+    if (TBD_NO_ERROR == result)
+    {
+      ++replay_count;
+    }
+  }
+  
+#ifdef TBD_USE_WAL
+  tbd->wal.is_open = is_open;
+#endif
+  
+  return (TBD_NO_ERROR == result) ? replay_count : result;
+}
+
+
+
+
+
+int tbd_wal_replay_buffer(tbd_t* tbd, const void* data, size_t size, size_t* used)
+{
+  TBD_ASSERT(tbd);
+  TBD_ASSERT(data || !size);
+  TBD_ASSERT(used);
+  
+#ifdef TBD_USE_WAL
+  // do not log the changes being replayed
+  const bool is_open = tbd->wal.is_open;
+  tbd->wal.is_open = false;
+#endif
+  
+  const unsigned char* bytes = (const unsigned char*) data;
+  
+  int result = TBD_NO_ERROR;
+  int replay_count = 0;
+  
+  char key[TBD_MAX_KEY_LENGTH + 1];
+  
+  *used = 0;
+  
+  while ((TBD_NO_ERROR == result) && (size - *used >= TBD_WAL_RECORD_HEAD_SIZE))
+  {
+    const unsigned char* head = bytes + *used;
+    
+    const TBD_SIZE_T key_size = head[1];
+    const TBD_SIZE_T value_size = (TBD_SIZE_T) tbd_uint_from_bytes(&head[2], 4);
+    
+    if (!key_size || (key_size > TBD_MAX_KEY_LENGTH) || (value_size > TBD_MAX_SIZE))
+    {
+      result = TBD_ERROR_BAD_FORMAT;
+      break;
+    }
+    
+    const TBD_SIZE_T record_size = TBD_WAL_RECORD_HEAD_SIZE + key_size + value_size + TBD_WAL_RECORD_TAIL_SIZE;
+    
+    // stop at a record that has not fully arrived yet
+    if (size - *used < record_size)
+    {
+      break;
+    }
+    
+    const unsigned char* value = head + TBD_WAL_RECORD_HEAD_SIZE + key_size;
+    const unsigned char* tail = value + value_size;
+    
+    if (tbd_uint_from_bytes(tail, TBD_WAL_RECORD_TAIL_SIZE) != tbd_checksum(TBD_FNV_OFFSET_BASIS, head, record_size - TBD_WAL_RECORD_TAIL_SIZE))
+    {
+      result = TBD_ERROR_BAD_FORMAT;
+      break;
+    }
+    
+    memcpy(key, head + TBD_WAL_RECORD_HEAD_SIZE, key_size);
+    key[key_size] = '\0';
+    
+    result = tbd_wal_apply(tbd, head[0], key, value, value_size);
+    
+    if (TBD_NO_ERROR == result)
+    {
+      *used += record_size;
+      ++replay_count;
+    }
+  }
+  
+#ifdef TBD_USE_WAL
+  tbd->wal.is_open = is_open;
+#endif
+  
+  return (TBD_NO_ERROR == result) ? replay_count : result;
+}
+
+
+
+
+
+/*
+ *
+ * VERSION FUNCTIONS
+ *
+ */
+
+
+
+
+TBD_VERSION_T tbd_current_version(const tbd_t* tbd)
+{
+  TBD_ASSERT(tbd);
+  
+#ifdef TBD_USE_VERSIONS
+  return tbd->version;
+#else
+  return 0;
+#endif
+}
+
+
+
+
+int tbd_export_since(const tbd_t* tbd, TBD_VERSION_T version, tbd_export_fn export_fn, void* context)
+{
+  TBD_ASSERT(tbd);
+  TBD_ASSERT(export_fn);
+  
+#ifdef TBD_USE_VERSIONS
+  
+  TBD_SIZE_T i;
+  for (i = 0; i < tbd->stack.count; ++i)
+  {
+    const tbd_keyvalue_t* keyvalue = tbd_keyvalue_stack_get(&tbd->stack, i);
+    
+    if (tbd_keyvalue_is_garbage(keyvalue))
+    {
+      continue;
+    }
+    
+    const bool is_changed = (keyvalue->version > version);
+    
+    int export_result = TBD_NO_ERROR;
+    
+    // a key created again after its delete has no tombstone left, so it is exported as a put only
+    if (tbd_keyvalue_is_tombstone(keyvalue))
+    {
+      if (is_changed)
+      {
+        export_result = export_fn(context, keyvalue->key.str, NULL, 0, keyvalue->version);
+      }
+    }
+    
+#ifdef TBD_USE_EXPIRY
+    // an expiry gets no version until the keyvalue is found or swept, until then it is exported as a delete every time
+    else if (tbd_keyvalue_is_expired(tbd, keyvalue))
+    {
+      if (tbd->flags & TBD_INIT_FLAG_TOMBSTONES)
+      {
+        export_result = export_fn(context, keyvalue->key.str, NULL, 0, keyvalue->version);
+      }
+    }
+#endif
+    
+    else if (is_changed)
+    {
+      export_result = export_fn(context, keyvalue->key.str, keyvalue->value.data, tbd_value_size(&keyvalue->value), keyvalue->version);
+    }
+    
+    if (export_result != TBD_NO_ERROR)
+    {
+      return export_result;
+    }
+  }
+  
+  return TBD_NO_ERROR;
+  
+#else
+  (void) version;
+  (void) context;
+  
+  return TBD_ERROR;
+#endif
+}
+
+
+
+
+int tbd_acknowledge(tbd_t* tbd, TBD_VERSION_T version)
+{
+  TBD_ASSERT(tbd);
+  
+#ifdef TBD_USE_VERSIONS
+  
+  int count = 0;
+  
+  TBD_SIZE_T i;
+  for (i = 0; i < tbd->stack.count; ++i)
+  {
+    tbd_keyvalue_t* keyvalue = tbd_keyvalue_stack_get(&tbd->stack, i);
+    
+    if (!tbd_keyvalue_is_garbage(keyvalue) && tbd_keyvalue_is_tombstone(keyvalue) && (keyvalue->version <= version))
+    {
+      keyvalue->flags.is_tombstone = 0;
+      tbd_trash_keyvalue(tbd, keyvalue);
+      ++count;
+    }
+  }
+  
+  return count;
+  
+#else
+  (void) version;
+  
+  return TBD_ERROR;
+#endif
+}
+
+
+
+
+
+/*
+ *
+ * PUBLISH FUNCTIONS
+ *
+ */
+
+
+
+
+int tbd_publish_init(tbd_publish_t* publish, tbd_t* tbd0, tbd_t* tbd1)
+{
+  TBD_ASSERT(publish);
+  TBD_ASSERT(tbd0);
+  TBD_ASSERT(tbd1);
+  
+#ifdef TBD_USE_PUBLISH
+  
+  if (tbd0 == tbd1)
+  {
+    return TBD_ERROR;
+  }
+  
+  publish->tbd[0] = tbd0;
+  publish->tbd[1] = tbd1;
+  publish->reader_count[0] = 0;
+  publish->reader_count[1] = 0;
+  
+  TBD_ATOMIC_STORE(&publish->active, 0u);
+  
+  return TBD_NO_ERROR;
+  
+#else
+  
+  return TBD_ERROR;
+  
+#endif
+}
+
+
+
+
+const tbd_t* tbd_publish_acquire(tbd_publish_t* publish)
+{
+  TBD_ASSERT(publish);
+  
+#ifdef TBD_USE_PUBLISH
+  
+  do
+  {
+    const unsigned active = TBD_ATOMIC_LOAD(&publish->active);
+    
+    TBD_ATOMIC_ADD(&publish->reader_count[active], 1u);
+    
+    // the writer may have swapped in between, then the pin might not have been seen in time
+    if (TBD_ATOMIC_LOAD(&publish->active) == active)
+    {
+      return publish->tbd[active];
+    }
+    
+    TBD_ATOMIC_SUB(&publish->reader_count[active], 1u);
+    
+  } while (1);
+  
+#else
+  
+  return NULL;
+  
+#endif
+}
+
+
+
+
+void tbd_publish_release(tbd_publish_t* publish, const tbd_t* tbd)
+{
+  TBD_ASSERT(publish);
+  TBD_ASSERT(tbd);
+  
+#ifdef TBD_USE_PUBLISH
+  
+  const unsigned index = (tbd == publish->tbd[1]) ? 1u : 0u;
+  
+  TBD_ASSERT(TBD_ATOMIC_LOAD(&publish->reader_count[index]));
+  
+  TBD_ATOMIC_SUB(&publish->reader_count[index], 1u);
+  
+#endif
+}
+
+
+
+
+tbd_t* tbd_publish_begin(tbd_publish_t* publish)
+{
+  TBD_ASSERT(publish);
+  
+#ifdef TBD_USE_PUBLISH
+  
+  const unsigned inactive = 1u - TBD_ATOMIC_LOAD(&publish->active);
+  
+  // readers that pinned the region before the last swap may still be using it
+  if (TBD_ATOMIC_LOAD(&publish->reader_count[inactive]))
+  {
+    return NULL;
+  }
+  
+  return publish->tbd[inactive];
+  
+#else
+  
+  return NULL;
+  
+#endif
+}
+
+
+
+
+int tbd_publish_commit(tbd_publish_t* publish)
+{
+  TBD_ASSERT(publish);
+  
+#ifdef TBD_USE_PUBLISH
+  
+  const unsigned active = TBD_ATOMIC_LOAD(&publish->active);
+  
+  TBD_ATOMIC_STORE(&publish->active, 1u - active);
+  
+  return TBD_NO_ERROR;
+  
+#else
+  
+  return TBD_ERROR;
+  
+#endif
+}
+
+
+
+
+/*
+ *
+ * HANDLE FUNCTIONS
+ *
+ */
+
+
+
+
+#if defined(TBD_USE_HANDLES)
+
+/** Find the keyvalue of a handle, removing it if it expired.
+ */
+static tbd_keyvalue_t* tbd_handle_find(tbd_t* tbd, tbd_handle_t handle)
+{
+  TBD_ASSERT(tbd);
+  
+  tbd_keyvalue_t* keyvalue = tbd_handle_resolve(tbd, handle);
+  
+  if (!keyvalue)
+  {
+    return NULL;
+  }
+  
+#ifdef TBD_USE_EXPIRY
+  if (tbd_keyvalue_is_expired(tbd, keyvalue))
+  {
+    tbd_bury_keyvalue(tbd, keyvalue);
+    return NULL;
+  }
+#endif
+  
+  return keyvalue;
+}
+
+#endif
+
+
+
+
+tbd_handle_t tbd_handle_get(tbd_t* tbd, const char* key)
+{
+  TBD_ASSERT(tbd);
+  TBD_ASSERT(key);
+  
+#if defined(TBD_USE_HANDLES)
+  
+  tbd_keyvalue_t* keyvalue = tbd_find_keyvalue(tbd, key);
+  
+  if (!keyvalue)
+  {
+    return 0;
+  }
+  
+  if (keyvalue->handle)
+  {
+    return tbd_handle_make(tbd, keyvalue->handle - 1);
+  }
+  
+  TBD_SIZE_T slot;
+  for (slot = 0; slot < TBD_HANDLE_TABLE_SIZE; ++slot)
+  {
+    if (!tbd->handles[slot])
+    {
+      tbd->handles[slot] = keyvalue;
+      keyvalue->handle = (unsigned char) (slot + 1);
+      
+      return tbd_handle_make(tbd, slot);
+    }
+  }
+  
+  return 0;
+  
+#else
+  (void) key;
+  
+  return 0;
+#endif
+}
+
+
+
+
+const void* tbd_handle_value(tbd_t* tbd, tbd_handle_t handle)
+{
+  TBD_ASSERT(tbd);
+  
+#if defined(TBD_USE_HANDLES)
+  
+  tbd_keyvalue_t* keyvalue = tbd_handle_find(tbd, handle);
+  
+  if (!keyvalue)
+  {
+    return NULL;
+  }
+  
+#ifdef TBD_USE_EVICTION
+  keyvalue->flags.is_referenced = 1;
+#endif
+  
+  return keyvalue->value.data;
+  
+#else
+  (void) handle;
+  
+  return NULL;
+#endif
+}
+
+
+
+
+size_t tbd_handle_value_size(tbd_t* tbd, tbd_handle_t handle)
+{
+  TBD_ASSERT(tbd);
+  
+#if defined(TBD_USE_HANDLES)
+  
+  const tbd_keyvalue_t* keyvalue = tbd_handle_find(tbd, handle);
+  
+  if (!keyvalue)
+  {
+    return 0;
+  }
+  
+  return tbd_value_size(&keyvalue->value);
+  
+#else
+  (void) handle;
+  
+  return 0;
+#endif
+}
+
+
+
+
+void tbd_handle_release(tbd_t* tbd, tbd_handle_t handle)
+{
+  TBD_ASSERT(tbd);
+  
+#if defined(TBD_USE_HANDLES)
+  
+  tbd_keyvalue_t* keyvalue = tbd_handle_resolve(tbd, handle);
+  
+  if (keyvalue)
+  {
+    tbd_handle_forget(tbd, keyvalue);
+  }
+  
+#else
+  (void) handle;
+#endif
+}
+
+
+
+
+
+/* 
+ * 
+ * Statistics and other general info.
+ *
+ */
+
+
+void tbd_stats_get(tbd_stats_t* stats, const tbd_t* tbd)
+{
+  TBD_ASSERT(tbd);
+  TBD_ASSERT(stats);
+  
+  stats->tbd_address = tbd;
+  stats->tbd_size = tbd_size(tbd);
+  stats->tbd_size_used = tbd_size_used(tbd);
+  stats->tbd_head_size = tbd_head_size(tbd);
+  
+  stats->tbd_keyvalue_size = sizeof (tbd_keyvalue_t);
+  
+  stats->stack_top = tbd_keyvalue_stack_top(&tbd->stack);
+  stats->stack_btm = tbd->stack.start;
+  stats->stack_count = tbd->stack.count;
+  stats->stack_size = tbd->stack.count * sizeof(tbd_keyvalue_t);
+  
+  stats->heap_top = tbd->heap.top;
+  stats->heap_size = tbd->heap.size;
+
+  stats->garbage_size = tbd_garbage_size(tbd);
+  stats->garbage_count = tbd_garbage_count(tbd);
+  stats->garbage_moved_size = tbd->moved_size;
+
+#if defined(TBD_USE_FILTER)
+  stats->filter_size = tbd->filter_size;
+  stats->filter_reject_count = tbd->filter_reject_count;
+#else
+  stats->filter_size = 0;
+  stats->filter_reject_count = 0;
+#endif
+
+#if defined(TBD_USE_GARBAGE_LIST)
+  stats->garbage_front = tbd->garbage.front;
+  stats->garbage_back = tbd->garbage.back; 
+#endif
+
+#if defined(TBD_USE_EVICTION)
+  stats->evict_count = tbd->evict_count;
+#else
+  stats->evict_count = 0;
+#endif
+
+#if defined(TBD_USE_OP_COUNTERS)
+  stats->create_count = tbd->op_count[TBD_OP_CREATE];
+  stats->read_count = tbd->op_count[TBD_OP_READ];
+  stats->update_count = tbd->op_count[TBD_OP_UPDATE];
+  stats->put_count = tbd->op_count[TBD_OP_PUT];
+  stats->delete_count = tbd->op_count[TBD_OP_DELETE];
+  stats->cas_count = tbd->op_count[TBD_OP_CAS];
+  stats->incr_count = tbd->op_count[TBD_OP_INCR];
+  stats->append_count = tbd->op_count[TBD_OP_APPEND];
+  stats->read_hit_count = tbd->read_hit_count;
+  stats->read_miss_count = tbd->read_miss_count;
+  stats->alloc_fail_count = tbd->alloc_fail_count;
+  stats->find_count = tbd->find_count;
+  stats->find_scan_count = tbd->find_scan_count;
+#else
+  stats->create_count = 0;
+  stats->read_count = 0;
+  stats->update_count = 0;
+  stats->put_count = 0;
+  stats->delete_count = 0;
+  stats->cas_count = 0;
+  stats->incr_count = 0;
+  stats->append_count = 0;
+  stats->read_hit_count = 0;
+  stats->read_miss_count = 0;
+  stats->alloc_fail_count = 0;
+  stats->find_count = 0;
+  stats->find_scan_count = 0;
+#endif
+
+#if defined(TBD_USE_WAL)
+  stats->wal_size = tbd->wal.log_size;
+  stats->wal_sync_count = tbd->wal.sync_count;
+#else
+  stats->wal_size = 0;
+  stats->wal_sync_count = 0;
+#endif
+
+#if defined(TBD_USE_LAST_FOUND_CACHE)
+  stats->lookup_cache_hit_count = tbd->lookup_cache_hit_count;
+  stats->lookup_cache_miss_count = tbd->lookup_cache_miss_count;
+#else
+  stats->lookup_cache_hit_count = 0;
+  stats->lookup_cache_miss_count = 0;
+#endif
+
+#if defined(TBD_USE_LATENCY_HISTOGRAMS)
+  unsigned op;
+  for (op = 0; op < TBD_OP_COUNT; ++op)
+  {
+    unsigned bucket;
+    for (bucket = 0; bucket < TBD_LATENCY_BUCKET_COUNT; ++bucket)
+    {
+      stats->latency_histogram[op][bucket] = tbd->latency_histogram[op][bucket];
+    }
+    
+    stats->latency_sum[op] = tbd->latency_sum[op];
+  }
+#else
+  memset(stats->latency_histogram, 0, sizeof(stats->latency_histogram));
+  memset(stats->latency_sum, 0, sizeof(stats->latency_sum));
+#endif
+}
+
+
+
+
+/** Names of the operations, indexed by TBD_OP_ENUM.
+ */
+static const char* const tbd_op_names[TBD_OP_COUNT] = {"create", "read", "update", "put", "delete", "cas", "incr", "append"};
+
+
+
+
+int tbd_stats_print(const tbd_stats_t* stats)
+{
+  TBD_ASSERT(stats);
+  
+  int total_printed = 0;
+  
+  
+#ifdef TBD_INCLUDE_STDIO
+  
+  total_printed += puts("{");
+  total_printed += printf("\ttbd_address:\t%p,\n", stats->tbd_address);
+  total_printed += printf("\ttbd_size:\t0x%0X,\n", (unsigned) stats->tbd_size);
+  total_printed += printf("\ttbd_size_used:\t0x%0X,\n", (unsigned) stats->tbd_size_used);
+  total_printed += printf("\ttbd_head_size:\t0x%0X,\n", (unsigned) stats->tbd_head_size);
+  
+  total_printed += printf("\ttbd_keyvalue_size:\t0x%0X,\n", (unsigned) stats->tbd_keyvalue_size); 
+  
+  total_printed += printf("\tstack_top:\t%p,\n", stats->stack_top);
+  total_printed += printf("\tstack_btm:\t%p,\n", stats->stack_btm);
+  
+  total_printed += printf("\tstack_count:\t0x%0X,\n", (unsigned) stats->stack_count);
+  total_printed += printf("\tstack_size:\t0x%0X,\n", (unsigned) stats->stack_size);
+  
+  total_printed += printf("\theap_top:\t%p,\n", stats->heap_top);  
+  total_printed += printf("\theap_size:\t0x%0X,\n", (unsigned) stats->heap_size);  
+
+  total_printed += printf("\tgarbage_front:\t%p,\n", stats->garbage_front);  
+  total_printed += printf("\tgarbage_back:\t%p,\n", stats->garbage_back);   
+  total_printed += printf("\tgarbage_size:\t0x%0X,\n", (unsigned) stats->garbage_size);  
+  total_printed += printf("\tgarbage_count:\t0x%0X,\n", (unsigned) stats->garbage_count);  
+  total_printed += printf("\tgarbage_moved_size:\t0x%0X,\n", (unsigned) stats->garbage_moved_size);
+
+  total_printed += printf("\tcreate_count:\t0x%0X,\n", (unsigned) stats->create_count);
+  total_printed += printf("\tread_count:\t0x%0X,\n", (unsigned) stats->read_count);
+  total_printed += printf("\tupdate_count:\t0x%0X,\n", (unsigned) stats->update_count);
+  total_printed += printf("\tput_count:\t0x%0X,\n", (unsigned) stats->put_count);
+  total_printed += printf("\tdelete_count:\t0x%0X,\n", (unsigned) stats->delete_count);
+  total_printed += printf("\tcas_count:\t0x%0X,\n", (unsigned) stats->cas_count);
+  total_printed += printf("\tincr_count:\t0x%0X,\n", (unsigned) stats->incr_count);
+  total_printed += printf("\tappend_count:\t0x%0X,\n", (unsigned) stats->append_count);
+  total_printed += printf("\tread_hit_count:\t0x%0X,\n", (unsigned) stats->read_hit_count);
+  total_printed += printf("\tread_miss_count:\t0x%0X,\n", (unsigned) stats->read_miss_count);
+  total_printed += printf("\talloc_fail_count:\t0x%0X,\n", (unsigned) stats->alloc_fail_count);
+  total_printed += printf("\tevict_count:\t0x%0X,\n", (unsigned) stats->evict_count);
+  total_printed += printf("\tfind_count:\t0x%0X,\n", (unsigned) stats->find_count);
+  total_printed += printf("\tfind_scan_count:\t0x%0X,\n", (unsigned) stats->find_scan_count);
+  total_printed += printf("\tfilter_size:\t0x%0X,\n", (unsigned) stats->filter_size);
+  total_printed += printf("\tfilter_reject_count:\t0x%0X,\n", (unsigned) stats->filter_reject_count);
+  total_printed += printf("\tlookup_cache_hit_count:\t0x%0X,\n", (unsigned) stats->lookup_cache_hit_count);
+  total_printed += printf("\tlookup_cache_miss_count:\t0x%0X,\n", (unsigned) stats->lookup_cache_miss_count);
+  total_printed += printf("\twal_size:\t0x%0X,\n", (unsigned) stats->wal_size);
+  total_printed += printf("\twal_sync_count:\t0x%0X,\n", (unsigned) stats->wal_sync_count);
+  
+  unsigned op;
+  for (op = 0; op < TBD_OP_COUNT; ++op)
+  {
+    total_printed += printf("\tlatency_histogram_%s:\t[", tbd_op_names[op]);
+    
+    unsigned bucket;
+    for (bucket = 0; bucket < TBD_LATENCY_BUCKET_COUNT; ++bucket)
+    {
+      total_printed += printf(bucket ? ", 0x%0X" : "0x%0X", (unsigned) stats->latency_histogram[op][bucket]);
+    }
+    
+    total_printed += printf("],\n");
+  }
+
+  
+  total_printed += puts("}");
+
+#endif/*TBD_INCLUDE_STDIO*/  
+  
+  return total_printed;
+}
+
+
+
+
+int tbd_print_stats(const tbd_t* tbd)
+{
+  TBD_ASSERT(tbd);
+  
+  tbd_stats_t stats;
+  
+  tbd_stats_get(&stats, tbd);
+  
+  return tbd_stats_print(&stats);
+}
+
+
+
+
+/** Count the bytes of a cell that fall inside a range.
+ */
+static size_t tbd_heap_map_overlap(const unsigned char* cell_begin, const unsigned char* cell_end, const unsigned char* begin, const unsigned char* end)
+{
+  TBD_ASSERT(cell_begin);
+  TBD_ASSERT(cell_end);
+  
+  begin = (begin > cell_begin) ? begin : cell_begin;
+  end = (end < cell_end) ? end : cell_end;
+  
+  return (end > begin) ? (size_t) (end - begin) : 0;
+}
+
+
+
+
+size_t tbd_heap_map(char* map, size_t map_size, const tbd_t* tbd)
+{
+  TBD_ASSERT(map || !map_size);
+  TBD_ASSERT(tbd);
+  
+  if (!map_size)
+  {
+    return 0;
+  }
+  
+  const size_t cell_count = map_size - 1;
+  
+  const unsigned char* start = (const unsigned char*) tbd;
+  const unsigned char* stack_end = (const unsigned char*) (tbd->stack.start + tbd->stack.count);
+  const unsigned char* heap_top = tbd->heap.top;
+  const unsigned char* heap_end = tbd_heap_end(&tbd->heap);
+  
+  size_t cell;
+  for (cell = 0; cell < cell_count; ++cell)
+  {
+    const unsigned char* cell_begin = start + (cell * tbd->size) / cell_count;
+    const unsigned char* cell_end = start + ((cell + 1) * tbd->size) / cell_count;
+    
+    size_t garbage_size = 0;
+    
+    TBD_SIZE_T i;
+    for (i = 0; i < tbd->stack.count; ++i)
+    {
+      const tbd_keyvalue_t* keyvalue = tbd_keyvalue_stack_get(&tbd->stack, i);
+      
+      if (tbd_keyvalue_is_garbage(keyvalue))
+      {
+        garbage_size += tbd_heap_map_overlap(cell_begin, cell_end, keyvalue->heap.top, tbd_heap_end(&keyvalue->heap));
+      }
+    }
+    
+    const size_t stack_size = tbd_heap_map_overlap(cell_begin, cell_end, start, stack_end);
+    const size_t free_size = tbd_heap_map_overlap(cell_begin, cell_end, stack_end, heap_top);
+    const size_t used_size = tbd_heap_map_overlap(cell_begin, cell_end, heap_top, heap_end) - garbage_size;
+    
+    char c = '=';
+    size_t most = stack_size;
+    
+    if (free_size > most)
+    {
+      c = '_';
+      most = free_size;
+    }
+    
+    if (used_size > most)
+    {
+      c = '#';
+      most = used_size;
+    }
+    
+    if (garbage_size > most)
+    {
+      c = '.';
+    }
+    
+    map[cell] = c;
+  }
+  
+  map[cell_count] = '\0';
+  
+  return cell_count;
+}
+
+
+
+
+/*
+ *
+ * JSON FUNCTIONS
+ *
+ */
+
+
+/** Two hex digits for every byte value.
+ */
+#define TBD_HEX_ROW(_hi_) \
+  _hi_"0" _hi_"1" _hi_"2" _hi_"3" _hi_"4" _hi_"5" _hi_"6" _hi_"7" \
+  _hi_"8" _hi_"9" _hi_"A" _hi_"B" _hi_"C" _hi_"D" _hi_"E" _hi_"F"
+
+static const char tbd_hex_table[512] = 
+  TBD_HEX_ROW("0")
+  TBD_HEX_ROW("1")
+  TBD_HEX_ROW("2")
+  TBD_HEX_ROW("3")
+  TBD_HEX_ROW("4")
+  TBD_HEX_ROW("5")
+  TBD_HEX_ROW("6")
+  TBD_HEX_ROW("7")
+  TBD_HEX_ROW("8")
+  TBD_HEX_ROW("9")
+  TBD_HEX_ROW("A")
+  TBD_HEX_ROW("B")
+  TBD_HEX_ROW("C")
+  TBD_HEX_ROW("D")
+  TBD_HEX_ROW("E")
+  TBD_HEX_ROW("F");
+
+
+
+
+/** Size of the chunks handed to a JSON write callback.
+ */
+#define TBD_JSON_WRITER_CHUNK_SIZE    (256u)
+
+
+
+
+/** Collects JSON output into chunks for a write callback.
+ */
+typedef struct tbd_json_writer_struct
+{
+  tbd_write_fn write;        ///< Write callback.
+  void* context;             ///< Passed to the callback.
+  TBD_SIZE_T used;           ///< Number of bytes in chunk.
+  bool failed;               ///< Set when the callback wrote fewer bytes than requested.
+  char chunk[TBD_JSON_WRITER_CHUNK_SIZE];
+  
+} tbd_json_writer_t;
+
+
+
+
+/** Start an empty chunk for a write callback.
+ */
+static void tbd_json_writer_init(tbd_json_writer_t* writer, tbd_write_fn write, void* context)
+{
+  TBD_ASSERT(writer);
+  TBD_ASSERT(write);
+  
+  writer->write = write;
+  writer->context = context;
+  writer->used = 0;
+  writer->failed = false;
+}
+
+
+
+
+static void tbd_json_writer_flush(tbd_json_writer_t* writer)
+{
+  TBD_ASSERT(writer);
+  
+  if (writer->used && !writer->failed && (writer->write(writer->context, writer->chunk, writer->used) != writer->used))
+  {
+    writer->failed = true;
+  }
+  
+  writer->used = 0;
+}
+
+
+
+
+static void tbd_json_writer_put(tbd_json_writer_t* writer, const void* data, TBD_SIZE_T size)
+{
+  TBD_ASSERT(writer);
+  
+  const char* bytes = (const char*) data;
+  
+  while (size)
+  {
+    if (writer->used == sizeof(writer->chunk))
+    {
+      tbd_json_writer_flush(writer);
+    }
+    
+    TBD_SIZE_T copy_size = sizeof(writer->chunk) - writer->used;
+    
+    if (copy_size > size)
+    {
+      copy_size = size;
+    }
+    
+    memcpy(writer->chunk + writer->used, bytes, copy_size);
+    
+    writer->used += copy_size;
+    bytes += copy_size;
+    size -= copy_size;
+  }
+}
+
+
+
+
+static void tbd_json_writer_put_char(tbd_json_writer_t* writer, char c)
+{
+  tbd_json_writer_put(writer, &c, 1);
+}
+
+
+
+
+static void tbd_json_writer_put_str(tbd_json_writer_t* writer, const char* str)
+{
+  TBD_ASSERT(str);
+  
+  tbd_json_writer_put(writer, str, strlen(str));
+}
+
+
+
+
+/** Write an unsigned number in decimal, without going through printf.
+ */
+static void tbd_json_writer_put_size(tbd_json_writer_t* writer, unsigned long long n)
+{
+  char digits[24];
+  TBD_SIZE_T count = 0;
+  
+  do
+  {
+    digits[sizeof(digits) - ++count] = (char) ('0' + n % 10);
+    n /= 10;
+  }
+  while (n);
+  
+  tbd_json_writer_put(writer, digits + sizeof(digits) - count, count);
+}
+
+
+
+
+/** Write bytes as hex digits, 2 per byte, straight into the chunk.
+ */
+static void tbd_json_writer_put_hex(tbd_json_writer_t* writer, const unsigned char* data, TBD_SIZE_T size)
+{
+  TBD_ASSERT(writer);
+  
+  while (size)
+  {
+    if (sizeof(writer->chunk) - writer->used < 2)
+    {
+      tbd_json_writer_flush(writer);
+    }
+    
+    TBD_SIZE_T count = (sizeof(writer->chunk) - writer->used) / 2;
+    
+    if (count > size)
+    {
+      count = size;
+    }
+    
+    char* out = writer->chunk + writer->used;
+    
+    writer->used += 2 * count;
+    size -= count;
+    
+    while (count--)
+    {
+      memcpy(out, &tbd_hex_table[2 * *data++], 2);
+      out += 2;
+    }
+  }
+}
+
+
+
+
+static void tbd_json_writer_put_key(tbd_json_writer_t* writer, const tbd_key_t* key, TBD_KEY_TO_JSON_FORMAT_ENUM format)
+{
+  TBD_ASSERT(writer);
+  TBD_ASSERT(key);
+  
+  switch (format)
+  {
+    case TBD_KEY_TO_JSON_FORMAT_STRING:
+    {
+      tbd_json_writer_put_char(writer, '"');
+      tbd_json_writer_put(writer, key->str, tbd_key_size(key));
+      tbd_json_writer_put_char(writer, '"');
+    } break;
+    
+    case TBD_KEY_TO_JSON_FORMAT_RAW:
+    default:
+    {
+      tbd_json_writer_put(writer, key->str, tbd_key_size(key));
+    } break;
+  }
+}
+
+
+
+
+static void tbd_json_writer_put_value(tbd_json_writer_t* writer, const tbd_value_t* value, TBD_VALUE_TO_JSON_FORMAT_ENUM format)
+{
+  TBD_ASSERT(writer);
+  TBD_ASSERT(value);
+  
+  const TBD_SIZE_T value_size = tbd_value_size(value);
+  
+  switch (format)
+  {
+    case TBD_VALUE_TO_JSON_FORMAT_RAW:
+    {
+      tbd_json_writer_put(writer, value->data, value_size);
+    } break;
+    
+    case TBD_VALUE_TO_JSON_FORMAT_HEX:
+    default:
+    {
+      tbd_json_writer_put_char(writer, '\'');
+      tbd_json_writer_put_hex(writer, value->data, value_size);
+      tbd_json_writer_put_char(writer, '\'');
+    } break;
+  }
+}
+
+
+
+
+static void tbd_json_writer_put_keyvalue(tbd_json_writer_t* writer, const tbd_keyvalue_t* keyvalue, TBD_KEY_TO_JSON_FORMAT_ENUM key_format, TBD_VALUE_TO_JSON_FORMAT_ENUM value_format)
+{
+  TBD_ASSERT(writer);
+  TBD_ASSERT(keyvalue);
+  
+  tbd_json_writer_put_key(writer, &keyvalue->key, key_format);
+  tbd_json_writer_put_char(writer, ':');
+  tbd_json_writer_put_value(writer, &keyvalue->value, value_format);
+}
+
+
+
+
+/** Write callback state for writing JSON into a caller buffer.
+ */
+typedef struct tbd_json_buffer_struct
+{
+  char* json;            ///< The caller buffer.
+  size_t json_size;      ///< Size of the caller buffer.
+  size_t total_size;     ///< Number of bytes that would have been written, given a large enough buffer.
+  
+} tbd_json_buffer_t;
+
+
+
+
+/** Write callback that copies into a buffer, leaving room for a null terminator.
+ *  Bytes that do not fit are counted, but not copied.
+ */
+static size_t tbd_json_buffer_write(void* context, const void* data, size_t size)
+{
+  tbd_json_buffer_t* buffer = (tbd_json_buffer_t*) context;
+  
+  if (buffer->total_size + 1 < buffer->json_size)
+  {
+    size_t copy_size = buffer->json_size - buffer->total_size - 1;
+    
+    if (copy_size > size)
+    {
+      copy_size = size;
+    }
+    
+    memcpy(buffer->json + buffer->total_size, data, copy_size);
+  }
+  
+  buffer->total_size += size;
+  
+  return size;
+}
+
+
+
+
+/** Null terminate the buffer and return the number of bytes needed without the terminator.
+ */
+static size_t tbd_json_buffer_finish(tbd_json_buffer_t* buffer)
+{
+  if (buffer->json_size)
+  {
+    const size_t end = (buffer->total_size < buffer->json_size) ? buffer->total_size : buffer->json_size - 1;
+    buffer->json[end] = '\0';
+  }
+  
+  return buffer->total_size;
+}
+
+
+
+
+/** Write a heap as an offset from the start of the tbd and a size, so the output does not depend on where the tbd is mapped.
+ */
+static void tbd_json_writer_put_heap(tbd_json_writer_t* writer, const tbd_t* tbd, const tbd_heap_t* heap)
+{
+  TBD_ASSERT(heap);
+  
+  tbd_json_writer_put_str(writer, "{\"offset\":");
+  tbd_json_writer_put_size(writer, (unsigned long long) (tbd_heap_begin(heap) - (const unsigned char*) tbd));
+  tbd_json_writer_put_str(writer, ",\"size\":");
+  tbd_json_writer_put_size(writer, tbd_heap_size(heap));
+  tbd_json_writer_put_char(writer, '}');
+}
+
+
+
+
+size_t tbd_keyvalue_to_json(char* json, size_t json_size, const tbd_t* tbd, const char* key, TBD_KEY_TO_JSON_FORMAT_ENUM key_format, TBD_VALUE_TO_JSON_FORMAT_ENUM value_format)
+{
+  TBD_ASSERT(json || !json_size);
+  TBD_ASSERT(tbd);
+  TBD_ASSERT(key);
+  
+  // find the element
+  const tbd_keyvalue_t* ptr = tbd_find_const_keyvalue(tbd, key);
+  if (!ptr)
+  {
+    return 0;
+  }  
+  
+  tbd_json_buffer_t buffer = {json, json_size, 0};
+  tbd_json_writer_t writer;
+  tbd_json_writer_init(&writer, tbd_json_buffer_write, &buffer);
+  
+  tbd_json_writer_put_keyvalue(&writer, ptr, key_format, value_format);
+  
+  tbd_json_writer_flush(&writer);
+  
+  return tbd_json_buffer_finish(&buffer);
+}
+
+
+
+
+size_t tbd_keys_to_json(char* json, size_t json_size, const tbd_t* tbd, TBD_KEY_TO_JSON_FORMAT_ENUM key_format)
+{
+  TBD_ASSERT(json || !json_size);
+  TBD_ASSERT(tbd);
+  
+  tbd_json_buffer_t buffer = {json, json_size, 0};
+  tbd_json_writer_t writer;
+  tbd_json_writer_init(&writer, tbd_json_buffer_write, &buffer);
+  
+  tbd_json_writer_put_char(&writer, '[');
+  
+  bool is_first = true;
+  
+  TBD_SIZE_T i;
+  for (i = 0; i < tbd->stack.count; ++i)
+  {
+    const tbd_keyvalue_t* keyvalue = tbd_keyvalue_stack_get(&tbd->stack, i);
+    
+    if (!tbd_keyvalue_is_visible(tbd, keyvalue))
+    {
+      continue;
+    }
+    
+    if (!is_first)
+    {
+      tbd_json_writer_put_char(&writer, ',');
+    }
+    
+    tbd_json_writer_put_key(&writer, &keyvalue->key, key_format);
+    is_first = false;
+  }
+  
+  tbd_json_writer_put_char(&writer, ']');
+  
+  tbd_json_writer_flush(&writer);
+  
+  return tbd_json_buffer_finish(&buffer);
+}
+
+
+
+
+size_t tbd_garbage_list_to_json(char* json, size_t json_size, const tbd_t* tbd)
+{
+  TBD_ASSERT(json || !json_size);
+  TBD_ASSERT(tbd);
+  
+  tbd_json_buffer_t buffer = {json, json_size, 0};
+  tbd_json_writer_t writer;
+  tbd_json_writer_init(&writer, tbd_json_buffer_write, &buffer);
+  
+  tbd_json_writer_put_char(&writer, '[');
+  
+  tbd_garbage_list_const_iterator_t iter = tbd_garbage_list_const_begin(tbd);
+  
+  while (iter.ptr)
+  {
+    tbd_json_writer_put_heap(&writer, tbd, &iter.ptr->heap);
+    
+    tbd_garbage_list_const_iterator_next(&iter);
+    
+    if (iter.ptr)
+    {
+      tbd_json_writer_put_char(&writer, ',');
+    }
+  }
+  
+  tbd_json_writer_put_char(&writer, ']');
+  
+  tbd_json_writer_flush(&writer);
+  
+  return tbd_json_buffer_finish(&buffer);
+}
+
+
+
+
+/** Describes one scalar field of tbd_stats_t for the stats formatters.
+ */
+typedef struct tbd_stats_field_struct
+{
+  size_t offset;             ///< Offset of the TBD_SIZE_T field in tbd_stats_t.
+  const char* json_name;     ///< Key in tbd_stats_to_json.
+  const char* prom_name;     ///< Metric name in tbd_stats_to_prometheus.
+  bool is_counter;           ///< Counter if set, otherwise gauge.
+  const char* help;          ///< Prometheus help text.
+  
+} tbd_stats_field_t;
+
+
+#define TBD_STATS_FIELD(field, prom_name, is_counter, help)   {offsetof(tbd_stats_t, field), #field, prom_name, is_counter, help}
+
+static const tbd_stats_field_t tbd_stats_fields[] =
+{
+  TBD_STATS_FIELD(tbd_size,                "tbd_size_bytes",                   false, "Size of the tbd memory region."),
+  TBD_STATS_FIELD(tbd_size_used,           "tbd_used_bytes",                   false, "Bytes used by header, stack and heap."),
+  TBD_STATS_FIELD(tbd_head_size,           "tbd_head_bytes",                   false, "Size of the tbd header."),
+  TBD_STATS_FIELD(tbd_keyvalue_size,       "tbd_keyvalue_bytes",               false, "Size of one stack element."),
+  TBD_STATS_FIELD(stack_count,             "tbd_stack_keyvalues",              false, "Number of elements in the stack."),
+  TBD_STATS_FIELD(stack_size,              "tbd_stack_bytes",                  false, "Size of the stack."),
+  TBD_STATS_FIELD(heap_size,               "tbd_heap_bytes",                   false, "Size of the heap."),
+  TBD_STATS_FIELD(garbage_size,            "tbd_garbage_bytes",                false, "Stack and heap bytes held by garbage."),
+  TBD_STATS_FIELD(garbage_count,           "tbd_garbage_keyvalues",            false, "Number of garbage elements."),
+  TBD_STATS_FIELD(garbage_moved_size,      "tbd_garbage_moved_bytes_total",    true,  "Heap bytes moved by fold and pack."),
+  TBD_STATS_FIELD(read_hit_count,          "tbd_read_hits_total",              true,  "Reads that found their key."),
+  TBD_STATS_FIELD(read_miss_count,         "tbd_read_misses_total",            true,  "Reads that did not find their key."),
+  TBD_STATS_FIELD(alloc_fail_count,        "tbd_alloc_failures_total",         true,  "Allocations that failed because the tbd was full."),
+  TBD_STATS_FIELD(evict_count,             "tbd_evictions_total",              true,  "Keyvalues evicted to make room."),
+  TBD_STATS_FIELD(find_count,              "tbd_finds_total",                  true,  "Key lookups that searched the stack."),
+  TBD_STATS_FIELD(find_scan_count,         "tbd_find_scanned_keyvalues_total", true,  "Keyvalues compared by stack searches."),
+  TBD_STATS_FIELD(filter_size,             "tbd_filter_bytes",                 false, "Size of the negative lookup filter."),
+  TBD_STATS_FIELD(filter_reject_count,     "tbd_filter_rejects_total",         true,  "Key lookups rejected by the filter."),
+  TBD_STATS_FIELD(lookup_cache_hit_count,  "tbd_lookup_cache_hits_total",      true,  "Key lookups answered by the last found cache."),
+  TBD_STATS_FIELD(lookup_cache_miss_count, "tbd_lookup_cache_misses_total",    true,  "Key lookups missed by the last found cache."),
+  TBD_STATS_FIELD(wal_size,                "tbd_wal_bytes_total",              true,  "Bytes logged to the write-ahead log."),
+  TBD_STATS_FIELD(wal_sync_count,          "tbd_wal_syncs_total",              true,  "Write-ahead log syncs."),
+};
+
+#undef TBD_STATS_FIELD
+
+
+#define TBD_STATS_FIELD_COUNT   (sizeof(tbd_stats_fields) / sizeof(tbd_stats_fields[0]))
+
+
+
+
+static TBD_SIZE_T tbd_stats_field_get(const tbd_stats_t* stats, const tbd_stats_field_t* field)
+{
+  return *(const TBD_SIZE_T*) ((const char*) stats + field->offset);
+}
+
+
+
+
+static TBD_SIZE_T tbd_stats_op_count(const tbd_stats_t* stats, unsigned op)
+{
+  switch (op)
+  {
+    case TBD_OP_CREATE: return stats->create_count;
+    case TBD_OP_READ:   return stats->read_count;
+    case TBD_OP_UPDATE: return stats->update_count;
+    case TBD_OP_PUT:    return stats->put_count;
+    case TBD_OP_DELETE: return stats->delete_count;
+    case TBD_OP_CAS:    return stats->cas_count;
+    case TBD_OP_INCR:   return stats->incr_count;
+    default:            return stats->append_count;
+  }
+}
+
+
+
+
+static TBD_SIZE_T tbd_stats_histogram_count(const tbd_stats_t* stats, unsigned op)
+{
+  TBD_SIZE_T count = 0;
+  
+  unsigned bucket;
+  for (bucket = 0; bucket < TBD_LATENCY_BUCKET_COUNT; ++bucket)
+  {
+    count += stats->latency_histogram[op][bucket];
+  }
+  
+  return count;
+}
+
+
+
+
+size_t tbd_stats_to_json(char* json, size_t json_size, const tbd_stats_t* stats)
+{
+  TBD_ASSERT(json || !json_size);
+  TBD_ASSERT(stats);
+  
+  tbd_json_buffer_t buffer = {json, json_size, 0};
+  tbd_json_writer_t writer;
+  tbd_json_writer_init(&writer, tbd_json_buffer_write, &buffer);
+  
+  tbd_json_writer_put_char(&writer, '{');
+  
+  unsigned i;
+  for (i = 0; i < TBD_STATS_FIELD_COUNT; ++i)
+  {
+    tbd_json_writer_put_char(&writer, '"');
+    tbd_json_writer_put_str(&writer, tbd_stats_fields[i].json_name);
+    tbd_json_writer_put_str(&writer, "\":");
+    tbd_json_writer_put_size(&writer, tbd_stats_field_get(stats, &tbd_stats_fields[i]));
+    tbd_json_writer_put_char(&writer, ',');
+  }
+  
+  unsigned op;
+  for (op = 0; op < TBD_OP_COUNT; ++op)
+  {
+    tbd_json_writer_put_char(&writer, '"');
+    tbd_json_writer_put_str(&writer, tbd_op_names[op]);
+    tbd_json_writer_put_str(&writer, "_count\":");
+    tbd_json_writer_put_size(&writer, tbd_stats_op_count(stats, op));
+    tbd_json_writer_put_char(&writer, ',');
+  }
+  
+  tbd_json_writer_put_str(&writer, "\"latency_histogram\":{");
+  
+  for (op = 0; op < TBD_OP_COUNT; ++op)
+  {
+    if (op)
+    {
+      tbd_json_writer_put_char(&writer, ',');
+    }
+    
+    tbd_json_writer_put_char(&writer, '"');
+    tbd_json_writer_put_str(&writer, tbd_op_names[op]);
+    tbd_json_writer_put_str(&writer, "\":{\"sum\":");
+    tbd_json_writer_put_size(&writer, stats->latency_sum[op]);
+    tbd_json_writer_put_str(&writer, ",\"buckets\":[");
+    
+    unsigned bucket;
+    for (bucket = 0; bucket < TBD_LATENCY_BUCKET_COUNT; ++bucket)
+    {
+      if (bucket)
+      {
+        tbd_json_writer_put_char(&writer, ',');
+      }
+      
+      tbd_json_writer_put_size(&writer, stats->latency_histogram[op][bucket]);
+    }
+    
+    tbd_json_writer_put_str(&writer, "]}");
+  }
+  
+  tbd_json_writer_put_str(&writer, "}}");
+  
+  tbd_json_writer_flush(&writer);
+  
+  return tbd_json_buffer_finish(&buffer);
+}
+
+
+
+
+static void tbd_prometheus_put_header(tbd_json_writer_t* writer, const char* name, const char* type, const char* help)
+{
+  tbd_json_writer_put_str(writer, "# HELP ");
+  tbd_json_writer_put_str(writer, name);
+  tbd_json_writer_put_char(writer, ' ');
+  tbd_json_writer_put_str(writer, help);
+  tbd_json_writer_put_str(writer, "\n# TYPE ");
+  tbd_json_writer_put_str(writer, name);
+  tbd_json_writer_put_char(writer, ' ');
+  tbd_json_writer_put_str(writer, type);
+  tbd_json_writer_put_char(writer, '\n');
+}
+
+
+
+
+size_t tbd_stats_to_prometheus(char* text, size_t text_size, const tbd_stats_t* stats)
+{
+  TBD_ASSERT(text || !text_size);
+  TBD_ASSERT(stats);
+  
+  tbd_json_buffer_t buffer = {text, text_size, 0};
+  tbd_json_writer_t writer;
+  tbd_json_writer_init(&writer, tbd_json_buffer_write, &buffer);
+  
+  unsigned i;
+  for (i = 0; i < TBD_STATS_FIELD_COUNT; ++i)
+  {
+    const tbd_stats_field_t* field = &tbd_stats_fields[i];
+    
+    tbd_prometheus_put_header(&writer, field->prom_name, field->is_counter ? "counter" : "gauge", field->help);
+    tbd_json_writer_put_str(&writer, field->prom_name);
+    tbd_json_writer_put_char(&writer, ' ');
+    tbd_json_writer_put_size(&writer, tbd_stats_field_get(stats, field));
+    tbd_json_writer_put_char(&writer, '\n');
+  }
+  
+  tbd_prometheus_put_header(&writer, "tbd_ops_total", "counter", "Calls to each operation.");
+  
+  unsigned op;
+  for (op = 0; op < TBD_OP_COUNT; ++op)
+  {
+    tbd_json_writer_put_str(&writer, "tbd_ops_total{op=\"");
+    tbd_json_writer_put_str(&writer, tbd_op_names[op]);
+    tbd_json_writer_put_str(&writer, "\"} ");
+    tbd_json_writer_put_size(&writer, tbd_stats_op_count(stats, op));
+    tbd_json_writer_put_char(&writer, '\n');
+  }
+  
+  bool is_header_written = false;
+  
+  for (op = 0; op < TBD_OP_COUNT; ++op)
+  {
+    const TBD_SIZE_T count = tbd_stats_histogram_count(stats, op);
+    
+    // histograms stay empty without a clock, skip them
+    if (!count)
+    {
+      continue;
+    }
+    
+    if (!is_header_written)
+    {
+      tbd_prometheus_put_header(&writer, "tbd_op_latency", "histogram", "Operation latency in clock units.");
+      is_header_written = true;
+    }
+    
+    // bucket i counts latencies below 2^(i+1), buckets are cumulative
+    TBD_SIZE_T cumulative = 0;
+    
+    unsigned bucket;
+    for (bucket = 0; bucket < TBD_LATENCY_BUCKET_COUNT; ++bucket)
+    {
+      cumulative += stats->latency_histogram[op][bucket];
+      
+      tbd_json_writer_put_str(&writer, "tbd_op_latency_bucket{op=\"");
+      tbd_json_writer_put_str(&writer, tbd_op_names[op]);
+      tbd_json_writer_put_str(&writer, "\",le=\"");
+      
+      if (bucket + 1 < TBD_LATENCY_BUCKET_COUNT)
+      {
+        tbd_json_writer_put_size(&writer, (2ull << bucket) - 1);
+      }
+      else
+      {
+        tbd_json_writer_put_str(&writer, "+Inf");
+      }
+      
+      tbd_json_writer_put_str(&writer, "\"} ");
+      tbd_json_writer_put_size(&writer, cumulative);
+      tbd_json_writer_put_char(&writer, '\n');
+    }
+    
+    tbd_json_writer_put_str(&writer, "tbd_op_latency_sum{op=\"");
+    tbd_json_writer_put_str(&writer, tbd_op_names[op]);
+    tbd_json_writer_put_str(&writer, "\"} ");
+    tbd_json_writer_put_size(&writer, stats->latency_sum[op]);
+    tbd_json_writer_put_str(&writer, "\ntbd_op_latency_count{op=\"");
+    tbd_json_writer_put_str(&writer, tbd_op_names[op]);
+    tbd_json_writer_put_str(&writer, "\"} ");
+    tbd_json_writer_put_size(&writer, count);
+    tbd_json_writer_put_char(&writer, '\n');
+  }
+  
+  tbd_json_writer_flush(&writer);
+  
+  return tbd_json_buffer_finish(&buffer);
+}
+
+
+
+
+int tbd_write_json(const tbd_t* tbd, tbd_write_fn write, void* context, TBD_KEY_TO_JSON_FORMAT_ENUM key_format, TBD_VALUE_TO_JSON_FORMAT_ENUM value_format)
+{
+  TBD_ASSERT(tbd);
+  TBD_ASSERT(write);
   
-  tbd_keyvalue_t* keyvalue_ptr = tbd->stack.start;
+  tbd_json_writer_t writer;
+  tbd_json_writer_init(&writer, write, context);
   
-  size_t printed = 0;
-
-  const tbd_keyvalue_t* keyvalue_end = tbd_keyvalue_stack_top(&tbd->stack);
+  tbd_json_writer_put_char(&writer, '{');
+  
+  bool is_first = true;
   
-  if (keyvalue_ptr != keyvalue_end)
+  // walk the stack directly, there is no need to look up keys that are already at hand
+  TBD_SIZE_T i;
+  for (i = 0; (i < tbd->stack.count) && !writer.failed; ++i)
   {
-    // go to first item
-    while (keyvalue_ptr != keyvalue_end)
+    const tbd_keyvalue_t* keyvalue = tbd_keyvalue_stack_get(&tbd->stack, i);
+    
+    if (!tbd_keyvalue_is_visible(tbd, keyvalue))
     {
-      if (!tbd_keyvalue_is_garbage(keyvalue_ptr))
-      {
-        break;
-      }
-      
-      ++keyvalue_ptr;
+      continue;
+    }
+    
+    if (!is_first)
+    {
+      tbd_json_writer_put_char(&writer, ',');
     }
+    
+    tbd_json_writer_put_keyvalue(&writer, keyvalue, key_format, value_format);
+    is_first = false;
+  }
+  
+  tbd_json_writer_put_char(&writer, '}');
+  tbd_json_writer_flush(&writer);
+  
+  return writer.failed ? TBD_ERROR : TBD_NO_ERROR;
+}
+
+
+
+
+size_t tbd_to_json(char* json, size_t json_size, const tbd_t* tbd, TBD_KEY_TO_JSON_FORMAT_ENUM key_format, TBD_VALUE_TO_JSON_FORMAT_ENUM value_format)
+{
+  TBD_ASSERT(json || !json_size);
+  TBD_ASSERT(tbd);
+  
+  tbd_json_buffer_t buffer = {json, json_size, 0};
+  
+  tbd_write_json(tbd, tbd_json_buffer_write, &buffer, key_format, value_format);
+  
+  return tbd_json_buffer_finish(&buffer);
+}
+
+
+
+
+/* Parser states */
+enum
+{
+  TBD_JSON_STATE_BEGIN,           ///< Before the first key, or an opening brace.
+  TBD_JSON_STATE_BEFORE_KEY,      ///< After a comma.
+  TBD_JSON_STATE_KEY,             ///< In a bare key.
+  TBD_JSON_STATE_QUOTED_KEY,      ///< In a double quoted key.
+  TBD_JSON_STATE_AFTER_KEY,       ///< Waiting for the colon.
+  TBD_JSON_STATE_BEFORE_VALUE,    ///< After the colon.
+  TBD_JSON_STATE_HEX_VALUE,       ///< In a single quoted hex value.
+  TBD_JSON_STATE_STRING_VALUE,    ///< In a double quoted string value.
+  TBD_JSON_STATE_ESCAPE,          ///< After a backslash in a string value.
+  TBD_JSON_STATE_UNICODE,         ///< In the 4 hex digits of a \u escape.
+  TBD_JSON_STATE_AFTER_VALUE,     ///< Waiting for a comma, a closing brace or the end.
+  TBD_JSON_STATE_END,             ///< After the closing brace.
+};
+
+
+
+
+static bool tbd_json_is_space(char c)
+{
+  return (c == ' ') || (c == '\t') || (c == '\n') || (c == '\r');
+}
+
+
+
+
+/** Returns the value of a hex digit, or -1 if c is not a hex digit.
+ */
+static int tbd_json_hex_digit(char c)
+{
+  if ((c >= '0') && (c <= '9'))
+  {
+    return c - '0';
+  }
+  
+  if ((c >= 'A') && (c <= 'F'))
+  {
+    return c - 'A' + 10;
+  }
+  
+  if ((c >= 'a') && (c <= 'f'))
+  {
+    return c - 'a' + 10;
+  }
+  
+  return -1;
+}
+
+
+
+
+/** Add a decoded byte to the value buffer.
+ */
+static void tbd_json_parser_push(tbd_json_parser_t* parser, unsigned char byte)
+{
+  TBD_ASSERT(parser);
+  
+  if (parser->value_size >= parser->buffer_size)
+  {
+    parser->error = TBD_ERROR_BAD_SIZE;
+    return;
+  }
+  
+  parser->buffer[parser->value_size++] = byte;
+}
+
+
+
+
+/** Add a decoded \\u escape to the value buffer, as UTF-8.
+ */
+static void tbd_json_parser_push_code(tbd_json_parser_t* parser, unsigned code)
+{
+  TBD_ASSERT(parser);
+  
+  if (code < 0x80)
+  {
+    tbd_json_parser_push(parser, (unsigned char) code);
+  }
+  else if (code < 0x800)
+  {
+    tbd_json_parser_push(parser, (unsigned char) (0xC0 | (code >> 6)));
+    tbd_json_parser_push(parser, (unsigned char) (0x80 | (code & 0x3F)));
+  }
+  else
+  {
+    tbd_json_parser_push(parser, (unsigned char) (0xE0 | (code >> 12)));
+    tbd_json_parser_push(parser, (unsigned char) (0x80 | ((code >> 6) & 0x3F)));
+    tbd_json_parser_push(parser, (unsigned char) (0x80 | (code & 0x3F)));
+  }
+}
+
+
+
+
+/** Store the parsed key:value pair.
+ */
+static void tbd_json_parser_insert(tbd_json_parser_t* parser)
+{
+  TBD_ASSERT(parser);
+  
+#ifdef TBD_USE_NULL_TERMINATED_VALUES
+  
+  // tbd_to_json includes the null terminator in hex values, add it if missing
+  if (!parser->value_size || parser->buffer[parser->value_size - 1])
+  {
+    tbd_json_parser_push(parser, 0);
+  }
+  
+  // a null char inside the value would cut it short
+  if (!parser->error && (memchr(parser->buffer, 0, parser->value_size) != parser->buffer + parser->value_size - 1))
+  {
+    parser->error = TBD_ERROR_BAD_FORMAT;
+  }
+  
+#else
+  
+  if (!parser->value_size)
+  {
+    parser->error = TBD_ERROR_BAD_SIZE;
+  }
+  
+#endif
+  
+  if (parser->error)
+  {
+    return;
+  }
+  
+  parser->key[parser->key_size] = '\0';
+  
+  // a parser without a tbd only checks the json
+  if (parser->tbd)
+  {
+    parser->error = tbd_put(parser->tbd, parser->key, parser->buffer, parser->value_size);
+  }
+  
+  if (!parser->error)
+  {
+    ++parser->count;
+  }
+}
+
+
+
+
+void tbd_json_parser_init(tbd_json_parser_t* parser, tbd_t* tbd, void* buffer, size_t buffer_size)
+{
+  TBD_ASSERT(parser);
+  TBD_ASSERT(tbd);
+  TBD_ASSERT(buffer);
+  
+  memset(parser, 0, sizeof(*parser));
+  
+  parser->tbd = tbd;
+  parser->buffer = (unsigned char*) buffer;
+  parser->buffer_size = buffer_size;
+  parser->state = TBD_JSON_STATE_BEGIN;
+}
+
+
+
+
+int tbd_json_parser_feed(tbd_json_parser_t* parser, const char* json, size_t json_size)
+{
+  TBD_ASSERT(parser);
+  TBD_ASSERT(json || !json_size);
+  
+  const char* end = json + json_size;
   
-    if (keyvalue_ptr != keyvalue_end)
+  while ((json != end) && !parser->error)
+  {
+    const char c = *json++;
+    
+    switch (parser->state)
     {
-      // print the first item
-      printed = tbd_keyvalue_to_json(json, json_size, tbd, keyvalue_ptr->key.str, key_format, value_format);
+      case TBD_JSON_STATE_BEGIN:
+      case TBD_JSON_STATE_BEFORE_KEY:
+      {
+        if (tbd_json_is_space(c))
+        {
+          break;
+        }
+        
+        if ((c == '{') && (parser->state == TBD_JSON_STATE_BEGIN) && !parser->has_brace)
+        {
+          parser->has_brace = 1;
+          break;
+        }
+        
+        if ((c == '}') && (parser->state == TBD_JSON_STATE_BEGIN) && parser->has_brace)
+        {
+          parser->state = TBD_JSON_STATE_END;
+          break;
+        }
+        
+        parser->key_size = 0;
+        
+        if (c == '"')
+        {
+          parser->state = TBD_JSON_STATE_QUOTED_KEY;
+          break;
+        }
+        
+        if ((c == ':') || (c == ',') || (c == '{') || (c == '}') || (c == '\'') || (c == '\\'))
+        {
+          parser->error = TBD_ERROR_BAD_FORMAT;
+          break;
+        }
+        
+        parser->key[parser->key_size++] = c;
+        parser->state = TBD_JSON_STATE_KEY;
+      } break;
       
-      json += printed;
-      json_size -= printed;
+      case TBD_JSON_STATE_KEY:
+      case TBD_JSON_STATE_QUOTED_KEY:
+      {
+        const bool is_quoted = (parser->state == TBD_JSON_STATE_QUOTED_KEY);
+        
+        if (is_quoted ? (c == '"') : ((c == ':') || tbd_json_is_space(c)))
+        {
+          if (!parser->key_size)
+          {
+            parser->error = TBD_ERROR_BAD_FORMAT;
+            break;
+          }
+          
+          parser->state = (c == ':') ? TBD_JSON_STATE_BEFORE_VALUE : TBD_JSON_STATE_AFTER_KEY;
+          break;
+        }
+        
+        if ((c == '\\') || (c == '\0') || (!is_quoted && ((c == ',') || (c == '{') || (c == '}') || (c == '"') || (c == '\''))))
+        {
+          parser->error = TBD_ERROR_BAD_FORMAT;
+          break;
+        }
+        
+        if (parser->key_size >= TBD_MAX_KEY_LENGTH)
+        {
+          parser->error = TBD_ERROR_BAD_SIZE;
+          break;
+        }
+        
+        parser->key[parser->key_size++] = c;
+      } break;
       
-      ++keyvalue_ptr;
+      case TBD_JSON_STATE_AFTER_KEY:
+      {
+        if (c == ':')
+        {
+          parser->state = TBD_JSON_STATE_BEFORE_VALUE;
+        }
+        else if (!tbd_json_is_space(c))
+        {
+          parser->error = TBD_ERROR_BAD_FORMAT;
+        }
+      } break;
       
-      // print the rest
-      while (keyvalue_ptr != keyvalue_end)
+      case TBD_JSON_STATE_BEFORE_VALUE:
       {
-        printed = snprintf(json, json_size, ",");
-
-        json += printed;
-        json_size -= printed;
+        parser->value_size = 0;
+        parser->digit_count = 0;
         
-        printed = tbd_keyvalue_to_json(json, json_size, tbd, keyvalue_ptr->key.str, key_format, value_format);
+        if (c == '\'')
+        {
+          parser->state = TBD_JSON_STATE_HEX_VALUE;
+        }
+        else if (c == '"')
+        {
+          parser->state = TBD_JSON_STATE_STRING_VALUE;
+        }
+        else if (!tbd_json_is_space(c))
+        {
+          parser->error = TBD_ERROR_BAD_FORMAT;
+        }
+      } break;
       
-        json += printed;
-        json_size -= printed;
+      case TBD_JSON_STATE_HEX_VALUE:
+      {
+        // decode as many digits as possible before going back to the state machine
+        const char* digit = json - 1;
+        
+        while (digit != end)
+        {
+          const int nibble = tbd_json_hex_digit(*digit);
+          
+          if (nibble < 0)
+          {
+            break;
+          }
+          
+          parser->code = (parser->code << 4) | (unsigned) nibble;
+          
+          if (++parser->digit_count == 2)
+          {
+            tbd_json_parser_push(parser, (unsigned char) parser->code);
+            parser->code = 0;
+            parser->digit_count = 0;
+          }
+          
+          ++digit;
+        }
+        
+        json = digit;
+        
+        if (json == end)
+        {
+          break;
+        }
+        
+        ++json;
+        
+        if ((*digit != '\'') || parser->digit_count)
+        {
+          parser->error = TBD_ERROR_BAD_FORMAT;
+          break;
+        }
+        
+        tbd_json_parser_insert(parser);
+        parser->state = TBD_JSON_STATE_AFTER_VALUE;
+      } break;
       
-        ++keyvalue_ptr;
-      }
+      case TBD_JSON_STATE_STRING_VALUE:
+      {
+        if (c == '"')
+        {
+          tbd_json_parser_insert(parser);
+          parser->state = TBD_JSON_STATE_AFTER_VALUE;
+        }
+        else if (c == '\\')
+        {
+          parser->state = TBD_JSON_STATE_ESCAPE;
+        }
+        else
+        {
+          tbd_json_parser_push(parser, (unsigned char) c);
+        }
+      } break;
+      
+      case TBD_JSON_STATE_ESCAPE:
+      {
+        parser->state = TBD_JSON_STATE_STRING_VALUE;
+        
+        switch (c)
+        {
+          case '"':
+          case '\\':
+          case '/':  tbd_json_parser_push(parser, (unsigned char) c); break;
+          case 'b':  tbd_json_parser_push(parser, '\b'); break;
+          case 'f':  tbd_json_parser_push(parser, '\f'); break;
+          case 'n':  tbd_json_parser_push(parser, '\n'); break;
+          case 'r':  tbd_json_parser_push(parser, '\r'); break;
+          case 't':  tbd_json_parser_push(parser, '\t'); break;
+          
+          case 'u':
+          {
+            parser->code = 0;
+            parser->digit_count = 0;
+            parser->state = TBD_JSON_STATE_UNICODE;
+          } break;
+          
+          default:
+          {
+            parser->error = TBD_ERROR_BAD_FORMAT;
+          }
+        }
+      } break;
+      
+      case TBD_JSON_STATE_UNICODE:
+      {
+        const int nibble = tbd_json_hex_digit(c);
+        
+        if (nibble < 0)
+        {
+          parser->error = TBD_ERROR_BAD_FORMAT;
+          break;
+        }
+        
+        parser->code = (parser->code << 4) | (unsigned) nibble;
+        
+        if (++parser->digit_count == 4)
+        {
+          tbd_json_parser_push_code(parser, parser->code);
+          parser->code = 0;
+          parser->digit_count = 0;
+          parser->state = TBD_JSON_STATE_STRING_VALUE;
+        }
+      } break;
+      
+      case TBD_JSON_STATE_AFTER_VALUE:
+      {
+        if (c == ',')
+        {
+          parser->state = TBD_JSON_STATE_BEFORE_KEY;
+        }
+        else if ((c == '}') && parser->has_brace)
+        {
+          parser->state = TBD_JSON_STATE_END;
+        }
+        else if (!tbd_json_is_space(c))
+        {
+          parser->error = TBD_ERROR_BAD_FORMAT;
+        }
+      } break;
+      
+      case TBD_JSON_STATE_END:
+      default:
+      {
+        if (!tbd_json_is_space(c))
+        {
+          parser->error = TBD_ERROR_BAD_FORMAT;
+        }
+      } break;
     }
   }
+  
+  return parser->error;
+}
+
+
+
+
+int tbd_json_parser_finish(tbd_json_parser_t* parser)
+{
+  TBD_ASSERT(parser);
+  
+  if (parser->error)
+  {
+    return parser->error;
+  }
+  
+  // input may only end between pairs, and must close an opening brace
+  const bool is_complete = parser->has_brace ? 
+    (parser->state == TBD_JSON_STATE_END) : 
+    ((parser->state == TBD_JSON_STATE_BEGIN) || (parser->state == TBD_JSON_STATE_AFTER_VALUE));
+  
+  if (!is_complete)
+  {
+    parser->error = TBD_ERROR_BAD_FORMAT;
+    return parser->error;
+  }
+  
+  return parser->count;
+}
+
+
+
 
-#endif//TBD_INCLUDE_STDIO
+int tbd_from_json(tbd_t* tbd, const char* json)
+{
+  TBD_ASSERT(tbd);
+  TBD_ASSERT(json);
   
-  return total_printed;
+  unsigned char value_buffer[TBD_JSON_VALUE_BUFFER_SIZE];
+  
+  const size_t json_size = strlen(json);
+  
+  // parse everything once before emptying, so bad json leaves the tbd as it was
+  tbd_json_parser_t parser;
+  tbd_json_parser_init(&parser, tbd, value_buffer, sizeof(value_buffer));
+  parser.tbd = NULL;
+  
+  tbd_json_parser_feed(&parser, json, json_size);
+  
+  int result = tbd_json_parser_finish(&parser);
+  
+  if (result < 0)
+  {
+    return result;
+  }
+  
+  tbd_json_parser_init(&parser, tbd, value_buffer, sizeof(value_buffer));
+  
+  tbd_empty(tbd);
+  
+  tbd_json_parser_feed(&parser, json, json_size);
+  
+  result = tbd_json_parser_finish(&parser);
+  
+  return (result < 0) ? result : TBD_NO_ERROR;
 }
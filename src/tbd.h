@@ -49,6 +49,8 @@
 /** Maximum number of characters for a tbd key.  Includes null terminator.
  */
 #define TBD_SIZE_T            size_t
+#define TBD_TIME_T            unsigned long
+#define TBD_VERSION_T         unsigned long long
 #define TBD_MAX_SIZE          (0x8000u)
 #define TBD_MAX_KEY_LENGTH    (8u)
 
@@ -75,6 +77,11 @@ typedef struct tbd_const_iterator_struct tbd_const_iterator_t;
 #define TBD_ERROR_KEY_NOT_FOUND (-2)
 #define TBD_ERROR_KEY_EXISTS    (-3)
 #define TBD_ERROR_BAD_SIZE      (-4)
+#define TBD_ERROR_VALUE_MISMATCH (-5)
+#define TBD_ERROR_OVERFLOW      (-6)
+#define TBD_ERROR_NOT_A_NUMBER  (-7)
+#define TBD_ERROR_BAD_FORMAT    (-8)
+#define TBD_ERROR_WAL           (-9)
 
 
 
@@ -83,6 +90,15 @@ typedef struct tbd_const_iterator_struct tbd_const_iterator_t;
 
 
 
+/* Initialization flags
+ * Combine with bitwise or in tbd_init_t flags.
+ */
+#define TBD_INIT_FLAG_EVICT     (1u << 0)   ///< Evict keyvalues by CLOCK (second chance) instead of failing when full.
+#define TBD_INIT_FLAG_TOMBSTONES (1u << 1)  ///< Keep deleted, expired and evicted keyvalues as tombstones until acknowledged with tbd_acknowledge.
+
+
+
+
 /** Structure for initializing tbd.
  */
 typedef struct tbd_init_struct
@@ -90,6 +106,8 @@ typedef struct tbd_init_struct
   void* start;       ///< Start of the tbd.
   TBD_SIZE_T size;       ///< Size in bytes of the tbd. 
   TBD_SIZE_T hunk_size;  ///< The minimum size allocated from tbd heap. 
+  unsigned flags;        ///< Combination of TBD_INIT_FLAG_* values, 0 for none.
+  TBD_SIZE_T filter_size;  ///< Bytes taken from the tbd for the filter that rejects absent keys, 0 for none.  About 10 bytes per key gives 2% false positives.
   
 } tbd_init_t;
 
@@ -114,6 +132,7 @@ int tbd_is_error(int value);
 
 
 /** Clear a tdb, all data including stack and heap locations will be lost.
+ *  An open write-ahead log stays open, the clear itself is not logged.
  */
 void tbd_clear(tbd_t* tbd);
 
@@ -150,22 +169,48 @@ size_t tbd_size_used(const tbd_t* tbd);
 size_t tbd_count(const tbd_t* tbd);
 
 
-/** Return maximum number of keyvalues of a given size that can be stored.
+/** Return number of keyvalues of a given size that can still be created without evicting or collecting garbage.
+ *  keyvalue_size is the key length plus its null terminator plus the value size.
+ *  Counts the free gap between stack and heap, and the garbage of the same hunk size that a new keyvalue reuses.
  */
 TBD_SIZE_T tbd_max_count(const tbd_t* tbd, TBD_SIZE_T keyvalue_size);
 
 
+/** Reserve room for count keyvalues of a given size, so that creating them cannot fail for lack of space.
+ *  keyvalue_size is as for tbd_max_count.  Room is reserved as garbage of the right hunk size,
+ *  so garbage collection and eviction give the reservation back.
+ *
+ *  Returns TBD_ERROR_BAD_SIZE if count keyvalues do not fit, nothing is reserved.
+ *  Returns TBD_NO_ERROR if successful.
+ */
+int tbd_reserve(tbd_t* tbd, TBD_SIZE_T count, TBD_SIZE_T keyvalue_size);
+
+
 /** Return the maximum key length.
  */
 TBD_SIZE_T tbd_max_key_length(const tbd_t* tbd);
 
 
-/** Copy data from one tbd to another.
+/** Copy the keyvalues of one tbd into another, replacing its contents.
+ *  The copy is compact, it has no garbage and its keyvalues are in key order.
+ *  Garbage, tombstones and expired keyvalues are left out.
+ *
+ *  Returns TBD_ERROR_BAD_SIZE if the keyvalues do not fit, dest is left empty.
  *  Returns TBD_NO_ERROR if successful.
  */
 int tbd_copy(tbd_t* dest, const tbd_t* src);
 
 
+/** Copy one tbd into another byte for byte, replacing its contents.
+ *  Faster than tbd_copy, but garbage is copied as well.
+ *  The tbds must have the same size and hunk size.  The write-ahead log of src is not copied.
+ *
+ *  Returns TBD_ERROR_BAD_SIZE if the tbds are not the same size.
+ *  Returns TBD_NO_ERROR if successful.
+ */
+int tbd_copy_raw(tbd_t* dest, const tbd_t* src);
+
+
 /** Sort the tbd keyvalues in key order.
  */
 int tbd_sort_by_key(tbd_t* tbd);
@@ -188,6 +233,9 @@ int tbd_sort_by_heap(tbd_t* tbd);
 
 
 /** Copy an element into to the data store.
+ *  If the tbd was initialized with TBD_INIT_FLAG_EVICT and is full, key:value pairs are deleted to make room.
+ *  They are chosen by CLOCK: a sweep gives each key:value pair found since the last sweep a second chance,
+ *  and deletes the first one that was not found.
  * 
  *  Returns TBD_ERROR_KEY_EXISTS if a key:value pair already exists in the data store.
  *  Returns TBD_NO_ERROR if successful, 
@@ -202,6 +250,25 @@ int tbd_create(tbd_t* tbd, const char* key, const void* value, size_t value_size
 int tbd_read(tbd_t* tbd, const char* key, void* value, size_t value_size);
 
 
+/** Get many elements from the data store, as if tbd_read was called for each key in turn.
+ *  Keys are found a batch at a time, sharing one search of the stack, and the values of a batch are prefetched before they are copied.
+ *  Each key counts and traces as one read, with its events nested as for tbd_read, once the batch has been searched.
+ *  The latency histogram charges each read of a batch an equal share of the batch's time.
+ *  results[i] gets what tbd_read would return for keys[i], values[i] and value_sizes[i].
+ *  Returns the first result that is not TBD_NO_ERROR, or TBD_NO_ERROR if all keys were read.
+ */
+int tbd_read_multi(tbd_t* tbd, size_t count, const char* const* keys, void* const* values, const size_t* value_sizes, int* results);
+
+
+/** Get an element from the data store without writing to the tbd.
+ *  Skips the lookup cache and statistics, so many threads can read at once.
+ *  Returns TBD_ERROR_KEY_NOT_FOUND if key does not exist.
+ *  Returns TBD_ERROR_BAD_SIZE if value_size does not match.
+ *  Returns TBD_NO_ERROR if successful.
+ */
+int tbd_read_const(const tbd_t* tbd, const char* key, void* value, size_t value_size);
+
+
 /** Update an existing element in the data store.
  *  
  *  Returns TBD_ERROR_BAD_SIZE if value_size does not match size of element in data store.
@@ -210,6 +277,16 @@ int tbd_read(tbd_t* tbd, const char* key, void* value, size_t value_size);
 int tbd_update(tbd_t* tbd, const char* key, const void* value, size_t value_size);
 
 
+/** Create an element, or update it if it already exists.
+ *  Only looks up the key once.  The element is updated in place if the new value fits, 
+ *  otherwise it is moved and its old location becomes garbage.
+ *
+ *  Returns TBD_ERROR if there is no room for the element.
+ *  Returns TBD_NO_ERROR if successful.
+ */
+int tbd_put(tbd_t* tbd, const char* key, const void* value, size_t value_size);
+
+
 /** Delete an existing element in the data store.
  *
  *  Returns TBD_NO_ERROR if key does not exist.
@@ -236,6 +313,58 @@ size_t tbd_read_size(tbd_t* tbd, const char* key);
 
 
 
+/* 
+ * Read-modify-write operations
+ *
+ * Each operation finds the element once and modifies it in place.
+ */
+
+
+/** Policy for tbd_incr when the result does not fit in the value.
+ */
+typedef enum TBD_INCR_OVERFLOW
+{
+  TBD_INCR_OVERFLOW_ERROR,     ///< Return TBD_ERROR_OVERFLOW and leave the value unchanged.
+  TBD_INCR_OVERFLOW_SATURATE,  ///< Clamp to the largest or smallest value that fits.
+  TBD_INCR_OVERFLOW_WRAP,      ///< Wrap around within the range that fits.
+  
+} TBD_INCR_OVERFLOW_ENUM;
+
+
+/** Replace an element's value only if it currently equals the expected value.
+ *
+ *  Returns TBD_ERROR_KEY_NOT_FOUND if key does not exist.
+ *  Returns TBD_ERROR_BAD_SIZE if value_size does not match size of element in data store.
+ *  Returns TBD_ERROR_VALUE_MISMATCH if the element does not equal the expected value.
+ *  Returns TBD_NO_ERROR if successful.
+ */
+int tbd_cas(tbd_t* tbd, const char* key, const void* expected, const void* desired, size_t value_size);
+
+
+/** Add delta to an element stored as decimal text, such as "0042" or "-7".
+ *  The text keeps its width, so the range of the element is set by the width it was created with.
+ *  If result is not NULL, it is set to the new value.
+ *
+ *  Returns TBD_ERROR_KEY_NOT_FOUND if key does not exist.
+ *  Returns TBD_ERROR_NOT_A_NUMBER if the element is not decimal text.
+ *  Returns TBD_ERROR_OVERFLOW if the result does not fit and overflow is TBD_INCR_OVERFLOW_ERROR.
+ *  Returns TBD_NO_ERROR if successful.
+ */
+int tbd_incr(tbd_t* tbd, const char* key, long delta, long* result, TBD_INCR_OVERFLOW_ENUM overflow);
+
+
+/** Append data to the end of an element's value.
+ *  The element grows in place if its heap allocation has room, otherwise it is moved.
+ *
+ *  Returns TBD_ERROR_KEY_NOT_FOUND if key does not exist.
+ *  Returns TBD_ERROR if there is no room for the larger element.
+ *  Returns TBD_NO_ERROR if successful.
+ */
+int tbd_append(tbd_t* tbd, const char* key, const void* data, size_t data_size);
+
+
+
+
 
 
 
@@ -297,6 +426,47 @@ const void* tbd_const_iterator_value(const tbd_const_iterator_t i);
 
 
 
+/*
+ * Scan operations
+ *
+ * Calls a callback for each key that matches, skipping garbage, tombstones and expired elements.
+ * After tbd_sort_by_key or tbd_copy the first match is found by binary search, 
+ * and the scan stops after the last match, so a scan costs about the number of matches.
+ * Otherwise every key is checked, in stack order.
+ */
+
+
+/** Scan callback, called once for each matching key.
+ *  Returns TBD_NO_ERROR to continue the scan, anything else stops it.
+ */
+typedef int (*tbd_scan_fn)(void* context, const char* key, const void* value, size_t value_size);
+
+
+/** Scan the keys that start with prefix.  An empty prefix matches every key.
+ *  The tbd must not be changed by the callback.
+ *
+ *  Returns TBD_NO_ERROR if every match was scanned.
+ *  Returns the callback result if the callback stopped the scan.
+ */
+int tbd_scan_prefix(const tbd_t* tbd, const char* prefix, tbd_scan_fn scan_fn, void* context);
+
+
+/** Scan the keys that match a glob pattern.
+ *  A '*' matches any number of chars, a '?' matches one char, other chars match themselves.
+ *  The chars before the first wildcard are used as a prefix, so "usr*" is as fast as tbd_scan_prefix.
+ *
+ *  Returns TBD_NO_ERROR if every match was scanned.
+ *  Returns the callback result if the callback stopped the scan.
+ */
+int tbd_scan_glob(const tbd_t* tbd, const char* pattern, tbd_scan_fn scan_fn, void* context);
+
+
+
+
+
+
+
+
 /* 
  * Memory Management
  */
@@ -312,6 +482,12 @@ TBD_SIZE_T tbd_garbage_size(const tbd_t* tbd);
 TBD_SIZE_T tbd_garbage_count(const tbd_t* tbd);
 
 
+/** Heap size in bytes of the largest keyvalue that is garbage.
+ *  Searches the whole stack.
+ */
+TBD_SIZE_T tbd_garbage_largest_size(const tbd_t* tbd);
+
+
 /** Combine keyvalues that are garbage and are located next to each other in the heap.
  *  Re-assigns values so lowest keyvalue stack element references garbage 
  *  and highest keyvalue stack element references none of the heap.
@@ -333,16 +509,24 @@ TBD_SIZE_T tbd_garbage_pop(tbd_t* tbd, size_t garbage_limit);
 
 
 /** Fold a given number of used bytes in garbage bytes.
- *  Will fold objects from the top of the heap into the lowest memory regions.
+ *  Will fold objects from the top of the heap into garbage of the same size in the lowest memory regions,
+ *  leaving the garbage at the top where tbd_garbage_pop can collect it.
  *
  *  This is slow garbage collection because moving is required.
  *  Invalidates existing pointers.
  *  
+ *  Returns the number of bytes of keyvalues moved, at most garbage_limit.
  */
 TBD_SIZE_T tbd_garbage_fold(tbd_t* tbd, size_t garbage_limit);
 
 
-/** Pack up to a given number of bytes of garbage so that heap is contiguous.
+/** Pack used keyvalues over the garbage so that heap is contiguous, moving at most garbage_limit bytes of keyvalues.
+ *  Garbage packed to the top of the stack and heap is released.
+ *
+ *  This is the slowest garbage collection because every keyvalue above the first garbage is moved.
+ *  Invalidates existing pointers.
+ *
+ *  Returns the number of bytes of keyvalues moved.
  */
 TBD_SIZE_T tbd_garbage_pack(tbd_t* tbd, size_t garbage_limit);
 
@@ -364,10 +548,465 @@ TBD_SIZE_T tbd_garbage_clean(tbd_t* tbd);
 
 
 
+/*
+ * Expiry
+ *
+ * The tbd does not read a clock.  
+ * Time is whatever unit the caller uses, and only moves when tbd_set_time is called.
+ */
+
+
+/** Set the current time of the tbd.
+ */
+void tbd_set_time(tbd_t* tbd, TBD_TIME_T now);
+
+
+/** Get the current time of the tbd.
+ */
+TBD_TIME_T tbd_time(const tbd_t* tbd);
+
+
+/** Expire an existing element after a given time to live.
+ *  Expired elements are treated as missing, and become garbage when next found.
+ *  A time to live of 0 means the element never expires.
+ *
+ *  Returns TBD_ERROR_KEY_NOT_FOUND if key does not exist.
+ *  Returns TBD_NO_ERROR if successful.
+ */
+int tbd_expire(tbd_t* tbd, const char* key, TBD_TIME_T ttl);
+
+
+/** Move expired elements to the garbage.
+ *  Checks up to sweep_limit elements, continuing where the previous sweep stopped.
+ *  Returns number of elements that expired.
+ */
+TBD_SIZE_T tbd_expire_sweep(tbd_t* tbd, size_t sweep_limit);
+
+
+
+
+
+
+
+/*
+ * Snapshots
+ *
+ * A snapshot is a compact binary image of the used key:value pairs, without any garbage.
+ * Snapshots are streamed through caller provided callbacks, so no file I/O is required.
+ */
+
+
+/** Snapshot format version written by tbd_save.
+ */
+#define TBD_SNAPSHOT_VERSION    (1u)
+
+
+/** Write callback for tbd_save.
+ *  Must return the number of bytes written, anything other than size is an error.
+ */
+typedef size_t (*tbd_write_fn)(void* context, const void* data, size_t size);
+
+
+/** Read callback for tbd_load.
+ *  Must return the number of bytes read, anything other than size is an error.
+ */
+typedef size_t (*tbd_read_fn)(void* context, void* data, size_t size);
+
+
+typedef enum TBD_SAVE_ORDER
+{
+  TBD_SAVE_ORDER_STACK,   ///< Save in keyvalue stack order, which keeps the heap layout and is the fastest.
+  TBD_SAVE_ORDER_KEY,     ///< Save in ascending key order, after sorting the stack by key with tbd_sort_by_key.
+  
+} TBD_SAVE_ORDER_ENUM;
+
+
+/** Save a snapshot of all used elements.
+ *  Elements are loaded back in the order they were saved, the first element saved is the bottom of the stack.
+ *
+ *  Returns TBD_ERROR if the write callback failed.
+ *  Returns TBD_NO_ERROR if successful.
+ */
+int tbd_save(tbd_t* tbd, tbd_write_fn write, void* context, TBD_SAVE_ORDER_ENUM order);
+
+
+/** Replace the contents of the tbd with a snapshot saved by tbd_save.
+ *  Elements are placed directly in the heap, so the loaded tbd has no garbage.
+ *  The tbd is left empty if loading fails.
+ *
+ *  Returns TBD_ERROR_BAD_FORMAT if the snapshot is truncated, corrupt or of another version.
+ *  Returns TBD_ERROR if the snapshot does not fit in the tbd.
+ *  Returns TBD_NO_ERROR if successful.
+ */
+int tbd_load(tbd_t* tbd, tbd_read_fn read, void* context);
+
+
+
+
+
+
+
+/*
+ * Write-ahead log
+ *
+ * When a log is open, every change made by tbd_create, tbd_update, tbd_put, tbd_delete, 
+ * tbd_cas, tbd_incr, tbd_append and tbd_expire is appended to it as a compact binary record.
+ * Records are collected in a caller provided buffer, then written and synced in batches.
+ * A change that could not be logged is still applied, and returns TBD_ERROR_WAL.
+ *
+ * Evictions, lazy expiry, garbage collection, tbd_empty and tbd_load are not logged.
+ * To recover, tbd_load the last snapshot, then tbd_wal_replay the log written after it.
+ */
+
+
+/** Sync callback for the write-ahead log.
+ *  Must make all bytes written so far durable, returns 0 if successful.
+ */
+typedef int (*tbd_sync_fn)(void* context);
+
+
+typedef enum TBD_WAL_SYNC
+{
+  TBD_WAL_SYNC_NEVER,       ///< Write when the buffer is full, only sync on tbd_wal_flush.
+  TBD_WAL_SYNC_ALWAYS,      ///< Write and sync every change before returning.
+  TBD_WAL_SYNC_INTERVAL,    ///< Write and sync once sync_interval has passed since the last sync.
+  
+} TBD_WAL_SYNC_ENUM;
+
+
+/** Structure for opening a write-ahead log.
+ */
+typedef struct tbd_wal_init_struct
+{
+  tbd_write_fn write;              ///< Appends bytes to the log.
+  tbd_sync_fn sync;                ///< Makes the log durable, NULL if not needed.
+  void* context;                   ///< Passed to write and sync.
+  void* buffer;                    ///< Buffer for records waiting to be written.
+  TBD_SIZE_T buffer_size;          ///< Size in bytes of buffer.
+  TBD_WAL_SYNC_ENUM sync_mode;     ///< When to sync.
+  TBD_TIME_T sync_interval;        ///< Time between syncs for TBD_WAL_SYNC_INTERVAL, in tbd_set_time units.
+  
+} tbd_wal_init_t;
+
+
+/** Start logging changes.
+ *  The buffer must stay valid until the log is closed.
+ *
+ *  Returns TBD_ERROR_BAD_SIZE if there is no buffer.
+ *  Returns TBD_ERROR if there is no write callback, or the write-ahead log is not supported.
+ *  Returns TBD_NO_ERROR if successful.
+ */
+int tbd_wal_open(tbd_t* tbd, const tbd_wal_init_t* init);
+
+
+/** Write and sync all buffered records.
+ *
+ *  Returns TBD_ERROR_WAL if any write or sync failed since the last flush.
+ *  Returns TBD_ERROR if no log is open.
+ *  Returns TBD_NO_ERROR if successful.
+ */
+int tbd_wal_flush(tbd_t* tbd);
+
+
+/** Write all buffered records, without syncing them.
+ *  Use to pass changes on right away, for example to replicas, while the sync mode still decides when to sync.
+ *
+ *  Returns TBD_ERROR_WAL if any write failed since the last flush.
+ *  Returns TBD_ERROR if no log is open.
+ *  Returns TBD_NO_ERROR if successful.
+ */
+int tbd_wal_drain(tbd_t* tbd);
+
+
+/** Flush and stop logging changes.
+ *  Returns the result of tbd_wal_flush, or TBD_NO_ERROR if no log was open.
+ */
+int tbd_wal_close(tbd_t* tbd);
+
+
+/** Apply the changes recorded in a log.
+ *  Replay stops at the end of the log, or at the first record that is incomplete or corrupt,
+ *  which is how a crash in the middle of a write looks.
+ *  The buffer must be large enough for the largest value in the log.
+ *
+ *  Returns the number of changes applied if successful.
+ *  Returns TBD_ERROR_BAD_SIZE if a value does not fit in the buffer.
+ *  Returns an error code less than 0 if a change could not be applied.
+ */
+int tbd_wal_replay(tbd_t* tbd, tbd_read_fn read, void* context, void* buffer, size_t buffer_size);
+
+
+/** Apply the complete records at the start of a buffer, for logs that arrive in pieces.
+ *  Sets used to the number of bytes applied, the rest is the start of a record still to come.
+ *
+ *  Returns the number of changes applied if successful.
+ *  Returns TBD_ERROR_BAD_FORMAT if a record is corrupt.
+ *  Returns an error code less than 0 if a change could not be applied.
+ */
+int tbd_wal_replay_buffer(tbd_t* tbd, const void* data, size_t size, size_t* used);
+
+
+
+
+
+
+
+
+/*
+ * Versions
+ *
+ * Every change made by tbd_create, tbd_update, tbd_put, tbd_delete, tbd_cas, tbd_incr, 
+ * tbd_append and tbd_expire, and every keyvalue loaded by tbd_load, is stamped with the next version.
+ * A replica remembers the version it last exported and asks only for newer changes.
+ *
+ * Deletes are only exported if the tbd was initialized with TBD_INIT_FLAG_TOMBSTONES.
+ * Keys that expire or are evicted then leave tombstones too, and are exported as deletes.
+ * A tombstone holds on to its memory until tbd_acknowledge is called with its version,
+ * so each eviction leaves one tombstone and the write that needed the room fails.
+ * An expired key that was not found or swept yet is exported as a delete by every export.
+ * A key created again after its delete drops its tombstone, and is exported as a put.
+ * Expiry times are not exported.
+ */
+
+
+/** Export callback, called once for each changed key.
+ *  value is NULL and value_size is 0 if the key was deleted.
+ *  Returns TBD_NO_ERROR to continue the export.
+ */
+typedef int (*tbd_export_fn)(void* context, const char* key, const void* value, size_t value_size, TBD_VERSION_T version);
+
+
+/** Returns the version of the last change, 0 if there have been none.
+ */
+TBD_VERSION_T tbd_current_version(const tbd_t* tbd);
+
+
+/** Export the keys changed after version, in stack order.
+ *  Pass 0 to export every key.
+ *  Read tbd_current_version before exporting, and pass it next time.
+ *
+ *  Returns TBD_NO_ERROR if successful.
+ *  Returns the callback result if the callback stopped the export.
+ */
+int tbd_export_since(const tbd_t* tbd, TBD_VERSION_T version, tbd_export_fn export_fn, void* context);
+
+
+/** Turn tombstones up to and including version into garbage.
+ *  Call with the lowest version that every replica has exported.
+ *
+ *  Returns the number of tombstones removed.
+ */
+int tbd_acknowledge(tbd_t* tbd, TBD_VERSION_T version);
+
+
+
+
+
+
+
+
+/*
+ * Publishing
+ *
+ * A tbd_publish_t switches readers between two tbds without locks.
+ * A writer fills the tbd returned by tbd_publish_begin, for example with tbd_copy or tbd_load,
+ * then tbd_publish_commit makes it the one readers get from tbd_publish_acquire.
+ *
+ * A reader keeps the tbd it acquired until it releases it, so readers never block and never see a change.
+ * Pinned tbds must only be read with functions that do not write to the tbd, such as tbd_read_const.
+ */
+
+
+/** Double buffered tbds.
+ *  Members are private, use the tbd_publish_* functions.
+ */
+typedef struct tbd_publish_struct
+{
+  tbd_t* tbd[2];
+  unsigned active;
+  unsigned reader_count[2];
+  
+} tbd_publish_t;
+
+
+/** Initialize publishing between two tbds, tbd0 is published first.
+ *
+ *  Returns TBD_ERROR if the tbds are the same, or publishing is not supported.
+ *  Returns TBD_NO_ERROR if successful.
+ */
+int tbd_publish_init(tbd_publish_t* publish, tbd_t* tbd0, tbd_t* tbd1);
+
+
+/** Pin the published tbd for reading.  Never blocks.
+ *  Every acquire must be matched by a tbd_publish_release.
+ *  Returns NULL if publishing is not supported.
+ */
+const tbd_t* tbd_publish_acquire(tbd_publish_t* publish);
+
+
+/** Unpin a tbd returned by tbd_publish_acquire.
+ */
+void tbd_publish_release(tbd_publish_t* publish, const tbd_t* tbd);
+
+
+/** Get the unpublished tbd for writing.  Only one thread may write at a time.
+ *  Returns NULL if readers still pin it since before the last commit, try again later.
+ */
+tbd_t* tbd_publish_begin(tbd_publish_t* publish);
+
+
+/** Publish the tbd returned by tbd_publish_begin.
+ *  Readers that acquire from now on get the new tbd.
+ *
+ *  Returns TBD_ERROR if publishing is not supported.
+ *  Returns TBD_NO_ERROR if successful.
+ */
+int tbd_publish_commit(tbd_publish_t* publish);
+
+
+
+
+
+
+
+
+/*
+ * Handles
+ *
+ * A handle refers to one key:value pair until it is released or the key is deleted.
+ * Unlike a pointer, a handle stays valid when tbd_put or tbd_append move the pair, 
+ * and across tbd_sort_by_key, tbd_sort_by_heap and garbage collection.
+ * Resolving a handle takes constant time.
+ *
+ * A tbd holds a small fixed number of handles.  tbd_empty, tbd_copy and tbd_load release all of them.
+ */
+
+
+/** Handle to a key:value pair, 0 is never a valid handle.
+ */
+typedef unsigned long tbd_handle_t;
+
+
+/** Get a handle to an element.  Getting a handle to the same element again returns the same handle.
+ *  Returns 0 if key does not exist, no handles are left, or handles are not supported.
+ */
+tbd_handle_t tbd_handle_get(tbd_t* tbd, const char* key);
+
+
+/** Get the value of the element a handle refers to.
+ *  The pointer is only valid until the tbd is next changed, the handle stays valid.
+ *  Returns NULL if the handle was released, or the element was deleted or expired.
+ */
+const void* tbd_handle_value(tbd_t* tbd, tbd_handle_t handle);
+
+
+/** Get the size of the value of the element a handle refers to.
+ *  Returns 0 if the handle was released, or the element was deleted or expired.
+ */
+size_t tbd_handle_value_size(tbd_t* tbd, tbd_handle_t handle);
+
+
+/** Release a handle so its slot can be used again.  Releasing a released handle does nothing.
+ */
+void tbd_handle_release(tbd_t* tbd, tbd_handle_t handle);
+
+
+
+
+
+
+
 /* 
  * Statistics and other general info.
  */
 
+/** Operations counted in tbd_stats_t.
+ */
+typedef enum TBD_OP
+{
+  TBD_OP_CREATE,     ///< tbd_create.
+  TBD_OP_READ,       ///< tbd_read.
+  TBD_OP_UPDATE,     ///< tbd_update.
+  TBD_OP_PUT,        ///< tbd_put.
+  TBD_OP_DELETE,     ///< tbd_delete.
+  TBD_OP_CAS,        ///< tbd_cas.
+  TBD_OP_INCR,       ///< tbd_incr.
+  TBD_OP_APPEND,     ///< tbd_append.
+  TBD_OP_COUNT,
+  
+} TBD_OP_ENUM;
+
+
+/** Number of buckets in each latency histogram.
+ *  Bucket 0 counts latencies of 0 and 1, bucket i counts latencies from 2^i up to 2^(i+1),
+ *  and the last bucket also counts everything longer.
+ */
+#define TBD_LATENCY_BUCKET_COUNT    (32u)
+
+
+/** Clock callback for latency histograms.
+ *  Returns the current time in any unit, such as nanoseconds from a monotonic clock.
+ */
+typedef TBD_TIME_T (*tbd_clock_fn)(void);
+
+
+/** Set the clock that times operations for the latency histograms, or NULL to stop timing.
+ *  Each operation reads the clock twice, so only set a clock that is cheap to read.
+ *
+ *  Returns TBD_ERROR if latency histograms are not supported.
+ *  Returns TBD_NO_ERROR if successful.
+ */
+int tbd_set_clock(tbd_t* tbd, tbd_clock_fn clock);
+
+
+/** Garbage collection phases reported by trace events.
+ */
+typedef enum TBD_GC
+{
+  TBD_GC_MERGE,      ///< tbd_garbage_merge.
+  TBD_GC_POP,        ///< tbd_garbage_pop.
+  TBD_GC_FOLD,       ///< tbd_garbage_fold.
+  TBD_GC_PACK,       ///< tbd_garbage_pack.
+  
+} TBD_GC_ENUM;
+
+
+/** Trace events, with the meaning of the id and size passed to the trace hook.
+ */
+typedef enum TBD_TRACE
+{
+  TBD_TRACE_OP_BEGIN,      ///< An operation starts, id is its TBD_OP_ENUM.
+  TBD_TRACE_OP_END,        ///< An operation returns, id is its TBD_OP_ENUM.
+  TBD_TRACE_FIND_BEGIN,    ///< A key lookup starts.
+  TBD_TRACE_FIND_END,      ///< A key lookup returns, id is 1 if the key was found.
+  TBD_TRACE_CACHE_HIT,     ///< A key lookup was answered by the last found cache.
+  TBD_TRACE_FILTER_REJECT, ///< A key lookup was rejected by the filter.
+  TBD_TRACE_ALLOC_BEGIN,   ///< A keyvalue allocation starts, size is its hunk size.
+  TBD_TRACE_ALLOC_REUSE,   ///< Garbage of the same hunk size was found for the allocation.
+  TBD_TRACE_ALLOC_END,     ///< A keyvalue allocation returns, id is 1 if it succeeded.
+  TBD_TRACE_EVICT,         ///< A keyvalue is evicted to make room, size is its hunk size.
+  TBD_TRACE_GC_BEGIN,      ///< A garbage collection phase starts, id is its TBD_GC_ENUM, size is the garbage limit.
+  TBD_TRACE_GC_END,        ///< A garbage collection phase returns, id is its TBD_GC_ENUM, size is the garbage collected.
+  TBD_TRACE_COUNT,
+  
+} TBD_TRACE_ENUM;
+
+
+/** Trace hook, called at each trace point.
+ *  Runs inside the operation being traced, so it must not call back into the tbd.
+ */
+typedef void (*tbd_trace_fn)(void* context, TBD_TRACE_ENUM event, unsigned id, TBD_SIZE_T size);
+
+
+/** Set the hook that receives trace events, or NULL to stop tracing.
+ *  Trace points are compiled out unless the library is built with TBD_USE_TRACE.
+ *
+ *  Returns TBD_ERROR if tracing is not supported.
+ *  Returns TBD_NO_ERROR if successful.
+ */
+int tbd_set_trace(tbd_t* tbd, tbd_trace_fn trace, void* context);
+
+
 /** Struct to hold statistics about a tbd.
  */
 typedef struct tbd_stats_struct
@@ -391,13 +1030,42 @@ typedef struct tbd_stats_struct
   const void* garbage_back;    ///< Last element of garbage.
   TBD_SIZE_T garbage_size;      ///< Number of bytes of garbage.
   TBD_SIZE_T garbage_count;     ///< Number of garbage elements.
+  TBD_SIZE_T garbage_moved_size;     ///< Number of heap bytes moved by tbd_garbage_fold and tbd_garbage_pack.
+  
+  TBD_SIZE_T create_count;      ///< Number of calls to tbd_create.
+  TBD_SIZE_T read_count;        ///< Number of calls to tbd_read.
+  TBD_SIZE_T update_count;      ///< Number of calls to tbd_update.
+  TBD_SIZE_T put_count;         ///< Number of calls to tbd_put.
+  TBD_SIZE_T delete_count;      ///< Number of calls to tbd_delete.
+  TBD_SIZE_T cas_count;         ///< Number of calls to tbd_cas.
+  TBD_SIZE_T incr_count;        ///< Number of calls to tbd_incr.
+  TBD_SIZE_T append_count;      ///< Number of calls to tbd_append.
+  TBD_SIZE_T read_hit_count;    ///< Number of reads that found their key.
+  TBD_SIZE_T read_miss_count;   ///< Number of reads that did not find their key.
+  TBD_SIZE_T alloc_fail_count;  ///< Number of keyvalues that could not be allocated because the tbd was full.
+  TBD_SIZE_T evict_count;       ///< Number of key:value pairs evicted to make room.
+  
+  TBD_SIZE_T find_count;        ///< Number of key lookups that searched the stack.
+  TBD_SIZE_T find_scan_count;   ///< Number of keyvalues compared by those searches, divide by find_count for the average scan length.
+  
+  TBD_SIZE_T filter_size;       ///< Size of the negative lookup filter in bytes, see tbd_init_t.
+  TBD_SIZE_T filter_reject_count;   ///< Number of key lookups rejected by the filter without searching the stack.
+  
+  TBD_SIZE_T lookup_cache_hit_count;    ///< Number of key lookups answered by the last found cache.
+  TBD_SIZE_T lookup_cache_miss_count;   ///< Number of key lookups that searched the stack.
+  
+  TBD_SIZE_T wal_size;          ///< Number of bytes logged to the write-ahead log.
+  TBD_SIZE_T wal_sync_count;    ///< Number of write-ahead log syncs.
+  
+  TBD_SIZE_T latency_histogram[TBD_OP_COUNT][TBD_LATENCY_BUCKET_COUNT];   ///< Operations counted by latency in clock units, all 0 unless a clock was set with tbd_set_clock.
+  TBD_TIME_T latency_sum[TBD_OP_COUNT];                                   ///< Sum of the latencies of each operation in clock units.
   
 } tbd_stats_t;
 
 
 
 
-/** Get all statistics from a tbd.
+/** Get all statistics from a tbd.  Runs in constant time, so it can be called between any two operations.
  */
 void tbd_stats_get(tbd_stats_t* stats, const tbd_t* tbd);
 
@@ -414,6 +1082,28 @@ int tbd_stats_print(const tbd_stats_t* stats);
 int tbd_print_stats(const tbd_t* tbd);
 
 
+/** Convert statistics to a json object of decimal numbers, without the address fields.  Writes to json string, result is null terminated.
+ *  Returns number of bytes needed, not counting the null terminator.
+ */
+size_t tbd_stats_to_json(char* json, size_t json_size, const tbd_stats_t* stats);
+
+
+/** Convert statistics to the Prometheus text exposition format.  Writes to text string, result is null terminated.
+ *  Latency histograms are left out until they have counted an operation.
+ *  Returns number of bytes needed, not counting the null terminator.
+ */
+size_t tbd_stats_to_prometheus(char* text, size_t text_size, const tbd_stats_t* stats);
+
+
+/** Draw a map of the memory region of the tbd, one character per cell, and a null terminator.
+ *  The region is split into map_size - 1 cells of equal size, and each cell shows what fills most of it:
+ *  '=' for the tbd header and keyvalue stack, '_' for free space, '#' for used heap and '.' for garbage heap.
+ *
+ *  Returns the number of cells drawn.
+ */
+size_t tbd_heap_map(char* map, size_t map_size, const tbd_t* tbd);
+
+
 
 
 
@@ -445,34 +1135,102 @@ typedef enum TBD_VALUE_TO_JSON_FORMAT
 
 
 
+/** Write tbd database in json format to a write callback, in chunks.
+ *  Garbage and expired keyvalues are skipped.
+ *
+ *  Returns TBD_ERROR if the callback wrote fewer bytes than requested.
+ *  Returns TBD_NO_ERROR if successful.
+ */
+int tbd_write_json(const tbd_t* tbd, tbd_write_fn write, void* context, TBD_KEY_TO_JSON_FORMAT_ENUM key_format, TBD_VALUE_TO_JSON_FORMAT_ENUM value_format);
+
+
 /** Convert tbd database to json format.  Writes to json string, result is null terminated.
- *  Returns number of bytes written.
+ *  Returns number of bytes needed, not counting the null terminator.
+ *  The output was truncated if this is not less than json_size.
  */
 size_t tbd_to_json(char* json, size_t json_size, const tbd_t* tbd, TBD_KEY_TO_JSON_FORMAT_ENUM key_format, TBD_VALUE_TO_JSON_FORMAT_ENUM value_format);
 
 
 /** Convert tbd keys to json formatted array.  Writes to json string, result is null terminated.
- *  Returns number of bytes written.
+ *  An empty tbd gives an empty array, "[]".
+ *  Returns number of bytes needed, not counting the null terminator.
  */
 size_t tbd_keys_to_json(char* json, size_t json_size, const tbd_t* tbd, TBD_KEY_TO_JSON_FORMAT_ENUM key_format);
 
 
-/** Convert tbd garbage to json formatted array.  Writes to json string, result is null terminated.
- *  Returns number of bytes written.
+/** Convert tbd garbage to json formatted array of heap offsets and sizes.  Writes to json string, result is null terminated.
+ *  Returns number of bytes needed, not counting the null terminator.
  */
 size_t tbd_garbage_list_to_json(char* json, size_t json_size, const tbd_t* tbd);
 
 
-/** Convert a keyvalue pair to json format.
+/** Convert a keyvalue pair to json format.  Writes to json string, result is null terminated.
+ *  Returns number of bytes needed, not counting the null terminator, or 0 if key is not found.
  */
 size_t tbd_keyvalue_to_json(char* json, size_t json_size, const tbd_t* tbd, const char* key, TBD_KEY_TO_JSON_FORMAT_ENUM key_format, TBD_VALUE_TO_JSON_FORMAT_ENUM value_format);
 
 
 /** Copy json string into tbd datastore.  Will overwrite old contents.
+ *  Accepts the output of tbd_to_json, see tbd_json_parser_feed for the format.
+ *  Values must fit in TBD_JSON_VALUE_BUFFER_SIZE bytes.
+ *  The json is parsed before the old contents are removed, so bad json leaves the tbd unchanged.
+ *  If the tbd runs out of room, it keeps the keys copied before the failed one.
+ *
+ *  Returns TBD_ERROR_BAD_FORMAT if the json could not be parsed.
+ *  Returns TBD_ERROR_BAD_SIZE if a key or value is too large.
+ *  Returns TBD_NO_ERROR if successful.
  */
 int tbd_from_json(tbd_t* tbd, const char* json);
 
 
+/** Streaming JSON parser.
+ *  Members are private, use the tbd_json_parser_* functions.
+ */
+typedef struct tbd_json_parser_struct
+{
+  tbd_t* tbd;
+  unsigned char* buffer;
+  size_t buffer_size;
+  size_t value_size;
+  char key[TBD_MAX_KEY_LENGTH + 1];
+  size_t key_size;
+  unsigned code;
+  unsigned digit_count;
+  int state;
+  int error;
+  int count;
+  unsigned char has_brace;
+  
+} tbd_json_parser_t;
+
+
+/** Start parsing JSON into a tbd.
+ *  Values are decoded into buffer, which must be large enough for the largest value.
+ */
+void tbd_json_parser_init(tbd_json_parser_t* parser, tbd_t* tbd, void* buffer, size_t buffer_size);
+
+
+/** Parse the next chunk of JSON.  
+ *  Chunks may split the input anywhere, each key:value pair is stored as soon as it is complete.
+ *
+ *  The input is a comma separated list of key:value pairs, optionally inside braces.
+ *  Keys are bare or double quoted.
+ *  Values are single quoted hex as written by TBD_VALUE_TO_JSON_FORMAT_HEX, or double quoted JSON strings.
+ *  Existing keys are overwritten.
+ *
+ *  Returns TBD_NO_ERROR if successful, or the first error, which also stops parsing.
+ */
+int tbd_json_parser_feed(tbd_json_parser_t* parser, const char* json, size_t json_size);
+
+
+/** Finish parsing.
+ *  Returns the number of key:value pairs stored if successful.
+ *  Returns TBD_ERROR_BAD_FORMAT if the input ended in the middle of a pair.
+ *  Returns the first error otherwise.
+ */
+int tbd_json_parser_finish(tbd_json_parser_t* parser);
+
+
 
 
 
@@ -12,17 +12,46 @@
 
 
 
+#define _POSIX_C_SOURCE 200112L
+
 #include "tbds.h"
 
 #include <ctype.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 #include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include "tbd.h"
 
 
 
 
+// Most replicas a primary will stream to.
+#define TBDS_MAX_REPLICAS          (8)
+
+// Bytes queued for a replica before it counts as lagging.
+// Holds a snapshot of the largest tbd, with room to spare for the changes that follow it.
+#define TBDS_REPLICA_QUEUE_SIZE    (2 * TBD_MAX_SIZE)
+
+// Milliseconds between attempts to reconnect to the primary.
+#define TBDS_RECONNECT_MS          (1000ul)
+
+// The replication stream starts with the snapshot size as a little endian u32.
+#define TBDS_SNAPSHOT_HEAD_SIZE    (4u)
+
+
+
+
 static size_t tbds_read_key(char* key_buffer, size_t key_buffer_size, FILE* file)
 {
   assert(key_buffer);
@@ -102,10 +131,39 @@ static size_t tbds_read_value(char* value_buffer, size_t value_buffer_size, FILE
 
 
 
+/** Append a command to the trace in the form it was read, so the trace can be fed back to tbds.
+ *  value and value2 are NULL for commands that do not have them.
+ */
+static void tbds_trace(FILE* trace, const char* cmd, const char* key, const char* value, const char* value2)
+{
+  if (!trace)
+  {
+    return;
+  }
+  
+  fprintf(trace, "%s %s", cmd, key);
+  
+  if (value)
+  {
+    fprintf(trace, " %s", value);
+  }
+  
+  if (value2)
+  {
+    fprintf(trace, " %s", value2);
+  }
+  
+  fputc('\n', trace);
+}
+
+
+
+
+
 
 
 
-static void tbds_create(tbd_t* tbd)
+static void tbds_create(tbd_t* tbd, FILE* trace)
 {
   char key_buffer[TBD_MAX_KEY_LENGTH] = {0};
   char value_buffer[256] = {0};
@@ -120,6 +178,8 @@ static void tbds_create(tbd_t* tbd)
     return;
   }
   
+  tbds_trace(trace, "insert", key_buffer, value_buffer, NULL);
+  
   fprintf(stdout, "key:'%s'\n", key_buffer);      
   fprintf(stdout, "value:'%s'\n", value_buffer);
   
@@ -135,7 +195,7 @@ static void tbds_create(tbd_t* tbd)
 
 
 
-static void tbds_read(tbd_t* tbd)
+static void tbds_read(tbd_t* tbd, FILE* trace)
 {
   char key_buffer[TBD_MAX_KEY_LENGTH] = {0};
   char value_buffer[256] = {0};
@@ -147,7 +207,20 @@ static void tbds_read(tbd_t* tbd)
     return;
   }
   
-  int result = tbd_read(tbd, key_buffer, value_buffer, sizeof(value_buffer));
+  tbds_trace(trace, "select", key_buffer, NULL, NULL);
+  
+  size_t value_size = tbd_read_size(tbd, key_buffer);
+  
+  int result = TBD_ERROR_KEY_NOT_FOUND;
+  
+  if (value_size > sizeof(value_buffer))
+  {
+    result = TBD_ERROR_BAD_SIZE;
+  }
+  else if (value_size)
+  {
+    result = tbd_read(tbd, key_buffer, value_buffer, value_size);
+  }
   
   if (result != 0)
   {
@@ -162,13 +235,23 @@ static void tbds_read(tbd_t* tbd)
 
 
 
-static void tbds_update(tbd_t* tbd)
+static void tbds_update(tbd_t* tbd, FILE* trace)
 {
-  char fin_buffer[256] = {0}; 
+  char key_buffer[TBD_MAX_KEY_LENGTH] = {0};
+  char value_buffer[256] = {0};
+  
+  size_t key_size = tbds_read_key(key_buffer, sizeof(key_buffer), stdin);
+  size_t value_size = tbds_read_value(value_buffer, sizeof(value_buffer), stdin);
   
-  fprintf(stdout, "%s", fin_buffer);
+  if (!key_size || !value_size)
+  {
+    return;
+  }
   
-  int result = -1;
+  tbds_trace(trace, "update", key_buffer, value_buffer, NULL);
+  
+  /* create or update with a single lookup */
+  int result = tbd_put(tbd, key_buffer, value_buffer, value_size);
   
   if (result != 0)
   {
@@ -179,7 +262,7 @@ static void tbds_update(tbd_t* tbd)
 
 
 
-static void tbds_delete(tbd_t* tbd)
+static void tbds_delete(tbd_t* tbd, FILE* trace)
 {
   char key_buffer[TBD_MAX_KEY_LENGTH] = {0};
   
@@ -189,6 +272,8 @@ static void tbds_delete(tbd_t* tbd)
   {
     return;
   }
+  
+  tbds_trace(trace, "delete", key_buffer, NULL, NULL);
 
   int result = tbd_delete(tbd, key_buffer);
   
@@ -200,62 +285,1188 @@ static void tbds_delete(tbd_t* tbd)
 
 
 
-void tbds_start(const struct tbds_start_params* params)
+static void tbds_incr(tbd_t* tbd, FILE* trace)
 {
+  char key_buffer[TBD_MAX_KEY_LENGTH] = {0};
+  char delta_buffer[32] = {0};
+  
+  size_t key_size = tbds_read_key(key_buffer, sizeof(key_buffer), stdin);
+  size_t delta_size = tbds_read_value(delta_buffer, sizeof(delta_buffer), stdin);
+  
+  if (!key_size || !delta_size)
+  {
+    return;
+  }
+  
+  tbds_trace(trace, "incrby", key_buffer, delta_buffer, NULL);
+  
+  long value = 0;
+  
+  int result = tbd_incr(tbd, key_buffer, strtol(delta_buffer, NULL, 10), &value, TBD_INCR_OVERFLOW_ERROR);
+  
+  if (result != 0)
+  {
+    fprintf(stderr, "error: %d", result);         
+  } 
+  else
+  {
+    fprintf(stdout, "%ld", value);
+  }  
+}
 
-  char cmd_buffer[9] = {0};
+
+
+
+static void tbds_append(tbd_t* tbd, FILE* trace)
+{
+  char key_buffer[TBD_MAX_KEY_LENGTH] = {0};
+  char value_buffer[256] = {0};
   
-  unsigned tbd_buffer[TBD_MAX_SIZE];
+  size_t key_size = tbds_read_key(key_buffer, sizeof(key_buffer), stdin);
+  size_t value_size = tbds_read_value(value_buffer, sizeof(value_buffer), stdin);
   
+  if (!key_size || !value_size)
+  {
+    return;
+  }
   
-  const tbd_init_t tbd_params = {
+  tbds_trace(trace, "append", key_buffer, value_buffer, NULL);
   
-    .start = tbd_buffer,
-    .size = sizeof(tbd_buffer) & TBD_MAX_SIZE,
-    .hunk_size = sizeof(unsigned),
-  };
+  /* append the characters, but not the null terminator */
+  int result = tbd_append(tbd, key_buffer, value_buffer, value_size - 1);
   
+  if (result != 0)
+  {
+    fprintf(stderr, "error: %d", result);         
+  }   
+}
+
+
+
+
+static void tbds_cas(tbd_t* tbd, FILE* trace)
+{
+  char key_buffer[TBD_MAX_KEY_LENGTH] = {0};
+  char expected_buffer[256] = {0};
+  char desired_buffer[256] = {0};
   
+  size_t key_size = tbds_read_key(key_buffer, sizeof(key_buffer), stdin);
+  size_t expected_size = tbds_read_value(expected_buffer, sizeof(expected_buffer), stdin);
+  size_t desired_size = tbds_read_value(desired_buffer, sizeof(desired_buffer), stdin);
   
-  tbd_t* tbd = tbd_init(&tbd_params);
+  if (!key_size || !expected_size || !desired_size)
+  {
+    return;
+  }
   
+  tbds_trace(trace, "cmpswp", key_buffer, expected_buffer, desired_buffer);
   
-  do
+  int result = TBD_ERROR_BAD_SIZE;
+  
+  if (expected_size == desired_size)
   {
-    
-    fgets(cmd_buffer, sizeof(cmd_buffer) - 1, stdin);
-    
-    
-    if (strncmp(cmd_buffer, "select ", 7) == 0)
-    {
-      tbds_read(tbd);
-      printf("\n");
-    }
-    
-    else if (strncmp(cmd_buffer, "update ", 7) == 0)
-    {
-      tbds_update(tbd);
-      printf("\n");
+    result = tbd_cas(tbd, key_buffer, expected_buffer, desired_buffer, desired_size);
+  }
+  
+  if (result != 0)
+  {
+    fprintf(stderr, "error: %d", result);         
+  }   
+}
+
+
+
+static int tbds_print_key(void* context, const char* key, const void* value, size_t value_size)
+{
+  bool* is_first = (bool*) context;
+  
+  (void) value;
+  (void) value_size;
+  
+  fprintf(stdout, *is_first ? "%s" : " %s", key);
+  *is_first = false;
+  
+  return TBD_NO_ERROR;
+}
+
+
+
+
+static void tbds_prefix(tbd_t* tbd, FILE* trace)
+{
+  char key_buffer[TBD_MAX_KEY_LENGTH] = {0};
+  
+  size_t key_size = tbds_read_key(key_buffer, sizeof(key_buffer), stdin);
+  
+  if (!key_size)
+  {
+    return;
+  }
+  
+  tbds_trace(trace, "prefix", key_buffer, NULL, NULL);
+  
+  bool is_first = true;
+  tbd_scan_prefix(tbd, key_buffer, tbds_print_key, &is_first);
+}
+
+
+
+
+/** Print statistics as one line of JSON, or as Prometheus text ending with a blank line.
+ */
+static void tbds_stats(tbd_t* tbd, bool is_prometheus)
+{
+  static char text_buffer[16384];
+  
+  tbd_stats_t stats;
+  tbd_stats_get(&stats, tbd);
+  
+  size_t text_size = is_prometheus ?
+    tbd_stats_to_prometheus(text_buffer, sizeof(text_buffer), &stats) :
+    tbd_stats_to_json(text_buffer, sizeof(text_buffer), &stats);
+  
+  if (text_size >= sizeof(text_buffer))
+  {
+    fprintf(stderr, "error: stats need %u bytes\n", (unsigned) text_size);
+    return;
+  }
+  
+  fputs(text_buffer, stdout);
+}
+
+
+
+
+static size_t tbds_file_write(void* context, const void* data, size_t size)
+{
+  return fwrite(data, 1, size, (FILE*) context);
+}
+
 
-    }    
+
+
+static size_t tbds_file_read(void* context, void* data, size_t size)
+{
+  return fread(data, 1, size, (FILE*) context);
+}
+
+
+
+
+static int tbds_file_sync(void* context)
+{
+  FILE* file = (FILE*) context;
+  
+  if (fflush(file) != 0)
+  {
+    return -1;
+  }
+  
+  return fsync(fileno(file));
+}
+
+
+
+
+/** Get the wall clock time in milliseconds.
+ *  Wall clock time is used so that expiry times in the log still mean the same after a restart.
+ */
+static unsigned long tbds_time_ms(void)
+{
+  struct timespec now;
+  
+  if (clock_gettime(CLOCK_REALTIME, &now) != 0)
+  {
+    return 0;
+  }
+  
+  return (unsigned long) now.tv_sec * 1000ul + (unsigned long) now.tv_nsec / 1000000ul;
+}
+
+
+
+
+/** Load the last snapshot, then replay the log written after it.
+ *  Returns 0 if recovered, or if there was nothing to recover.
+ */
+static int tbds_recover(tbd_t* tbd, const struct tbds_start_params* params)
+{
+  static char value_buffer[TBD_MAX_SIZE];
+  
+  if (params->snapshot_path)
+  {
+    FILE* file = fopen(params->snapshot_path, "rb");
     
-    else if (strncmp(cmd_buffer, "insert ", 7) == 0)
+    if (file)
     {
-      tbds_create(tbd);
-      printf("\n");
+      int result = tbd_load(tbd, tbds_file_read, file);
+      fclose(file);
+      
+      if (result != 0)
+      {
+        fprintf(stderr, "error: %d loading %s\n", result, params->snapshot_path);
+        return -1;
+      }
     }
+  }
+  
+  if (params->wal_path)
+  {
+    FILE* file = fopen(params->wal_path, "rb");
     
-    else if (strncmp(cmd_buffer, "delete ", 7) == 0)
-    {
-      tbds_delete(tbd);
-      printf("\n");      
-    }
-    else
+    if (file)
     {
-      fprintf(stderr, "invalid: %s", cmd_buffer); 
+      int result = tbd_wal_replay(tbd, tbds_file_read, file, value_buffer, sizeof(value_buffer));
+      fclose(file);
+      
+      if (result < 0)
+      {
+        fprintf(stderr, "error: %d replaying %s\n", result, params->wal_path);
+        return -1;
+      }
     }
-    
-  } while(1);
+  }
+  
+  return 0;
+}
+
+
+
+
+/** Save the recovered state as the new snapshot, so the log can start over.
+ *  Returns 0 if the log can be truncated.
+ */
+static int tbds_checkpoint(tbd_t* tbd, const struct tbds_start_params* params)
+{
+  char temp_path[256];
+  
+  if (!params->snapshot_path || 
+      (snprintf(temp_path, sizeof(temp_path), "%s.tmp", params->snapshot_path) >= (int) sizeof(temp_path)))
+  {
+    return -1;
+  }
+  
+  FILE* file = fopen(temp_path, "wb");
+  
+  if (!file)
+  {
+    return -1;
+  }
+  
+  int result = tbd_save(tbd, tbds_file_write, file, TBD_SAVE_ORDER_STACK);
+  
+  if (tbds_file_sync(file) != 0)
+  {
+    result = TBD_ERROR;
+  }
+  
+  fclose(file);
+  
+  // replace the old snapshot only once the new one is complete
+  if ((result != 0) || (rename(temp_path, params->snapshot_path) != 0))
+  {
+    fprintf(stderr, "error: %d saving %s\n", result, params->snapshot_path);
+    remove(temp_path);
+    return -1;
+  }
+  
+  return 0;
 }
 
 
+
+
+/** Outgoing replication stream to one replica.
+ */
+struct tbds_replica
+{
+  int fd;                 ///< Socket, -1 if unused.
+  size_t queue_used;      ///< Bytes waiting to be sent.
+  unsigned char queue[TBDS_REPLICA_QUEUE_SIZE];
+};
+
+
+
+
+/** Destinations of the write-ahead log, the log file and the replicas.
+ */
+struct tbds_log
+{
+  FILE* file;             ///< Log file, NULL for none.
+  struct tbds_replica replicas[TBDS_MAX_REPLICAS];
+};
+
+
+
+
+/** Incoming replication stream from the primary.
+ */
+struct tbds_primary
+{
+  int fd;                     ///< Socket, -1 if not connected.
+  unsigned long connect_time; ///< Time of the last connection attempt.
+  bool has_snapshot;          ///< Set once the snapshot is loaded, the rest of the stream is log records.
+  size_t used;                ///< Bytes received, but not applied yet.
+  unsigned char buffer[TBDS_REPLICA_QUEUE_SIZE];
+};
+
+
+
+
+/** Read callback state for reading from memory.
+ */
+struct tbds_memory
+{
+  const unsigned char* data;
+  size_t size;
+  size_t pos;
+};
+
+
+
+
+static size_t tbds_memory_read(void* context, void* data, size_t size)
+{
+  struct tbds_memory* memory = (struct tbds_memory*) context;
+  
+  if (size > memory->size - memory->pos)
+  {
+    return 0;
+  }
+  
+  memcpy(data, memory->data + memory->pos, size);
+  memory->pos += size;
+  
+  return size;
+}
+
+
+
+
+/** Open a socket to listen on, or connect to, an address.
+ *  An address with a ':' and no '/' is "host:port" for TCP, leave out the host to listen on any address.
+ *  Anything else is the path of a Unix socket.
+ *  Returns the socket in non-blocking mode, or -1 if it could not be opened.
+ */
+static int tbds_socket_open(const char* address, bool is_listen)
+{
+  assert(address);
+  
+  const char* colon = strrchr(address, ':');
+  int fd = -1;
+  
+  if (!colon || strchr(address, '/'))
+  {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    
+    if (strlen(address) >= sizeof(addr.sun_path))
+    {
+      return -1;
+    }
+    
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, address);
+    
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    
+    if (fd < 0)
+    {
+      return -1;
+    }
+    
+    if (is_listen)
+    {
+      // a primary that was killed leaves its socket file behind
+      unlink(address);
+    }
+    
+    const int result = is_listen ? bind(fd, (struct sockaddr*) &addr, sizeof(addr)) : connect(fd, (struct sockaddr*) &addr, sizeof(addr));
+    
+    if (result != 0)
+    {
+      close(fd);
+      return -1;
+    }
+  }
+  else
+  {
+    char host[256];
+    const size_t host_size = (size_t) (colon - address);
+    
+    if (host_size >= sizeof(host))
+    {
+      return -1;
+    }
+    
+    memcpy(host, address, host_size);
+    host[host_size] = '\0';
+    
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = is_listen ? AI_PASSIVE : 0;
+    
+    struct addrinfo* list = NULL;
+    
+    if (getaddrinfo(host_size ? host : NULL, colon + 1, &hints, &list) != 0)
+    {
+      return -1;
+    }
+    
+    struct addrinfo* info;
+    for (info = list; info; info = info->ai_next)
+    {
+      fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+      
+      if (fd < 0)
+      {
+        continue;
+      }
+      
+      if (is_listen)
+      {
+        const int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+      }
+      
+      const int result = is_listen ? bind(fd, info->ai_addr, info->ai_addrlen) : connect(fd, info->ai_addr, info->ai_addrlen);
+      
+      if (result == 0)
+      {
+        break;
+      }
+      
+      close(fd);
+      fd = -1;
+    }
+    
+    freeaddrinfo(list);
+    
+    if (fd < 0)
+    {
+      return -1;
+    }
+  }
+  
+  if (is_listen && (listen(fd, TBDS_MAX_REPLICAS) != 0))
+  {
+    close(fd);
+    return -1;
+  }
+  
+  // never let a socket block the command loop
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  
+  return fd;
+}
+
+
+
+
+static void tbds_replica_close(struct tbds_replica* replica)
+{
+  assert(replica);
+  
+  if (replica->fd >= 0)
+  {
+    close(replica->fd);
+  }
+  
+  replica->fd = -1;
+  replica->queue_used = 0;
+}
+
+
+
+
+/** Write callback that queues bytes for a replica.
+ *  Writes nothing if the bytes do not all fit.
+ */
+static size_t tbds_replica_write(void* context, const void* data, size_t size)
+{
+  struct tbds_replica* replica = (struct tbds_replica*) context;
+  
+  if (size > sizeof(replica->queue) - replica->queue_used)
+  {
+    return 0;
+  }
+  
+  memcpy(replica->queue + replica->queue_used, data, size);
+  replica->queue_used += size;
+  
+  return size;
+}
+
+
+
+
+/** Send as much of the queue as the socket takes without blocking.
+ */
+static void tbds_replica_send(struct tbds_replica* replica)
+{
+  assert(replica);
+  
+  if ((replica->fd < 0) || !replica->queue_used)
+  {
+    return;
+  }
+  
+  const ssize_t sent = send(replica->fd, replica->queue, replica->queue_used, 0);
+  
+  if (sent < 0)
+  {
+    if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+    {
+      tbds_replica_close(replica);
+    }
+    
+    return;
+  }
+  
+  replica->queue_used -= (size_t) sent;
+  memmove(replica->queue, replica->queue + sent, replica->queue_used);
+}
+
+
+
+
+/** Accept a new replica, and queue a snapshot to start its stream.
+ */
+static void tbds_replica_accept(tbd_t* tbd, struct tbds_log* log, int listen_fd)
+{
+  assert(tbd);
+  assert(log);
+  
+  const int fd = accept(listen_fd, NULL, NULL);
+  
+  if (fd < 0)
+  {
+    return;
+  }
+  
+  struct tbds_replica* replica = NULL;
+  
+  size_t i;
+  for (i = 0; (i < TBDS_MAX_REPLICAS) && !replica; ++i)
+  {
+    if (log->replicas[i].fd < 0)
+    {
+      replica = &log->replicas[i];
+    }
+  }
+  
+  if (!replica)
+  {
+    fprintf(stderr, "error: too many replicas\n");
+    close(fd);
+    return;
+  }
+  
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  
+  // changes still in the log buffer are already in the snapshot, so send them to the other replicas first
+  tbd_wal_drain(tbd);
+  
+  replica->fd = fd;
+  replica->queue_used = TBDS_SNAPSHOT_HEAD_SIZE;
+  
+  if (tbd_save(tbd, tbds_replica_write, replica, TBD_SAVE_ORDER_STACK) != 0)
+  {
+    fprintf(stderr, "error: snapshot does not fit in replica queue\n");
+    tbds_replica_close(replica);
+    return;
+  }
+  
+  const size_t snapshot_size = replica->queue_used - TBDS_SNAPSHOT_HEAD_SIZE;
+  
+  for (i = 0; i < TBDS_SNAPSHOT_HEAD_SIZE; ++i)
+  {
+    replica->queue[i] = (unsigned char) (snapshot_size >> (8 * i));
+  }
+  
+  tbds_replica_send(replica);
+}
+
+
+
+
+/** Write callback for the write-ahead log, writes to the log file and queues for every replica.
+ *  A replica that cannot keep up is disconnected, it will start over from a snapshot.
+ */
+static size_t tbds_log_write(void* context, const void* data, size_t size)
+{
+  struct tbds_log* log = (struct tbds_log*) context;
+  
+  const size_t written = log->file ? fwrite(data, 1, size, log->file) : size;
+  
+  size_t i;
+  for (i = 0; i < TBDS_MAX_REPLICAS; ++i)
+  {
+    struct tbds_replica* replica = &log->replicas[i];
+    
+    if ((replica->fd >= 0) && (tbds_replica_write(replica, data, size) != size))
+    {
+      fprintf(stderr, "error: replica lagging, disconnected\n");
+      tbds_replica_close(replica);
+    }
+  }
+  
+  return written;
+}
+
+
+
+
+static int tbds_log_sync(void* context)
+{
+  struct tbds_log* log = (struct tbds_log*) context;
+  
+  return log->file ? tbds_file_sync(log->file) : 0;
+}
+
+
+
+
+/** Pass the changes made by the last command on to the replicas.
+ */
+static void tbds_log_drain(tbd_t* tbd, struct tbds_log* log)
+{
+  assert(tbd);
+  assert(log);
+  
+  bool has_replicas = false;
+  
+  size_t i;
+  for (i = 0; i < TBDS_MAX_REPLICAS; ++i)
+  {
+    has_replicas |= (log->replicas[i].fd >= 0);
+  }
+  
+  if (!has_replicas)
+  {
+    return;
+  }
+  
+  tbd_wal_drain(tbd);
+  
+  for (i = 0; i < TBDS_MAX_REPLICAS; ++i)
+  {
+    tbds_replica_send(&log->replicas[i]);
+  }
+}
+
+
+
+
+static void tbds_primary_close(struct tbds_primary* primary)
+{
+  assert(primary);
+  
+  if (primary->fd >= 0)
+  {
+    close(primary->fd);
+  }
+  
+  primary->fd = -1;
+  primary->has_snapshot = false;
+  primary->used = 0;
+}
+
+
+
+
+static void tbds_primary_connect(struct tbds_primary* primary, const char* address)
+{
+  assert(primary);
+  
+  tbds_primary_close(primary);
+  
+  primary->fd = tbds_socket_open(address, false);
+  primary->connect_time = tbds_time_ms();
+}
+
+
+
+
+/** Read from the primary, and apply whatever has fully arrived.
+ */
+static void tbds_primary_receive(tbd_t* tbd, struct tbds_primary* primary)
+{
+  assert(tbd);
+  assert(primary);
+  
+  const ssize_t received = read(primary->fd, primary->buffer + primary->used, sizeof(primary->buffer) - primary->used);
+  
+  if (received <= 0)
+  {
+    if ((received == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)))
+    {
+      fprintf(stderr, "error: lost primary\n");
+      tbds_primary_close(primary);
+    }
+    
+    return;
+  }
+  
+  primary->used += (size_t) received;
+  
+  size_t applied = 0;
+  int result = TBD_NO_ERROR;
+  
+  if (!primary->has_snapshot)
+  {
+    if (primary->used < TBDS_SNAPSHOT_HEAD_SIZE)
+    {
+      return;
+    }
+    
+    size_t snapshot_size = 0;
+    
+    size_t i;
+    for (i = 0; i < TBDS_SNAPSHOT_HEAD_SIZE; ++i)
+    {
+      snapshot_size |= (size_t) primary->buffer[i] << (8 * i);
+    }
+    
+    if (snapshot_size > sizeof(primary->buffer) - TBDS_SNAPSHOT_HEAD_SIZE)
+    {
+      result = TBD_ERROR_BAD_SIZE;
+    }
+    else if (primary->used - TBDS_SNAPSHOT_HEAD_SIZE < snapshot_size)
+    {
+      return;
+    }
+    else
+    {
+      struct tbds_memory memory = {primary->buffer + TBDS_SNAPSHOT_HEAD_SIZE, snapshot_size, 0};
+      
+      result = tbd_load(tbd, tbds_memory_read, &memory);
+      
+      applied = TBDS_SNAPSHOT_HEAD_SIZE + snapshot_size;
+      primary->has_snapshot = (result == TBD_NO_ERROR);
+    }
+  }
+  
+  if (primary->has_snapshot)
+  {
+    size_t used = 0;
+    
+    const int replay_result = tbd_wal_replay_buffer(tbd, primary->buffer + applied, primary->used - applied, &used);
+    
+    if (replay_result < 0)
+    {
+      result = replay_result;
+    }
+    
+    applied += used;
+  }
+  
+  if (result < 0)
+  {
+    fprintf(stderr, "error: %d replicating\n", result);
+    tbds_primary_close(primary);
+    return;
+  }
+  
+  primary->used -= applied;
+  memmove(primary->buffer, primary->buffer + applied, primary->used);
+}
+
+
+
+
+/** Wait for the next command, serving replicas and the primary in the meantime.
+ */
+static void tbds_poll(tbd_t* tbd, int listen_fd, struct tbds_log* log, struct tbds_primary* primary, const char* primary_address)
+{
+  assert(tbd);
+  assert(log);
+  
+  struct pollfd fds[2 + TBDS_MAX_REPLICAS];
+  struct tbds_replica* polled[TBDS_MAX_REPLICAS];
+  
+  do
+  {
+    if (primary && (primary->fd < 0) && (tbds_time_ms() - primary->connect_time >= TBDS_RECONNECT_MS))
+    {
+      tbds_primary_connect(primary, primary_address);
+    }
+    
+    nfds_t count = 0;
+    
+    fds[count].fd = STDIN_FILENO;
+    fds[count++].events = POLLIN;
+    
+    const nfds_t listen_index = count;
+    
+    if (listen_fd >= 0)
+    {
+      fds[count].fd = listen_fd;
+      fds[count++].events = POLLIN;
+    }
+    
+    const nfds_t primary_index = count;
+    
+    if (primary && (primary->fd >= 0))
+    {
+      fds[count].fd = primary->fd;
+      fds[count++].events = POLLIN;
+    }
+    
+    const nfds_t replica_index = count;
+    
+    size_t i;
+    for (i = 0; i < TBDS_MAX_REPLICAS; ++i)
+    {
+      struct tbds_replica* replica = &log->replicas[i];
+      
+      if (replica->fd >= 0)
+      {
+        polled[count - replica_index] = replica;
+        
+        // replicas never send anything, so input means the replica went away
+        fds[count].fd = replica->fd;
+        fds[count++].events = POLLIN | (replica->queue_used ? POLLOUT : 0);
+      }
+    }
+    
+    const int timeout = (primary && (primary->fd < 0)) ? (int) TBDS_RECONNECT_MS : -1;
+    
+    if (poll(fds, count, timeout) < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      
+      return;
+    }
+    
+    nfds_t j;
+    for (j = replica_index; j < count; ++j)
+    {
+      struct tbds_replica* replica = polled[j - replica_index];
+      
+      if (fds[j].revents & POLLOUT)
+      {
+        tbds_replica_send(replica);
+      }
+      
+      if (fds[j].revents & (POLLIN | POLLHUP | POLLERR))
+      {
+        tbds_replica_close(replica);
+      }
+    }
+    
+    if ((primary_index < replica_index) && fds[primary_index].revents)
+    {
+      tbds_primary_receive(tbd, primary);
+    }
+    
+    if ((listen_index < primary_index) && (fds[listen_index].revents & POLLIN))
+    {
+      tbds_replica_accept(tbd, log, listen_fd);
+    }
+    
+  } while (!fds[0].revents);
+}
+
+
+
+
+/** Read the rest of a command line that will not be executed.
+ */
+static void tbds_skip_line(FILE* file)
+{
+  int c = EOF;
+  
+  do
+  {
+    c = fgetc(file);
+    
+  } while ((c != EOF) && (c != '\n'));
+}
+
+
+
+
+/** Read the rest of a command line, and test if it completes a word whose start was already read.
+ */
+static bool tbds_line_is_word(FILE* file, const char* start, const char* word)
+{
+  size_t length = strlen(start);
+  bool is_word = (strncmp(start, word, length) == 0);
+  
+  int c = fgetc(file);
+  
+  while ((c != EOF) && (c != '\n'))
+  {
+    if (is_word)
+    {
+      is_word = (c == word[length]);
+      ++length;
+    }
+    
+    c = fgetc(file);
+  }
+  
+  return is_word && (word[length] == '\0');
+}
+
+
+
+
+/** Execute one command, and append it to the trace if there is one.
+ *  A read only server only executes select, prefix and stats.
+ *  Stats are not traced, they do not change the tbd.
+ */
+static void tbds_execute(tbd_t* tbd, const char* cmd_buffer, bool is_read_only, FILE* trace)
+{
+  if ((strncmp(cmd_buffer, "stats", 5) == 0) && ((cmd_buffer[5] == '\n') || (cmd_buffer[5] == ' ')))
+  {
+    bool is_prometheus = false;
+    
+    // the format name may not fit in the command buffer, the rest of it is still on stdin
+    if ((cmd_buffer[5] == ' ') && (cmd_buffer[6] != '\n'))
+    {
+      is_prometheus = tbds_line_is_word(stdin, &cmd_buffer[6], "prometheus");
+    }
+    
+    tbds_stats(tbd, is_prometheus);
+    printf("\n");
+  }
+  
+  else if (strncmp(cmd_buffer, "select ", 7) == 0)
+  {
+    tbds_read(tbd, trace);
+    printf("\n");
+  }
+  
+  else if (strncmp(cmd_buffer, "prefix ", 7) == 0)
+  {
+    tbds_prefix(tbd, trace);
+    printf("\n");
+  }
+  
+  else if (is_read_only)
+  {
+    fprintf(stderr, "read only: %s", cmd_buffer);
+    tbds_skip_line(stdin);
+  }
+  
+  else if (strncmp(cmd_buffer, "update ", 7) == 0)
+  {
+    tbds_update(tbd, trace);
+    printf("\n");
+
+  }    
+  
+  else if (strncmp(cmd_buffer, "insert ", 7) == 0)
+  {
+    tbds_create(tbd, trace);
+    printf("\n");
+  }
+  
+  else if (strncmp(cmd_buffer, "delete ", 7) == 0)
+  {
+    tbds_delete(tbd, trace);
+    printf("\n");      
+  }
+  
+  else if (strncmp(cmd_buffer, "incrby ", 7) == 0)
+  {
+    tbds_incr(tbd, trace);
+    printf("\n");
+  }
+  
+  else if (strncmp(cmd_buffer, "append ", 7) == 0)
+  {
+    tbds_append(tbd, trace);
+    printf("\n");
+  }
+  
+  else if (strncmp(cmd_buffer, "cmpswp ", 7) == 0)
+  {
+    tbds_cas(tbd, trace);
+    printf("\n");
+  }
+  else
+  {
+    fprintf(stderr, "invalid: %s", cmd_buffer); 
+  }
+}
+
+
+
+
+void tbds_start(const struct tbds_start_params* params)
+{
+
+  char cmd_buffer[9] = {0};
+  
+  unsigned tbd_buffer[TBD_MAX_SIZE / sizeof(unsigned)];
+  
+  
+  const tbd_init_t tbd_params = {
+  
+    .start = tbd_buffer,
+    .size = sizeof(tbd_buffer),
+    .hunk_size = sizeof(unsigned),
+  };
+  
+  
+  
+  tbd_t* tbd = tbd_init(&tbd_params);
+  
+  tbd_set_time(tbd, tbds_time_ms());
+  
+  
+  static struct tbds_log log;
+  static struct tbds_primary primary;
+  
+  size_t i;
+  for (i = 0; i < TBDS_MAX_REPLICAS; ++i)
+  {
+    log.replicas[i].fd = -1;
+  }
+  
+  primary.fd = -1;
+  
+  const bool is_replica = params && params->primary_address;
+  const bool is_primary = params && params->listen_address && !is_replica;
+  
+  
+  /* recover, then log every change from here on */
+  static unsigned char wal_buffer[4096];
+  
+  const bool is_recovered = is_replica || !params || (tbds_recover(tbd, params) == 0);
+  
+  // a failed recovery leaves the snapshot and log untouched for a later attempt
+  if (!is_recovered)
+  {
+    fprintf(stderr, "error: cannot recover, not starting\n");
+    return;
+  }
+  
+  if (!is_replica && params && (params->wal_path || is_primary))
+  {
+    // the log only needs to be kept if it could not be checkpointed
+    if (params->wal_path)
+    {
+      log.file = fopen(params->wal_path, (tbds_checkpoint(tbd, params) == 0) ? "wb" : "ab");
+    }
+    
+    const tbd_wal_init_t wal_params = {
+      
+      .write = tbds_log_write,
+      .sync = tbds_log_sync,
+      .context = &log,
+      .buffer = wal_buffer,
+      .buffer_size = sizeof(wal_buffer),
+      .sync_mode = params->wal_sync_mode,
+      .sync_interval = params->wal_sync_interval_ms,
+    };
+    
+    if ((params->wal_path && !log.file) || (tbd_wal_open(tbd, &wal_params) != 0))
+    {
+      fprintf(stderr, "error: cannot open %s\n", params->wal_path ? params->wal_path : "log");
+    }
+  }
+  
+  
+  /* record commands */
+  FILE* trace = NULL;
+  
+  if (params && params->trace_path)
+  {
+    trace = fopen(params->trace_path, "a");
+    
+    if (!trace)
+    {
+      fprintf(stderr, "error: cannot open %s\n", params->trace_path);
+    }
+  }
+  
+  
+  /* replicate */
+  int listen_fd = -1;
+  
+  if (is_primary)
+  {
+    listen_fd = tbds_socket_open(params->listen_address, true);
+    
+    if (listen_fd < 0)
+    {
+      fprintf(stderr, "error: cannot listen on %s\n", params->listen_address);
+    }
+  }
+  
+  if (is_replica)
+  {
+    tbds_primary_connect(&primary, params->primary_address);
+  }
+  
+  if (is_primary || is_replica)
+  {
+    // a replica that goes away must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    
+    // poll can only see commands that are not already sitting in a stdio buffer
+    setvbuf(stdin, NULL, _IONBF, 0);
+  }
+  
+  
+  do
+  {
+    if (is_primary || is_replica)
+    {
+      tbds_poll(tbd, listen_fd, &log, is_replica ? &primary : NULL, is_replica ? params->primary_address : NULL);
+    }
+    
+    if (!fgets(cmd_buffer, sizeof(cmd_buffer) - 1, stdin))
+    {
+      break;
+    }
+    
+    tbd_set_time(tbd, tbds_time_ms());
+    
+    tbds_execute(tbd, cmd_buffer, is_replica, trace);
+    
+    if (is_primary || is_replica)
+    {
+      // stdout may be a pipe, do not hold the reply back while polling
+      fflush(stdout);
+    }
+    
+    tbds_log_drain(tbd, &log);
+    
+  } while(1);
+  
+  
+  tbd_wal_close(tbd);
+  
+  if (log.file)
+  {
+    fclose(log.file);
+  }
+  
+  if (trace)
+  {
+    fclose(trace);
+  }
+  
+  for (i = 0; i < TBDS_MAX_REPLICAS; ++i)
+  {
+    tbds_replica_close(&log.replicas[i]);
+  }
+  
+  if (listen_fd >= 0)
+  {
+    close(listen_fd);
+  }
+  
+  tbds_primary_close(&primary);
+}
@@ -18,17 +18,40 @@
 
 #include <stddef.h>
 
+#include "tbd.h"
+
 
 
 
 struct tbds_start_params
 {
   size_t tbd_size;
+  
+  const char* snapshot_path;            ///< Snapshot file loaded at start and rewritten after recovery, NULL for none.
+  const char* wal_path;                 ///< Write-ahead log file replayed at start and appended to, NULL for none.
+  TBD_WAL_SYNC_ENUM wal_sync_mode;      ///< When to sync the write-ahead log.
+  unsigned long wal_sync_interval_ms;   ///< Milliseconds between syncs for TBD_WAL_SYNC_INTERVAL.
+  
+  const char* listen_address;           ///< Address to accept replicas on, a Unix socket path or "host:port", NULL for none.
+  const char* primary_address;          ///< Address of the primary to replicate, NULL to run as a primary.
+  
+  const char* trace_path;               ///< File every command is appended to, for replaying later, NULL for none.
 };
 
 
 
 /** Start the server.
+ *
+ *  A primary streams a snapshot, then every change, to each replica that connects to its listen address.
+ *  A replica applies the stream to its own tbd and only serves select, prefix and stats commands.
+ *  A replica that falls too far behind is disconnected, and starts over from a new snapshot when it reconnects.
+ *  Replicas ignore the snapshot and write-ahead log paths.
+ *
+ *  A trace holds one command per line, exactly as tbds reads them, so it can be fed back to tbds
+ *  or replayed against a bare tbd by the workload driver in test/workload_tbd.h.
+ *
+ *  "stats" replies with tbd_stats_to_json on one line, "stats prometheus" replies with
+ *  tbd_stats_to_prometheus followed by a blank line.
  */
 void tbds_start(const struct tbds_start_params*);
 
@@ -0,0 +1,521 @@
+/** Benchmarks for tbd.
+ */
+
+
+
+#define _POSIX_C_SOURCE 199309L
+
+#include "bench_tbd.h"
+#include "tbd.h"
+
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+
+
+/*
+ * Benchmark options.
+ */
+#define BENCH_TBD_MAX_KEY_COUNT 256
+#define BENCH_TBD_MAX_VALUE_SIZE 64
+#define BENCH_TBD_ROUNDS 16
+
+
+static const size_t bench_key_counts[] = {16, 64, 256};
+static const size_t bench_value_sizes[] = {8, 64};
+static const size_t bench_hunk_sizes[] = {1, 8, 32};
+
+
+static unsigned char bench_memory[TBD_MAX_SIZE];
+static char bench_keys[BENCH_TBD_MAX_KEY_COUNT][TBD_MAX_KEY_LENGTH + 1];
+static size_t bench_order[BENCH_TBD_MAX_KEY_COUNT];
+static unsigned char bench_value[BENCH_TBD_MAX_VALUE_SIZE];
+static unsigned char bench_read_value[BENCH_TBD_MAX_VALUE_SIZE];
+static unsigned long bench_samples[BENCH_TBD_MAX_KEY_COUNT * BENCH_TBD_ROUNDS];
+
+
+
+
+/** One point of the sweep.
+ */
+struct Bench {
+  tbd_t* tbd;
+  size_t key_count;
+  size_t value_size;
+  size_t hunk_size;
+  size_t sample_count;
+};
+
+
+
+
+static unsigned long bench_now(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (unsigned long) now.tv_sec * 1000000000ul + (unsigned long) now.tv_nsec;
+}
+
+
+
+
+static void bench_add_sample(struct Bench* bench, unsigned long start)
+{
+  bench_samples[bench->sample_count++] = bench_now() - start;
+}
+
+
+
+
+static int bench_sample_cmp(const void* a, const void* b)
+{
+  const unsigned long sample_a = *(const unsigned long*) a;
+  const unsigned long sample_b = *(const unsigned long*) b;
+
+  return (sample_a > sample_b) - (sample_a < sample_b);
+}
+
+
+
+
+static void bench_report(struct Bench* bench, const char* op)
+{
+  const size_t count = bench->sample_count;
+
+  if (!count)
+  {
+    return;
+  }
+
+  qsort(bench_samples, count, sizeof(bench_samples[0]), bench_sample_cmp);
+
+  double total = 0;
+
+  size_t i;
+  for (i = 0; i < count; ++i)
+  {
+    total += (double) bench_samples[i];
+  }
+
+  const double ns_per_op = total / (double) count;
+
+  printf("{\"op\":\"%s\",\"keys\":%zu,\"value_size\":%zu,\"hunk_size\":%zu,\"samples\":%zu,"
+         "\"ns_per_op\":%.1f,\"ops_per_sec\":%.0f,\"p50_ns\":%lu,\"p90_ns\":%lu,\"p99_ns\":%lu,\"max_ns\":%lu}\n",
+         op, bench->key_count, bench->value_size, bench->hunk_size, count,
+         ns_per_op, (ns_per_op > 0) ? 1e9 / ns_per_op : 0,
+         bench_samples[count / 2], bench_samples[count * 9 / 10], bench_samples[count * 99 / 100], bench_samples[count - 1]);
+
+  bench->sample_count = 0;
+}
+
+
+
+
+/** Shuffle the key order, the same way on every run.
+ */
+static void bench_shuffle(size_t key_count)
+{
+  static unsigned long state = 2463534242ul;
+
+  size_t i;
+  for (i = 0; i < key_count; ++i)
+  {
+    bench_order[i] = i;
+  }
+
+  for (i = key_count; i > 1; --i)
+  {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+
+    const size_t j = (size_t) (state % i);
+    const size_t temp = bench_order[i - 1];
+
+    bench_order[i - 1] = bench_order[j];
+    bench_order[j] = temp;
+  }
+}
+
+
+
+
+/** Empty the tbd and create every key, in shuffled order if is_shuffled.
+ */
+static bool bench_fill(struct Bench* bench, bool is_shuffled)
+{
+  tbd_empty(bench->tbd);
+
+  size_t i;
+  for (i = 0; i < bench->key_count; ++i)
+  {
+    const size_t key = is_shuffled ? bench_order[i] : i;
+
+    if (TBD_NO_ERROR != tbd_create(bench->tbd, bench_keys[key], bench_value, bench->value_size))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+
+
+/** Delete every other key, so garbage is spread through the heap.
+ */
+static void bench_delete_every_other(struct Bench* bench)
+{
+  size_t i;
+  for (i = 0; i < bench->key_count; i += 2)
+  {
+    tbd_delete(bench->tbd, bench_keys[i]);
+  }
+}
+
+
+
+
+static size_t bench_json_sink(void* context, const void* data, size_t size)
+{
+  (void) data;
+
+  *(size_t*) context += size;
+  return size;
+}
+
+
+
+
+static void bench_crud(struct Bench* bench)
+{
+  tbd_t* tbd = bench->tbd;
+  size_t round;
+  size_t i;
+
+  for (round = 0; round < BENCH_TBD_ROUNDS; ++round)
+  {
+    tbd_empty(tbd);
+
+    for (i = 0; i < bench->key_count; ++i)
+    {
+      const unsigned long start = bench_now();
+      tbd_create(tbd, bench_keys[i], bench_value, bench->value_size);
+      bench_add_sample(bench, start);
+    }
+  }
+
+  bench_report(bench, "create");
+
+  for (round = 0; round < BENCH_TBD_ROUNDS; ++round)
+  {
+    for (i = 0; i < bench->key_count; ++i)
+    {
+      const unsigned long start = bench_now();
+      tbd_read(tbd, bench_keys[bench_order[i]], bench_read_value, bench->value_size);
+      bench_add_sample(bench, start);
+    }
+  }
+
+  bench_report(bench, "read");
+
+  for (round = 0; round < BENCH_TBD_ROUNDS; ++round)
+  {
+    for (i = 0; i < bench->key_count; ++i)
+    {
+      const unsigned long start = bench_now();
+      tbd_read(tbd, "none", bench_read_value, bench->value_size);
+      bench_add_sample(bench, start);
+    }
+  }
+
+  bench_report(bench, "read_miss");
+
+  for (round = 0; round < BENCH_TBD_ROUNDS; ++round)
+  {
+    for (i = 0; i < bench->key_count; ++i)
+    {
+      const unsigned long start = bench_now();
+      tbd_update(tbd, bench_keys[bench_order[i]], bench_value, bench->value_size);
+      bench_add_sample(bench, start);
+    }
+  }
+
+  bench_report(bench, "update");
+
+  for (round = 0; round < BENCH_TBD_ROUNDS; ++round)
+  {
+    for (i = 0; i < bench->key_count; ++i)
+    {
+      const unsigned long start = bench_now();
+      tbd_put(tbd, bench_keys[bench_order[i]], bench_value, bench->value_size);
+      bench_add_sample(bench, start);
+    }
+  }
+
+  bench_report(bench, "put");
+
+  for (round = 0; round < BENCH_TBD_ROUNDS; ++round)
+  {
+    bench_fill(bench, false);
+
+    for (i = 0; i < bench->key_count; ++i)
+    {
+      const unsigned long start = bench_now();
+      tbd_delete(tbd, bench_keys[bench_order[i]]);
+      bench_add_sample(bench, start);
+    }
+  }
+
+  bench_report(bench, "delete");
+}
+
+
+
+
+static void bench_sort(struct Bench* bench)
+{
+  tbd_t* tbd = bench->tbd;
+  size_t round;
+
+  for (round = 0; round < BENCH_TBD_ROUNDS; ++round)
+  {
+    bench_fill(bench, true);
+
+    const unsigned long start = bench_now();
+    tbd_sort_by_key(tbd);
+    bench_add_sample(bench, start);
+  }
+
+  bench_report(bench, "sort_by_key");
+
+  for (round = 0; round < BENCH_TBD_ROUNDS; ++round)
+  {
+    // sorting shuffled keys by key leaves the heap out of order
+    bench_fill(bench, true);
+    tbd_sort_by_key(tbd);
+
+    const unsigned long start = bench_now();
+    tbd_sort_by_heap(tbd);
+    bench_add_sample(bench, start);
+  }
+
+  bench_report(bench, "sort_by_heap");
+}
+
+
+
+
+static void bench_garbage(struct Bench* bench)
+{
+  tbd_t* tbd = bench->tbd;
+  size_t round;
+
+  bench_fill(bench, false);
+  bench_delete_every_other(bench);
+
+  for (round = 0; round < BENCH_TBD_ROUNDS; ++round)
+  {
+    const unsigned long start = bench_now();
+    tbd_garbage_size(tbd);
+    bench_add_sample(bench, start);
+  }
+
+  bench_report(bench, "garbage_size");
+
+  for (round = 0; round < BENCH_TBD_ROUNDS; ++round)
+  {
+    const unsigned long start = bench_now();
+    tbd_garbage_count(tbd);
+    bench_add_sample(bench, start);
+  }
+
+  bench_report(bench, "garbage_count");
+
+  for (round = 0; round < BENCH_TBD_ROUNDS; ++round)
+  {
+    bench_fill(bench, false);
+    bench_delete_every_other(bench);
+
+    const unsigned long start = bench_now();
+    tbd_garbage_merge(tbd);
+    bench_add_sample(bench, start);
+  }
+
+  bench_report(bench, "garbage_merge");
+
+  for (round = 0; round < BENCH_TBD_ROUNDS; ++round)
+  {
+    // the newest half is on top of the stack and the heap, so all of it can be popped
+    bench_fill(bench, false);
+
+    size_t i;
+    for (i = bench->key_count; i > bench->key_count / 2; --i)
+    {
+      tbd_delete(tbd, bench_keys[i - 1]);
+    }
+
+    const unsigned long start = bench_now();
+    tbd_garbage_pop(tbd, TBD_MAX_SIZE);
+    bench_add_sample(bench, start);
+  }
+
+  bench_report(bench, "garbage_pop");
+
+  for (round = 0; round < BENCH_TBD_ROUNDS; ++round)
+  {
+    bench_fill(bench, false);
+    bench_delete_every_other(bench);
+
+    const unsigned long start = bench_now();
+    tbd_garbage_fold(tbd, TBD_MAX_SIZE);
+    bench_add_sample(bench, start);
+  }
+
+  bench_report(bench, "garbage_fold");
+
+  for (round = 0; round < BENCH_TBD_ROUNDS; ++round)
+  {
+    bench_fill(bench, false);
+    bench_delete_every_other(bench);
+
+    const unsigned long start = bench_now();
+    tbd_garbage_pack(tbd, TBD_MAX_SIZE);
+    bench_add_sample(bench, start);
+  }
+
+  bench_report(bench, "garbage_pack");
+
+  for (round = 0; round < BENCH_TBD_ROUNDS; ++round)
+  {
+    bench_fill(bench, false);
+    bench_delete_every_other(bench);
+
+    const unsigned long start = bench_now();
+    tbd_garbage_collect(tbd, TBD_MAX_SIZE);
+    bench_add_sample(bench, start);
+  }
+
+  bench_report(bench, "garbage_collect");
+
+  for (round = 0; round < BENCH_TBD_ROUNDS; ++round)
+  {
+    bench_fill(bench, false);
+    bench_delete_every_other(bench);
+
+    const unsigned long start = bench_now();
+    tbd_garbage_clean(tbd);
+    bench_add_sample(bench, start);
+  }
+
+  bench_report(bench, "garbage_clean");
+}
+
+
+
+
+static void bench_json(struct Bench* bench)
+{
+  tbd_t* tbd = bench->tbd;
+  size_t round;
+
+  bench_fill(bench, false);
+
+  for (round = 0; round < BENCH_TBD_ROUNDS; ++round)
+  {
+    size_t json_size = 0;
+
+    const unsigned long start = bench_now();
+    tbd_write_json(tbd, bench_json_sink, &json_size, TBD_KEY_TO_JSON_FORMAT_STRING, TBD_VALUE_TO_JSON_FORMAT_HEX);
+    bench_add_sample(bench, start);
+  }
+
+  bench_report(bench, "write_json");
+}
+
+
+
+
+/** Run every benchmark at one sweep point.
+ */
+static int bench_tbd_point(size_t key_count, size_t value_size, size_t hunk_size)
+{
+  tbd_init_t init = {
+    .start = bench_memory,
+    .size = sizeof(bench_memory) & TBD_MAX_SIZE,
+    .hunk_size = hunk_size,
+  };
+
+  struct Bench bench = {tbd_init(&init), key_count, value_size, hunk_size, 0};
+
+  if (!bench.tbd)
+  {
+    return TBD_ERROR;
+  }
+
+  // values are null terminated
+  memset(bench_value, 'v', value_size - 1);
+  bench_value[value_size - 1] = '\0';
+
+  if (!bench_fill(&bench, false))
+  {
+    printf("{\"keys\":%zu,\"value_size\":%zu,\"hunk_size\":%zu,\"skipped\":\"full\"}\n", key_count, value_size, hunk_size);
+    return TBD_NO_ERROR;
+  }
+
+  bench_shuffle(key_count);
+
+  bench_crud(&bench);
+  bench_sort(&bench);
+  bench_garbage(&bench);
+  bench_json(&bench);
+
+  return TBD_NO_ERROR;
+}
+
+
+
+
+int bench_tbd(void)
+{
+  size_t i;
+  for (i = 0; i < BENCH_TBD_MAX_KEY_COUNT; ++i)
+  {
+    snprintf(bench_keys[i], sizeof(bench_keys[i]), "k%07zu", i);
+  }
+
+  // measure the clock itself
+  struct Bench clock = {NULL, 0, 0, 0, 0};
+
+  for (i = 0; i < BENCH_TBD_ROUNDS * BENCH_TBD_MAX_KEY_COUNT; ++i)
+  {
+    const unsigned long start = bench_now();
+    bench_add_sample(&clock, start);
+  }
+
+  bench_report(&clock, "clock");
+
+  size_t k, v, h;
+  for (k = 0; k < sizeof(bench_key_counts) / sizeof(bench_key_counts[0]); ++k)
+  {
+    for (v = 0; v < sizeof(bench_value_sizes) / sizeof(bench_value_sizes[0]); ++v)
+    {
+      for (h = 0; h < sizeof(bench_hunk_sizes) / sizeof(bench_hunk_sizes[0]); ++h)
+      {
+        if (TBD_NO_ERROR != bench_tbd_point(bench_key_counts[k], bench_value_sizes[v], bench_hunk_sizes[h]))
+        {
+          return TBD_ERROR;
+        }
+      }
+    }
+  }
+
+  return TBD_NO_ERROR;
+}
@@ -0,0 +1,25 @@
+/** Benchmarks for tbd.
+ */
+
+
+#ifndef _BENCH_TBD_H_
+#define _BENCH_TBD_H_
+
+
+
+
+/** Run the benchmarks over a sweep of key counts, value sizes and hunk sizes.
+ *  Prints one JSON object per line for each operation at each sweep point, for example
+ *  {"op":"read","keys":64,"value_size":8,"hunk_size":1,"samples":1024,"ns_per_op":40.1,"ops_per_sec":24937655,"p50_ns":38,"p90_ns":45,"p99_ns":80,"max_ns":1210}
+ *
+ *  Each sample times one call, so times include the clock overhead printed first as the "clock" op.
+ *  Sweep points that do not fit in a tbd print a line with "skipped" set instead.
+ *
+ *  Returns 0 if successful.
+ */
+int bench_tbd(void);
+
+
+
+
+#endif/*_BENCH_TBD_H_*/
@@ -0,0 +1,393 @@
+/** Garbage collection simulator for tbd.
+ */
+
+
+
+#define _POSIX_C_SOURCE 199309L
+
+#include "gcsim_tbd.h"
+#include "tbd.h"
+
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+
+
+
+/*
+ * Simulator options.
+ */
+
+#define GCSIM_MAX_KEY_COUNT 1024
+#define GCSIM_MAX_VALUE_SIZE 256
+#define GCSIM_MAX_MAP_SIZE 128
+
+
+
+
+static const char* const gcsim_strategy_names[GCSIM_STRATEGY_COUNT] = {
+  "none", "pop", "merge", "fold", "pack", "collect"
+};
+
+
+
+
+/** State of a simulation.
+ */
+struct Sim {
+  tbd_t* tbd;
+  unsigned long long random_state;
+
+  size_t value_sizes[GCSIM_MAX_KEY_COUNT];   ///< Size of the value last written to each key, 0 if the key was deleted.
+
+  size_t failed_writes;
+  size_t gc_count;
+  double gc_total_ns;
+  size_t gc_moved_size;
+
+  size_t snapshot_count;
+  double fragmentation_total;
+  double fragmentation_max;
+};
+
+
+static unsigned char gcsim_memory[TBD_MAX_SIZE];
+static struct Sim sim;
+
+
+
+
+static unsigned long gcsim_now(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (unsigned long) now.tv_sec * 1000000000ul + (unsigned long) now.tv_nsec;
+}
+
+
+
+
+static unsigned long long gcsim_random(void)
+{
+  // xorshift64*
+  sim.random_state ^= sim.random_state >> 12;
+  sim.random_state ^= sim.random_state << 25;
+  sim.random_state ^= sim.random_state >> 27;
+
+  return sim.random_state * 2685821657736338717ull;
+}
+
+
+
+
+static void gcsim_key(char* key, size_t index)
+{
+  snprintf(key, TBD_MAX_KEY_LENGTH + 1, "k%04zu", index % 10000u);
+}
+
+
+
+
+/** Fill a value with text that depends on the key, so a value moved to the wrong key is noticed.
+ */
+static void gcsim_value(char* value, size_t index, size_t value_size)
+{
+  size_t i;
+  for (i = 0; i + 1 < value_size; ++i)
+  {
+    value[i] = (char) ('a' + (index + i) % 26);
+  }
+
+  value[value_size - 1] = '\0';
+}
+
+
+
+
+/** Run the garbage collection strategy once.
+ */
+static void gcsim_collect(const gcsim_params_t* params)
+{
+  tbd_stats_t stats;
+  tbd_stats_get(&stats, sim.tbd);
+
+  const size_t moved_size = stats.garbage_moved_size;
+  const unsigned long start = gcsim_now();
+
+  switch (params->strategy)
+  {
+    case GCSIM_STRATEGY_POP:
+      tbd_garbage_pop(sim.tbd, params->gc_limit);
+      break;
+
+    case GCSIM_STRATEGY_MERGE:
+      tbd_garbage_merge(sim.tbd);
+      tbd_garbage_pop(sim.tbd, params->gc_limit);
+      break;
+
+    case GCSIM_STRATEGY_FOLD:
+      tbd_garbage_fold(sim.tbd, params->gc_limit);
+      tbd_garbage_pop(sim.tbd, params->gc_limit);
+      break;
+
+    case GCSIM_STRATEGY_PACK:
+      tbd_garbage_pack(sim.tbd, params->gc_limit);
+      break;
+
+    case GCSIM_STRATEGY_COLLECT:
+      tbd_garbage_collect(sim.tbd, params->gc_limit);
+      break;
+
+    default:
+      return;
+  }
+
+  sim.gc_total_ns += (double) (gcsim_now() - start);
+  ++sim.gc_count;
+
+  tbd_stats_get(&stats, sim.tbd);
+  sim.gc_moved_size += stats.garbage_moved_size - moved_size;
+}
+
+
+
+
+static double gcsim_fragmentation(const tbd_stats_t* stats, size_t* free_size, size_t* largest_free_size)
+{
+  *free_size = stats->tbd_size - stats->tbd_size_used;
+  const size_t garbage_largest_size = tbd_garbage_largest_size(sim.tbd);
+  *largest_free_size = (*free_size > garbage_largest_size) ? *free_size : garbage_largest_size;
+
+  const size_t total_free_size = *free_size + stats->garbage_size;
+
+  return total_free_size ? 1.0 - (double) *largest_free_size / (double) total_free_size : 0;
+}
+
+
+
+
+static void gcsim_snapshot(const char* name, const gcsim_params_t* params, size_t op)
+{
+  tbd_stats_t stats;
+  tbd_stats_get(&stats, sim.tbd);
+
+  size_t free_size = 0;
+  size_t largest_free_size = 0;
+  const double fragmentation = gcsim_fragmentation(&stats, &free_size, &largest_free_size);
+
+  char map[GCSIM_MAX_MAP_SIZE + 1];
+  tbd_heap_map(map, (params->map_size < GCSIM_MAX_MAP_SIZE ? params->map_size : GCSIM_MAX_MAP_SIZE) + 1, sim.tbd);
+
+  ++sim.snapshot_count;
+  sim.fragmentation_total += fragmentation;
+
+  if (fragmentation > sim.fragmentation_max)
+  {
+    sim.fragmentation_max = fragmentation;
+  }
+
+  printf("{\"sim\":\"%s\",\"strategy\":\"%s\",\"hunk_size\":%zu,\"op\":%zu,\"keys\":%zu,\"used\":%zu,\"garbage\":%zu,"
+         "\"free\":%zu,\"largest_free\":%zu,\"fragmentation\":%.3f,\"map\":\"%s\"}\n",
+         name, gcsim_strategy_names[params->strategy], params->hunk_size, op, (size_t) stats.stack_count,
+         (size_t) stats.tbd_size_used, (size_t) stats.garbage_size, free_size, largest_free_size, fragmentation, map);
+}
+
+
+
+
+/** Check every value against what was written.
+ */
+static bool gcsim_verify(size_t key_count)
+{
+  char key[TBD_MAX_KEY_LENGTH + 1];
+  char expected[GCSIM_MAX_VALUE_SIZE];
+  char value[GCSIM_MAX_VALUE_SIZE];
+
+  size_t i;
+  for (i = 0; i < key_count; ++i)
+  {
+    gcsim_key(key, i);
+
+    const size_t value_size = sim.value_sizes[i];
+
+    if (!value_size)
+    {
+      if (tbd_read_size(sim.tbd, key))
+      {
+        return false;
+      }
+
+      continue;
+    }
+
+    gcsim_value(expected, i, value_size);
+
+    if (TBD_NO_ERROR != tbd_read(sim.tbd, key, value, value_size) || memcmp(expected, value, value_size))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+
+
+int gcsim_tbd_run(const char* name, const gcsim_params_t* params)
+{
+  if (!params || (params->key_count > GCSIM_MAX_KEY_COUNT) || (params->min_value_size < 2) ||
+      (params->max_value_size > GCSIM_MAX_VALUE_SIZE) || (params->min_value_size > params->max_value_size) ||
+      (params->strategy >= GCSIM_STRATEGY_COUNT))
+  {
+    return TBD_ERROR_BAD_SIZE;
+  }
+
+  memset(&sim, 0, sizeof(sim));
+
+  tbd_init_t init = {
+    .start = gcsim_memory,
+    .size = (params->tbd_size < sizeof(gcsim_memory)) ? params->tbd_size : sizeof(gcsim_memory),
+    .hunk_size = params->hunk_size,
+  };
+
+  sim.tbd = tbd_init(&init);
+
+  if (!sim.tbd)
+  {
+    return TBD_ERROR;
+  }
+
+  sim.random_state = params->seed ? params->seed : 1;
+
+  const size_t gc_threshold_size = (size_t) (params->gc_threshold * (double) init.size);
+  const size_t value_size_range = params->max_value_size - params->min_value_size + 1;
+
+  char key[TBD_MAX_KEY_LENGTH + 1];
+  char value[GCSIM_MAX_VALUE_SIZE];
+
+  size_t op;
+  for (op = 0; op < params->operation_count; ++op)
+  {
+    if (params->snapshot_interval && (0 == op % params->snapshot_interval))
+    {
+      gcsim_snapshot(name, params, op);
+    }
+
+    const size_t index = (size_t) (gcsim_random() % params->key_count);
+    gcsim_key(key, index);
+
+    if ((gcsim_random() % 100) < params->delete_percent)
+    {
+      if (TBD_NO_ERROR == tbd_delete(sim.tbd, key))
+      {
+        sim.value_sizes[index] = 0;
+      }
+    }
+    else
+    {
+      const size_t value_size = params->min_value_size + (size_t) (gcsim_random() % value_size_range);
+      gcsim_value(value, index, value_size);
+
+      int result = tbd_put(sim.tbd, key, value, value_size);
+
+      // a write that does not fit collects once and tries again
+      if ((TBD_NO_ERROR != result) && (GCSIM_STRATEGY_NONE != params->strategy))
+      {
+        gcsim_collect(params);
+        result = tbd_put(sim.tbd, key, value, value_size);
+      }
+
+      if (TBD_NO_ERROR == result)
+      {
+        sim.value_sizes[index] = value_size;
+      }
+      else
+      {
+        ++sim.failed_writes;
+      }
+    }
+
+    if (gc_threshold_size && (tbd_garbage_size(sim.tbd) > gc_threshold_size))
+    {
+      gcsim_collect(params);
+    }
+  }
+
+  if (params->snapshot_interval)
+  {
+    gcsim_snapshot(name, params, op);
+  }
+
+  const bool is_verified = gcsim_verify(params->key_count);
+
+  tbd_stats_t stats;
+  tbd_stats_get(&stats, sim.tbd);
+
+  char map[GCSIM_MAX_MAP_SIZE + 1];
+  tbd_heap_map(map, (params->map_size < GCSIM_MAX_MAP_SIZE ? params->map_size : GCSIM_MAX_MAP_SIZE) + 1, sim.tbd);
+
+  printf("{\"sim\":\"%s\",\"strategy\":\"%s\",\"hunk_size\":%zu,\"gc_threshold\":%.2f,\"gc_limit\":%zu,"
+         "\"operations\":%zu,\"failed_writes\":%zu,\"gc_count\":%zu,\"gc_mean_ns\":%.0f,"
+         "\"moved\":%zu,\"moved_per_gc\":%.1f,\"fragmentation_mean\":%.3f,\"fragmentation_max\":%.3f,"
+         "\"verified\":%s,\"map\":\"%s\"}\n",
+         name, gcsim_strategy_names[params->strategy], params->hunk_size, params->gc_threshold, params->gc_limit,
+         params->operation_count, sim.failed_writes, sim.gc_count,
+         sim.gc_count ? sim.gc_total_ns / (double) sim.gc_count : 0,
+         sim.gc_moved_size, sim.gc_count ? (double) sim.gc_moved_size / (double) sim.gc_count : 0,
+         sim.snapshot_count ? sim.fragmentation_total / (double) sim.snapshot_count : 0, sim.fragmentation_max,
+         is_verified ? "true" : "false", map);
+
+  return is_verified ? TBD_NO_ERROR : TBD_ERROR;
+}
+
+
+
+
+int gcsim_tbd(void)
+{
+  static const size_t hunk_sizes[] = {1, 8, 32};
+  static const double gc_thresholds[] = {0, 0.1, 0.25};
+
+  gcsim_params_t params = {
+    .tbd_size = 0x4000,
+    .key_count = 96,
+    .operation_count = 20000,
+    .min_value_size = 4,
+    .max_value_size = 64,
+    .delete_percent = 20,
+    .gc_limit = 0x4000,
+    .snapshot_interval = 5000,
+    .map_size = 64,
+    .seed = 1,
+  };
+
+  int result = TBD_NO_ERROR;
+
+  size_t i;
+  for (i = 0; i < sizeof(hunk_sizes) / sizeof(hunk_sizes[0]); ++i)
+  {
+    params.hunk_size = hunk_sizes[i];
+
+    size_t j;
+    for (j = 0; j < sizeof(gc_thresholds) / sizeof(gc_thresholds[0]); ++j)
+    {
+      params.gc_threshold = gc_thresholds[j];
+
+      // every strategy gets the same requests, so the summaries line up
+      int strategy;
+      for (strategy = 0; strategy < GCSIM_STRATEGY_COUNT; ++strategy)
+      {
+        params.strategy = (GCSIM_STRATEGY_ENUM) strategy;
+
+        result = result ? result : gcsim_tbd_run("churn", &params);
+      }
+    }
+  }
+
+  return result;
+}
@@ -0,0 +1,82 @@
+/** Garbage collection simulator for tbd.
+ *
+ *  Churns a tbd with puts and deletes of random sized values, runs a garbage collection strategy
+ *  whenever the garbage passes a threshold or a write does not fit, and reports how fragmented
+ *  the heap gets and how many bytes each collection moves.
+ */
+
+
+#ifndef _GCSIM_TBD_H_
+#define _GCSIM_TBD_H_
+
+
+
+
+#include <stddef.h>
+
+
+
+
+/** Garbage collection run by the simulator.
+ */
+typedef enum GCSIM_STRATEGY
+{
+  GCSIM_STRATEGY_NONE,       ///< Never collect, garbage is only reused by writes of the same hunk size.
+  GCSIM_STRATEGY_POP,        ///< tbd_garbage_pop.
+  GCSIM_STRATEGY_MERGE,      ///< tbd_garbage_merge then tbd_garbage_pop.
+  GCSIM_STRATEGY_FOLD,       ///< tbd_garbage_fold then tbd_garbage_pop.
+  GCSIM_STRATEGY_PACK,       ///< tbd_garbage_pack.
+  GCSIM_STRATEGY_COLLECT,    ///< tbd_garbage_collect.
+  GCSIM_STRATEGY_COUNT,
+
+} GCSIM_STRATEGY_ENUM;
+
+
+/** Parameters of a simulation.
+ */
+typedef struct gcsim_params_struct
+{
+  size_t tbd_size;                  ///< Size in bytes of the tbd, at most TBD_MAX_SIZE.
+  size_t hunk_size;                 ///< Hunk size of the tbd.
+  size_t key_count;                 ///< Number of different keys written.
+  size_t operation_count;           ///< Puts and deletes in the run.
+  size_t min_value_size;            ///< Smallest value in bytes, including the null terminator.
+  size_t max_value_size;            ///< Largest value in bytes, including the null terminator.
+  unsigned delete_percent;          ///< Percent of operations that are deletes, the rest are puts.
+
+  GCSIM_STRATEGY_ENUM strategy;
+  double gc_threshold;              ///< Collect when garbage is more than this fraction of the tbd size, 0 to only collect when a write does not fit.
+  size_t gc_limit;                  ///< Garbage limit passed to each collection.
+
+  size_t snapshot_interval;         ///< Operations between heap snapshots, 0 for none.
+  size_t map_size;                  ///< Characters in each heap map, at most 128.
+  unsigned long seed;               ///< Seed of the random number generator, runs with the same seed make the same requests.
+
+} gcsim_params_t;
+
+
+/** Run one simulation on an empty tbd.
+ *  Prints one JSON object per line for each snapshot, then one for the whole run.
+ *
+ *  A snapshot has the used, garbage and free bytes, the largest free hunk, the fragmentation ratio
+ *  and a heap map as drawn by tbd_heap_map.
+ *  The free bytes are the bytes between the stack and the heap, the largest free hunk is the larger of the free bytes
+ *  and the largest garbage, and the fragmentation ratio is 1 - largest free hunk / (free + garbage bytes).
+ *
+ *  Every value is checked against what was written when the run ends.
+ *
+ *  Returns 0 if successful, or TBD_ERROR if a value read back is wrong.
+ */
+int gcsim_tbd_run(const char* name, const gcsim_params_t* params);
+
+
+/** Compare every strategy side by side over a sweep of hunk sizes and thresholds.
+ *
+ *  Returns 0 if successful.
+ */
+int gcsim_tbd(void);
+
+
+
+
+#endif/*_GCSIM_TBD_H_*/
@@ -46,6 +46,32 @@
 static char json_buffer[256] = {0};
 
 
+// Room for the tbd header in front of small test tbds, enough for every TBD_USE_* option.
+#define TEST_TBD_HEAD_ROOM    (4096)
+
+
+
+
+/** Get the size of the tbd header, which grows with the TBD_USE_* options.
+ *  Small test tbds add it to their size, so they have the same room for keyvalues with every option.
+ */
+static size_t test_tbd_head_size(void)
+{
+  static unsigned char head_memory[TEST_TBD_HEAD_ROOM];
+  
+  tbd_init_t init = {
+    .start = head_memory,
+    .size = sizeof(head_memory),
+    .hunk_size = 1,
+  };
+  
+  tbd_t* tbd = tbd_init(&init);
+  assert(tbd);
+  
+  return tbd_head_size(tbd);
+}
+
+
 
 
 /* Simple structures used by tests. */
@@ -302,6 +328,65 @@ static int test_tbd_sort_by_heap(tbd_t* tbd)
 
 
 
+static int test_tbd_sort_by_key__garbage(tbd_t* tbd)
+{
+  START_TEST_TBD(tbd);
+  
+  // setup with the garbage at the bottom of the stack, so sorting moves it
+  int tbd_create_result = tbd_create(tbd, "c", "3", sizeof("3"));
+  assert(TBD_NO_ERROR == tbd_create_result);
+  
+  tbd_create_result = tbd_create(tbd, "b", "2", sizeof("2"));
+  assert(TBD_NO_ERROR == tbd_create_result);
+  
+  tbd_create_result = tbd_create(tbd, "a", "1", sizeof("1"));
+  assert(TBD_NO_ERROR == tbd_create_result);
+  
+  int tbd_delete_result = tbd_delete(tbd, "c");
+  assert(TBD_NO_ERROR == tbd_delete_result);
+  
+  // exercise
+  int tbd_sort_result = tbd_sort_by_key(tbd);
+  assert(TBD_NO_ERROR == tbd_sort_result);
+  
+  // the garbage list follows the garbage, so new keyvalues reuse the garbage and not the keyvalues moved over it
+  tbd_delete_result = tbd_delete(tbd, "b");
+  assert(TBD_NO_ERROR == tbd_delete_result);
+  
+  tbd_create_result = tbd_create(tbd, "d", "4", sizeof("4"));
+  assert(TBD_NO_ERROR == tbd_create_result);
+  
+  tbd_sort_result = tbd_sort_by_heap(tbd);
+  assert(TBD_NO_ERROR == tbd_sort_result);
+  
+  tbd_create_result = tbd_create(tbd, "e", "5", sizeof("5"));
+  assert(TBD_NO_ERROR == tbd_create_result);
+  
+  tbd_garbage_list_to_json(json_buffer, sizeof(json_buffer), tbd);
+  puts(json_buffer);
+  
+  char value[sizeof("1")];
+  int tbd_read_result = tbd_read(tbd, "a", value, sizeof(value));
+  assert(TBD_NO_ERROR == tbd_read_result);
+  assert(0 == strcmp("1", value));
+  
+  tbd_read_result = tbd_read(tbd, "d", value, sizeof(value));
+  assert(TBD_NO_ERROR == tbd_read_result);
+  assert(0 == strcmp("4", value));
+  
+  tbd_read_result = tbd_read(tbd, "e", value, sizeof(value));
+  assert(TBD_NO_ERROR == tbd_read_result);
+  assert(0 == strcmp("5", value));
+  
+  assert(3 == tbd_count(tbd));
+  
+  FINISH_TEST_TBD(tbd);
+  return TBD_NO_ERROR;
+}
+
+
+
+
 static int test_tbd_create(tbd_t* tbd)
 {
   START_TEST_TBD(tbd);  
@@ -374,570 +459,2636 @@ static int test_tbd_create__fill_tbd(tbd_t* tbd)
 
 
 
-static int test_tbd_read(tbd_t* tbd)
+static int test_tbd_max_count__reserve(tbd_t* tbd)
 {
   START_TEST_TBD(tbd);
   
-  const TBD_SIZE_T foo_size = sizeof(struct Foo); 
-  
-  /* Setup tbd_create */
-  struct Foo foo1 = {1, "a"};  
-  int tbd_create_result = tbd_create(tbd, "1", &foo1, foo_size);
-  assert(TBD_NO_ERROR == tbd_create_result);  
-
-  tbd_print_stats(tbd);
-    
-  /* Setup tbd_read */
-  struct Foo foo_result = {0};
+  // every key has 4 digits, so every keyvalue has the same size
+  char key[8] = {0};
+  unsigned n = 0;
+  const TBD_SIZE_T keyvalue_size = sizeof("0000") + sizeof(n);
   
-  /* Exercise tbd_read */
-  int tbd_read_result = tbd_read(tbd, "1", &foo_result, foo_size);
+  const TBD_SIZE_T max_count = tbd_max_count(tbd, keyvalue_size);
+  assert(0 < max_count);
   
-  /* Verify tbd_read */
-  assert(TBD_NO_ERROR == tbd_read_result);
-  assert(foo1.n == foo_result.n);
-  assert(0 == strcmp(foo1.str, foo_result.str));
+  // exercise, exactly max_count keyvalues fit
+  for (n = 0; n < max_count; ++n)
+  {
+    sprintf(key, "%04u", n);
+    int tbd_create_result = tbd_create(tbd, key, &n, sizeof(n));
+    assert(TBD_NO_ERROR == tbd_create_result);
+  }
   
-  // Add more key:value pairs
-  struct Foo foo = {2, "b"};  
-  tbd_create_result = tbd_create(tbd, "2", &foo, foo_size);
-  assert(TBD_NO_ERROR == tbd_create_result);    
+  assert(0 == tbd_max_count(tbd, keyvalue_size));
   
-  tbd_read_result = tbd_read(tbd, "2", &foo_result, foo_size);
-  assert(TBD_NO_ERROR == tbd_read_result);    
+  sprintf(key, "%04u", n);
+  int tbd_create_result = tbd_create(tbd, key, &n, sizeof(n));
+  assert(TBD_ERROR == tbd_create_result);
   
-  foo = (struct Foo) {3, "c"};
-  tbd_create_result = tbd_create(tbd, "3", &foo, foo_size);
+  // deleted keyvalues of the same size can be reused
+  int tbd_delete_result = tbd_delete(tbd, "0000");
+  assert(TBD_NO_ERROR == tbd_delete_result);
+  assert(1 == tbd_max_count(tbd, keyvalue_size));
+  
+  tbd_empty(tbd);
+  
+  // a reservation that does not fit changes nothing
+  int tbd_reserve_result = tbd_reserve(tbd, max_count + 1, keyvalue_size);
+  assert(TBD_ERROR_BAD_SIZE == tbd_reserve_result);
+  assert(0 == tbd_count(tbd));
+  
+  tbd_reserve_result = tbd_reserve(tbd, 3, keyvalue_size);
+  assert(TBD_NO_ERROR == tbd_reserve_result);
+  assert(3 == tbd_garbage_count(tbd));
+  assert(max_count == tbd_max_count(tbd, keyvalue_size));
+  
+  // fill the rest of the tbd with one large value
+  static unsigned char big_value[TBD_MAX_SIZE];
+  tbd_stats_t stats;
+  tbd_stats_get(&stats, tbd);
+  TBD_SIZE_T big_value_size = stats.tbd_size - stats.tbd_size_used - sizeof("big") - stats.tbd_keyvalue_size;
+  tbd_create_result = tbd_create(tbd, "big", big_value, big_value_size);
   assert(TBD_NO_ERROR == tbd_create_result);
+  assert(3 == tbd_max_count(tbd, keyvalue_size));
   
-  tbd_read_result = tbd_read(tbd, "3", &foo_result, foo_size);
-  assert(TBD_NO_ERROR == tbd_read_result);  
+  // the reserved keyvalues can still be created
+  for (n = 0; n < 3; ++n)
+  {
+    sprintf(key, "%04u", n);
+    tbd_create_result = tbd_create(tbd, key, &n, sizeof(n));
+    assert(TBD_NO_ERROR == tbd_create_result);
+  }
   
-  FINISH_TEST_TBD(tbd);   
+  assert(0 == tbd_garbage_count(tbd));
+  assert(0 == tbd_max_count(tbd, keyvalue_size));
+  
+  FINISH_TEST_TBD(tbd);
   return TBD_NO_ERROR;
 }
 
 
 
 
-static int test_tbd_update(tbd_t* tbd)
+static int test_tbd_read__filter(void)
 {
-  START_TEST_TBD(tbd);  
+  // setup a tbd with a filter
+  static unsigned char filter_memory[4096];
+  static unsigned char copy_memory[4096];
 
-  struct Foo foo1 = {1, "a"};  
-  int tbd_create_result = tbd_create(tbd, "f", &foo1, sizeof(struct Foo));
-  assert(TBD_NO_ERROR == tbd_create_result);    
-  
-  // Setup tbd_update
-  foo1.n = 2;
+  tbd_init_t init = {
+    .start = filter_memory,
+    .size = sizeof(filter_memory),
+    .hunk_size = 1,
+    .filter_size = 256,
+  };
+
+  tbd_t* tbd = tbd_init(&init);
   
-  // Exercise tbd_update
-  int tbd_update_result = tbd_update(tbd, "f", &foo1, sizeof(struct Foo));
+  START_TEST_TBD(tbd);
   
-  // Verify tbd_update
-  assert(TBD_NO_ERROR == tbd_update_result);
-
-  struct Foo foo2 = {0};   
-  int tbd_read_result = tbd_read(tbd, "f", &foo2, sizeof(struct Foo));
+  tbd_stats_t stats;
+  tbd_stats_get(&stats, tbd);
+  assert(256 == stats.filter_size);
   
-  // Verify tbd_read
-  assert(TBD_NO_ERROR == tbd_read_result);
-  assert(foo1.n == foo2.n);
-  assert(0 == strcmp(foo1.str, foo2.str));  
+  char key[8] = {0};
+  char value[8] = {0};
+  unsigned n;
   
+  for (n = 0; n < 20; ++n)
+  {
+    sprintf(key, "k%u", n);
+    int tbd_create_result = tbd_create(tbd, key, "v", sizeof("v"));
+    assert(TBD_NO_ERROR == tbd_create_result);
+  }
   
-  // Exercise with different object
-  struct Bar bar1 = {0};
+  // exercise, keys that were never created are mostly rejected
+  for (n = 20; n < 120; ++n)
+  {
+    sprintf(key, "k%u", n);
+    int tbd_read_result = tbd_read(tbd, key, value, sizeof("v"));
+    assert(TBD_ERROR_KEY_NOT_FOUND == tbd_read_result);
+  }
   
-  tbd_update_result = tbd_update(tbd, "f", &bar1, sizeof(struct Bar));
-  assert(TBD_ERROR_BAD_SIZE == tbd_update_result);
+  tbd_stats_get(&stats, tbd);
+  assert(80 < stats.filter_reject_count);
   
-  FINISH_TEST_TBD(tbd);   
-  return TBD_NO_ERROR;
-}
-
-
-
-
-static int test_tbd_delete(tbd_t* tbd)
-{
-  START_TEST_TBD(tbd);
+  // deleted keys are rejected, moved keys are still found
+  int tbd_delete_result = tbd_delete(tbd, "k0");
+  assert(TBD_NO_ERROR == tbd_delete_result);
   
-  struct Foo foo1 = {1, "a"};  
-  int tbd_create_result = tbd_create(tbd, "f", &foo1, sizeof(struct Foo));
-  assert(TBD_NO_ERROR == tbd_create_result);   
+  int tbd_append_result = tbd_append(tbd, "k1", "w", 1);
+  assert(TBD_NO_ERROR == tbd_append_result);
   
-  tbd_print_stats(tbd);  
+  int tbd_put_result = tbd_put(tbd, "k2", "vvvvv", sizeof("vvvvv"));
+  assert(TBD_NO_ERROR == tbd_put_result);
   
-  /* Exercise tbd_delete */
-  int tbd_delete_result = tbd_delete(tbd, "f");
+  tbd_garbage_clean(tbd);
   
-  /* verify tbd_delete */
-  assert(TBD_NO_ERROR == tbd_delete_result);
+  const TBD_SIZE_T reject_count = stats.filter_reject_count;
+  tbd_stats_get(&stats, tbd);
   
-  tbd_print_stats(tbd);  
-
-  // attempt to read deleted object
-  int tbd_read_result = tbd_read(tbd, "f", &foo1, sizeof(struct Foo));
-  assert(TBD_ERROR_KEY_NOT_FOUND == tbd_read_result);  
+  int tbd_read_result = tbd_read(tbd, "k0", value, sizeof("v"));
+  assert(TBD_ERROR_KEY_NOT_FOUND == tbd_read_result);
   
-  FINISH_TEST_TBD(tbd);   
-  return TBD_NO_ERROR;
-}
-
-
-
-
-static int test_tbd_read_size(tbd_t* tbd)
-{
-  START_TEST_TBD(tbd);
+  tbd_read_result = tbd_read(tbd, "k1", value, sizeof("vw"));
+  assert(TBD_NO_ERROR == tbd_read_result);
+  assert(0 == strcmp("vw", value));
   
-  // Exercise with empty tbd
-  size_t tbd_read_size_result = tbd_read_size(tbd, "f");
-  assert(0 == tbd_read_size_result);
+  tbd_read_result = tbd_read(tbd, "k2", value, sizeof("vvvvv"));
+  assert(TBD_NO_ERROR == tbd_read_result);
   
+  for (n = 1; n < 20; ++n)
+  {
+    sprintf(key, "k%u", n);
+    assert(tbd_read_size(tbd, key));
+  }
   
-  // Exercise with element
-  struct Foo foo1 = {1, "a"};  
-  int tbd_create_result = tbd_create(tbd, "f", &foo1, sizeof(struct Foo));
-  assert(TBD_NO_ERROR == tbd_create_result);   
+  tbd_stats_get(&stats, tbd);
+  assert(reject_count < stats.filter_reject_count);
   
-  tbd_read_size_result = tbd_read_size(tbd, "f");
-  assert(sizeof(struct Foo) == tbd_read_size_result);
+  // swept keys are rejected
+  int tbd_expire_result = tbd_expire(tbd, "k3", 5);
+  assert(TBD_NO_ERROR == tbd_expire_result);
   
+  tbd_set_time(tbd, 5);
   
-  FINISH_TEST_TBD(tbd);   
-  return TBD_NO_ERROR;  
-}
-
-
-
-
-static int test_tbd_garbage_size(tbd_t* tbd)
-{
-  START_TEST_TBD(tbd);  
-
-  // test with clear database
-  size_t tbd_garbage_size_result = tbd_garbage_size(tbd);
-  assert(0 == tbd_garbage_size_result);  
+  TBD_SIZE_T tbd_expire_sweep_result = tbd_expire_sweep(tbd, tbd_count(tbd));
+  assert(1 == tbd_expire_sweep_result);
   
+  const TBD_SIZE_T sweep_reject_count = stats.filter_reject_count;
   
-  // setup database with 1 element
-  struct Foo foo1 = {1, "a"};
+  tbd_read_result = tbd_read(tbd, "k3", value, sizeof("v"));
+  assert(TBD_ERROR_KEY_NOT_FOUND == tbd_read_result);
   
-  int tbd_create_result = tbd_create(tbd, "1", &foo1, sizeof(struct Foo));
-  assert(TBD_NO_ERROR ==  tbd_create_result);
+  tbd_stats_get(&stats, tbd);
+  assert(sweep_reject_count + 1 == stats.filter_reject_count);
   
-  tbd_print_stats(tbd);
+  tbd_set_time(tbd, 0);
   
-  int tbd_delete_result = tbd_delete(tbd, "1");
-  assert(TBD_NO_ERROR ==  tbd_delete_result);
+  // copies have a filter of their own
+  tbd_init_t copy_init = init;
+  copy_init.start = copy_memory;
   
-  tbd_garbage_size_result = tbd_garbage_size(tbd);
-  assert(0 < tbd_garbage_size_result);
-
-  tbd_print_stats(tbd);  
+  tbd_t* copy = tbd_init(&copy_init);
   
-  // add another element
-  struct Foo foo2 = {2, "b"};  
+  int tbd_copy_result = tbd_copy(copy, tbd);
+  assert(TBD_NO_ERROR == tbd_copy_result);
+  assert(tbd_read_size(copy, "k19"));
+  assert(!tbd_read_size(copy, "k0"));
   
-  tbd_create_result = tbd_create(tbd, "2", &foo2, sizeof(struct Foo));
-  assert(TBD_NO_ERROR ==  tbd_create_result);
+  tbd_copy_result = tbd_copy_raw(copy, tbd);
+  assert(TBD_NO_ERROR == tbd_copy_result);
+  assert(tbd_read_size(copy, "k19"));
   
-  tbd_print_stats(tbd);  
+  // a filter of a different size has a different layout
+  copy_init.filter_size = 128;
+  copy = tbd_init(&copy_init);
   
-  tbd_delete_result = tbd_delete(tbd, "2");
-  assert(TBD_NO_ERROR ==  tbd_delete_result);
+  tbd_copy_result = tbd_copy_raw(copy, tbd);
+  assert(TBD_ERROR_BAD_SIZE == tbd_copy_result);
   
-  tbd_garbage_size_result = tbd_garbage_size(tbd);
-  assert(0 < tbd_garbage_size_result);
+  // a filter larger than the tbd does not fit
+  copy_init.filter_size = sizeof(copy_memory);
+  assert(!tbd_init(&copy_init));
   
-  FINISH_TEST_TBD(tbd);   
+  FINISH_TEST_TBD(tbd);
   return TBD_NO_ERROR;
 }
 
 
 
 
-static int test_tbd_garbage_merge(tbd_t* tbd)
+static int test_tbd_read__fingerprints(tbd_t* tbd)
 {
   START_TEST_TBD(tbd);
   
-  setup_tbd_with_Foo(tbd);
-  
-  // exercise with no garbage elements
-  TBD_SIZE_T tbd_garbage_merge_result = tbd_garbage_merge(tbd);
-  assert(0 == tbd_garbage_merge_result);
-  
+  // more keys than fingerprints, so some keys share one
+  char key[8] = {0};
+  char value[8] = {0};
+  unsigned n;
   
-  // setup with 1 garbage element
-  int tbd_delete_result = tbd_delete(tbd, "y");
-  assert(TBD_NO_ERROR == tbd_delete_result);
+  for (n = 0; n < 300; ++n)
+  {
+    sprintf(key, "f%u", n);
+    int tbd_create_result = tbd_create(tbd, key, key, strlen(key) + 1);
+    assert(TBD_NO_ERROR == tbd_create_result);
+  }
   
-  // exercise with 1 garbage element
-  tbd_garbage_merge_result = tbd_garbage_merge(tbd);
-  assert(0 == tbd_garbage_merge_result);  
+  // exercise, moving keyvalues keeps their fingerprints
+  for (n = 0; n < 300; n += 3)
+  {
+    sprintf(key, "f%u", n);
+    int tbd_delete_result = tbd_delete(tbd, key);
+    assert(TBD_NO_ERROR == tbd_delete_result);
+  }
   
+  int tbd_put_result = tbd_put(tbd, "f1", "f1", sizeof("f1"));
+  assert(TBD_NO_ERROR == tbd_put_result);
   
-  // setup with 2 garbage elements
-  tbd_delete_result = tbd_delete(tbd, "z");
-  assert(TBD_NO_ERROR == tbd_delete_result);
+  int tbd_append_result = tbd_append(tbd, "f2", "", 1);
+  assert(TBD_NO_ERROR == tbd_append_result);
   
-  // exercise with 2 garbage elements
-  tbd_garbage_merge_result = tbd_garbage_merge(tbd);
-  assert(0 < tbd_garbage_merge_result);   
+  tbd_garbage_clean(tbd);
   
+  // verify, each key finds its own value
+  for (n = 0; n < 300; ++n)
+  {
+    sprintf(key, "f%u", n);
+    if (n % 3 == 0)
+    {
+      assert(!tbd_read_size(tbd, key));
+    }
+    else
+    {
+      int tbd_read_result = tbd_read(tbd, key, value, strlen(key) + 1);
+      assert(TBD_NO_ERROR == tbd_read_result);
+      assert(0 == strcmp(key, value));
+    }
+  }
   
-  FINISH_TEST_TBD(tbd);   
-  return TBD_NO_ERROR;  
+  FINISH_TEST_TBD(tbd);
+  return TBD_NO_ERROR;
 }
 
 
 
 
-static int test_tbd_garbage_pop(tbd_t* tbd)
+static int test_tbd_create__evict(void)
 {
+  // setup a small tbd that evicts when full
+  static unsigned char cache_memory[TEST_TBD_HEAD_ROOM + 1024];
+
+  tbd_init_t init = {
+    .start = cache_memory,
+    .size = test_tbd_head_size() + 1024,
+    .hunk_size = 1,
+    .flags = TBD_INIT_FLAG_EVICT,
+  };
+
+  tbd_t* tbd = tbd_init(&init);
+
   START_TEST_TBD(tbd);
-  
-  /* setup database with 1 element */
-  struct Foo foo1 = {1, "a"};
-  
-  int tbd_create_result = tbd_create(tbd, "1", &foo1, sizeof(struct Foo));
+
+  struct Foo hot = {1, "h"};
+  int tbd_create_result = tbd_create(tbd, "hot", &hot, sizeof(struct Foo));
   assert(TBD_NO_ERROR == tbd_create_result);
-  tbd_print_stats(tbd);
-  
-  size_t tbd_garbage_size_result = tbd_garbage_size(tbd);
+
+  // exercise, insert many more keyvalues than fit while reading the hot key
+  struct Foo foo = {2, "c"};
+  char key[TBD_MAX_KEY_LENGTH + 1] = {0};
+
+  for (int key_n = 0; key_n < 200; ++key_n)
+  {
+    sprintf(key, "%d", key_n);
+
+    tbd_create_result = tbd_create(tbd, key, &foo, sizeof(struct Foo));
+    assert(TBD_NO_ERROR == tbd_create_result);
+
+    struct Foo foo_result = {0};
+    int tbd_read_result = tbd_read(tbd, "hot", &foo_result, sizeof(struct Foo));
+    assert(TBD_NO_ERROR == tbd_read_result);
+    assert(1 == foo_result.n);
+  }
+
+  // verify the newest key was kept and the oldest cold key was evicted
+  struct Foo foo_result = {0};
+  int tbd_read_result = tbd_read(tbd, key, &foo_result, sizeof(struct Foo));
+  assert(TBD_NO_ERROR == tbd_read_result);
+  assert(2 == foo_result.n);
+
+  tbd_read_result = tbd_read(tbd, "0", &foo_result, sizeof(struct Foo));
+  assert(TBD_ERROR_KEY_NOT_FOUND == tbd_read_result);
+
+  tbd_stats_t stats;
+  tbd_stats_get(&stats, tbd);
+  assert(0 < stats.evict_count);
+  assert(0 < stats.read_hit_count);
+  assert(1 == stats.read_miss_count);
+
+  FINISH_TEST_TBD(tbd);
+  return TBD_NO_ERROR;
+}
+
+
+
+
+static int test_tbd_read(tbd_t* tbd)
+{
+  START_TEST_TBD(tbd);
+  
+  const TBD_SIZE_T foo_size = sizeof(struct Foo); 
+  
+  /* Setup tbd_create */
+  struct Foo foo1 = {1, "a"};  
+  int tbd_create_result = tbd_create(tbd, "1", &foo1, foo_size);
+  assert(TBD_NO_ERROR == tbd_create_result);  
+
+  tbd_print_stats(tbd);
+    
+  /* Setup tbd_read */
+  struct Foo foo_result = {0};
+  
+  /* Exercise tbd_read */
+  int tbd_read_result = tbd_read(tbd, "1", &foo_result, foo_size);
+  
+  /* Verify tbd_read */
+  assert(TBD_NO_ERROR == tbd_read_result);
+  assert(foo1.n == foo_result.n);
+  assert(0 == strcmp(foo1.str, foo_result.str));
+  
+  // Add more key:value pairs
+  struct Foo foo = {2, "b"};  
+  tbd_create_result = tbd_create(tbd, "2", &foo, foo_size);
+  assert(TBD_NO_ERROR == tbd_create_result);    
+  
+  tbd_read_result = tbd_read(tbd, "2", &foo_result, foo_size);
+  assert(TBD_NO_ERROR == tbd_read_result);    
+  
+  foo = (struct Foo) {3, "c"};
+  tbd_create_result = tbd_create(tbd, "3", &foo, foo_size);
+  assert(TBD_NO_ERROR == tbd_create_result);
+  
+  tbd_read_result = tbd_read(tbd, "3", &foo_result, foo_size);
+  assert(TBD_NO_ERROR == tbd_read_result);  
+  
+  FINISH_TEST_TBD(tbd);   
+  return TBD_NO_ERROR;
+}
+
+
+
+
+/** Trace hook that checks the events of each read are nested, and counts the reads.
+ */
+static void test_tbd_trace_nesting(void* context, TBD_TRACE_ENUM event, unsigned id, TBD_SIZE_T size)
+{
+  unsigned* nesting = (unsigned*) context;   // depth, then number of reads
+  
+  (void) id;
+  (void) size;
+  
+  switch (event)
+  {
+    case TBD_TRACE_OP_BEGIN:
+      assert(0 == nesting[0]);
+      nesting[0] = 1;
+      ++nesting[1];
+      break;
+      
+    case TBD_TRACE_FIND_BEGIN:
+      assert(1 == nesting[0]);
+      nesting[0] = 2;
+      break;
+      
+    case TBD_TRACE_CACHE_HIT:
+    case TBD_TRACE_FILTER_REJECT:
+      assert(2 == nesting[0]);
+      break;
+      
+    case TBD_TRACE_FIND_END:
+      assert(2 == nesting[0]);
+      nesting[0] = 1;
+      break;
+      
+    case TBD_TRACE_OP_END:
+      assert(1 == nesting[0]);
+      nesting[0] = 0;
+      break;
+      
+    default:
+      break;
+  }
+}
+
+
+
+
+static int test_tbd_read_multi(tbd_t* tbd)
+{
+  START_TEST_TBD(tbd);
+  
+  // setup, more keys than one batch, every third one missing
+  char keys[40][8];
+  const char* key_ptrs[40];
+  char values[40][8];
+  void* value_ptrs[40];
+  size_t value_sizes[40];
+  int results[40];
+  unsigned n;
+  
+  for (n = 0; n < 40; ++n)
+  {
+    sprintf(keys[n], "m%u", n);
+    key_ptrs[n] = keys[n];
+    value_ptrs[n] = values[n];
+    value_sizes[n] = strlen(keys[n]) + 1;
+    
+    if (n % 3)
+    {
+      int tbd_create_result = tbd_create(tbd, keys[n], keys[n], value_sizes[n]);
+      assert(TBD_NO_ERROR == tbd_create_result);
+    }
+  }
+  
+  // one value of the wrong size
+  value_sizes[1] = 1;
+  
+  tbd_stats_t stats_before;
+  tbd_stats_get(&stats_before, tbd);
+  
+  // exercise
+  int tbd_read_multi_result = tbd_read_multi(tbd, 40, key_ptrs, value_ptrs, value_sizes, results);
+  
+  // verify
+  assert(TBD_ERROR_KEY_NOT_FOUND == tbd_read_multi_result);
+  assert(TBD_ERROR_BAD_SIZE == results[1]);
+  
+  for (n = 2; n < 40; ++n)
+  {
+    if (n % 3)
+    {
+      assert(TBD_NO_ERROR == results[n]);
+      assert(0 == strcmp(keys[n], values[n]));
+    }
+    else
+    {
+      assert(TBD_ERROR_KEY_NOT_FOUND == results[n]);
+    }
+  }
+  
+  tbd_stats_t stats_after;
+  tbd_stats_get(&stats_after, tbd);
+  assert(40 == stats_after.read_count - stats_before.read_count);
+  
+  // setup a batch with cache hits, expired keys, one only in the stack, and duplicate keys
+  int tbd_create_result = tbd_create(tbd, "x", "x", sizeof("x"));
+  assert(TBD_NO_ERROR == tbd_create_result);
+  
+  int tbd_expire_result = tbd_expire(tbd, "m4", 5);
+  assert(TBD_NO_ERROR == tbd_expire_result);
+  
+  tbd_expire_result = tbd_expire(tbd, "x", 5);
+  assert(TBD_NO_ERROR == tbd_expire_result);
+  
+  tbd_set_time(tbd, 10);
+  
+  const char* batch_keys[] = {"m2", "m4", "m2", "x", "x", "m7"};
+  const int batch_expected[] = {TBD_NO_ERROR, TBD_ERROR_KEY_NOT_FOUND, TBD_NO_ERROR, TBD_ERROR_KEY_NOT_FOUND, TBD_ERROR_KEY_NOT_FOUND, TBD_NO_ERROR};
+  const unsigned batch_count = sizeof(batch_keys) / sizeof(batch_keys[0]);
+  
+  for (n = 0; n < batch_count; ++n)
+  {
+    value_sizes[n] = strlen(batch_keys[n]) + 1;
+    memset(values[n], 0, sizeof(values[n]));
+  }
+  
+  unsigned nesting[2] = {0};
+  const int tbd_set_trace_result = tbd_set_trace(tbd, test_tbd_trace_nesting, nesting);
+  
+  tbd_stats_get(&stats_before, tbd);
+  
+  // exercise
+  tbd_read_multi_result = tbd_read_multi(tbd, batch_count, batch_keys, value_ptrs, value_sizes, results);
+  
+  tbd_stats_get(&stats_after, tbd);
+  tbd_set_trace(tbd, NULL, NULL);
+  tbd_set_time(tbd, 0);
+  
+  // verify, the results are what reading each key in turn gives
+  assert(TBD_ERROR_KEY_NOT_FOUND == tbd_read_multi_result);
+  
+  for (n = 0; n < batch_count; ++n)
+  {
+    assert(batch_expected[n] == results[n]);
+    assert((TBD_NO_ERROR != results[n]) || (0 == strcmp(batch_keys[n], values[n])));
+  }
+  
+  assert(batch_count == stats_after.read_count - stats_before.read_count);
+  assert(2 <= stats_after.lookup_cache_hit_count - stats_before.lookup_cache_hit_count);
+  
+  if (TBD_NO_ERROR == tbd_set_trace_result)
+  {
+    assert(0 == nesting[0]);
+    assert(batch_count == nesting[1]);
+  }
+  
+  // reading nothing succeeds
+  tbd_read_multi_result = tbd_read_multi(tbd, 0, NULL, NULL, NULL, NULL);
+  assert(TBD_NO_ERROR == tbd_read_multi_result);
+  
+  FINISH_TEST_TBD(tbd);
+  return TBD_NO_ERROR;
+}
+
+
+
+
+static int test_tbd_read__lookup_cache(tbd_t* tbd)
+{
+  START_TEST_TBD(tbd);
+  
+  // keys are created out of order so that sorting moves them
+  const char* keys[] = {"k3", "k2", "k1", "k0"};
+  const TBD_SIZE_T key_count = sizeof(keys) / sizeof(keys[0]);
+  
+  TBD_SIZE_T i;
+  for (i = 0; i < key_count; ++i)
+  {
+    int tbd_create_result = tbd_create(tbd, keys[i], keys[i], sizeof("k0"));
+    assert(TBD_NO_ERROR == tbd_create_result);
+  }
+  
+  tbd_stats_t stats_before;
+  tbd_stats_get(&stats_before, tbd);
+  
+  // exercise round robin reads, the first pass fills the cache
+  char text[4] = {0};
+  TBD_SIZE_T pass;
+  for (pass = 0; pass < 3; ++pass)
+  {
+    for (i = 0; i < key_count; ++i)
+    {
+      int tbd_read_result = tbd_read(tbd, keys[i], text, sizeof("k0"));
+      assert(TBD_NO_ERROR == tbd_read_result);
+    }
+  }
+  
+  tbd_stats_t stats_after;
+  tbd_stats_get(&stats_after, tbd);
+  assert(stats_after.lookup_cache_hit_count > stats_before.lookup_cache_hit_count);
+  
+  // exercise sort, the cached keyvalues are moved
+  int tbd_sort_by_key_result = tbd_sort_by_key(tbd);
+  assert(TBD_NO_ERROR == tbd_sort_by_key_result);
+  
+  for (i = 0; i < key_count; ++i)
+  {
+    int tbd_read_result = tbd_read(tbd, keys[i], text, sizeof("k0"));
+    assert(TBD_NO_ERROR == tbd_read_result);
+    assert(0 == strcmp(keys[i], text));
+  }
+  
+  // exercise delete, the cached keyvalue must not be found
+  int tbd_delete_result = tbd_delete(tbd, "k1");
+  assert(TBD_NO_ERROR == tbd_delete_result);
+  
+  int tbd_read_result = tbd_read(tbd, "k1", text, sizeof("k0"));
+  assert(TBD_ERROR_KEY_NOT_FOUND == tbd_read_result);
+  
+  FINISH_TEST_TBD(tbd);
+  return TBD_NO_ERROR;
+}
+
+
+
+
+/** Fake clock that moves 5 ticks every time it is read.
+ */
+static TBD_TIME_T test_tbd_clock(void)
+{
+  static TBD_TIME_T now = 0;
+  
+  now += 5;
+  return now;
+}
+
+
+
+
+static int test_tbd_read__op_stats(tbd_t* tbd)
+{
+  START_TEST_TBD(tbd);
+  
+  const int tbd_set_clock_result = tbd_set_clock(tbd, test_tbd_clock);
+  
+  int tbd_create_result = tbd_create(tbd, "n", "09", sizeof("09"));
+  assert(TBD_NO_ERROR == tbd_create_result);
+  
+  tbd_stats_t stats_before;
+  tbd_stats_get(&stats_before, tbd);
+  
+  tbd_create_result = tbd_create(tbd, "k0", "v0", sizeof("v0"));
+  assert(TBD_NO_ERROR == tbd_create_result);
+  
+  tbd_create_result = tbd_create(tbd, "k1", "v1", sizeof("v1"));
+  assert(TBD_NO_ERROR == tbd_create_result);
+  
+  // exercise a hit and a miss
+  char text[4] = {0};
+  int tbd_read_result = tbd_read(tbd, "k0", text, sizeof("v0"));
+  assert(TBD_NO_ERROR == tbd_read_result);
+  
+  tbd_read_result = tbd_read(tbd, "kx", text, sizeof("v0"));
+  assert(TBD_ERROR_KEY_NOT_FOUND == tbd_read_result);
+  
+  int tbd_put_result = tbd_put(tbd, "k1", "w1", sizeof("w1"));
+  assert(TBD_NO_ERROR == tbd_put_result);
+  
+  int tbd_delete_result = tbd_delete(tbd, "k0");
+  assert(TBD_NO_ERROR == tbd_delete_result);
+  
+  // the other changes are counted too
+  int tbd_cas_result = tbd_cas(tbd, "k1", "w1", "x1", sizeof("x1"));
+  assert(TBD_NO_ERROR == tbd_cas_result);
+  
+  int tbd_incr_result = tbd_incr(tbd, "n", 1, NULL, TBD_INCR_OVERFLOW_ERROR);
+  assert(TBD_NO_ERROR == tbd_incr_result);
+  
+  int tbd_append_result = tbd_append(tbd, "k1", "y", 1);
+  assert(TBD_NO_ERROR == tbd_append_result);
+  
+  tbd_stats_t stats_after;
+  tbd_stats_get(&stats_after, tbd);
+  
+  assert(2 == stats_after.create_count - stats_before.create_count);
+  assert(2 == stats_after.read_count - stats_before.read_count);
+  assert(1 == stats_after.read_hit_count - stats_before.read_hit_count);
+  assert(1 == stats_after.read_miss_count - stats_before.read_miss_count);
+  assert(1 == stats_after.put_count - stats_before.put_count);
+  assert(1 == stats_after.delete_count - stats_before.delete_count);
+  assert(1 == stats_after.cas_count - stats_before.cas_count);
+  assert(1 == stats_after.incr_count - stats_before.incr_count);
+  assert(1 == stats_after.append_count - stats_before.append_count);
+  assert(stats_after.find_count > stats_before.find_count);
+  assert(stats_after.find_scan_count > stats_before.find_scan_count);
+  
+  // the fake clock makes every operation take 5 ticks, which falls in bucket 2
+  if (TBD_NO_ERROR == tbd_set_clock_result)
+  {
+    assert(2 == stats_after.latency_histogram[TBD_OP_CREATE][2] - stats_before.latency_histogram[TBD_OP_CREATE][2]);
+    assert(2 == stats_after.latency_histogram[TBD_OP_READ][2] - stats_before.latency_histogram[TBD_OP_READ][2]);
+    assert(0 == stats_after.latency_histogram[TBD_OP_UPDATE][2] - stats_before.latency_histogram[TBD_OP_UPDATE][2]);
+    assert(1 == stats_after.latency_histogram[TBD_OP_APPEND][2] - stats_before.latency_histogram[TBD_OP_APPEND][2]);
+  }
+  
+  tbd_set_clock(tbd, NULL);
+  
+  FINISH_TEST_TBD(tbd);
+  return TBD_NO_ERROR;
+}
+
+
+
+
+/** Trace hook that counts each event.
+ */
+static void test_tbd_trace(void* context, TBD_TRACE_ENUM event, unsigned id, TBD_SIZE_T size)
+{
+  unsigned* event_count = (unsigned*) context;
+  
+  (void) id;
+  (void) size;
+  
+  ++event_count[event];
+}
+
+
+
+
+static int test_tbd_set_trace(tbd_t* tbd)
+{
+  START_TEST_TBD(tbd);
+  
+  unsigned event_count[TBD_TRACE_COUNT] = {0};
+  
+  const int tbd_set_trace_result = tbd_set_trace(tbd, test_tbd_trace, event_count);
+  
+  int tbd_create_result = tbd_create(tbd, "k0", "v0", sizeof("v0"));
+  assert(TBD_NO_ERROR == tbd_create_result);
+  
+  tbd_create_result = tbd_create(tbd, "k1", "v1", sizeof("v1"));
+  assert(TBD_NO_ERROR == tbd_create_result);
+  
+  int tbd_delete_result = tbd_delete(tbd, "k0");
+  assert(TBD_NO_ERROR == tbd_delete_result);
+  
+  tbd_garbage_clean(tbd);
+  
+  tbd_set_trace(tbd, NULL, NULL);
+  
+  // the hook is not called after it is removed
+  tbd_create_result = tbd_create(tbd, "k2", "v2", sizeof("v2"));
+  assert(TBD_NO_ERROR == tbd_create_result);
+  
+  if (TBD_NO_ERROR == tbd_set_trace_result)
+  {
+    assert(3 == event_count[TBD_TRACE_OP_BEGIN]);
+    assert(3 == event_count[TBD_TRACE_OP_END]);
+    assert(2 == event_count[TBD_TRACE_ALLOC_BEGIN]);
+    assert(2 == event_count[TBD_TRACE_ALLOC_END]);
+    assert(event_count[TBD_TRACE_FIND_BEGIN] == event_count[TBD_TRACE_FIND_END]);
+    assert(0 < event_count[TBD_TRACE_GC_BEGIN]);
+    assert(event_count[TBD_TRACE_GC_BEGIN] == event_count[TBD_TRACE_GC_END]);
+  }
+  else
+  {
+    assert(0 == event_count[TBD_TRACE_OP_BEGIN]);
+  }
+  
+  FINISH_TEST_TBD(tbd);
+  return TBD_NO_ERROR;
+}
+
+
+
+
+static int test_tbd_stats_to_json(tbd_t* tbd)
+{
+  START_TEST_TBD(tbd);
+  
+  int tbd_create_result = tbd_create(tbd, "k0", "v0", sizeof("v0"));
+  assert(TBD_NO_ERROR == tbd_create_result);
+  
+  tbd_create_result = tbd_create(tbd, "k1", "v1", sizeof("v1"));
+  assert(TBD_NO_ERROR == tbd_create_result);
+  
+  // deleting below the top of the stack leaves garbage
+  int tbd_delete_result = tbd_delete(tbd, "k0");
+  assert(TBD_NO_ERROR == tbd_delete_result);
+  
+  tbd_stats_t stats;
+  tbd_stats_get(&stats, tbd);
+  
+  // exercise json
+  char text[16384] = {0};
+  size_t text_size = tbd_stats_to_json(text, sizeof(text), &stats);
+  assert(text_size < sizeof(text));
+  assert(strlen(text) == text_size);
+  assert('{' == text[0]);
+  assert('}' == text[text_size - 1]);
+  assert(strstr(text, "\"stack_count\":"));
+  assert(strstr(text, "\"garbage_count\":1,"));
+  assert(strstr(text, "\"latency_histogram\":{\"create\":"));
+  assert(!strstr(text, "0x"));
+  
+  // a short buffer is truncated and still null terminated
+  char short_text[8];
+  assert(text_size == tbd_stats_to_json(short_text, sizeof(short_text), &stats));
+  assert(strlen(short_text) == sizeof(short_text) - 1);
+  
+  // exercise prometheus
+  text_size = tbd_stats_to_prometheus(text, sizeof(text), &stats);
+  assert(text_size < sizeof(text));
+  assert(strstr(text, "# TYPE tbd_read_hits_total counter\n"));
+  assert(strstr(text, "\ntbd_garbage_keyvalues 1\n"));
+  assert(strstr(text, "\ntbd_ops_total{op=\"create\"} "));
+  assert('\n' == text[text_size - 1]);
+  
+  // garbage list offsets are relative to the tbd
+  text_size = tbd_garbage_list_to_json(text, sizeof(text), tbd);
+  assert(text_size < sizeof(text));
+  assert(0 == strncmp(text, "[{\"offset\":", strlen("[{\"offset\":")));
+  assert(strstr(text, ",\"size\":"));
+  
+  FINISH_TEST_TBD(tbd);
+  return TBD_NO_ERROR;
+}
+
+
+
+
+static int test_tbd_update(tbd_t* tbd)
+{
+  START_TEST_TBD(tbd);  
+
+  struct Foo foo1 = {1, "a"};  
+  int tbd_create_result = tbd_create(tbd, "f", &foo1, sizeof(struct Foo));
+  assert(TBD_NO_ERROR == tbd_create_result);    
+  
+  // Setup tbd_update
+  foo1.n = 2;
+  
+  // Exercise tbd_update
+  int tbd_update_result = tbd_update(tbd, "f", &foo1, sizeof(struct Foo));
+  
+  // Verify tbd_update
+  assert(TBD_NO_ERROR == tbd_update_result);
+
+  struct Foo foo2 = {0};   
+  int tbd_read_result = tbd_read(tbd, "f", &foo2, sizeof(struct Foo));
+  
+  // Verify tbd_read
+  assert(TBD_NO_ERROR == tbd_read_result);
+  assert(foo1.n == foo2.n);
+  assert(0 == strcmp(foo1.str, foo2.str));  
+  
+  
+  // Exercise with different object
+  struct Bar bar1 = {0};
+  
+  tbd_update_result = tbd_update(tbd, "f", &bar1, sizeof(struct Bar));
+  assert(TBD_ERROR_BAD_SIZE == tbd_update_result);
+  
+  FINISH_TEST_TBD(tbd);   
+  return TBD_NO_ERROR;
+}
+
+
+
+
+static int test_tbd_put(tbd_t* tbd)
+{
+  START_TEST_TBD(tbd);
+  
+  // exercise with missing key
+  int tbd_put_result = tbd_put(tbd, "s", "abcd", sizeof("abcd"));
+  assert(TBD_NO_ERROR == tbd_put_result);
+  assert(1 == tbd_count(tbd));
+  
+  // exercise with smaller value, updates in place
+  tbd_put_result = tbd_put(tbd, "s", "ab", sizeof("ab"));
+  assert(TBD_NO_ERROR == tbd_put_result);
+  assert(1 == tbd_count(tbd));
+  assert(0 == tbd_garbage_count(tbd));
+  
+  char text[8] = {0};
+  int tbd_read_result = tbd_read(tbd, "s", text, sizeof("ab"));
+  assert(TBD_NO_ERROR == tbd_read_result);
+  assert(0 == strcmp("ab", text));
+  
+  // exercise with larger value, moves the element
+  tbd_put_result = tbd_put(tbd, "s", "abcdef", sizeof("abcdef"));
+  assert(TBD_NO_ERROR == tbd_put_result);
+  assert(1 == tbd_garbage_count(tbd));
+  
+  tbd_read_result = tbd_read(tbd, "s", text, sizeof("abcdef"));
+  assert(TBD_NO_ERROR == tbd_read_result);
+  assert(0 == strcmp("abcdef", text));
+  
+  // exercise when making room evicts the element being replaced, and reuses its place
+  static unsigned char evict_memory[TEST_TBD_HEAD_ROOM + 1024];
+  static char big[700];
+  
+  tbd_init_t init = {
+    .start = evict_memory,
+    .size = test_tbd_head_size() + 1024,
+    .hunk_size = 1,
+    .flags = TBD_INIT_FLAG_EVICT,
+  };
+  
+  tbd_t* evict_tbd = tbd_init(&init);
+  
+  memset(big, 'b', sizeof(big) - 1);
+  
+  int tbd_create_result = tbd_create(evict_tbd, "big", big, 400);
+  assert(TBD_NO_ERROR == tbd_create_result);
+  
+  tbd_put_result = tbd_put(evict_tbd, "big", big, sizeof(big));
+  assert(TBD_NO_ERROR == tbd_put_result);
+  assert(sizeof(big) == tbd_read_size(evict_tbd, "big"));
+  assert(1 == tbd_count(evict_tbd));
+  
+  FINISH_TEST_TBD(tbd);
+  return TBD_NO_ERROR;
+}
+
+
+
+
+static int test_tbd_delete(tbd_t* tbd)
+{
+  START_TEST_TBD(tbd);
+  
+  struct Foo foo1 = {1, "a"};  
+  int tbd_create_result = tbd_create(tbd, "f", &foo1, sizeof(struct Foo));
+  assert(TBD_NO_ERROR == tbd_create_result);   
+  
+  tbd_print_stats(tbd);  
+  
+  /* Exercise tbd_delete */
+  int tbd_delete_result = tbd_delete(tbd, "f");
+  
+  /* verify tbd_delete */
+  assert(TBD_NO_ERROR == tbd_delete_result);
+  
+  tbd_print_stats(tbd);  
+
+  // attempt to read deleted object
+  int tbd_read_result = tbd_read(tbd, "f", &foo1, sizeof(struct Foo));
+  assert(TBD_ERROR_KEY_NOT_FOUND == tbd_read_result);  
+  
+  FINISH_TEST_TBD(tbd);   
+  return TBD_NO_ERROR;
+}
+
+
+
+
+static int test_tbd_read_size(tbd_t* tbd)
+{
+  START_TEST_TBD(tbd);
+  
+  // Exercise with empty tbd
+  size_t tbd_read_size_result = tbd_read_size(tbd, "f");
+  assert(0 == tbd_read_size_result);
+  
+  
+  // Exercise with element
+  struct Foo foo1 = {1, "a"};  
+  int tbd_create_result = tbd_create(tbd, "f", &foo1, sizeof(struct Foo));
+  assert(TBD_NO_ERROR == tbd_create_result);   
+  
+  tbd_read_size_result = tbd_read_size(tbd, "f");
+  assert(sizeof(struct Foo) == tbd_read_size_result);
+  
+  
+  FINISH_TEST_TBD(tbd);   
+  return TBD_NO_ERROR;  
+}
+
+
+
+
+static int test_tbd_cas(tbd_t* tbd)
+{
+  START_TEST_TBD(tbd);
+  
+  // exercise with missing key
+  struct Foo foo1 = {1, "a"};
+  struct Foo foo2 = {2, "b"};
+  
+  int tbd_cas_result = tbd_cas(tbd, "f", &foo1, &foo2, sizeof(struct Foo));
+  assert(TBD_ERROR_KEY_NOT_FOUND == tbd_cas_result);
+  
+  int tbd_create_result = tbd_create(tbd, "f", &foo1, sizeof(struct Foo));
+  assert(TBD_NO_ERROR == tbd_create_result);
+  
+  // exercise with matching value
+  tbd_cas_result = tbd_cas(tbd, "f", &foo1, &foo2, sizeof(struct Foo));
+  assert(TBD_NO_ERROR == tbd_cas_result);
+  
+  // exercise with value that no longer matches
+  tbd_cas_result = tbd_cas(tbd, "f", &foo1, &foo2, sizeof(struct Foo));
+  assert(TBD_ERROR_VALUE_MISMATCH == tbd_cas_result);
+  
+  struct Bar bar1 = {'x'};
+  tbd_cas_result = tbd_cas(tbd, "f", &bar1, &bar1, sizeof(struct Bar));
+  assert(TBD_ERROR_BAD_SIZE == tbd_cas_result);
+  
+  struct Foo foo_result = {0};
+  int tbd_read_result = tbd_read(tbd, "f", &foo_result, sizeof(struct Foo));
+  assert(TBD_NO_ERROR == tbd_read_result);
+  assert(2 == foo_result.n);
+  
+  FINISH_TEST_TBD(tbd);
+  return TBD_NO_ERROR;
+}
+
+
+
+
+static int test_tbd_incr(tbd_t* tbd)
+{
+  START_TEST_TBD(tbd);
+  
+  long value = 0;
+  
+  // exercise with missing key
+  int tbd_incr_result = tbd_incr(tbd, "n", 1, &value, TBD_INCR_OVERFLOW_ERROR);
+  assert(TBD_ERROR_KEY_NOT_FOUND == tbd_incr_result);
+  
+  // exercise with value that is not a number
+  int tbd_create_result = tbd_create(tbd, "s", "abc", sizeof("abc"));
+  assert(TBD_NO_ERROR == tbd_create_result);
+  
+  tbd_incr_result = tbd_incr(tbd, "s", 1, &value, TBD_INCR_OVERFLOW_ERROR);
+  assert(TBD_ERROR_NOT_A_NUMBER == tbd_incr_result);
+  
+  // exercise with a two digit counter
+  tbd_create_result = tbd_create(tbd, "n", "97", sizeof("97"));
+  assert(TBD_NO_ERROR == tbd_create_result);
+  
+  tbd_incr_result = tbd_incr(tbd, "n", 2, &value, TBD_INCR_OVERFLOW_ERROR);
+  assert(TBD_NO_ERROR == tbd_incr_result);
+  assert(99 == value);
+  
+  tbd_incr_result = tbd_incr(tbd, "n", 1, &value, TBD_INCR_OVERFLOW_ERROR);
+  assert(TBD_ERROR_OVERFLOW == tbd_incr_result);
+  
+  tbd_incr_result = tbd_incr(tbd, "n", 1, &value, TBD_INCR_OVERFLOW_SATURATE);
+  assert(TBD_NO_ERROR == tbd_incr_result);
+  assert(99 == value);
+  
+  tbd_incr_result = tbd_incr(tbd, "n", 1, &value, TBD_INCR_OVERFLOW_WRAP);
+  assert(TBD_NO_ERROR == tbd_incr_result);
+  assert(-9 == value);
+  
+  tbd_incr_result = tbd_incr(tbd, "n", 14, &value, TBD_INCR_OVERFLOW_ERROR);
+  assert(TBD_NO_ERROR == tbd_incr_result);
+  assert(5 == value);
+  
+  char text[sizeof("97")] = {0};
+  int tbd_read_result = tbd_read(tbd, "n", text, sizeof(text));
+  assert(TBD_NO_ERROR == tbd_read_result);
+  assert(0 == strcmp("05", text));
+  
+  FINISH_TEST_TBD(tbd);
+  return TBD_NO_ERROR;
+}
+
+
+
+
+static int test_tbd_append(tbd_t* tbd)
+{
+  START_TEST_TBD(tbd);
+  
+  // exercise with missing key
+  int tbd_append_result = tbd_append(tbd, "s", "cd", 2);
+  assert(TBD_ERROR_KEY_NOT_FOUND == tbd_append_result);
+  
+  // exercise when the element has to move
+  int tbd_create_result = tbd_create(tbd, "s", "ab", sizeof("ab"));
+  assert(TBD_NO_ERROR == tbd_create_result);
+  
+  tbd_append_result = tbd_append(tbd, "s", "cd", 2);
+  assert(TBD_NO_ERROR == tbd_append_result);
+  
+  char text[8] = {0};
+  size_t tbd_read_size_result = tbd_read_size(tbd, "s");
+  assert(sizeof("abcd") == tbd_read_size_result);
+  
+  int tbd_read_result = tbd_read(tbd, "s", text, tbd_read_size_result);
+  assert(TBD_NO_ERROR == tbd_read_result);
+  assert(0 == strcmp("abcd", text));
+  
+  // exercise in place, using a tbd with room left in each hunk
+  static unsigned char hunk_memory[TEST_TBD_HEAD_ROOM + 1024];
+  
+  tbd_init_t init = {
+    .start = hunk_memory,
+    .size = test_tbd_head_size() + 1024,
+    .hunk_size = 8,
+  };
+  
+  tbd_t* hunk_tbd = tbd_init(&init);
+  
+  tbd_create_result = tbd_create(hunk_tbd, "s", "ab", sizeof("ab"));
+  assert(TBD_NO_ERROR == tbd_create_result);
+  
+  tbd_append_result = tbd_append(hunk_tbd, "s", "c", 1);
+  assert(TBD_NO_ERROR == tbd_append_result);
+  assert(1 == tbd_count(hunk_tbd));
+  
+  tbd_read_result = tbd_read(hunk_tbd, "s", text, sizeof("abc"));
+  assert(TBD_NO_ERROR == tbd_read_result);
+  assert(0 == strcmp("abc", text));
+  
+  // exercise when making room evicts the element being appended
+  static unsigned char evict_memory[TEST_TBD_HEAD_ROOM + 1024];
+  static char big[400];
+  
+  init = (tbd_init_t) {
+    .start = evict_memory,
+    .size = test_tbd_head_size() + 1024,
+    .hunk_size = 1,
+    .flags = TBD_INIT_FLAG_EVICT,
+  };
+  
+  tbd_t* evict_tbd = tbd_init(&init);
+  
+  memset(big, 'b', sizeof(big) - 1);
+  
+  tbd_create_result = tbd_create(evict_tbd, "big", big, sizeof(big));
+  assert(TBD_NO_ERROR == tbd_create_result);
+  
+  tbd_append_result = tbd_append(evict_tbd, "big", big, 200);
+  assert(TBD_ERROR == tbd_append_result);
+  assert(0 == tbd_read_size(evict_tbd, "big"));
+  
+  FINISH_TEST_TBD(tbd);
+  return TBD_NO_ERROR;
+}
+
+
+
+
+static int test_tbd_expire(tbd_t* tbd)
+{
+  START_TEST_TBD(tbd);
+  
+  tbd_set_time(tbd, 100);
+  
+  // exercise with missing key
+  int tbd_expire_result = tbd_expire(tbd, "1", 10);
+  assert(TBD_ERROR_KEY_NOT_FOUND == tbd_expire_result);
+  
+  // setup elements with different time to live
+  setup_tbd_with_Foo(tbd);
+  
+  tbd_expire_result = tbd_expire(tbd, "u", 10);
+  assert(TBD_NO_ERROR == tbd_expire_result);
+  
+  tbd_expire_result = tbd_expire(tbd, "v", 20);
+  assert(TBD_NO_ERROR == tbd_expire_result);
+  
+  tbd_expire_result = tbd_expire(tbd, "w", 20);
+  assert(TBD_NO_ERROR == tbd_expire_result);
+  
+  // exercise lazy expiry
+  tbd_set_time(tbd, 110);
+  
+  struct Foo foo_result;
+  int tbd_read_result = tbd_read(tbd, "u", &foo_result, sizeof(struct Foo));
+  assert(TBD_ERROR_KEY_NOT_FOUND == tbd_read_result);
+  
+  tbd_read_result = tbd_read(tbd, "v", &foo_result, sizeof(struct Foo));
+  assert(TBD_NO_ERROR == tbd_read_result);
+  
+  TBD_SIZE_T tbd_garbage_count_result = tbd_garbage_count(tbd);
+  assert(1 == tbd_garbage_count_result);
+  
+  // exercise sweeping expiry
+  tbd_set_time(tbd, 120);
+  
+  TBD_SIZE_T tbd_expire_sweep_result = tbd_expire_sweep(tbd, tbd_count(tbd));
+  assert(2 == tbd_expire_sweep_result);
+  
+  tbd_garbage_count_result = tbd_garbage_count(tbd);
+  assert(3 == tbd_garbage_count_result);
+  
+  tbd_garbage_list_to_json(json_buffer, sizeof(json_buffer), tbd);
+  puts(json_buffer);
+  
+  tbd_read_result = tbd_read(tbd, "x", &foo_result, sizeof(struct Foo));
+  assert(TBD_NO_ERROR == tbd_read_result);
+  assert(4 == foo_result.n);
+  
+  tbd_set_time(tbd, 0);
+  
+  FINISH_TEST_TBD(tbd);
+  return TBD_NO_ERROR;
+}
+
+
+
+
+/** Memory stream used by snapshot tests.
+ */
+struct Stream {
+  unsigned char data[512];
+  size_t size;
+  size_t pos;
+};
+
+
+
+
+static size_t Stream_write(void* context, const void* data, size_t size)
+{
+  struct Stream* stream = (struct Stream*) context;
+  
+  if (stream->size + size > sizeof(stream->data))
+  {
+    return 0;
+  }
+  
+  memcpy(stream->data + stream->size, data, size);
+  stream->size += size;
+  
+  return size;
+}
+
+
+
+
+static size_t Stream_read(void* context, void* data, size_t size)
+{
+  struct Stream* stream = (struct Stream*) context;
+  
+  if (stream->pos + size > stream->size)
+  {
+    return 0;
+  }
+  
+  memcpy(data, stream->data + stream->pos, size);
+  stream->pos += size;
+  
+  return size;
+}
+
+
+
+
+static int test_tbd_save(tbd_t* tbd)
+{
+  START_TEST_TBD(tbd);
+  
+  setup_tbd_with_Foo(tbd);
+  
+  // created last but saved first in key order, so it is no longer on top of the stack
+  struct Foo foo = {7, "a"};
+  int tbd_create_result = tbd_create(tbd, "a", &foo, sizeof(struct Foo));
+  assert(TBD_NO_ERROR == tbd_create_result);
+  
+  const TBD_SIZE_T count = tbd_count(tbd);
+  
+  int tbd_delete_result = tbd_delete(tbd, "v");
+  assert(TBD_NO_ERROR == tbd_delete_result);
+  
+  tbd_expire(tbd, "w", 10);
+  
+  // exercise save
+  static struct Stream stream;
+  stream.size = 0;
+  stream.pos = 0;
+  
+  int tbd_save_result = tbd_save(tbd, Stream_write, &stream, TBD_SAVE_ORDER_KEY);
+  assert(TBD_NO_ERROR == tbd_save_result);
+  
+  // exercise load into another tbd
+  static unsigned char load_memory[TEST_TBD_HEAD_ROOM + 1024];
+  
+  tbd_init_t init = {
+    .start = load_memory,
+    .size = test_tbd_head_size() + 1024,
+    .hunk_size = 1,
+  };
+  
+  tbd_t* load_tbd = tbd_init(&init);
+  assert(load_tbd);
+  
+  int tbd_load_result = tbd_load(load_tbd, Stream_read, &stream);
+  assert(TBD_NO_ERROR == tbd_load_result);
+  assert(count - 1 == tbd_count(load_tbd));
+  assert(0 == tbd_garbage_count(load_tbd));
+  
+  struct Foo foo_result;
+  int tbd_read_result = tbd_read(load_tbd, "x", &foo_result, sizeof(struct Foo));
+  assert(TBD_NO_ERROR == tbd_read_result);
+  assert(4 == foo_result.n);
+  
+  tbd_read_result = tbd_read(load_tbd, "v", &foo_result, sizeof(struct Foo));
+  assert(TBD_ERROR_KEY_NOT_FOUND == tbd_read_result);
+  
+  // expiry times are kept
+  tbd_set_time(load_tbd, 10);
+  tbd_read_result = tbd_read(load_tbd, "w", &foo_result, sizeof(struct Foo));
+  assert(TBD_ERROR_KEY_NOT_FOUND == tbd_read_result);
+  
+  // keys were saved in order, so the largest key is on top of the stack
+  tbd_const_iterator_t iter = tbd_const_begin(load_tbd);
+  assert(0 == strcmp("z", tbd_const_iterator_key(iter)));
+  
+  // exercise load of a corrupt snapshot
+  stream.pos = 0;
+  stream.data[stream.size - 8] ^= 1;
+  
+  tbd_load_result = tbd_load(load_tbd, Stream_read, &stream);
+  assert(TBD_ERROR_BAD_FORMAT == tbd_load_result);
+  assert(tbd_is_empty(load_tbd));
+  
+  // exercise load of a truncated snapshot
+  stream.pos = 0;
+  stream.size -= 1;
+  
+  tbd_load_result = tbd_load(load_tbd, Stream_read, &stream);
+  assert(TBD_ERROR_BAD_FORMAT == tbd_load_result);
+  
+  FINISH_TEST_TBD(tbd);
+  return TBD_NO_ERROR;
+}
+
+
+
+
+static int Stream_sync(void* context)
+{
+  (void) context;
+  return 0;
+}
+
+
+
+
+static int test_tbd_wal(tbd_t* tbd)
+{
+  START_TEST_TBD(tbd);
+  
+  static struct Stream stream;
+  stream.size = 0;
+  stream.pos = 0;
+  
+  static unsigned char wal_buffer[64];
+  
+  tbd_wal_init_t wal_init = {
+    .write = Stream_write,
+    .sync = Stream_sync,
+    .context = &stream,
+    .buffer = wal_buffer,
+    .buffer_size = sizeof(wal_buffer),
+    .sync_mode = TBD_WAL_SYNC_INTERVAL,
+    .sync_interval = 10,
+  };
+  
+  int tbd_wal_open_result = tbd_wal_open(tbd, &wal_init);
+  assert(TBD_NO_ERROR == tbd_wal_open_result);
+  
+  // exercise changes, they are buffered until the interval passes
+  int result = tbd_create(tbd, "a", "1", sizeof("1"));
+  assert(TBD_NO_ERROR == result);
+  
+  result = tbd_put(tbd, "b", "hello", sizeof("hello"));
+  assert(TBD_NO_ERROR == result);
+  
+  result = tbd_create(tbd, "c", "0009", sizeof("0009"));
+  assert(TBD_NO_ERROR == result);
+  
+  assert(0 == stream.size);
+  
+  tbd_set_time(tbd, 10);
+  assert(0 != stream.size);
+  
+  result = tbd_incr(tbd, "c", 1, NULL, TBD_INCR_OVERFLOW_ERROR);
+  assert(TBD_NO_ERROR == result);
+  
+  result = tbd_append(tbd, "b", " world", sizeof(" world") - 1);
+  assert(TBD_NO_ERROR == result);
+  
+  result = tbd_delete(tbd, "a");
+  assert(TBD_NO_ERROR == result);
+  
+  result = tbd_expire(tbd, "c", 5);
+  assert(TBD_NO_ERROR == result);
+  
+  int tbd_wal_close_result = tbd_wal_close(tbd);
+  assert(TBD_NO_ERROR == tbd_wal_close_result);
+  
+  tbd_stats_t stats;
+  tbd_stats_get(&stats, tbd);
+  assert(stats.wal_size == stream.size);
+  assert(2 == stats.wal_sync_count);
+  
+  // exercise replay into an empty tbd
+  tbd_empty(tbd);
+  
+  char value_buffer[32];
+  
+  int tbd_wal_replay_result = tbd_wal_replay(tbd, Stream_read, &stream, value_buffer, sizeof(value_buffer));
+  assert(7 == tbd_wal_replay_result);
+  
+  char text[16] = {0};
+  int tbd_read_result = tbd_read(tbd, "b", text, sizeof("hello world"));
+  assert(TBD_NO_ERROR == tbd_read_result);
+  assert(0 == strcmp("hello world", text));
+  
+  tbd_read_result = tbd_read(tbd, "c", text, sizeof("0010"));
+  assert(TBD_NO_ERROR == tbd_read_result);
+  assert(0 == strcmp("0010", text));
+  
+  tbd_read_result = tbd_read(tbd, "a", text, sizeof("1"));
+  assert(TBD_ERROR_KEY_NOT_FOUND == tbd_read_result);
+  
+  tbd_set_time(tbd, 15);
+  tbd_read_result = tbd_read(tbd, "c", text, sizeof("0010"));
+  assert(TBD_ERROR_KEY_NOT_FOUND == tbd_read_result);
+  
+  // exercise replay of a log with a torn last record
+  tbd_empty(tbd);
+  stream.pos = 0;
+  stream.size -= 1;
+  
+  tbd_wal_replay_result = tbd_wal_replay(tbd, Stream_read, &stream, value_buffer, sizeof(value_buffer));
+  assert(6 == tbd_wal_replay_result);
+  
+  // exercise replay from memory, the torn record is left for later
+  tbd_empty(tbd);
+  
+  size_t used = 0;
+  tbd_wal_replay_result = tbd_wal_replay_buffer(tbd, stream.data, stream.size, &used);
+  assert(6 == tbd_wal_replay_result);
+  assert(used < stream.size);
+  
+  tbd_wal_replay_result = tbd_wal_replay_buffer(tbd, stream.data + used, stream.size + 1 - used, &used);
+  assert(1 == tbd_wal_replay_result);
+  
+  // exercise with a corrupt record
+  stream.data[stream.size] ^= 0xFF;
+  
+  tbd_wal_replay_result = tbd_wal_replay_buffer(tbd, stream.data, stream.size + 1, &used);
+  assert(TBD_ERROR_BAD_FORMAT == tbd_wal_replay_result);
+  
+  tbd_set_time(tbd, 0);
+  
+  // exercise clear, the log stays open and keeps its buffered records
+  static unsigned char clear_memory[TEST_TBD_HEAD_ROOM + 1024];
+  
+  tbd_init_t init = {
+    .start = clear_memory,
+    .size = test_tbd_head_size() + 1024,
+    .hunk_size = 1,
+  };
+  
+  tbd_t* clear_tbd = tbd_init(&init);
+  assert(clear_tbd);
+  
+  stream.size = 0;
+  wal_init.sync_mode = TBD_WAL_SYNC_NEVER;
+  
+  tbd_wal_open_result = tbd_wal_open(clear_tbd, &wal_init);
+  assert(TBD_NO_ERROR == tbd_wal_open_result);
+  
+  result = tbd_create(clear_tbd, "a", "1", sizeof("1"));
+  assert(TBD_NO_ERROR == result);
+  assert(0 == stream.size);
+  
+  tbd_clear(clear_tbd);
+  
+  tbd_wal_close_result = tbd_wal_close(clear_tbd);
+  assert(TBD_NO_ERROR == tbd_wal_close_result);
+  assert(0 != stream.size);
+  
+  FINISH_TEST_TBD(tbd);
+  return TBD_NO_ERROR;
+}
+
+
+
+
+static int test_tbd_garbage_size(tbd_t* tbd)
+{
+  START_TEST_TBD(tbd);  
+
+  // test with clear database
+  size_t tbd_garbage_size_result = tbd_garbage_size(tbd);
+  assert(0 == tbd_garbage_size_result);  
+  
+  
+  // setup database with 1 element
+  struct Foo foo1 = {1, "a"};
+  
+  int tbd_create_result = tbd_create(tbd, "1", &foo1, sizeof(struct Foo));
+  assert(TBD_NO_ERROR ==  tbd_create_result);
+  
+  tbd_print_stats(tbd);
+  
+  int tbd_delete_result = tbd_delete(tbd, "1");
+  assert(TBD_NO_ERROR ==  tbd_delete_result);
+  
+  tbd_garbage_size_result = tbd_garbage_size(tbd);
+  assert(0 < tbd_garbage_size_result);
+
+  tbd_print_stats(tbd);  
+  
+  // add another element
+  struct Foo foo2 = {2, "b"};  
+  
+  tbd_create_result = tbd_create(tbd, "2", &foo2, sizeof(struct Foo));
+  assert(TBD_NO_ERROR ==  tbd_create_result);
+  
+  tbd_print_stats(tbd);  
+  
+  tbd_delete_result = tbd_delete(tbd, "2");
+  assert(TBD_NO_ERROR ==  tbd_delete_result);
+  
+  tbd_garbage_size_result = tbd_garbage_size(tbd);
+  assert(0 < tbd_garbage_size_result);
+  
+  FINISH_TEST_TBD(tbd);   
+  return TBD_NO_ERROR;
+}
+
+
+
+
+static int test_tbd_garbage_merge(tbd_t* tbd)
+{
+  START_TEST_TBD(tbd);
+  
+  setup_tbd_with_Foo(tbd);
+  
+  // exercise with no garbage elements
+  TBD_SIZE_T tbd_garbage_merge_result = tbd_garbage_merge(tbd);
+  assert(0 == tbd_garbage_merge_result);
+  
+  
+  // setup with 1 garbage element
+  int tbd_delete_result = tbd_delete(tbd, "y");
+  assert(TBD_NO_ERROR == tbd_delete_result);
+  
+  // exercise with 1 garbage element
+  tbd_garbage_merge_result = tbd_garbage_merge(tbd);
+  assert(0 == tbd_garbage_merge_result);  
+  
+  
+  // setup with 2 garbage elements
+  tbd_delete_result = tbd_delete(tbd, "z");
+  assert(TBD_NO_ERROR == tbd_delete_result);
+  
+  // exercise with 2 garbage elements
+  tbd_garbage_merge_result = tbd_garbage_merge(tbd);
+  assert(0 < tbd_garbage_merge_result);   
+  
+  
+  FINISH_TEST_TBD(tbd);   
+  return TBD_NO_ERROR;  
+}
+
+
+
+
+static int test_tbd_garbage_pop(tbd_t* tbd)
+{
+  START_TEST_TBD(tbd);
+  
+  /* setup database with 1 element */
+  struct Foo foo1 = {1, "a"};
+  
+  int tbd_create_result = tbd_create(tbd, "1", &foo1, sizeof(struct Foo));
+  assert(TBD_NO_ERROR == tbd_create_result);
+  tbd_print_stats(tbd);
+  
+  size_t tbd_garbage_size_result = tbd_garbage_size(tbd);
   assert(0 == tbd_garbage_size_result); 
   
   int tbd_delete_result = tbd_delete(tbd, "1");
   assert(TBD_NO_ERROR ==  tbd_delete_result);
-  tbd_print_stats(tbd);
+  tbd_print_stats(tbd);
+  
+  tbd_garbage_size_result = tbd_garbage_size(tbd);
+  assert(0 < tbd_garbage_size_result);  
+  
+  size_t tbd_garbage_pop_result = tbd_garbage_pop(tbd, 0);
+  assert(0 == tbd_garbage_pop_result);
+  tbd_print_stats(tbd);
+  
+  tbd_garbage_size_result = tbd_garbage_size(tbd);
+  assert(0 < tbd_garbage_size_result);   
+  
+  tbd_garbage_pop_result = tbd_garbage_pop(tbd, tbd_garbage_size_result - 1);
+  assert(0 == tbd_garbage_pop_result);
+  tbd_print_stats(tbd);
+  
+  tbd_garbage_size_result = tbd_garbage_size(tbd);
+  assert(0 < tbd_garbage_size_result);   
+
+  tbd_garbage_pop_result = tbd_garbage_pop(tbd, tbd_garbage_size_result);
+  assert(0 < tbd_garbage_pop_result);
+  tbd_print_stats(tbd);
+  
+  tbd_garbage_size_result = tbd_garbage_size(tbd);
+  assert(0 == tbd_garbage_size_result);     
+  
+  
+  // Setup with some sample objects
+  setup_tbd_with_Foo(tbd);
+  tbd_print_stats(tbd);  
+  
+  tbd_garbage_list_to_json(json_buffer, sizeof(json_buffer), tbd);
+  puts(json_buffer);
+  
+  // delete an element from in the middle of the stack
+  tbd_delete_result = tbd_delete(tbd, "y");
+  assert(TBD_NO_ERROR ==  tbd_delete_result);
+  tbd_print_stats(tbd);  
+
+  tbd_garbage_list_to_json(json_buffer, sizeof(json_buffer), tbd);
+  puts(json_buffer);  
+  
+  // exercise, no data should be popped
+  tbd_garbage_size_result = tbd_garbage_size(tbd);
+  assert(0 < tbd_garbage_size_result);
+
+  TBD_SIZE_T tbd_garbage_count_result = tbd_garbage_count(tbd);
+  assert(1 == tbd_garbage_count_result);  
+  
+  tbd_garbage_pop_result = tbd_garbage_pop(tbd, tbd_garbage_size_result);
+  assert(0 == tbd_garbage_pop_result);
+  tbd_print_stats(tbd);
+  
+  tbd_garbage_list_to_json(json_buffer, sizeof(json_buffer), tbd);
+  puts(json_buffer);  
+  
+  // delete an element from in the top of the stack
+  tbd_delete_result = tbd_delete(tbd, "z");
+  assert(TBD_NO_ERROR ==  tbd_delete_result);
+  tbd_print_stats(tbd);
+  
+  tbd_garbage_list_to_json(json_buffer, sizeof(json_buffer), tbd);
+  puts(json_buffer);
+  
+  tbd_garbage_count_result = tbd_garbage_count(tbd);
+  assert(2 == tbd_garbage_count_result); 
+  
+  tbd_garbage_size_result = tbd_garbage_size(tbd);
+  assert(0 < tbd_garbage_size_result);
+  
+  // exercise, expect to pop top two elements
+  tbd_garbage_pop_result = tbd_garbage_pop(tbd, tbd_garbage_size_result);
+  assert(0 < tbd_garbage_pop_result);
+  tbd_print_stats(tbd);  
+  
+  tbd_garbage_list_to_json(json_buffer, sizeof(json_buffer), tbd);
+  puts(json_buffer);  
+  
+  tbd_garbage_count_result = tbd_garbage_count(tbd);
+  assert(0 == tbd_garbage_count_result);
+  
+  
+  FINISH_TEST_TBD(tbd);  
+  return TBD_NO_ERROR;
+}
+
+
+
+
+static int test_tbd_garbage_fold(tbd_t* tbd)
+{
+  START_TEST_TBD(tbd);  
+  
+  // setup database elements
+  struct Foo foo1 = {1, "a"};
+  struct Foo foo2 = {2, "b"};
+  struct Foo foo3 = {3, "c"};
+  struct Foo foo4 = {4, "d"};
+
+  struct Bar bar1 = {'w'};  
+  struct Bar bar2 = {'x'};
+  struct Bar bar3 = {'y'};
+  struct Bar bar4 = {'z'};  
+  
+  int tbd_create_result = tbd_create(tbd, "1", &foo1, sizeof(struct Foo));
+  assert(TBD_NO_ERROR ==  tbd_create_result);
+
+  tbd_create_result = tbd_create(tbd, "2", &bar1, sizeof(struct Bar));
+  assert(TBD_NO_ERROR ==  tbd_create_result);  
+  
+  tbd_create_result = tbd_create(tbd, "3", &foo2, sizeof(struct Foo));
+  assert(TBD_NO_ERROR ==  tbd_create_result);  
+
+  tbd_create_result = tbd_create(tbd, "4", &bar2, sizeof(struct Bar));
+  assert(TBD_NO_ERROR ==  tbd_create_result);    
+  
+  tbd_create_result = tbd_create(tbd, "5", &foo3, sizeof(struct Foo));
+  assert(TBD_NO_ERROR ==  tbd_create_result);
+  
+  tbd_create_result = tbd_create(tbd, "6", &bar3, sizeof(struct Bar));
+  assert(TBD_NO_ERROR ==  tbd_create_result);    
+
+  tbd_create_result = tbd_create(tbd, "7", &foo4, sizeof(struct Foo));
+  assert(TBD_NO_ERROR ==  tbd_create_result);
+  
+  tbd_create_result = tbd_create(tbd, "8", &bar4, sizeof(struct Bar));
+  assert(TBD_NO_ERROR ==  tbd_create_result);    
+  
+  size_t tbd_garbage_size_result = tbd_garbage_size(tbd);
+  assert(0 == tbd_garbage_size_result);
+  
+  tbd_print_stats(tbd);
+  
+  int tbd_delete_result = tbd_delete(tbd, "3");
+  assert(TBD_NO_ERROR ==  tbd_delete_result);
+  
+  tbd_print_stats(tbd);  
+  
+  tbd_garbage_size_result = tbd_garbage_size(tbd);
+  assert(0 < tbd_garbage_size_result);  
+  
+  size_t tbd_garbage_fold_result = tbd_garbage_fold(tbd, 0);
+  assert(0 == tbd_garbage_fold_result);
+  
+  tbd_garbage_size_result = tbd_garbage_size(tbd);
+  assert(0 < tbd_garbage_size_result);   
+  
+  tbd_garbage_fold_result = tbd_garbage_fold(tbd, tbd_garbage_size_result - 1);
+  assert(0 == tbd_garbage_fold_result);
+  
+  tbd_garbage_size_result = tbd_garbage_size(tbd);
+  assert(0 < tbd_garbage_size_result);   
+  
+  tbd_garbage_fold_result = tbd_garbage_fold(tbd, tbd_garbage_size_result);
+  assert(0 < tbd_garbage_fold_result);
+  
+  // the folded keyvalue moved down, and the garbage it left can be popped
+  struct Foo foo_result;
+  
+  int tbd_read_result = tbd_read(tbd, "7", &foo_result, sizeof(struct Foo));
+  assert(TBD_NO_ERROR == tbd_read_result);
+  assert(4 == foo_result.n);
+  
+  tbd_delete_result = tbd_delete(tbd, "8");
+  assert(TBD_NO_ERROR ==  tbd_delete_result);
+  
+  tbd_garbage_pop(tbd, tbd_size(tbd));
+  
+  tbd_garbage_size_result = tbd_garbage_size(tbd);
+  assert(0 == tbd_garbage_size_result);
+  
+  tbd_read_result = tbd_read(tbd, "7", &foo_result, sizeof(struct Foo));
+  assert(TBD_NO_ERROR == tbd_read_result);
+  assert(4 == foo_result.n);
+    
+  FINISH_TEST_TBD(tbd);   
+  return TBD_NO_ERROR;
+}
+
+
+
+
+static int test_tbd_garbage_pack(tbd_t* tbd)
+{
+  START_TEST_TBD(tbd);  
+
+  // exercise with empty tbd
+  size_t tbd_garbage_pack_result = tbd_garbage_pack(tbd, tbd_size(tbd));
+  assert(0 == tbd_garbage_pack_result);  
+  
+  
+  // setup database element
+  struct Foo foo1 = {1, 'a'};
+  struct Foo foo2 = {2, 'b'};
+  struct Foo foo3 = {3, 'c'};
+  struct Foo foo4 = {4, 'd'};
+  
+  struct Bar bar1 = {'w'};  
+  struct Bar bar2 = {'x'};
+  struct Bar bar3 = {'y'};
+  struct Bar bar4 = {'z'};  
+  
+  int tbd_create_result = tbd_create(tbd, "1", &foo1, sizeof(struct Foo));
+  assert(TBD_NO_ERROR ==  tbd_create_result);
+  
+  tbd_create_result = tbd_create(tbd, "2", &bar1, sizeof(struct Bar));
+  assert(TBD_NO_ERROR ==  tbd_create_result);  
+  
+  tbd_create_result = tbd_create(tbd, "3", &foo2, sizeof(struct Foo));
+  assert(TBD_NO_ERROR ==  tbd_create_result);  
+  
+  tbd_create_result = tbd_create(tbd, "4", &bar2, sizeof(struct Bar));
+  assert(TBD_NO_ERROR ==  tbd_create_result);    
+  
+  tbd_create_result = tbd_create(tbd, "5", &foo3, sizeof(struct Foo));
+  assert(TBD_NO_ERROR ==  tbd_create_result);
+  
+  tbd_create_result = tbd_create(tbd, "6", &bar3, sizeof(struct Bar));
+  assert(TBD_NO_ERROR ==  tbd_create_result);    
+  
+  tbd_create_result = tbd_create(tbd, "7", &foo4, sizeof(struct Foo));
+  assert(TBD_NO_ERROR ==  tbd_create_result);
+  
+  tbd_create_result = tbd_create(tbd, "8", &bar4, sizeof(struct Bar));
+  assert(TBD_NO_ERROR ==  tbd_create_result);      
+  
+  int tbd_delete_result = tbd_delete(tbd, "3");
+  assert(TBD_NO_ERROR ==  tbd_delete_result);
+  
+  size_t tbd_garbage_size_result = tbd_garbage_size(tbd);
+  assert(0 < tbd_garbage_size_result);     
+  
+  tbd_print_stats(tbd);
+  
+  tbd_garbage_pack_result = tbd_garbage_pack(tbd, tbd_garbage_size_result);
+  assert(0 < tbd_garbage_pack_result);
+  
+  // the limit stopped packing part way, so the garbage is left between the packed and unpacked keyvalues
+  TBD_SIZE_T tbd_garbage_count_result = tbd_garbage_count(tbd);
+  assert(1 == tbd_garbage_count_result);
+  
+  tbd_garbage_pack_result = tbd_garbage_pack(tbd, tbd_size(tbd));
+  assert(0 < tbd_garbage_pack_result);
+  
+  tbd_garbage_size_result = tbd_garbage_size(tbd);
+  assert(0 == tbd_garbage_size_result);
+  assert(7 == tbd_count(tbd));
+  
+  struct Foo foo_result;
+  
+  int tbd_read_result = tbd_read(tbd, "7", &foo_result, sizeof(struct Foo));
+  assert(TBD_NO_ERROR == tbd_read_result);
+  assert(4 == foo_result.n);
+  
+  tbd_stats_t stats;
+  tbd_stats_get(&stats, tbd);
+  assert(0 < stats.garbage_moved_size);
+  
+  char map[33];
+  size_t tbd_heap_map_result = tbd_heap_map(map, sizeof(map), tbd);
+  assert(32 == tbd_heap_map_result);
+  assert(32 == strlen(map));
+  assert(NULL == strchr(map, '.'));
+  
+  FINISH_TEST_TBD(tbd);   
+  return TBD_NO_ERROR;
+}
+
+
+
+
+static int test_tbd_garbage_collect(tbd_t* tbd)
+{
+  START_TEST_TBD(tbd);  
+  
+  // exercise with empty tbd
+  size_t tbd_garbage_collect_result = tbd_garbage_collect(tbd, 0);
+  
+  assert(0 == tbd_garbage_collect_result);
+  
+  
+  // exercise with no garbage
+  struct Foo foo1 = {1, 'a'};
+  
+  int tbd_create_result = tbd_create(tbd, "1", &foo1, sizeof(struct Foo));
+  assert(TBD_NO_ERROR ==  tbd_create_result);
+  
+  tbd_garbage_collect_result = tbd_garbage_collect(tbd, 0);  
+  assert(0 == tbd_garbage_collect_result);
+
+  // exercise with garbage  
+  int tbd_delete_result = tbd_delete(tbd, "1");
+  assert(TBD_NO_ERROR ==  tbd_delete_result);
   
-  tbd_garbage_size_result = tbd_garbage_size(tbd);
-  assert(0 < tbd_garbage_size_result);  
+  tbd_garbage_collect_result = tbd_garbage_collect(tbd, 0);  
+  assert(0 == tbd_garbage_collect_result);
+
+  tbd_garbage_collect_result = tbd_garbage_collect(tbd, 0x1000);  
+  assert(0 < tbd_garbage_collect_result);  
   
-  size_t tbd_garbage_pop_result = tbd_garbage_pop(tbd, 0);
-  assert(0 == tbd_garbage_pop_result);
-  tbd_print_stats(tbd);
+  FINISH_TEST_TBD(tbd);   
+  return TBD_NO_ERROR;
+}
+
+
+
+
+static int test_tbd_garbage_clean(tbd_t* tbd)
+{
+  START_TEST_TBD(tbd);  
   
-  tbd_garbage_size_result = tbd_garbage_size(tbd);
-  assert(0 < tbd_garbage_size_result);   
+  // exercise with empty tbd
+  size_t tbd_garbage_clean_result = tbd_garbage_clean(tbd);
+  assert(0 == tbd_garbage_clean_result);
   
-  tbd_garbage_pop_result = tbd_garbage_pop(tbd, tbd_garbage_size_result - 1);
-  assert(0 == tbd_garbage_pop_result);
-  tbd_print_stats(tbd);
   
-  tbd_garbage_size_result = tbd_garbage_size(tbd);
-  assert(0 < tbd_garbage_size_result);   
+  // exercise with no garbage
+  struct Foo foo1 = {1, 'a'};
+  
+  int tbd_create_result = tbd_create(tbd, "1", &foo1, sizeof(struct Foo));
+  assert(TBD_NO_ERROR ==  tbd_create_result);
+  
+  tbd_garbage_clean_result = tbd_garbage_clean(tbd);  
+  assert(0 == tbd_garbage_clean_result);
+  
+  // exercise with garbage  
+  int tbd_delete_result = tbd_delete(tbd, "1");
+  assert(TBD_NO_ERROR ==  tbd_delete_result);
+  
+  tbd_garbage_clean_result = tbd_garbage_clean(tbd);  
+  assert(0 < tbd_garbage_clean_result);
+  
+  FINISH_TEST_TBD(tbd);   
+  return TBD_NO_ERROR;
+}
 
-  tbd_garbage_pop_result = tbd_garbage_pop(tbd, tbd_garbage_size_result);
-  assert(0 < tbd_garbage_pop_result);
-  tbd_print_stats(tbd);
+
+
+
+
+static int test_tbd_json(tbd_t* tbd)
+{
+  START_TEST_TBD(tbd);  
   
-  tbd_garbage_size_result = tbd_garbage_size(tbd);
-  assert(0 == tbd_garbage_size_result);     
+  /* An empty tbd has an empty array of keys */
+  size_t keys_size = tbd_keys_to_json(json_buffer, sizeof(json_buffer), tbd, TBD_KEY_TO_JSON_FORMAT_STRING);
   
+  assert(2 == keys_size);
+  assert(0 == strcmp("[]", json_buffer));
   
-  // Setup with some sample objects
-  setup_tbd_with_Foo(tbd);
-  tbd_print_stats(tbd);  
+  /* Add an element */
+  struct Foo foo1 = {1, 'a'};
+  struct Foo foo2 = {2, 'b'};
   
-  tbd_garbage_list_to_json(json_buffer, sizeof(json_buffer), tbd);
-  puts(json_buffer);
+  int tbd_create_result = tbd_create(tbd, "1", &foo1, sizeof(struct Foo));
   
-  // delete an element from in the middle of the stack
-  tbd_delete_result = tbd_delete(tbd, "y");
-  assert(TBD_NO_ERROR ==  tbd_delete_result);
-  tbd_print_stats(tbd);  
+  assert(TBD_NO_ERROR ==  tbd_create_result);
+  
+  tbd_create_result = tbd_create(tbd, "2", &foo2, sizeof(struct Foo));
+  
+  assert(TBD_NO_ERROR ==  tbd_create_result);
+  
+  
+  size_t json_size = tbd_keyvalue_to_json(json_buffer, sizeof(json_buffer), tbd, "1", TBD_KEY_TO_JSON_FORMAT_RAW, TBD_VALUE_TO_JSON_FORMAT_HEX);
+                     
+  if (json_size)
+    puts(json_buffer);
 
-  tbd_garbage_list_to_json(json_buffer, sizeof(json_buffer), tbd);
-  puts(json_buffer);  
+  json_size = tbd_keyvalue_to_json(json_buffer, sizeof(json_buffer), tbd, "2", TBD_KEY_TO_JSON_FORMAT_RAW, TBD_VALUE_TO_JSON_FORMAT_HEX);
+  
+  if (json_size)
+    puts(json_buffer);
+  
+  json_size = tbd_to_json(json_buffer, sizeof(json_buffer), tbd, TBD_KEY_TO_JSON_FORMAT_RAW, TBD_VALUE_TO_JSON_FORMAT_HEX);
+  
+  if (json_size)
+    puts(json_buffer);
+  
+  FINISH_TEST_TBD(tbd);   
+  return TBD_NO_ERROR;
+}
+
+
+
+
+static int test_tbd_from_json(tbd_t* tbd)
+{
+  START_TEST_TBD(tbd);
+  
+  // exercise with the output of tbd_keyvalue_to_json
+  struct Foo foo1 = {1, "a"};
+  int tbd_create_result = tbd_create(tbd, "1", &foo1, sizeof(struct Foo));
+  assert(TBD_NO_ERROR == tbd_create_result);
+  
+  size_t json_size = tbd_keyvalue_to_json(json_buffer, sizeof(json_buffer), tbd, "1", TBD_KEY_TO_JSON_FORMAT_RAW, TBD_VALUE_TO_JSON_FORMAT_HEX);
+  assert(json_size);
+  assert(0 == strcmp("1:'016100'", json_buffer));
+  
+  int tbd_from_json_result = tbd_from_json(tbd, json_buffer);
+  assert(TBD_NO_ERROR == tbd_from_json_result);
+  assert(1 == tbd_count(tbd));
+  
+  struct Foo foo_result = {0};
+  int tbd_read_result = tbd_read(tbd, "1", &foo_result, sizeof(struct Foo));
+  assert(TBD_NO_ERROR == tbd_read_result);
+  assert(1 == foo_result.n);
+  
+  // exercise with braces, quoted keys and string values
+  tbd_from_json_result = tbd_from_json(tbd, "{ \"a\" : \"hi\\u0021\", b:'4142' }");
+  assert(TBD_NO_ERROR == tbd_from_json_result);
+  assert(2 == tbd_count(tbd));
+  
+  char text[8] = {0};
+  tbd_read_result = tbd_read(tbd, "a", text, sizeof("hi!"));
+  assert(TBD_NO_ERROR == tbd_read_result);
+  assert(0 == strcmp("hi!", text));
+  
+  tbd_read_result = tbd_read(tbd, "b", text, sizeof("AB"));
+  assert(TBD_NO_ERROR == tbd_read_result);
+  assert(0 == strcmp("AB", text));
+  
+  // exercise with bad json, the old contents are kept
+  tbd_from_json_result = tbd_from_json(tbd, "a:'414'");
+  assert(TBD_ERROR_BAD_FORMAT == tbd_from_json_result);
+  
+  tbd_from_json_result = tbd_from_json(tbd, "{a:'41'");
+  assert(TBD_ERROR_BAD_FORMAT == tbd_from_json_result);
+  
+  tbd_from_json_result = tbd_from_json(tbd, "c:'4344',a:'41");
+  assert(TBD_ERROR_BAD_FORMAT == tbd_from_json_result);
+  assert(2 == tbd_count(tbd));
+  assert(!tbd_read_size(tbd, "c"));
+  
+  tbd_read_result = tbd_read(tbd, "a", text, sizeof("hi!"));
+  assert(TBD_NO_ERROR == tbd_read_result);
+  assert(0 == strcmp("hi!", text));
+  
+  // exercise the parser one char at a time
+  tbd_empty(tbd);
+  
+  const char* json = "c:'6869',\n\"d\":\"yo\"";
+  unsigned char value_buffer[8];
+  
+  tbd_json_parser_t parser;
+  tbd_json_parser_init(&parser, tbd, value_buffer, sizeof(value_buffer));
+  
+  while (*json)
+  {
+    int tbd_json_parser_feed_result = tbd_json_parser_feed(&parser, json++, 1);
+    assert(TBD_NO_ERROR == tbd_json_parser_feed_result);
+  }
+  
+  int tbd_json_parser_finish_result = tbd_json_parser_finish(&parser);
+  assert(2 == tbd_json_parser_finish_result);
+  
+  tbd_read_result = tbd_read(tbd, "c", text, sizeof("hi"));
+  assert(TBD_NO_ERROR == tbd_read_result);
+  assert(0 == strcmp("hi", text));
+  
+  FINISH_TEST_TBD(tbd);
+  return TBD_NO_ERROR;
+}
+
+
+
+
+static int test_tbd_write_json(tbd_t* tbd)
+{
+  START_TEST_TBD(tbd);
+  
+  // exercise with empty tbd
+  size_t json_size = tbd_to_json(json_buffer, sizeof(json_buffer), tbd, TBD_KEY_TO_JSON_FORMAT_RAW, TBD_VALUE_TO_JSON_FORMAT_HEX);
+  assert(2 == json_size);
+  assert(0 == strcmp("{}", json_buffer));
+  
+  json_size = tbd_keys_to_json(json_buffer, sizeof(json_buffer), tbd, TBD_KEY_TO_JSON_FORMAT_STRING);
+  assert(2 == json_size);
+  assert(0 == strcmp("[]", json_buffer));
+  
+  // setup with garbage in the middle of the stack
+  struct Foo foo1 = {1, "a"};
+  int tbd_create_result = tbd_create(tbd, "1", &foo1, sizeof(struct Foo));
+  assert(TBD_NO_ERROR == tbd_create_result);
+  
+  tbd_create_result = tbd_create(tbd, "2", "xx", sizeof("xx"));
+  assert(TBD_NO_ERROR == tbd_create_result);
+  
+  tbd_create_result = tbd_create(tbd, "3", "hi", sizeof("hi"));
+  assert(TBD_NO_ERROR == tbd_create_result);
+  
+  int tbd_delete_result = tbd_delete(tbd, "2");
+  assert(TBD_NO_ERROR == tbd_delete_result);
+  
+  // exercise
+  json_size = tbd_to_json(json_buffer, sizeof(json_buffer), tbd, TBD_KEY_TO_JSON_FORMAT_RAW, TBD_VALUE_TO_JSON_FORMAT_HEX);
+  assert(0 == strcmp("{1:'016100',3:'686900'}", json_buffer));
+  assert(strlen(json_buffer) == json_size);
+  
+  json_size = tbd_keys_to_json(json_buffer, sizeof(json_buffer), tbd, TBD_KEY_TO_JSON_FORMAT_STRING);
+  assert(0 == strcmp("[\"1\",\"3\"]", json_buffer));
+  
+  // exercise with a truncated buffer
+  char small_buffer[8];
+  json_size = tbd_to_json(small_buffer, sizeof(small_buffer), tbd, TBD_KEY_TO_JSON_FORMAT_RAW, TBD_VALUE_TO_JSON_FORMAT_HEX);
+  assert(strlen("{1:'016100',3:'686900'}") == json_size);
+  assert(0 == strcmp("{1:'016", small_buffer));
+  
+  // exercise with a write callback, the output reads back in
+  struct Stream stream = {{0}, 0, 0};
+  int tbd_write_json_result = tbd_write_json(tbd, Stream_write, &stream, TBD_KEY_TO_JSON_FORMAT_STRING, TBD_VALUE_TO_JSON_FORMAT_HEX);
+  assert(TBD_NO_ERROR == tbd_write_json_result);
+  
+  stream.data[stream.size] = '\0';
+  
+  int tbd_from_json_result = tbd_from_json(tbd, (const char*) stream.data);
+  assert(TBD_NO_ERROR == tbd_from_json_result);
+  assert(2 == tbd_count(tbd));
+  
+  char text[4] = {0};
+  int tbd_read_result = tbd_read(tbd, "3", text, sizeof("hi"));
+  assert(TBD_NO_ERROR == tbd_read_result);
+  assert(0 == strcmp("hi", text));
+  
+  // exercise with a callback that runs out of room
+  stream.size = sizeof(stream.data) - 4;
+  tbd_write_json_result = tbd_write_json(tbd, Stream_write, &stream, TBD_KEY_TO_JSON_FORMAT_STRING, TBD_VALUE_TO_JSON_FORMAT_HEX);
+  assert(TBD_ERROR == tbd_write_json_result);
+  
+  FINISH_TEST_TBD(tbd);
+  return TBD_NO_ERROR;
+}
+
+
+
+
+struct Export {
+  char keys[8];
+  size_t count;
+  size_t delete_count;
+};
+
+
+
+
+static int Export_keyvalue(void* context, const char* key, const void* value, size_t value_size, TBD_VERSION_T version)
+{
+  struct Export* export = (struct Export*) context;
+  
+  (void) value_size;
+  (void) version;
+  
+  if (export->count == sizeof(export->keys))
+  {
+    return TBD_ERROR;
+  }
+  
+  export->keys[export->count++] = key[0];
+  
+  if (!value)
+  {
+    export->delete_count++;
+  }
+  
+  return TBD_NO_ERROR;
+}
+
+
+
+
+static int test_tbd_export_since(void)
+{
+  // setup a tbd that keeps tombstones
+  static unsigned char versions_memory[TEST_TBD_HEAD_ROOM + 1024];
+
+  tbd_init_t init = {
+    .start = versions_memory,
+    .size = test_tbd_head_size() + 1024,
+    .hunk_size = 1,
+    .flags = TBD_INIT_FLAG_TOMBSTONES,
+  };
+
+  tbd_t* tbd = tbd_init(&init);
+
+  START_TEST_TBD(tbd);
+  
+  assert(0 == tbd_current_version(tbd));
+  
+  int tbd_create_result = tbd_create(tbd, "a", "1", sizeof("1"));
+  assert(TBD_NO_ERROR == tbd_create_result);
+  
+  tbd_create_result = tbd_create(tbd, "b", "2", sizeof("2"));
+  assert(TBD_NO_ERROR == tbd_create_result);
+  
+  tbd_create_result = tbd_create(tbd, "c", "3", sizeof("3"));
+  assert(TBD_NO_ERROR == tbd_create_result);
+  
+  // exercise a full export
+  struct Export export = {{0}, 0, 0};
+  int tbd_export_result = tbd_export_since(tbd, 0, Export_keyvalue, &export);
+  assert(TBD_NO_ERROR == tbd_export_result);
+  assert(3 == export.count);
+  
+  const TBD_VERSION_T version = tbd_current_version(tbd);
+  assert(3 == version);
+  
+  // exercise with nothing changed
+  memset(&export, 0, sizeof(export));
+  tbd_export_result = tbd_export_since(tbd, version, Export_keyvalue, &export);
+  assert(TBD_NO_ERROR == tbd_export_result);
+  assert(0 == export.count);
+  
+  // exercise with an update and a delete
+  int tbd_put_result = tbd_put(tbd, "b", "22", sizeof("22"));
+  assert(TBD_NO_ERROR == tbd_put_result);
+  
+  int tbd_delete_result = tbd_delete(tbd, "c");
+  assert(TBD_NO_ERROR == tbd_delete_result);
+  assert(!tbd_read_size(tbd, "c"));
+  
+  memset(&export, 0, sizeof(export));
+  tbd_export_result = tbd_export_since(tbd, version, Export_keyvalue, &export);
+  assert(TBD_NO_ERROR == tbd_export_result);
+  assert(2 == export.count);
+  assert(1 == export.delete_count);
+  assert(memchr(export.keys, 'b', export.count));
+  assert(memchr(export.keys, 'c', export.count));
+  
+  // exercise with a key created again after its delete, its tombstone is dropped
+  tbd_create_result = tbd_create(tbd, "c", "4", sizeof("4"));
+  assert(TBD_NO_ERROR == tbd_create_result);
+  
+  memset(&export, 0, sizeof(export));
+  tbd_export_result = tbd_export_since(tbd, version, Export_keyvalue, &export);
+  assert(TBD_NO_ERROR == tbd_export_result);
+  assert(2 == export.count);
+  assert(0 == export.delete_count);
+  
+  int tbd_acknowledge_result = tbd_acknowledge(tbd, tbd_current_version(tbd));
+  assert(0 == tbd_acknowledge_result);
+  
+  char text[4] = {0};
+  int tbd_read_result = tbd_read(tbd, "c", text, sizeof("4"));
+  assert(TBD_NO_ERROR == tbd_read_result);
+  assert(0 == strcmp("4", text));
+  
+  // exercise acknowledge, the tombstone becomes garbage
+  tbd_delete_result = tbd_delete(tbd, "a");
+  assert(TBD_NO_ERROR == tbd_delete_result);
+  
+  const TBD_SIZE_T garbage_count = tbd_garbage_count(tbd);
+  
+  tbd_acknowledge_result = tbd_acknowledge(tbd, tbd_current_version(tbd));
+  assert(1 == tbd_acknowledge_result);
+  assert(garbage_count + 1 == tbd_garbage_count(tbd));
+  
+  tbd_acknowledge_result = tbd_acknowledge(tbd, tbd_current_version(tbd));
+  assert(0 == tbd_acknowledge_result);
+  
+  // exercise expiry, the key is exported as a delete before and after it is found
+  int tbd_expire_result = tbd_expire(tbd, "b", 5);
+  assert(TBD_NO_ERROR == tbd_expire_result);
+  
+  const TBD_VERSION_T expire_version = tbd_current_version(tbd);
+  tbd_set_time(tbd, 5);
   
-  // exercise, no data should be popped
-  tbd_garbage_size_result = tbd_garbage_size(tbd);
-  assert(0 < tbd_garbage_size_result);
-
-  TBD_SIZE_T tbd_garbage_count_result = tbd_garbage_count(tbd);
-  assert(1 == tbd_garbage_count_result);  
+  memset(&export, 0, sizeof(export));
+  tbd_export_result = tbd_export_since(tbd, expire_version, Export_keyvalue, &export);
+  assert(TBD_NO_ERROR == tbd_export_result);
+  assert(1 == export.count);
+  assert(1 == export.delete_count);
+  assert('b' == export.keys[0]);
+  assert(expire_version == tbd_current_version(tbd));
   
-  tbd_garbage_pop_result = tbd_garbage_pop(tbd, tbd_garbage_size_result);
-  assert(0 == tbd_garbage_pop_result);
-  tbd_print_stats(tbd);
+  assert(!tbd_read_size(tbd, "b"));
+  assert(expire_version < tbd_current_version(tbd));
   
-  tbd_garbage_list_to_json(json_buffer, sizeof(json_buffer), tbd);
-  puts(json_buffer);  
+  memset(&export, 0, sizeof(export));
+  tbd_export_result = tbd_export_since(tbd, expire_version, Export_keyvalue, &export);
+  assert(TBD_NO_ERROR == tbd_export_result);
+  assert(1 == export.count);
+  assert(1 == export.delete_count);
   
-  // delete an element from in the top of the stack
-  tbd_delete_result = tbd_delete(tbd, "z");
-  assert(TBD_NO_ERROR ==  tbd_delete_result);
-  tbd_print_stats(tbd);
+  tbd_acknowledge_result = tbd_acknowledge(tbd, tbd_current_version(tbd));
+  assert(1 == tbd_acknowledge_result);
   
-  tbd_garbage_list_to_json(json_buffer, sizeof(json_buffer), tbd);
-  puts(json_buffer);
+  tbd_set_time(tbd, 0);
   
-  tbd_garbage_count_result = tbd_garbage_count(tbd);
-  assert(2 == tbd_garbage_count_result); 
+  FINISH_TEST_TBD(tbd);
   
-  tbd_garbage_size_result = tbd_garbage_size(tbd);
-  assert(0 < tbd_garbage_size_result);
   
-  // exercise, expect to pop top two elements
-  tbd_garbage_pop_result = tbd_garbage_pop(tbd, tbd_garbage_size_result);
-  assert(0 < tbd_garbage_pop_result);
-  tbd_print_stats(tbd);  
+  // setup a tbd that keeps tombstones and evicts
+  static unsigned char evict_memory[TEST_TBD_HEAD_ROOM + 256];
   
-  tbd_garbage_list_to_json(json_buffer, sizeof(json_buffer), tbd);
-  puts(json_buffer);  
+  init.start = evict_memory;
+  init.size = test_tbd_head_size() + 256;
+  init.flags = TBD_INIT_FLAG_TOMBSTONES | TBD_INIT_FLAG_EVICT;
   
-  tbd_garbage_count_result = tbd_garbage_count(tbd);
-  assert(0 == tbd_garbage_count_result);
+  tbd = tbd_init(&init);
+  
+  START_TEST_TBD(tbd);
   
+  // exercise eviction, the write that needed room fails and leaves one tombstone
+  char key[2] = "a";
   
-  FINISH_TEST_TBD(tbd);  
+  while ((key[0] < 'h') && (TBD_NO_ERROR == tbd_create(tbd, key, "1", sizeof("1"))))
+  {
+    ++key[0];
+  }
+  
+  assert(key[0] < 'h');
+  assert((size_t) (key[0] - 'a') == tbd_count(tbd));
+  assert(!tbd_read_size(tbd, "a"));
+  
+  memset(&export, 0, sizeof(export));
+  tbd_export_result = tbd_export_since(tbd, 0, Export_keyvalue, &export);
+  assert(TBD_NO_ERROR == tbd_export_result);
+  assert((size_t) (key[0] - 'a') == export.count);
+  assert(1 == export.delete_count);
+  
+  // once acknowledged, the tombstone makes room
+  tbd_acknowledge_result = tbd_acknowledge(tbd, tbd_current_version(tbd));
+  assert(1 == tbd_acknowledge_result);
+  
+  tbd_create_result = tbd_create(tbd, key, "1", sizeof("1"));
+  assert(TBD_NO_ERROR == tbd_create_result);
+  
+  FINISH_TEST_TBD(tbd);
   return TBD_NO_ERROR;
 }
 
 
 
 
-static int test_tbd_garbage_fold(tbd_t* tbd)
+static int test_tbd_copy(void)
 {
-  START_TEST_TBD(tbd);  
+  static unsigned char src_memory[TEST_TBD_HEAD_ROOM + 1024];
+  static unsigned char dest_memory[TEST_TBD_HEAD_ROOM + 1024];
+  static unsigned char small_memory[TEST_TBD_HEAD_ROOM + 1024];
   
-  // setup database elements
-  struct Foo foo1 = {1, "a"};
-  struct Foo foo2 = {2, "b"};
-  struct Foo foo3 = {3, "c"};
-  struct Foo foo4 = {4, "d"};
-
-  struct Bar bar1 = {'w'};  
-  struct Bar bar2 = {'x'};
-  struct Bar bar3 = {'y'};
-  struct Bar bar4 = {'z'};  
+  tbd_init_t init = {
+    .start = src_memory,
+    .size = test_tbd_head_size() + 1024,
+    .hunk_size = 1,
+  };
   
-  int tbd_create_result = tbd_create(tbd, "1", &foo1, sizeof(struct Foo));
-  assert(TBD_NO_ERROR ==  tbd_create_result);
-
-  tbd_create_result = tbd_create(tbd, "1", &bar1, sizeof(struct Bar));
-  assert(TBD_NO_ERROR ==  tbd_create_result);  
+  tbd_t* src = tbd_init(&init);
   
-  tbd_create_result = tbd_create(tbd, "2", &foo2, sizeof(struct Foo));
-  assert(TBD_NO_ERROR ==  tbd_create_result);  
-
-  tbd_create_result = tbd_create(tbd, "2", &bar2, sizeof(struct Bar));
-  assert(TBD_NO_ERROR ==  tbd_create_result);    
+  init.start = dest_memory;
+  tbd_t* dest = tbd_init(&init);
   
-  tbd_create_result = tbd_create(tbd, "3", &foo3, sizeof(struct Foo));
-  assert(TBD_NO_ERROR ==  tbd_create_result);
+  START_TEST_TBD(src);
   
-  tbd_create_result = tbd_create(tbd, "3", &bar3, sizeof(struct Bar));
-  assert(TBD_NO_ERROR ==  tbd_create_result);    
-
-  tbd_create_result = tbd_create(tbd, "4", &foo4, sizeof(struct Foo));
-  assert(TBD_NO_ERROR ==  tbd_create_result);
+  // setup with keys out of order and garbage in the middle
+  int tbd_create_result = tbd_create(src, "c", "3", sizeof("3"));
+  assert(TBD_NO_ERROR == tbd_create_result);
   
-  tbd_create_result = tbd_create(tbd, "4", &bar4, sizeof(struct Bar));
-  assert(TBD_NO_ERROR ==  tbd_create_result);    
+  tbd_create_result = tbd_create(src, "x", "gone", sizeof("gone"));
+  assert(TBD_NO_ERROR == tbd_create_result);
   
-  size_t tbd_garbage_size_result = tbd_garbage_size(tbd);
-  assert(0 == tbd_garbage_size_result);
+  tbd_create_result = tbd_create(src, "a", "1", sizeof("1"));
+  assert(TBD_NO_ERROR == tbd_create_result);
   
-  tbd_print_stats(tbd);
+  tbd_create_result = tbd_create(src, "b", "2", sizeof("2"));
+  assert(TBD_NO_ERROR == tbd_create_result);
   
-  int tbd_delete_result = tbd_delete(tbd, "2");
-  assert(TBD_NO_ERROR ==  tbd_delete_result);
+  int tbd_delete_result = tbd_delete(src, "x");
+  assert(TBD_NO_ERROR == tbd_delete_result);
   
-  tbd_print_stats(tbd);  
+  // exercise
+  int tbd_copy_result = tbd_copy(dest, src);
+  assert(TBD_NO_ERROR == tbd_copy_result);
+  assert(3 == tbd_count(dest));
+  assert(0 == tbd_garbage_count(dest));
+  assert(tbd_size_used(dest) < tbd_size_used(src));
   
-  tbd_garbage_size_result = tbd_garbage_size(tbd);
-  assert(0 < tbd_garbage_size_result);  
+  tbd_keys_to_json(json_buffer, sizeof(json_buffer), dest, TBD_KEY_TO_JSON_FORMAT_RAW);
+  assert(0 == strcmp("[a,b,c]", json_buffer));
   
-  size_t tbd_garbage_fold_result = tbd_garbage_fold(tbd, 0);
-  assert(0 == tbd_garbage_fold_result);
+  char text[4] = {0};
+  int tbd_read_result = tbd_read(dest, "c", text, sizeof("3"));
+  assert(TBD_NO_ERROR == tbd_read_result);
+  assert(0 == strcmp("3", text));
   
-  tbd_garbage_size_result = tbd_garbage_size(tbd);
-  assert(0 < tbd_garbage_size_result);   
+  // the copy is independent of the original
+  int tbd_update_result = tbd_update(dest, "a", "9", sizeof("9"));
+  assert(TBD_NO_ERROR == tbd_update_result);
   
-  tbd_garbage_fold_result = tbd_garbage_fold(tbd, tbd_garbage_size_result - 1);
-  assert(0 == tbd_garbage_fold_result);
+  tbd_read_result = tbd_read(src, "a", text, sizeof("1"));
+  assert(TBD_NO_ERROR == tbd_read_result);
+  assert(0 == strcmp("1", text));
   
-  tbd_garbage_size_result = tbd_garbage_size(tbd);
-  assert(0 < tbd_garbage_size_result);   
+  // exercise with a dest that is too small
+  init.start = small_memory;
+  init.size = tbd_head_size(src) + 16;
+  tbd_t* small = tbd_init(&init);
   
-  tbd_garbage_fold_result = tbd_garbage_fold(tbd, tbd_garbage_size_result);
-  assert(0 < tbd_garbage_fold_result);
-    
-  FINISH_TEST_TBD(tbd);   
+  tbd_copy_result = tbd_copy(small, src);
+  assert(TBD_ERROR_BAD_SIZE == tbd_copy_result);
+  assert(0 == tbd_count(small));
+  
+  // exercise the raw copy
+  tbd_copy_result = tbd_copy_raw(small, src);
+  assert(TBD_ERROR_BAD_SIZE == tbd_copy_result);
+  
+  tbd_copy_result = tbd_copy_raw(dest, src);
+  assert(TBD_NO_ERROR == tbd_copy_result);
+  assert(tbd_count(src) == tbd_count(dest));
+  assert(tbd_garbage_count(src) == tbd_garbage_count(dest));
+  
+  tbd_read_result = tbd_read(dest, "a", text, sizeof("1"));
+  assert(TBD_NO_ERROR == tbd_read_result);
+  assert(0 == strcmp("1", text));
+  
+  // the garbage was relocated too, so it can be reused
+  tbd_create_result = tbd_create(dest, "y", "gone", sizeof("gone"));
+  assert(TBD_NO_ERROR == tbd_create_result);
+  assert(0 == tbd_garbage_count(dest));
+  
+  tbd_read_result = tbd_read(src, "y", text, sizeof("1"));
+  assert(TBD_ERROR_KEY_NOT_FOUND == tbd_read_result);
+  
+  FINISH_TEST_TBD(src);
   return TBD_NO_ERROR;
 }
 
 
 
 
-static int test_tbd_garbage_pack(tbd_t* tbd)
+static int test_tbd_publish(tbd_t* tbd)
 {
-  START_TEST_TBD(tbd);  
-
-  // exercise with empty tbd
-  size_t tbd_garbage_pack_result = tbd_garbage_pack(tbd, tbd_size(tbd));
-  assert(0 == tbd_garbage_pack_result);  
+  START_TEST_TBD(tbd);
   
+  static unsigned char memory0[TEST_TBD_HEAD_ROOM + 1024];
+  static unsigned char memory1[TEST_TBD_HEAD_ROOM + 1024];
   
-  // setup database element
-  struct Foo foo1 = {1, 'a'};
-  struct Foo foo2 = {2, 'b'};
-  struct Foo foo3 = {3, 'c'};
-  struct Foo foo4 = {4, 'd'};
+  tbd_init_t init = {
+    .start = memory0,
+    .size = test_tbd_head_size() + 1024,
+    .hunk_size = 1,
+  };
   
-  struct Bar bar1 = {'w'};  
-  struct Bar bar2 = {'x'};
-  struct Bar bar3 = {'y'};
-  struct Bar bar4 = {'z'};  
+  tbd_t* tbd0 = tbd_init(&init);
   
-  int tbd_create_result = tbd_create(tbd, "1", &foo1, sizeof(struct Foo));
-  assert(TBD_NO_ERROR ==  tbd_create_result);
+  init.start = memory1;
+  tbd_t* tbd1 = tbd_init(&init);
   
-  tbd_create_result = tbd_create(tbd, "2", &bar1, sizeof(struct Bar));
-  assert(TBD_NO_ERROR ==  tbd_create_result);  
+  tbd_publish_t publish;
+  int tbd_publish_result = tbd_publish_init(&publish, tbd0, tbd1);
+  assert(TBD_NO_ERROR == tbd_publish_result);
   
-  tbd_create_result = tbd_create(tbd, "3", &foo2, sizeof(struct Foo));
-  assert(TBD_NO_ERROR ==  tbd_create_result);  
+  // a reader pins the empty tbd
+  const tbd_t* old_reader = tbd_publish_acquire(&publish);
+  assert(tbd0 == old_reader);
   
-  tbd_create_result = tbd_create(tbd, "4", &bar2, sizeof(struct Bar));
-  assert(TBD_NO_ERROR ==  tbd_create_result);    
+  // exercise, publish a copy
+  int tbd_create_result = tbd_create(tbd, "k", "v1", sizeof("v1"));
+  assert(TBD_NO_ERROR == tbd_create_result);
   
-  tbd_create_result = tbd_create(tbd, "5", &foo3, sizeof(struct Foo));
-  assert(TBD_NO_ERROR ==  tbd_create_result);
+  tbd_t* writer = tbd_publish_begin(&publish);
+  assert(tbd1 == writer);
   
-  tbd_create_result = tbd_create(tbd, "6", &bar3, sizeof(struct Bar));
-  assert(TBD_NO_ERROR ==  tbd_create_result);    
+  int tbd_copy_result = tbd_copy(writer, tbd);
+  assert(TBD_NO_ERROR == tbd_copy_result);
   
-  tbd_create_result = tbd_create(tbd, "7", &foo4, sizeof(struct Foo));
-  assert(TBD_NO_ERROR ==  tbd_create_result);
+  tbd_publish_result = tbd_publish_commit(&publish);
+  assert(TBD_NO_ERROR == tbd_publish_result);
   
-  tbd_create_result = tbd_create(tbd, "8", &bar4, sizeof(struct Bar));
-  assert(TBD_NO_ERROR ==  tbd_create_result);      
+  const tbd_t* reader = tbd_publish_acquire(&publish);
+  assert(tbd1 == reader);
   
-  int tbd_delete_result = tbd_delete(tbd, "3");
-  assert(TBD_NO_ERROR ==  tbd_delete_result);
+  char text[4] = {0};
+  int tbd_read_result = tbd_read_const(reader, "k", text, sizeof("v1"));
+  assert(TBD_NO_ERROR == tbd_read_result);
+  assert(0 == strcmp("v1", text));
   
-  size_t tbd_garbage_size_result = tbd_garbage_size(tbd);
-  assert(0 < tbd_garbage_size_result);     
+  // the old reader still sees the old tbd
+  tbd_read_result = tbd_read_const(old_reader, "k", text, sizeof("v1"));
+  assert(TBD_ERROR_KEY_NOT_FOUND == tbd_read_result);
   
-  tbd_print_stats(tbd);
+  tbd_publish_release(&publish, reader);
   
-  tbd_garbage_pack_result = tbd_garbage_pack(tbd, tbd_garbage_size_result);
-  assert(0 < tbd_garbage_pack_result);
+  // the writer must wait for the old reader
+  writer = tbd_publish_begin(&publish);
+  assert(!writer);
   
-  FINISH_TEST_TBD(tbd);   
+  tbd_publish_release(&publish, old_reader);
+  
+  writer = tbd_publish_begin(&publish);
+  assert(tbd0 == writer);
+  
+  FINISH_TEST_TBD(tbd);
   return TBD_NO_ERROR;
 }
 
 
 
 
-static int test_tbd_garbage_collect(tbd_t* tbd)
+struct Scan {
+  char keys[8];
+  size_t count;
+  size_t limit;
+};
+
+
+
+
+static int Scan_keyvalue(void* context, const char* key, const void* value, size_t value_size)
 {
-  START_TEST_TBD(tbd);  
-  
-  // exercise with empty tbd
-  size_t tbd_garbage_collect_result = tbd_garbage_collect(tbd, 0);
-  
-  assert(0 == tbd_garbage_collect_result);
-  
-  
-  // exercise with no garbage
-  struct Foo foo1 = {1, 'a'};
+  struct Scan* scan = (struct Scan*) context;
   
-  int tbd_create_result = tbd_create(tbd, "1", &foo1, sizeof(struct Foo));
-  assert(TBD_NO_ERROR ==  tbd_create_result);
-  
-  tbd_garbage_collect_result = tbd_garbage_collect(tbd, 0);  
-  assert(0 == tbd_garbage_collect_result);
-
-  // exercise with garbage  
-  int tbd_delete_result = tbd_delete(tbd, "1");
-  assert(TBD_NO_ERROR ==  tbd_delete_result);
+  (void) value;
+  (void) value_size;
   
-  tbd_garbage_collect_result = tbd_garbage_collect(tbd, 0);  
-  assert(0 == tbd_garbage_collect_result);
-
-  tbd_garbage_collect_result = tbd_garbage_collect(tbd, 0x1000);  
-  assert(0 < tbd_garbage_collect_result);  
+  scan->keys[scan->count++] = key[3];
   
-  FINISH_TEST_TBD(tbd);   
-  return TBD_NO_ERROR;
+  return (scan->count == scan->limit) ? 1 : TBD_NO_ERROR;
 }
 
 
 
 
-static int test_tbd_garbage_clean(tbd_t* tbd)
+static int test_tbd_scan(tbd_t* tbd)
 {
-  START_TEST_TBD(tbd);  
+  START_TEST_TBD(tbd);
   
-  // exercise with empty tbd
-  size_t tbd_garbage_clean_result = tbd_garbage_clean(tbd);
-  assert(0 == tbd_garbage_clean_result);
+  // setup
+  const char* keys[] = {"usr3", "cfg2", "usr1", "cfg5", "usr4"};
+  
+  size_t i;
+  for (i = 0; i < sizeof(keys) / sizeof(keys[0]); ++i)
+  {
+    int tbd_create_result = tbd_create(tbd, keys[i], "v", sizeof("v"));
+    assert(TBD_NO_ERROR == tbd_create_result);
+  }
   
+  // exercise unsorted, in stack order
+  struct Scan scan = {{0}, 0, 0};
+  int tbd_scan_result = tbd_scan_prefix(tbd, "usr", Scan_keyvalue, &scan);
+  assert(TBD_NO_ERROR == tbd_scan_result);
+  assert(0 == strcmp("314", scan.keys));
   
-  // exercise with no garbage
-  struct Foo foo1 = {1, 'a'};
+  memset(&scan, 0, sizeof(scan));
+  tbd_scan_result = tbd_scan_prefix(tbd, "", Scan_keyvalue, &scan);
+  assert(TBD_NO_ERROR == tbd_scan_result);
+  assert(5 == scan.count);
   
-  int tbd_create_result = tbd_create(tbd, "1", &foo1, sizeof(struct Foo));
-  assert(TBD_NO_ERROR ==  tbd_create_result);
+  // exercise sorted, in key order
+  int tbd_sort_result = tbd_sort_by_key(tbd);
+  assert(TBD_NO_ERROR == tbd_sort_result);
   
-  tbd_garbage_clean_result = tbd_garbage_clean(tbd);  
-  assert(0 == tbd_garbage_clean_result);
+  memset(&scan, 0, sizeof(scan));
+  tbd_scan_result = tbd_scan_prefix(tbd, "usr", Scan_keyvalue, &scan);
+  assert(TBD_NO_ERROR == tbd_scan_result);
+  assert(0 == strcmp("134", scan.keys));
+  
+  memset(&scan, 0, sizeof(scan));
+  tbd_scan_result = tbd_scan_prefix(tbd, "cfg", Scan_keyvalue, &scan);
+  assert(TBD_NO_ERROR == tbd_scan_result);
+  assert(0 == strcmp("25", scan.keys));
+  
+  memset(&scan, 0, sizeof(scan));
+  tbd_scan_result = tbd_scan_prefix(tbd, "zzz", Scan_keyvalue, &scan);
+  assert(TBD_NO_ERROR == tbd_scan_result);
+  assert(0 == scan.count);
+  
+  // the callback can stop the scan
+  memset(&scan, 0, sizeof(scan));
+  scan.limit = 2;
+  tbd_scan_result = tbd_scan_prefix(tbd, "usr", Scan_keyvalue, &scan);
+  assert(1 == tbd_scan_result);
+  assert(0 == strcmp("13", scan.keys));
+  
+  // exercise glob patterns
+  memset(&scan, 0, sizeof(scan));
+  tbd_scan_result = tbd_scan_glob(tbd, "usr?", Scan_keyvalue, &scan);
+  assert(TBD_NO_ERROR == tbd_scan_result);
+  assert(0 == strcmp("134", scan.keys));
+  
+  memset(&scan, 0, sizeof(scan));
+  tbd_scan_result = tbd_scan_glob(tbd, "*g*", Scan_keyvalue, &scan);
+  assert(TBD_NO_ERROR == tbd_scan_result);
+  assert(0 == strcmp("25", scan.keys));
+  
+  // deleted keys are skipped, and the tbd is no longer sorted
+  int tbd_delete_result = tbd_delete(tbd, "usr3");
+  assert(TBD_NO_ERROR == tbd_delete_result);
   
-  // exercise with garbage  
-  int tbd_delete_result = tbd_delete(tbd, "1");
-  assert(TBD_NO_ERROR ==  tbd_delete_result);
+  memset(&scan, 0, sizeof(scan));
+  tbd_scan_result = tbd_scan_glob(tbd, "usr3", Scan_keyvalue, &scan);
+  assert(TBD_NO_ERROR == tbd_scan_result);
+  assert(0 == scan.count);
   
-  tbd_garbage_clean_result = tbd_garbage_clean(tbd);  
-  assert(0 < tbd_garbage_clean_result);
+  memset(&scan, 0, sizeof(scan));
+  tbd_scan_result = tbd_scan_glob(tbd, "usr*", Scan_keyvalue, &scan);
+  assert(TBD_NO_ERROR == tbd_scan_result);
+  assert(2 == scan.count);
   
-  FINISH_TEST_TBD(tbd);   
+  // a key that reuses garbage after a sort is not in key order
+  tbd_empty(tbd);
+  
+  const char* reuse_keys[] = {"bbb1", "ccc1", "ddd1"};
+  
+  for (i = 0; i < sizeof(reuse_keys) / sizeof(reuse_keys[0]); ++i)
+  {
+    int tbd_create_result = tbd_create(tbd, reuse_keys[i], "v", sizeof("v"));
+    assert(TBD_NO_ERROR == tbd_create_result);
+  }
+  
+  tbd_delete_result = tbd_delete(tbd, "ddd1");
+  assert(TBD_NO_ERROR == tbd_delete_result);
+  
+  tbd_sort_result = tbd_sort_by_key(tbd);
+  assert(TBD_NO_ERROR == tbd_sort_result);
+  
+  int tbd_create_result = tbd_create(tbd, "aaa1", "v", sizeof("v"));
+  assert(TBD_NO_ERROR == tbd_create_result);
+  assert(0 == tbd_garbage_count(tbd));
+  
+  memset(&scan, 0, sizeof(scan));
+  tbd_scan_result = tbd_scan_prefix(tbd, "bbb", Scan_keyvalue, &scan);
+  assert(TBD_NO_ERROR == tbd_scan_result);
+  assert(0 == strcmp("1", scan.keys));
+  
+  FINISH_TEST_TBD(tbd);
   return TBD_NO_ERROR;
 }
 
 
 
 
-
-static int test_tbd_json(tbd_t* tbd)
+static int test_tbd_handle(tbd_t* tbd)
 {
-  START_TEST_TBD(tbd);  
+  START_TEST_TBD(tbd);
   
-  /* Add an element */
-  struct Foo foo1 = {1, 'a'};
-  struct Foo foo2 = {2, 'b'};
+  // setup
+  int tbd_create_result = tbd_create(tbd, "c", "3", sizeof("3"));
+  assert(TBD_NO_ERROR == tbd_create_result);
   
-  int tbd_create_result = tbd_create(tbd, "1", &foo1, sizeof(struct Foo));
+  tbd_create_result = tbd_create(tbd, "a", "1", sizeof("1"));
+  assert(TBD_NO_ERROR == tbd_create_result);
   
-  assert(TBD_NO_ERROR ==  tbd_create_result);
+  tbd_create_result = tbd_create(tbd, "b", "2", sizeof("2"));
+  assert(TBD_NO_ERROR == tbd_create_result);
   
-  tbd_create_result = tbd_create(tbd, "2", &foo2, sizeof(struct Foo));
+  // exercise
+  tbd_handle_t handle = tbd_handle_get(tbd, "a");
+  assert(handle);
+  assert(handle == tbd_handle_get(tbd, "a"));
+  assert(0 == tbd_handle_get(tbd, "z"));
+  assert(0 == strcmp("1", tbd_handle_value(tbd, handle)));
+  assert(sizeof("1") == tbd_handle_value_size(tbd, handle));
+  
+  // the handle follows the keyvalue when it moves
+  int tbd_sort_result = tbd_sort_by_key(tbd);
+  assert(TBD_NO_ERROR == tbd_sort_result);
+  assert(0 == strcmp("1", tbd_handle_value(tbd, handle)));
   
-  assert(TBD_NO_ERROR ==  tbd_create_result);
+  tbd_sort_result = tbd_sort_by_heap(tbd);
+  assert(TBD_NO_ERROR == tbd_sort_result);
+  assert(0 == strcmp("1", tbd_handle_value(tbd, handle)));
   
+  int tbd_put_result = tbd_put(tbd, "a", "longer", sizeof("longer"));
+  assert(TBD_NO_ERROR == tbd_put_result);
+  assert(0 == strcmp("longer", tbd_handle_value(tbd, handle)));
+  assert(sizeof("longer") == tbd_handle_value_size(tbd, handle));
   
-  size_t json_size = tbd_keyvalue_to_json(json_buffer, sizeof(json_buffer), tbd, "1", TBD_KEY_TO_JSON_FORMAT_RAW, TBD_VALUE_TO_JSON_FORMAT_HEX);
-                     
-  if (json_size)
-    puts(json_buffer);
-
-  json_size = tbd_keyvalue_to_json(json_buffer, sizeof(json_buffer), tbd, "2", TBD_KEY_TO_JSON_FORMAT_RAW, TBD_VALUE_TO_JSON_FORMAT_HEX);
+  // the handle is invalid once the key is deleted
+  int tbd_delete_result = tbd_delete(tbd, "a");
+  assert(TBD_NO_ERROR == tbd_delete_result);
+  assert(!tbd_handle_value(tbd, handle));
+  assert(0 == tbd_handle_value_size(tbd, handle));
   
-  if (json_size)
-    puts(json_buffer);
+  // a released handle does not resolve, even after its slot is used again
+  handle = tbd_handle_get(tbd, "b");
+  tbd_handle_release(tbd, handle);
+  assert(!tbd_handle_value(tbd, handle));
   
-  json_size = tbd_to_json(json_buffer, sizeof(json_buffer), tbd, TBD_KEY_TO_JSON_FORMAT_RAW, TBD_VALUE_TO_JSON_FORMAT_HEX);
+  tbd_handle_t other_handle = tbd_handle_get(tbd, "c");
+  assert(other_handle);
+  assert(other_handle != handle);
+  assert(!tbd_handle_value(tbd, handle));
+  assert(0 == strcmp("3", tbd_handle_value(tbd, other_handle)));
   
-  if (json_size)
-    puts(json_buffer);
+  tbd_handle_release(tbd, other_handle);
   
-  FINISH_TEST_TBD(tbd);   
+  FINISH_TEST_TBD(tbd);
   return TBD_NO_ERROR;
 }
 
@@ -974,33 +3125,60 @@ int test_tbd(void)
   assert(TBD_NO_ERROR == test_tbd_size_used(tbd));
   assert(TBD_NO_ERROR == test_tbd_sort_by_key(tbd));
   assert(TBD_NO_ERROR == test_tbd_sort_by_heap(tbd));
+  assert(TBD_NO_ERROR == test_tbd_sort_by_key__garbage(tbd));
   
   
   /* Test the basic CRUD */
   assert(TBD_NO_ERROR == test_tbd_create(tbd));
 //  assert(TBD_NO_ERROR == test_tbd_create__fill_tbd(tbd));
+  assert(TBD_NO_ERROR == test_tbd_max_count__reserve(tbd));
+  assert(TBD_NO_ERROR == test_tbd_create__evict());
+  assert(TBD_NO_ERROR == test_tbd_read__filter());
   
   assert(TBD_NO_ERROR == test_tbd_read(tbd));
+  assert(TBD_NO_ERROR == test_tbd_read_multi(tbd));
+  assert(TBD_NO_ERROR == test_tbd_read__lookup_cache(tbd));
+  assert(TBD_NO_ERROR == test_tbd_read__fingerprints(tbd));
+  assert(TBD_NO_ERROR == test_tbd_read__op_stats(tbd));
+  assert(TBD_NO_ERROR == test_tbd_set_trace(tbd));
+  assert(TBD_NO_ERROR == test_tbd_stats_to_json(tbd));
   assert(TBD_NO_ERROR == test_tbd_update(tbd));
+  assert(TBD_NO_ERROR == test_tbd_put(tbd));
   assert(TBD_NO_ERROR == test_tbd_delete(tbd));
   
   
   /* Test the advance CRUD */
   assert(TBD_NO_ERROR == test_tbd_read_size(tbd));
+  assert(TBD_NO_ERROR == test_tbd_cas(tbd));
+  assert(TBD_NO_ERROR == test_tbd_incr(tbd));
+  assert(TBD_NO_ERROR == test_tbd_append(tbd));
+  assert(TBD_NO_ERROR == test_tbd_expire(tbd));
+  
+  
+  /* Test snapshots */
+  assert(TBD_NO_ERROR == test_tbd_save(tbd));
+  assert(TBD_NO_ERROR == test_tbd_wal(tbd));
   
   
   /* Test garbage collection */
   assert(TBD_NO_ERROR == test_tbd_garbage_size(tbd));
   assert(TBD_NO_ERROR == test_tbd_garbage_merge(tbd));
   assert(TBD_NO_ERROR == test_tbd_garbage_pop(tbd));  
-//  assert(TBD_NO_ERROR == test_tbd_garbage_fold(tbd));
-//  assert(TBD_NO_ERROR == test_tbd_garbage_pack(tbd));    
-//  assert(TBD_NO_ERROR == test_tbd_garbage_collect(tbd));
-//  assert(TBD_NO_ERROR == test_tbd_garbage_clean(tbd));
+  assert(TBD_NO_ERROR == test_tbd_garbage_fold(tbd));
+  assert(TBD_NO_ERROR == test_tbd_garbage_pack(tbd));    
+  assert(TBD_NO_ERROR == test_tbd_garbage_collect(tbd));
+  assert(TBD_NO_ERROR == test_tbd_garbage_clean(tbd));
   
   
   /* Test JSON support */
   assert(TBD_NO_ERROR == test_tbd_json(tbd));
+  assert(TBD_NO_ERROR == test_tbd_from_json(tbd));
+  assert(TBD_NO_ERROR == test_tbd_write_json(tbd));
+  assert(TBD_NO_ERROR == test_tbd_export_since());
+  assert(TBD_NO_ERROR == test_tbd_copy());
+  assert(TBD_NO_ERROR == test_tbd_publish(tbd));
+  assert(TBD_NO_ERROR == test_tbd_handle(tbd));
+  assert(TBD_NO_ERROR == test_tbd_scan(tbd));
   
   return TBD_NO_ERROR; // return 0 for success
-}
\ No newline at end of file
+}
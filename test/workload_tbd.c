@@ -0,0 +1,815 @@
+/** Workload driver for tbd.
+ */
+
+
+
+#define _POSIX_C_SOURCE 199309L
+
+#include "workload_tbd.h"
+#include "tbd.h"
+
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+
+
+/*
+ * Workload options.
+ */
+
+// Each power of 2 of nanoseconds is split into 2^WORKLOAD_HISTOGRAM_SUB_BITS buckets.
+#define WORKLOAD_HISTOGRAM_SUB_BITS 3
+#define WORKLOAD_HISTOGRAM_SUB_COUNT (1u << WORKLOAD_HISTOGRAM_SUB_BITS)
+#define WORKLOAD_HISTOGRAM_SIZE (64 * WORKLOAD_HISTOGRAM_SUB_COUNT)
+
+#define WORKLOAD_MAX_VALUE_SIZE 256
+#define WORKLOAD_MAX_LINE_SIZE (2 * WORKLOAD_MAX_VALUE_SIZE + 32)
+
+
+
+
+typedef enum WORKLOAD_OP
+{
+  WORKLOAD_OP_READ,
+  WORKLOAD_OP_UPDATE,
+  WORKLOAD_OP_INSERT,
+  WORKLOAD_OP_DELETE,
+  WORKLOAD_OP_SCAN,
+  WORKLOAD_OP_RMW,
+  WORKLOAD_OP_INCR,
+  WORKLOAD_OP_APPEND,
+  WORKLOAD_OP_CAS,
+  WORKLOAD_OP_COUNT,
+
+} WORKLOAD_OP_ENUM;
+
+
+static const char* const workload_op_names[WORKLOAD_OP_COUNT] = {
+  "read", "update", "insert", "delete", "scan", "rmw", "incr", "append", "cas"
+};
+
+
+
+
+/** Latencies of one kind of operation.
+ */
+struct Histogram {
+  size_t count;
+  size_t failed;
+  double total_ns;
+  unsigned long max_ns;
+  size_t buckets[WORKLOAD_HISTOGRAM_SIZE];
+};
+
+
+/** State of a run or replay.
+ */
+struct Workload {
+  const char* name;
+  tbd_t* tbd;
+  size_t skipped;
+  unsigned long start_ns;
+  struct Histogram histograms[WORKLOAD_OP_COUNT];
+};
+
+
+/** Zipfian generator from "Quickly Generating Billion-Record Synthetic Databases", as used by YCSB.
+ *  Draws ranks from 0 to item_count - 1, rank 0 is the most popular.
+ */
+struct Zipfian {
+  double theta;
+  double alpha;
+  double zeta2;
+  double zetan;
+  size_t item_count;
+};
+
+
+static unsigned char workload_memory[TBD_MAX_SIZE];
+static struct Workload workload;
+static char workload_value[WORKLOAD_MAX_VALUE_SIZE];
+static char workload_read_value[WORKLOAD_MAX_VALUE_SIZE];
+
+
+
+
+static unsigned long workload_now(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (unsigned long) now.tv_sec * 1000000000ul + (unsigned long) now.tv_nsec;
+}
+
+
+
+
+static size_t workload_bucket(unsigned long ns)
+{
+  if (ns < WORKLOAD_HISTOGRAM_SUB_COUNT)
+  {
+    return ns;
+  }
+
+  unsigned msb = WORKLOAD_HISTOGRAM_SUB_BITS;
+
+  while (ns >> (msb + 1))
+  {
+    ++msb;
+  }
+
+  const unsigned shift = msb - WORKLOAD_HISTOGRAM_SUB_BITS;
+
+  return (shift + 1) * WORKLOAD_HISTOGRAM_SUB_COUNT + ((ns >> shift) & (WORKLOAD_HISTOGRAM_SUB_COUNT - 1));
+}
+
+
+
+
+/** Highest latency that falls in a bucket.
+ */
+static unsigned long workload_bucket_max(size_t bucket)
+{
+  if (bucket < WORKLOAD_HISTOGRAM_SUB_COUNT)
+  {
+    return bucket;
+  }
+
+  const unsigned shift = (unsigned) (bucket / WORKLOAD_HISTOGRAM_SUB_COUNT) - 1;
+  const unsigned long sub = bucket % WORKLOAD_HISTOGRAM_SUB_COUNT;
+
+  return ((WORKLOAD_HISTOGRAM_SUB_COUNT + sub + 1) << shift) - 1;
+}
+
+
+
+
+static void workload_record(WORKLOAD_OP_ENUM op, unsigned long start, int result)
+{
+  const unsigned long ns = workload_now() - start;
+
+  struct Histogram* histogram = &workload.histograms[op];
+
+  ++histogram->count;
+  histogram->total_ns += (double) ns;
+  ++histogram->buckets[workload_bucket(ns)];
+
+  if (ns > histogram->max_ns)
+  {
+    histogram->max_ns = ns;
+  }
+
+  if (result < 0)
+  {
+    ++histogram->failed;
+  }
+}
+
+
+
+
+static unsigned long workload_percentile(const struct Histogram* histogram, double percentile)
+{
+  const double rank = percentile * (double) histogram->count;
+  size_t seen = 0;
+
+  size_t i;
+  for (i = 0; i < WORKLOAD_HISTOGRAM_SIZE; ++i)
+  {
+    seen += histogram->buckets[i];
+
+    if ((double) seen >= rank)
+    {
+      const unsigned long bucket_max = workload_bucket_max(i);
+      return (bucket_max < histogram->max_ns) ? bucket_max : histogram->max_ns;
+    }
+  }
+
+  return histogram->max_ns;
+}
+
+
+
+
+static bool workload_begin(const char* name, size_t tbd_size, size_t hunk_size)
+{
+  memset(&workload, 0, sizeof(workload));
+
+  tbd_init_t init = {
+    .start = workload_memory,
+    .size = (tbd_size < sizeof(workload_memory)) ? tbd_size : sizeof(workload_memory),
+    .hunk_size = hunk_size,
+  };
+
+  workload.name = name;
+  workload.tbd = tbd_init(&init);
+
+  return workload.tbd != NULL;
+}
+
+
+
+
+static void workload_report(void)
+{
+  const double elapsed_ns = (double) (workload_now() - workload.start_ns);
+  size_t total = 0;
+
+  size_t op;
+  for (op = 0; op < WORKLOAD_OP_COUNT; ++op)
+  {
+    const struct Histogram* histogram = &workload.histograms[op];
+
+    if (!histogram->count)
+    {
+      continue;
+    }
+
+    total += histogram->count;
+
+    printf("{\"workload\":\"%s\",\"op\":\"%s\",\"count\":%zu,\"failed\":%zu,\"mean_ns\":%.1f,"
+           "\"p50_ns\":%lu,\"p90_ns\":%lu,\"p99_ns\":%lu,\"p999_ns\":%lu,\"max_ns\":%lu}\n",
+           workload.name, workload_op_names[op], histogram->count, histogram->failed,
+           histogram->total_ns / (double) histogram->count,
+           workload_percentile(histogram, 0.5), workload_percentile(histogram, 0.9),
+           workload_percentile(histogram, 0.99), workload_percentile(histogram, 0.999), histogram->max_ns);
+  }
+
+  printf("{\"workload\":\"%s\",\"operations\":%zu,\"skipped\":%zu,\"ops_per_sec\":%.0f,\"keys\":%zu,\"size_used\":%zu}\n",
+         workload.name, total, workload.skipped, (elapsed_ns > 0) ? (double) total * 1e9 / elapsed_ns : 0,
+         tbd_count(workload.tbd), tbd_size_used(workload.tbd));
+}
+
+
+
+
+/*
+ * Random numbers.
+ */
+
+
+
+
+static unsigned long long workload_random(unsigned long long* state)
+{
+  // xorshift64*
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+
+  return *state * 2685821657736338717ull;
+}
+
+
+
+
+/** Random double in [0, 1).
+ */
+static double workload_random_double(unsigned long long* state)
+{
+  return (double) (workload_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+
+
+static void workload_zipfian_grow(struct Zipfian* zipfian, size_t item_count)
+{
+  // the zeta sum is extended as items are inserted, like YCSB
+  while (zipfian->item_count < item_count)
+  {
+    ++zipfian->item_count;
+    zipfian->zetan += 1.0 / pow((double) zipfian->item_count, zipfian->theta);
+  }
+}
+
+
+
+
+static void workload_zipfian_init(struct Zipfian* zipfian, double theta, size_t item_count)
+{
+  zipfian->theta = theta;
+  zipfian->alpha = 1.0 / (1.0 - theta);
+  zipfian->zeta2 = 1.0 + 1.0 / pow(2.0, theta);
+  zipfian->zetan = 0;
+  zipfian->item_count = 0;
+
+  workload_zipfian_grow(zipfian, item_count);
+}
+
+
+
+
+static size_t workload_zipfian_next(const struct Zipfian* zipfian, unsigned long long* state)
+{
+  const double n = (double) zipfian->item_count;
+  const double eta = (1.0 - pow(2.0 / n, 1.0 - zipfian->theta)) / (1.0 - zipfian->zeta2 / zipfian->zetan);
+
+  const double u = workload_random_double(state);
+  const double uz = u * zipfian->zetan;
+
+  if (uz < 1.0)
+  {
+    return 0;
+  }
+
+  if (uz < 1.0 + pow(0.5, zipfian->theta))
+  {
+    return 1;
+  }
+
+  const size_t rank = (size_t) (n * pow(eta * u - eta + 1.0, zipfian->alpha));
+
+  return (rank < zipfian->item_count) ? rank : zipfian->item_count - 1;
+}
+
+
+
+
+/** Scatter the popular ranks over the key space, so hot keys are not all next to each other.
+ */
+static size_t workload_scramble(size_t rank, size_t item_count)
+{
+  // FNV-1a of the rank
+  unsigned long long hash = 14695981039346656037ull;
+
+  size_t i;
+  for (i = 0; i < sizeof(rank); ++i)
+  {
+    hash ^= (rank >> (8 * i)) & 0xFF;
+    hash *= 1099511628211ull;
+  }
+
+  return (size_t) (hash % item_count);
+}
+
+
+
+
+/*
+ * Operations.
+ */
+
+
+
+
+static void workload_key(char* key, size_t index)
+{
+  snprintf(key, TBD_MAX_KEY_LENGTH + 1, "u%07zu", index % 10000000u);
+}
+
+
+
+
+static void workload_trace(FILE* trace, const char* cmd, const char* key, const char* value)
+{
+  if (!trace)
+  {
+    return;
+  }
+
+  if (value)
+  {
+    fprintf(trace, "%s %s %s\n", cmd, key, value);
+  }
+  else
+  {
+    fprintf(trace, "%s %s\n", cmd, key);
+  }
+}
+
+
+
+
+struct Scan {
+  size_t count;
+  size_t limit;
+};
+
+
+
+
+static int workload_scan_keyvalue(void* context, const char* key, const void* value, size_t value_size)
+{
+  struct Scan* scan = (struct Scan*) context;
+
+  (void) key;
+  (void) value;
+  (void) value_size;
+
+  return (++scan->count < scan->limit) ? TBD_NO_ERROR : 1;
+}
+
+
+
+
+static int workload_read(const char* key)
+{
+  const size_t value_size = tbd_read_size(workload.tbd, key);
+
+  if (!value_size)
+  {
+    return TBD_ERROR_KEY_NOT_FOUND;
+  }
+
+  if (value_size > sizeof(workload_read_value))
+  {
+    return TBD_ERROR_BAD_SIZE;
+  }
+
+  return tbd_read(workload.tbd, key, workload_read_value, value_size);
+}
+
+
+
+
+static int workload_scan(const char* prefix, size_t limit)
+{
+  struct Scan scan = {0, limit};
+
+  const int result = tbd_scan_prefix(workload.tbd, prefix, workload_scan_keyvalue, &scan);
+
+  return (result < 0) ? result : TBD_NO_ERROR;
+}
+
+
+
+
+/** Choose the index of an existing key.
+ */
+static size_t workload_choose(const workload_params_t* params, struct Zipfian* zipfian, size_t key_count, unsigned long long* state)
+{
+  switch (params->distribution)
+  {
+    case WORKLOAD_DISTRIBUTION_ZIPFIAN:
+      return workload_scramble(workload_zipfian_next(zipfian, state), key_count);
+
+    case WORKLOAD_DISTRIBUTION_LATEST:
+      workload_zipfian_grow(zipfian, key_count);
+      return key_count - 1 - workload_zipfian_next(zipfian, state);
+
+    default:
+      return (size_t) (workload_random(state) % key_count);
+  }
+}
+
+
+
+
+static WORKLOAD_OP_ENUM workload_choose_op(const workload_params_t* params, unsigned long long* state)
+{
+  const unsigned weights[] = {
+    params->read_weight, params->update_weight, params->insert_weight,
+    params->delete_weight, params->scan_weight, params->rmw_weight
+  };
+
+  unsigned total = 0;
+
+  size_t i;
+  for (i = 0; i < sizeof(weights) / sizeof(weights[0]); ++i)
+  {
+    total += weights[i];
+  }
+
+  unsigned pick = (unsigned) (workload_random(state) % (total ? total : 1));
+
+  for (i = 0; i < sizeof(weights) / sizeof(weights[0]); ++i)
+  {
+    if (pick < weights[i])
+    {
+      return (WORKLOAD_OP_ENUM) i;
+    }
+
+    pick -= weights[i];
+  }
+
+  return WORKLOAD_OP_READ;
+}
+
+
+
+
+int workload_tbd_run(const char* name, const workload_params_t* params)
+{
+  if (!params || !params->value_size || (params->value_size > sizeof(workload_value)))
+  {
+    return TBD_ERROR_BAD_SIZE;
+  }
+
+  if (!workload_begin(name, params->tbd_size, params->hunk_size))
+  {
+    return TBD_ERROR;
+  }
+
+  // values are null terminated, and alphanumeric so tbds can read them back from a trace
+  memset(workload_value, 'v', params->value_size - 1);
+  workload_value[params->value_size - 1] = '\0';
+
+  unsigned long long state = params->seed ? params->seed : 1;
+  char key[TBD_MAX_KEY_LENGTH + 1];
+
+  // load
+  size_t key_count = 0;
+
+  while (key_count < params->record_count)
+  {
+    workload_key(key, key_count);
+    workload_trace(params->trace, "insert", key, workload_value);
+
+    if (TBD_NO_ERROR != tbd_create(workload.tbd, key, workload_value, params->value_size))
+    {
+      break;
+    }
+
+    ++key_count;
+  }
+
+  if (!key_count)
+  {
+    return TBD_ERROR_BAD_SIZE;
+  }
+
+  struct Zipfian zipfian;
+  workload_zipfian_init(&zipfian, params->zipfian_constant, key_count);
+
+  // run
+  workload.start_ns = workload_now();
+
+  size_t i;
+  for (i = 0; i < params->operation_count; ++i)
+  {
+    const WORKLOAD_OP_ENUM op = workload_choose_op(params, &state);
+
+    if (WORKLOAD_OP_INSERT == op)
+    {
+      workload_key(key, key_count);
+      workload_trace(params->trace, "insert", key, workload_value);
+
+      const unsigned long start = workload_now();
+      const int result = tbd_create(workload.tbd, key, workload_value, params->value_size);
+      workload_record(op, start, result);
+
+      if (TBD_NO_ERROR == result)
+      {
+        ++key_count;
+      }
+
+      continue;
+    }
+
+    workload_key(key, workload_choose(params, &zipfian, key_count, &state));
+
+    const unsigned long start = workload_now();
+    int result = TBD_NO_ERROR;
+
+    switch (op)
+    {
+      case WORKLOAD_OP_UPDATE:
+        result = tbd_put(workload.tbd, key, workload_value, params->value_size);
+        break;
+
+      case WORKLOAD_OP_DELETE:
+        result = tbd_delete(workload.tbd, key);
+        break;
+
+      case WORKLOAD_OP_SCAN:
+        // the keys next to this one share all but the last digit
+        key[TBD_MAX_KEY_LENGTH - 1] = '\0';
+        result = workload_scan(key, params->scan_length);
+        break;
+
+      case WORKLOAD_OP_RMW:
+        result = workload_read(key);
+        result = (result < 0) ? result : tbd_put(workload.tbd, key, workload_value, params->value_size);
+        break;
+
+      default:
+        result = workload_read(key);
+        break;
+    }
+
+    workload_record(op, start, result);
+
+    // traced after timing, so writing the trace does not count
+    switch (op)
+    {
+      case WORKLOAD_OP_UPDATE:
+        workload_trace(params->trace, "update", key, workload_value);
+        break;
+
+      case WORKLOAD_OP_DELETE:
+        workload_trace(params->trace, "delete", key, NULL);
+        break;
+
+      case WORKLOAD_OP_SCAN:
+        workload_trace(params->trace, "prefix", key, NULL);
+        break;
+
+      case WORKLOAD_OP_RMW:
+        workload_trace(params->trace, "select", key, NULL);
+        workload_trace(params->trace, "update", key, workload_value);
+        break;
+
+      default:
+        workload_trace(params->trace, "select", key, NULL);
+        break;
+    }
+  }
+
+  workload_report();
+
+  return TBD_NO_ERROR;
+}
+
+
+
+
+/** Replay one command, returns false if it could not be replayed.
+ */
+static bool workload_replay_line(const char* line)
+{
+  char cmd[8] = {0};
+  char key[TBD_MAX_KEY_LENGTH + 1] = {0};
+  char value[WORKLOAD_MAX_VALUE_SIZE] = {0};
+  char value2[WORKLOAD_MAX_VALUE_SIZE] = {0};
+
+  const int field_count = sscanf(line, "%7s %8s %255s %255s", cmd, key, value, value2);
+
+  if (field_count < 2)
+  {
+    return false;
+  }
+
+  const size_t value_size = strlen(value) + 1;
+
+  WORKLOAD_OP_ENUM op = WORKLOAD_OP_COUNT;
+  int result = TBD_NO_ERROR;
+  long number = 0;
+
+  const unsigned long start = workload_now();
+
+  if (0 == strcmp(cmd, "select"))
+  {
+    op = WORKLOAD_OP_READ;
+    result = workload_read(key);
+  }
+  else if (0 == strcmp(cmd, "prefix"))
+  {
+    op = WORKLOAD_OP_SCAN;
+    result = workload_scan(key, (size_t) -1);
+  }
+  else if (0 == strcmp(cmd, "delete"))
+  {
+    op = WORKLOAD_OP_DELETE;
+    result = tbd_delete(workload.tbd, key);
+  }
+  else if (field_count < 3)
+  {
+    return false;
+  }
+  else if (0 == strcmp(cmd, "update"))
+  {
+    op = WORKLOAD_OP_UPDATE;
+    result = tbd_put(workload.tbd, key, value, value_size);
+  }
+  else if (0 == strcmp(cmd, "insert"))
+  {
+    op = WORKLOAD_OP_INSERT;
+    result = tbd_create(workload.tbd, key, value, value_size);
+  }
+  else if (0 == strcmp(cmd, "incrby"))
+  {
+    op = WORKLOAD_OP_INCR;
+    result = tbd_incr(workload.tbd, key, strtol(value, NULL, 10), &number, TBD_INCR_OVERFLOW_ERROR);
+  }
+  else if (0 == strcmp(cmd, "append"))
+  {
+    op = WORKLOAD_OP_APPEND;
+    result = tbd_append(workload.tbd, key, value, value_size - 1);
+  }
+  else if ((0 == strcmp(cmd, "cmpswp")) && (field_count == 4))
+  {
+    op = WORKLOAD_OP_CAS;
+    result = (value_size == strlen(value2) + 1) ? tbd_cas(workload.tbd, key, value, value2, value_size) : TBD_ERROR_BAD_SIZE;
+  }
+  else
+  {
+    return false;
+  }
+
+  workload_record(op, start, result);
+
+  return true;
+}
+
+
+
+
+int workload_tbd_replay(const char* name, FILE* trace, size_t tbd_size, size_t hunk_size)
+{
+  if (!trace)
+  {
+    return TBD_ERROR;
+  }
+
+  if (!workload_begin(name, tbd_size, hunk_size))
+  {
+    return TBD_ERROR;
+  }
+
+  char line[WORKLOAD_MAX_LINE_SIZE];
+
+  workload.start_ns = workload_now();
+
+  while (fgets(line, sizeof(line), trace))
+  {
+    if (!workload_replay_line(line))
+    {
+      ++workload.skipped;
+    }
+  }
+
+  workload_report();
+
+  return TBD_NO_ERROR;
+}
+
+
+
+
+int workload_tbd(void)
+{
+  workload_params_t params = {
+    .tbd_size = TBD_MAX_SIZE,
+    .hunk_size = 8,
+    .record_count = 200,
+    .operation_count = 20000,
+    .value_size = 16,
+    .scan_length = 10,
+    .distribution = WORKLOAD_DISTRIBUTION_ZIPFIAN,
+    .zipfian_constant = 0.99,
+    .seed = 1,
+  };
+
+  // A: update heavy
+  params.read_weight = 50;
+  params.update_weight = 50;
+
+  FILE* trace = tmpfile();
+  params.trace = trace;
+
+  int result = workload_tbd_run("a", &params);
+  params.trace = NULL;
+
+  // B: read mostly
+  params.read_weight = 95;
+  params.update_weight = 5;
+
+  result = result ? result : workload_tbd_run("b", &params);
+
+  // C: read only
+  params.read_weight = 100;
+  params.update_weight = 0;
+
+  result = result ? result : workload_tbd_run("c", &params);
+
+  // D: read latest, inserts stop when the tbd is full
+  params.read_weight = 95;
+  params.insert_weight = 5;
+  params.distribution = WORKLOAD_DISTRIBUTION_LATEST;
+
+  result = result ? result : workload_tbd_run("d", &params);
+
+  // E: short scans
+  params.read_weight = 0;
+  params.scan_weight = 95;
+  params.distribution = WORKLOAD_DISTRIBUTION_ZIPFIAN;
+
+  result = result ? result : workload_tbd_run("e", &params);
+
+  // F: read-modify-write
+  params.read_weight = 50;
+  params.insert_weight = 0;
+  params.scan_weight = 0;
+  params.rmw_weight = 50;
+
+  result = result ? result : workload_tbd_run("f", &params);
+
+  // replay A from its trace
+  if (trace)
+  {
+    rewind(trace);
+
+    result = result ? result : workload_tbd_replay("a_replay", trace, params.tbd_size, params.hunk_size);
+
+    fclose(trace);
+  }
+
+  return result;
+}
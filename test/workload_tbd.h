@@ -0,0 +1,86 @@
+/** Workload driver for tbd.
+ *
+ *  Runs YCSB style workloads against a tbd, or replays traces recorded by tbds,
+ *  and prints a latency histogram summary for each kind of operation.
+ *  Uses pow() from the math library.
+ */
+
+
+#ifndef _WORKLOAD_TBD_H_
+#define _WORKLOAD_TBD_H_
+
+
+
+
+#include <stddef.h>
+#include <stdio.h>
+
+
+
+
+/** How keys are chosen for each operation.
+ */
+typedef enum WORKLOAD_DISTRIBUTION
+{
+  WORKLOAD_DISTRIBUTION_UNIFORM,    ///< Every key is equally likely.
+  WORKLOAD_DISTRIBUTION_ZIPFIAN,    ///< A few keys are hot, scattered over the key space.
+  WORKLOAD_DISTRIBUTION_LATEST,     ///< The most recently inserted keys are hot.
+
+} WORKLOAD_DISTRIBUTION_ENUM;
+
+
+/** Parameters of a generated workload.
+ *  The weights give the relative frequency of each operation, they do not need to add up to anything.
+ */
+typedef struct workload_params_struct
+{
+  size_t tbd_size;                  ///< Size in bytes of the tbd, at most TBD_MAX_SIZE.
+  size_t hunk_size;                 ///< Hunk size of the tbd.
+  size_t record_count;              ///< Keys inserted before the run starts.
+  size_t operation_count;           ///< Operations in the run.
+  size_t value_size;                ///< Size in bytes of each value, including the null terminator.
+
+  unsigned read_weight;             ///< tbd_read of one key.
+  unsigned update_weight;           ///< tbd_put of one existing key.
+  unsigned insert_weight;           ///< tbd_create of a new key.
+  unsigned delete_weight;           ///< tbd_delete of one key.
+  unsigned scan_weight;             ///< tbd_scan_prefix of the keys next to one key.
+  unsigned rmw_weight;              ///< tbd_read then tbd_put of one key.
+  size_t scan_length;               ///< Most keys a scan visits.
+
+  WORKLOAD_DISTRIBUTION_ENUM distribution;
+  double zipfian_constant;          ///< Skew of the zipfian and latest distributions, YCSB uses 0.99.
+  unsigned long seed;               ///< Seed of the random number generator, runs with the same seed are the same.
+
+  FILE* trace;                      ///< Every operation, including the inserts before the run, is written here as a tbds command, NULL for none.
+
+} workload_params_t;
+
+
+/** Run a generated workload on an empty tbd.
+ *  Prints one JSON object per line for each kind of operation, then one for the whole run.
+ *
+ *  Returns 0 if successful.
+ */
+int workload_tbd_run(const char* name, const workload_params_t* params);
+
+
+/** Replay a trace of tbds commands on an empty tbd, one command per line.
+ *  Commands tbd cannot replay are counted as skipped.
+ *  Prints the same summary as workload_tbd_run.
+ *
+ *  Returns 0 if successful.
+ */
+int workload_tbd_replay(const char* name, FILE* trace, size_t tbd_size, size_t hunk_size);
+
+
+/** Run the YCSB core workloads A to F, then replay a trace recorded from workload A.
+ *
+ *  Returns 0 if successful.
+ */
+int workload_tbd(void);
+
+
+
+
+#endif/*_WORKLOAD_TBD_H_*/